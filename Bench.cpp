@@ -0,0 +1,1062 @@
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "bench.h"
+#include "const_utility.h"
+#include "options.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "render_session.h"
+#include "regression.h"
+#include "bvh_stats.h"
+#include "grid.h"
+#include "stats.h"
+#include "cpu_dispatch.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include "image.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+/// <summary>
+/// Threads the reports render on when --threads is not given
+/// </summary>
+const int BENCH_THREADS = 4;
+
+/// <summary>
+/// What the reports share: the settings of the command line, with the height and thread count defaulted for the
+/// report, and timed renders of whole frames, either on a pool of threads or on the calling thread, whose traversal
+/// counters then hold every ray of the frame
+/// </summary>
+class Bench
+{
+private:
+	std::unique_ptr<ThreadPool> threadPool;
+
+public:
+	const Options& options;
+	int height;
+	int threads;
+
+	/// <param name="options">Settings of the command line</param>
+	/// <param name="defaultHeight">Image height of the report when --height is not given</param>
+	/// <param name="defaultThreads">Threads of the report when --threads is not given</param>
+	Bench(const Options& options, int defaultHeight, int defaultThreads = BENCH_THREADS) : options(options)
+	{
+		height = options.height > 0 ? options.height : defaultHeight;
+		threads = options.threads > 0 ? options.threads : defaultThreads;
+	}
+
+	/// <summary>
+	/// Pool of the report, started on first use
+	/// </summary>
+	ThreadPool& pool()
+	{
+		if (!threadPool)
+			threadPool.reset(new ThreadPool(threads));
+		return *threadPool;
+	}
+
+	/// <summary>
+	/// Context rendering the whole frame of a scene with the settings of the command line
+	/// </summary>
+	RenderContext context(const SceneData& scene) const
+	{
+		RenderContext context;
+		context.world = scene.root.get();
+		context.lights = scene.lights.get();
+		context.camera = scene.camera;
+		context.imgWidth = scene.imgWidth;
+		context.imgHeight = scene.imgHeight;
+		context.settings = options.settings;
+		return context;
+	}
+
+	/// <summary>
+	/// Renders a whole frame with its tiles spread over the pool
+	/// </summary>
+	/// <param name="image">Receives the frame</param>
+	/// <param name="rays">Receives the number of rays traced, if not null</param>
+	/// <returns>Seconds the frame took</returns>
+	double render(const RenderContext& context, FloatImage& image, uint64_t* rays = nullptr)
+	{
+		image = FloatImage(context.imgWidth, context.imgHeight);
+		std::vector<Tile> tiles = makeTiles(context.imgWidth, context.imgHeight, options.tileSize);
+		std::atomic<uint64_t> traced(0);
+
+		auto start = std::chrono::steady_clock::now();
+		pool().parallelFor(tiles.size(), [&](size_t i)
+		{
+			std::vector<float> pixels(size_t(tiles[i].width()) * tiles[i].height() * 3);
+			uint64_t before = traversalCounters().rays;
+			renderTile(context, tiles[i], 1, pixels.data());
+			traced += traversalCounters().rays - before;
+			image.setTile(tiles[i], pixels.data());
+		});
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (rays != nullptr)
+			*rays = traced;
+		return seconds;
+	}
+
+	/// <summary>
+	/// Renders a whole frame on the calling thread, with its traversal counters reset first
+	/// </summary>
+	/// <param name="pixels">Receives the three floats of every pixel, row by row</param>
+	/// <param name="counters">Receives what traversal counted for the frame, if not null</param>
+	/// <returns>Seconds the frame took</returns>
+	double renderHere(const RenderContext& context, std::vector<float>& pixels, TraversalCounters* counters = nullptr) const
+	{
+		Tile frame = { 0, 0, context.imgWidth, context.imgHeight };
+		pixels.resize(size_t(frame.width()) * frame.height() * 3);
+
+		traversalCounters() = TraversalCounters();
+		auto start = std::chrono::steady_clock::now();
+		renderTile(context, frame, 1, pixels.data());
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (counters != nullptr)
+			*counters = traversalCounters();
+		return seconds;
+	}
+};
+
+/// <summary>
+/// Adds the materials of the objects, or of the objects they group, to the set
+/// </summary>
+void collectMaterials(const Hittable* object, std::set<Material*>& materials)
+{
+	if (auto list = dynamic_cast<const HittableList*>(object))
+	{
+		for (const auto& child : list->objects)
+			collectMaterials(child.get(), materials);
+		return;
+	}
+	if (auto box = dynamic_cast<const Cuboid*>(object))
+	{
+		collectMaterials(&box->cuboid, materials);
+		return;
+	}
+	if (object->material() != nullptr)
+		materials.insert(object->material());
+}
+
+/// <summary>
+/// Changes the parameters of every material the way a look-development tweak would: albedos, fuzz and refractive
+/// indices, but nothing that moves geometry or light
+/// </summary>
+/// <returns>Number of materials changed</returns>
+int tweakMaterials(const HittableList& world)
+{
+	std::set<Material*> materials;
+	collectMaterials(&world, materials);
+
+	int changed = 0;
+	for (Material* material : materials)
+	{
+		if (auto lambertian = dynamic_cast<Lambertian*>(material))
+			lambertian->albedo = colour(lambertian->albedo.z(), lambertian->albedo.x(), lambertian->albedo.y());
+		else if (auto metal = dynamic_cast<Metal*>(material))
+			metal->fuzz = fmin(metal->fuzz + 0.3, 1.0);
+		else if (auto dielectric = dynamic_cast<Dielectric*>(material))
+			dielectric->ir = 2.0;
+		else
+			continue;
+		changed++;
+	}
+	return changed;
+}
+
+/// <summary>
+/// Renders scenes 1 and 3 into a G-buffer, tweaks their materials and renders them again, once from the G-buffer and
+/// once tracing every camera ray, and prints the times, the memory of the G-buffer and whether the images match
+/// </summary>
+int runGBufferReport(const Options& options)
+{
+	Bench bench(options, 240);
+
+	std::cerr << std::left << std::setw(7) << "scene" << std::right << std::setw(11) << "materials" << std::setw(12) << "record s"
+		<< std::setw(12) << "reuse s" << std::setw(12) << "trace s" << std::setw(10) << "speedup" << std::setw(12) << "G-buf MiB"
+		<< "  images\n";
+
+	for (int id : { 1, 3 })
+	{
+		auto scene = buildScene(id, bench.height, options.arena, options.bvh);
+		RenderContext context = bench.context(*scene);
+
+		// the sessions record into the buffer on the first render and reuse it once it is ready
+		auto render = [&](shared_ptr<GBuffer> gbuffer, FloatImage& image)
+		{
+			auto start = std::chrono::steady_clock::now();
+			RenderSession session(bench.pool(), scene, context, Tile{ 0, 0, 0, 0 }, options.tileSize);
+			session.reuseHits(gbuffer);
+			image = session.start().get();
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		};
+
+		auto gbuffer = make_shared<GBuffer>(scene->imgWidth, scene->imgHeight, options.settings.samples);
+		FloatImage before, reused, traced;
+
+		double recordSeconds = render(gbuffer, before);
+		int changed = tweakMaterials(scene->world);
+		double reuseSeconds = render(gbuffer, reused);
+		// a fresh buffer records again, tracing every camera ray with the same samples as the reusing render
+		double traceSeconds = render(make_shared<GBuffer>(scene->imgWidth, scene->imgHeight, options.settings.samples), traced);
+
+		std::cerr << std::left << std::setw(7) << id << std::right << std::setw(11) << changed << std::fixed << std::setprecision(3)
+			<< std::setw(12) << recordSeconds << std::setw(12) << reuseSeconds << std::setw(12) << traceSeconds
+			<< std::setprecision(2) << std::setw(9) << traceSeconds / reuseSeconds << "x" << std::setprecision(1)
+			<< std::setw(12) << gbuffer->memoryBytes() / double(1 << 20) << std::defaultfloat
+			<< "  " << (reused.pixels == traced.pixels ? "identical" : "DIFFER") << "\n";
+	}
+	return 0;
+}
+
+/// <summary>
+/// Renders scenes 3 and 4, which are nearly all diffuse, by plain path tracing and with an irradiance cache, and
+/// prints the time of each, the records of the cache and the error of both against a path traced reference with 16
+/// times the samples
+/// </summary>
+int runIrradianceReport(const Options& options)
+{
+	Bench bench(options, 120);
+
+	std::cerr << std::left << std::setw(7) << "scene" << std::setw(8) << "method" << std::right << std::setw(10) << "fill s"
+		<< std::setw(10) << "render s" << std::setw(10) << "total s" << std::setw(10) << "records" << std::setw(10) << "KB"
+		<< std::setw(10) << "RMSE" << std::setw(10) << "PSNR" << "\n";
+
+	for (int id : { 3, 4 })
+	{
+		auto scene = buildScene(id, bench.height, options.arena, options.bvh);
+		RenderContext context = bench.context(*scene);
+		context.settings.lightSampling = LightSampling::Off;
+
+		FloatImage reference, traced, cached;
+		RenderContext referenceContext = context;
+		referenceContext.settings.samples *= 16;
+		referenceContext.settings.seed = mixSeed(context.settings.seed, 16);
+		bench.render(referenceContext, reference);
+
+		double traceSeconds = bench.render(context, traced);
+
+		IrradianceCache cache = makeIrradianceCache(*scene, options.irradianceAccuracy);
+		auto start = std::chrono::steady_clock::now();
+		fillIrradianceCache(context, cache, bench.pool(), options.irradianceRays);
+		double fillSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		RenderContext cacheContext = context;
+		cacheContext.irradiance = &cache;
+		double cacheSeconds = bench.render(cacheContext, cached);
+
+		double rmse = 0.0, psnr = 0.0;
+		imageDifference(traced, reference, rmse, psnr);
+		std::cerr << std::left << std::setw(7) << id << std::setw(8) << "path" << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(10) << 0.0 << std::setw(10) << traceSeconds << std::setw(10) << traceSeconds << std::setw(10) << "-"
+			<< std::setw(10) << "-" << std::setw(10) << std::setprecision(4) << rmse << std::setw(10) << std::setprecision(1) << psnr << "\n";
+
+		imageDifference(cached, reference, rmse, psnr);
+		std::cerr << std::left << std::setw(7) << id << std::setw(8) << "cache" << std::right << std::setprecision(3)
+			<< std::setw(10) << fillSeconds << std::setw(10) << cacheSeconds << std::setw(10) << fillSeconds + cacheSeconds
+			<< std::setw(10) << cache.size() << std::setw(10) << cache.memoryBytes() / 1024 << std::setw(10) << std::setprecision(4) << rmse
+			<< std::setw(10) << std::setprecision(1) << psnr << std::defaultfloat << "\n";
+	}
+	return 0;
+}
+
+/// <summary>
+/// Renders scenes 1, 2 and 6, which have glass, by plain path tracing and with a caustic photon map, and prints the
+/// time of each, the photons of the map and the error of both against a path traced reference with 16 times the
+/// samples. Scene 1 is lit by the sky alone, so it gets no photons and shows what the map costs when it is empty
+/// </summary>
+int runCausticsReport(const Options& options)
+{
+	Bench bench(options, 120);
+
+	std::cerr << std::left << std::setw(7) << "scene" << std::setw(8) << "method" << std::right << std::setw(10) << "build s"
+		<< std::setw(10) << "render s" << std::setw(10) << "total s" << std::setw(10) << "photons" << std::setw(10) << "emitted"
+		<< std::setw(10) << "KB" << std::setw(10) << "RMSE" << std::setw(10) << "PSNR" << "\n";
+
+	for (int id : { 1, 2, 6 })
+	{
+		auto scene = buildScene(id, bench.height, options.arena, options.bvh);
+		RenderContext context = bench.context(*scene);
+		context.settings.lightSampling = LightSampling::Off;
+
+		FloatImage reference, traced, mapped;
+		RenderContext referenceContext = context;
+		referenceContext.settings.samples *= 16;
+		referenceContext.settings.seed = mixSeed(context.settings.seed, 16);
+		bench.render(referenceContext, reference);
+
+		double traceSeconds = bench.render(context, traced);
+
+		PhotonMap photons = makePhotonMap(*scene, options);
+		auto start = std::chrono::steady_clock::now();
+		photons.build(*scene->root, scene->world.objects, *scene->lights, bench.pool());
+		double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		RenderContext photonContext = context;
+		photonContext.photons = &photons;
+		double photonSeconds = bench.render(photonContext, mapped);
+
+		double rmse = 0.0, psnr = 0.0;
+		imageDifference(traced, reference, rmse, psnr);
+		std::cerr << std::left << std::setw(7) << id << std::setw(8) << "path" << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(10) << 0.0 << std::setw(10) << traceSeconds << std::setw(10) << traceSeconds << std::setw(10) << "-"
+			<< std::setw(10) << "-" << std::setw(10) << "-" << std::setw(10) << std::setprecision(4) << rmse
+			<< std::setw(10) << std::setprecision(1) << psnr << "\n";
+
+		imageDifference(mapped, reference, rmse, psnr);
+		std::cerr << std::left << std::setw(7) << id << std::setw(8) << "photon" << std::right << std::setprecision(3)
+			<< std::setw(10) << buildSeconds << std::setw(10) << photonSeconds << std::setw(10) << buildSeconds + photonSeconds
+			<< std::setw(10) << photons.size() << std::setw(10) << photons.emittedCount() << std::setw(10) << photons.memoryBytes() / 1024
+			<< std::setw(10) << std::setprecision(4) << rmse << std::setw(10) << std::setprecision(1) << psnr << std::defaultfloat << "\n";
+	}
+	return 0;
+}
+
+/// <summary>
+/// Builds every scene once and traverses it in turn with the pointer-based BVH, the flattened BVH, a uniform grid and a
+/// hierarchical grid, all built through the Accelerator interface over the same primitives. Prints the build time,
+/// the memory of each structure, the nodes or cells visited and primitives tested per ray and the speed, rendering on
+/// the calling thread, and whether the image matches the one of the pointer-based BVH
+/// </summary>
+int runAcceleratorReport(const Options& options)
+{
+	Bench bench(options, 120);
+
+	std::cerr << std::left << std::setw(8) << "scene" << std::setw(10) << "accel" << std::right << std::setw(10) << "prims"
+		<< std::setw(12) << "build ms" << std::setw(12) << "KB" << std::setw(12) << "visits/ray" << std::setw(12) << "prims/ray"
+		<< std::setw(10) << "Mrays/s" << "  image\n";
+
+	for (int id = 1; id <= SCENE_COUNT; id++)
+	{
+		auto scene = buildScene(id, bench.height, true, options.bvh);
+		std::vector<shared_ptr<Hittable>> primitives;
+		if (scene->root->tree)
+			scene->root->tree->collect(primitives);
+
+		RenderContext context = bench.context(*scene);
+		std::vector<float> pixels, reference;
+
+		std::vector<shared_ptr<Accelerator>> accelerators = { make_shared<BVH_Node>(),
+			make_shared<FlatBVH>(options.bvh.layout, options.bvh.quantized, options.bvh.prefetch, options.bvh.typedLeaves),
+			make_shared<UniformGrid>(false, options.bvh.gridDensity), make_shared<UniformGrid>(true, options.bvh.gridDensity) };
+
+		for (const auto& accelerator : accelerators)
+		{
+			auto start = std::chrono::steady_clock::now();
+			if (!primitives.empty())
+				accelerator->build(primitives);
+			double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			scene->root->accelerator = primitives.empty() ? nullptr : accelerator;
+
+			TraversalCounters counters;
+			double seconds = bench.renderHere(context, pixels, &counters);
+
+			if (reference.empty())
+				reference = pixels;
+			double rays = double(std::max<uint64_t>(counters.rays, 1));
+			std::cerr << std::left << std::setw(8) << id << std::setw(10) << accelerator->name() << std::right << std::setw(10) << primitives.size()
+				<< std::fixed << std::setprecision(2) << std::setw(12) << buildMs << std::setw(12) << accelerator->memoryBytes() / 1024
+				<< std::setw(12) << counters.nodes / rays << std::setw(12) << counters.primitives / rays << std::setw(10) << rays / seconds / 1e6
+				<< std::defaultfloat << "  " << (pixels == reference ? "same" : "differs") << "\n";
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Builds every scene once with individual heap allocations and once with an arena, and prints how many
+/// allocations each needs, how many bytes they take and how fragmented the memory is
+/// </summary>
+int runAllocReport()
+{
+	std::cerr << std::left << std::setw(8) << "scene" << std::setw(8) << "memory" << std::right << std::setw(14) << "allocations"
+		<< std::setw(14) << "KB requested" << std::setw(14) << "KB reserved" << std::setw(15) << "fragmentation" << std::setw(12) << "build ms" << "\n";
+
+	for (int id = 1; id <= SCENE_COUNT; id++)
+	{
+		for (bool useArena : { false, true })
+		{
+			HeapStats& heap = heapStats();
+			size_t allocationsBefore = heap.allocations, requestedBefore = heap.bytesUsed, reservedBefore = heap.bytesReserved;
+			auto start = std::chrono::steady_clock::now();
+
+			auto scene = buildScene(id, 0, useArena);
+
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			size_t allocations = heap.allocations - allocationsBefore;
+			size_t requested = heap.bytesUsed - requestedBefore;
+			size_t reserved = heap.bytesReserved - reservedBefore;
+
+			if (useArena)
+			{
+				// the blocks come from malloc directly, add them to what the scene still asked the heap for
+				ArenaStats stats = scene->arena->stats();
+				allocations += stats.blocks;
+				requested += stats.bytesUsed;
+				reserved += stats.bytesReserved;
+			}
+
+			std::cerr << std::left << std::setw(8) << id << std::setw(8) << (useArena ? "arena" : "heap") << std::right
+				<< std::setw(14) << allocations << std::setw(14) << requested / 1024 << std::setw(14) << reserved / 1024
+				<< std::setw(14) << std::fixed << std::setprecision(1) << (reserved > 0 ? 100.0 * (1.0 - double(requested) / reserved) : 0.0) << "%"
+				<< std::setw(12) << std::setprecision(2) << ms << std::defaultfloat << "\n";
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Renders every scene on the calling thread, once with all bounded primitives in the BVH and once with the large ones
+/// tested apart, and prints how many nodes and primitives each ray visits
+/// </summary>
+int runTraversalReport(const Options& options)
+{
+	Bench bench(options, 120);
+
+	std::cerr << std::left << std::setw(8) << "scene" << std::setw(12) << "large" << std::right << std::setw(10) << "apart"
+		<< std::setw(14) << "nodes/ray" << std::setw(14) << "prims/ray" << std::setw(12) << "Mrays/s" << "\n";
+
+	for (int id = 1; id <= SCENE_COUNT; id++)
+	{
+		for (double largeFactor : { 0.0, 16.0 })
+		{
+			BVHSettings bvh = options.bvh;
+			bvh.largeFactor = largeFactor;
+			auto scene = buildScene(id, bench.height, true, bvh);
+
+			std::vector<float> pixels;
+			TraversalCounters counters;
+			double seconds = bench.renderHere(bench.context(*scene), pixels, &counters);
+
+			double rays = double(std::max<uint64_t>(counters.rays, 1));
+			std::cerr << std::left << std::setw(8) << id << std::setw(12) << (largeFactor > 0.0 ? "apart" : "in tree") << std::right
+				<< std::setw(10) << scene->root->large.size() << std::fixed << std::setprecision(2)
+				<< std::setw(14) << counters.nodes / rays << std::setw(14) << counters.primitives / rays
+				<< std::setw(12) << rays / seconds / 1e6 << std::defaultfloat << "\n";
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Number of nodes in a BVH_Node tree
+/// </summary>
+size_t countNodes(const BVH_Node& node)
+{
+	if (node.leaf)
+		return 1;
+	return 1 + countNodes(*static_cast<const BVH_Node*>(node.left.get())) + countNodes(*static_cast<const BVH_Node*>(node.right.get()));
+}
+
+/// <summary>
+/// Reports the shape and traversal cost of the BVH of one scene and dumps its boxes as an OBJ wireframe, as asked
+/// </summary>
+int runBVHStats(const Options& options)
+{
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+	if (!scene->root->tree)
+	{
+		std::cerr << "Scene " << options.scene << " has no BVH: all of its primitives are kept out of the tree\n";
+		return 1;
+	}
+	const BVH_Node& tree = *scene->root->tree;
+
+	if (!options.bvhObj.empty())
+	{
+		if (!writeBVHObj(tree, options.bvhObj, options.bvhObjDepth))
+		{
+			std::cerr << "Could not write " << options.bvhObj << "\n";
+			return 1;
+		}
+		std::cerr << "BVH boxes written to " << options.bvhObj << "\n";
+	}
+	if (!options.bvhStats)
+		return 0;
+
+	BVHStats stats = analyzeBVH(tree);
+	measureBVHTraversal(tree, *scene->root, scene->camera, size_t(std::max(options.bvhRays, 0)), mixSeed(options.settings.seed, 50), stats);
+
+	std::cerr << "BVH of scene " << options.scene << " (" << scene->root->large.size() << " large primitives kept out of it)\n"
+		<< std::fixed << std::setprecision(3)
+		<< "  nodes            " << stats.nodes << " (" << stats.nodes - stats.leaves << " interior, " << stats.leaves << " leaves)\n"
+		<< "  primitives       " << stats.primitives << "\n"
+		<< "  depth            max " << stats.maxDepth << ", mean leaf " << stats.meanLeafDepth << "\n"
+		<< "  SAH cost         " << stats.sahCost << "\n"
+		<< "  sibling overlap  " << stats.overlapRatio << "\n"
+		<< "  memory           " << stats.memoryBytes / 1024.0 << " KB (" << sizeof(BVH_Node) << " bytes per node)\n"
+		<< "  camera rays      " << stats.cameraRays << ": " << stats.cameraNodesPerRay << " nodes, " << stats.cameraPrimitivesPerRay
+		<< " primitives per ray\n"
+		<< "  bounce rays      " << stats.bounceRays << ": " << stats.bounceNodesPerRay << " nodes, " << stats.bouncePrimitivesPerRay
+		<< " primitives per ray\n" << std::defaultfloat;
+
+	std::cerr << "  leaves by depth\n";
+	for (size_t depth = 0; depth < stats.leafDepths.size(); depth++)
+		if (stats.leafDepths[depth] > 0)
+			std::cerr << "    " << std::setw(4) << depth << std::setw(10) << stats.leafDepths[depth] << "\n";
+
+	std::cerr << "  leaves by primitives\n";
+	for (size_t size = 0; size < stats.leafSizes.size(); size++)
+		if (stats.leafSizes[size] > 0)
+			std::cerr << "    " << std::setw(4) << size << std::setw(10) << stats.leafSizes[size] << "\n";
+	return 0;
+}
+
+/// <summary>
+/// Renders every scene, plus a cloud of individual spheres large enough to leave the caches, on the calling thread
+/// with the pointer-based BVH, with every flat layout, node format and prefetch setting, and with virtual calls in the
+/// leaves, and prints the memory of the nodes, the node visits and cache misses per ray and the speed
+/// </summary>
+int runLayoutReport(const Options& options)
+{
+	Bench bench(options, 80);
+	const int CLOUD = SCENE_COUNT + 1;
+
+	std::vector<std::pair<std::string, BVHSettings>> configurations;
+	BVHSettings pointer;
+	pointer.flat = false;
+	configurations.push_back({ "pointer", pointer });
+	for (BVHLayout layout : { BVHLayout::DepthFirst, BVHLayout::BreadthFirst, BVHLayout::VanEmdeBoas })
+	{
+		for (bool quantized : { false, true })
+		{
+			for (bool prefetch : { false, true })
+			{
+				BVHSettings bvh;
+				bvh.layout = layout;
+				bvh.quantized = quantized;
+				bvh.prefetch = prefetch;
+				configurations.push_back({ std::string(layoutName(layout)) + (quantized ? " q8" : " f32") + (prefetch ? " pf" : ""), bvh });
+			}
+		}
+	}
+	BVHSettings virtualLeaves;
+	virtualLeaves.typedLeaves = false;
+	configurations.push_back({ "veb f32 virt", virtualLeaves });
+
+	PerfCounter cacheMisses(PERF_HARDWARE, PERF_CACHE_MISSES);
+	PerfCounter l1Misses(PERF_CACHE, PERF_L1D_READ_MISSES);
+
+	std::cerr << std::left << std::setw(8) << "scene" << std::setw(14) << "nodes" << std::right << std::setw(10) << "count"
+		<< std::setw(12) << "KB" << std::setw(12) << "visits/ray" << std::setw(10) << "Mrays/s"
+		<< std::setw(14) << "L1D miss/ray" << std::setw(14) << "LLC miss/ray" << "\n";
+
+	for (int id = 1; id <= CLOUD; id++)
+	{
+		shared_ptr<SceneData> scene;
+		if (id == CLOUD)
+		{
+			scene = make_shared<SceneData>();
+			scene->arena = make_shared<SceneArena>();
+			ArenaScope scope(scene->arena.get());
+			resetRandom();
+
+			auto white = create<Lambertian>(colour(0.73, 0.73, 0.73));
+			for (int i = 0; i < 200000; i++)
+				scene->world.add(create<Sphere>(point::random(0, 100), 0.3, white));
+
+			scene->aspectRatio = 1.0;
+			scene->imgHeight = bench.height;
+			scene->imgWidth = bench.height;
+			scene->camera = Camera(point(50, 50, -120), point(50, 50, 50), 1.0, 40, 0.0, 10.0);
+			scene->root = create<SceneBVH>(scene->world.objects);
+		}
+		else
+			scene = buildScene(id, bench.height, true, pointer);
+
+		RenderContext context = bench.context(*scene);
+		context.settings.samples = 1;
+		std::vector<float> pixels;
+
+		for (const auto& configuration : configurations)
+		{
+			flattenScene(*scene->root, configuration.second);
+
+			size_t nodes = scene->root->tree ? countNodes(*scene->root->tree) : 0;
+			size_t bytes = nodes * sizeof(BVH_Node);
+			if (scene->root->accelerator)
+			{
+				auto flat = static_cast<const FlatBVH*>(scene->root->accelerator.get());
+				nodes = flat->size();
+				bytes = flat->memoryBytes();
+			}
+
+			cacheMisses.start();
+			l1Misses.start();
+			TraversalCounters counters;
+			double seconds = bench.renderHere(context, pixels, &counters);
+			uint64_t llc = cacheMisses.stop();
+			uint64_t l1 = l1Misses.stop();
+			double rays = double(std::max<uint64_t>(counters.rays, 1));
+
+			std::cerr << std::left << std::setw(8) << (id == CLOUD ? std::string("cloud") : std::to_string(id)) << std::setw(14) << configuration.first
+				<< std::right << std::setw(10) << nodes << std::setw(12) << bytes / 1024 << std::fixed << std::setprecision(2)
+				<< std::setw(12) << counters.nodes / rays << std::setw(10) << rays / seconds / 1e6;
+			if (l1Misses.valid())
+				std::cerr << std::setw(14) << l1 / rays;
+			else
+				std::cerr << std::setw(14) << "n/a";
+			if (cacheMisses.valid())
+				std::cerr << std::setw(14) << llc / rays;
+			else
+				std::cerr << std::setw(14) << "n/a";
+			std::cerr << std::defaultfloat << "\n";
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Renders every scene, with the float and the quantized flat BVH, once with the scalar kernels and once with each
+/// vectorized kernel set the CPU supports, and checks that the images are bit-identical
+/// </summary>
+/// <returns>0 if all images match, 1 otherwise</returns>
+int runIsaCheck(const Options& options)
+{
+	Bench bench(options, 60);
+	IsaLevel detected = detectIsa();
+	bool allMatch = true;
+
+	for (int id = 1; id <= SCENE_COUNT; id++)
+	{
+		for (bool quantized : { false, true })
+		{
+			BVHSettings bvh = options.bvh;
+			bvh.flat = true;
+			bvh.quantized = quantized;
+			auto scene = buildScene(id, bench.height, true, bvh);
+			RenderContext context = bench.context(*scene);
+			std::vector<float> reference;
+
+			for (IsaLevel level : { IsaLevel::Scalar, IsaLevel::SSE42, IsaLevel::AVX2, IsaLevel::AVX512 })
+			{
+				if (level > detected)
+					break;
+
+				selectIsa(level);
+				std::vector<float> pixels;
+				bench.renderHere(context, pixels);
+
+				if (level == IsaLevel::Scalar)
+				{
+					reference.swap(pixels);
+					continue;
+				}
+
+				size_t differences = 0;
+				for (size_t i = 0; i < pixels.size(); i++)
+					differences += std::memcmp(&pixels[i], &reference[i], sizeof(float)) != 0;
+				allMatch = allMatch && differences == 0;
+
+				std::cerr << "scene " << id << (quantized ? " q8  " : " f32 ") << std::left << std::setw(8) << isaName(level) << std::right
+					<< (differences == 0 ? "match" : "DIFFERS in " + std::to_string(differences) + " values") << "\n";
+			}
+		}
+	}
+
+	selectIsa(detected);
+	if (detected == IsaLevel::Scalar)
+		std::cerr << "The CPU supports no vectorized kernels, nothing to compare\n";
+	std::cerr << (allMatch ? "All kernel sets produce identical images\n" : "Kernel sets disagree\n");
+	return allMatch ? 0 : 1;
+}
+
+/// <summary>
+/// Builds a floor with a few spheres on it, lit by the given number of small spheres of light scattered above it.
+/// The radiance of each light is divided by their number, so the total power stays the same
+/// </summary>
+shared_ptr<SceneData> buildLightScene(int lights, int height)
+{
+	auto scene = make_shared<SceneData>();
+	scene->arena = make_shared<SceneArena>();
+	ArenaScope scope(scene->arena.get());
+	resetRandom();
+
+	auto floor = create<Lambertian>(colour(0.73, 0.73, 0.73));
+	scene->world.add(create<xzPlane>(-120, 120, -120, 120, 0, floor));
+	for (int i = 0; i < 12; i++)
+		scene->world.add(create<Sphere>(point(randomDouble(-30, 30), 3, randomDouble(-30, 30)), 3, create<Lambertian>(colour::random(0.2, 0.9))));
+
+	// the lights hang above the view, so the error is that of the light they cast and not of the few pixels that
+	// would see them
+	auto light = create<Light>(colour(1200.0, 1200.0, 1200.0) / lights);
+	for (int i = 0; i < lights; i++)
+		scene->world.add(create<Sphere>(point(randomDouble(-100, 100), randomDouble(45, 60), randomDouble(-100, 100)), 1, light));
+
+	scene->aspectRatio = 1.0;
+	scene->imgHeight = height;
+	scene->imgWidth = height;
+	scene->camera = Camera(point(0, 30, 90), point(0, -3, 0), 1.0, 40, 0.0, 10.0);
+	scene->root = create<SceneBVH>(scene->world.objects);
+	flattenScene(*scene->root, BVHSettings());
+	scene->lights = create<LightBVH>(scene->world.objects);
+	return scene;
+}
+
+/// <summary>
+/// Renders the scene of buildLightScene with 1 to 10000 lights and every light sampling mode, and prints the time
+/// per frame and the error against a reference rendered with many samples through the light BVH
+/// </summary>
+int runLightReport(const Options& options)
+{
+	Bench bench(options, 64, 1);
+
+	std::cerr << std::left << std::setw(8) << "lights" << std::setw(10) << "mode" << std::right << std::setw(12) << "ms/frame"
+		<< std::setw(14) << "ns/sample" << std::setw(14) << "rel. RMSE" << "\n";
+
+	for (int lights : { 1, 10, 100, 1000, 10000 })
+	{
+		auto scene = buildLightScene(lights, bench.height);
+		RenderContext context = bench.context(*scene);
+		context.settings.lightOff = true;
+
+		FloatImage reference;
+		context.settings.lightSampling = LightSampling::BVH;
+		context.settings.samples = 256;
+		bench.render(context, reference);
+		size_t floats = reference.pixels.size();
+		double mean = 0.0;
+		for (float value : reference.pixels)
+			mean += value;
+		mean = std::max(mean / floats, 1e-12);
+
+		for (LightSampling mode : { LightSampling::Off, LightSampling::Uniform, LightSampling::BVH })
+		{
+			context.settings.lightSampling = mode;
+			context.settings.samples = options.settings.samples;
+			context.settings.seed = options.settings.seed + 1;
+
+			FloatImage image;
+			double seconds = bench.render(context, image);
+
+			double error = 0.0;
+			for (size_t i = 0; i < floats; i++)
+				error += (double(image.pixels[i]) - reference.pixels[i]) * (double(image.pixels[i]) - reference.pixels[i]);
+
+			double samples = double(image.width) * image.height * context.settings.samples;
+			std::cerr << std::left << std::setw(8) << lights << std::setw(10) << lightSamplingName(mode) << std::right << std::fixed
+				<< std::setprecision(1) << std::setw(12) << seconds * 1000.0 << std::setw(14) << seconds * 1e9 * bench.threads / samples
+				<< std::setprecision(3) << std::setw(14) << sqrt(error / floats) / mean << std::defaultfloat << "\n";
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Scene of runTextureReport: a floor and a row of spheres, all covered by the same texture, seen at a grazing angle
+/// so every mip level is used somewhere
+/// </summary>
+shared_ptr<SceneData> buildTextureScene(shared_ptr<Texture> texture, int height)
+{
+	auto scene = make_shared<SceneData>();
+	scene->arena = make_shared<SceneArena>();
+	ArenaScope scope(scene->arena.get());
+
+	auto material = create<Lambertian>(texture);
+	scene->world.add(create<xzPlane>(-50, 50, -60, 40, 0, material));
+	for (int i = 0; i < 9; i++)
+		scene->world.add(create<Sphere>(point(-16 + 4 * i, 1.5, 20 - 6 * i), 1.5, material));
+
+	scene->aspectRatio = 16.0 / 9.0;
+	scene->imgHeight = height;
+	scene->imgWidth = static_cast<int>(height * scene->aspectRatio);
+	scene->camera = Camera(point(0, 3, 30), point(0, 1, 0), scene->aspectRatio, 50, 0.0, 10.0);
+	scene->root = create<SceneBVH>(scene->world.objects);
+	flattenScene(*scene->root, BVHSettings());
+	scene->lights = create<LightBVH>(scene->world.objects);
+	return scene;
+}
+
+/// <summary>
+/// Writes a 4096 x 4096 texture of randomly coloured cells with dark borders to --output.rtex, renders the scene of
+/// buildTextureScene with it through caches of several sizes, each starting empty, and prints time, hit rate and the
+/// bytes read from disk
+/// </summary>
+int runTextureReport(const Options& options)
+{
+	Bench bench(options, 120, 1);
+	const int size = 4096;
+	std::string filename = options.output + ".rtex";
+	{
+		FloatImage image(size, size);
+		resetRandom();
+		for (int cy = 0; cy < size; cy += 16)
+			for (int cx = 0; cx < size; cx += 16)
+			{
+				colour cell = colour::random(0.1, 0.9);
+				for (int y = cy; y < cy + 16; y++)
+					for (int x = cx; x < cx + 16; x++)
+					{
+						bool border = x - cx < 2 || y - cy < 2;
+						for (int c = 0; c < 3; c++)
+							image.at(x, y)[c] = border ? 0.02f : float(cell[c]);
+					}
+			}
+		if (!writeTiledTexture(filename, image, TEXTURE_TILE_SIZE))
+		{
+			std::cerr << "Could not write " << filename << "\n";
+			return 1;
+		}
+	}
+
+	auto texture = openTexture(filename);
+	if (!texture)
+	{
+		std::cerr << "Could not read " << filename << "\n";
+		return 1;
+	}
+
+	auto scene = buildTextureScene(texture, bench.height);
+	RenderContext context = bench.context(*scene);
+	FloatImage image;
+
+	std::cerr << std::right << std::setw(10) << "cache MiB" << std::setw(12) << "ms/frame" << std::setw(14) << "lookups"
+		<< std::setw(10) << "hits %" << std::setw(12) << "MiB read" << std::setw(12) << "evictions" << "\n";
+
+	for (int mib : { 1, 4, 16, 64 })
+	{
+		textureCache().clear();
+		textureCache().setCapacity(size_t(mib) << 20);
+
+		double seconds = bench.render(context, image);
+
+		std::cerr << std::setw(10) << mib << std::fixed << std::setprecision(1) << std::setw(12) << seconds * 1000.0
+			<< std::setw(14) << textureCache().lookups() << std::setprecision(2) << std::setw(10) << 100.0 * textureCache().hitRate()
+			<< std::setw(12) << textureCache().bytesFromDisk() / (1024.0 * 1024.0) << std::setw(12) << textureCache().evictedTiles()
+			<< std::defaultfloat << "\n";
+	}
+
+	image.writePPM(options.output + ".ppm");
+	return 0;
+}
+
+/// <summary>
+/// Renders every scene with fixed settings, measures time, rays per second and the peak memory of the process, compares
+/// each image with its stored reference and the speed with an earlier summary, and writes the results as JSON
+/// </summary>
+/// <returns>1, if an image or the speed regressed</returns>
+int runRegression(const Options& options)
+{
+	Bench bench(options, 120);
+	RegressionSettings settings;
+	settings.height = bench.height;
+	settings.samples = options.settings.samples;
+	settings.maxDepth = options.settings.maxDepth;
+	settings.seed = options.settings.seed;
+	settings.threads = bench.threads;
+
+	RegressionSettings baselineSettings;
+	std::vector<RegressionResult> baseline;
+	if (!options.regressBaseline.empty())
+	{
+		if (!readRegressionSummary(options.regressBaseline, baselineSettings, baseline))
+		{
+			std::cerr << "Could not read the summary " << options.regressBaseline << "\n";
+			return 1;
+		}
+		if (baselineSettings.height != settings.height || baselineSettings.samples != settings.samples || baselineSettings.maxDepth != settings.maxDepth
+			|| baselineSettings.seed != settings.seed || baselineSettings.threads != settings.threads)
+			std::cerr << "Warning: " << options.regressBaseline << " was run with other settings, its speed is not comparable\n";
+	}
+
+	std::vector<RegressionResult> results;
+	bool failed = false;
+
+	std::cerr << std::left << std::setw(7) << "scene" << std::right << std::setw(10) << "size" << std::setw(10) << "seconds"
+		<< std::setw(10) << "Mrays/s" << std::setw(10) << "+-" << std::setw(10) << "vs base" << std::setw(10) << "limit" << std::setw(10)
+		<< "proc MiB" << std::setw(10) << "PSNR" << "  result\n";
+
+	for (int id = 1; id <= SCENE_COUNT; id++)
+	{
+		auto scene = buildScene(id, settings.height, options.arena, options.bvh);
+		RenderContext context = bench.context(*scene);
+
+		// rows are seeded from their position, so the image does not depend on the thread count or the tile order;
+		// an untimed render warms the caches and gives the image, and every render after it is identical
+		FloatImage image;
+		uint64_t rays = 0;
+		bench.render(context, image, &rays);
+
+		// a single render of a small scene takes a few milliseconds, too little to time, so every measurement renders
+		// for at least REGRESSION_MIN_SECONDS, and the spread of the measurements tells how far their mean can be trusted
+		std::vector<double> rates;
+		int renders = 0;
+		double seconds = 0.0;
+		for (int repeat = 0; repeat < REGRESSION_REPEATS; repeat++)
+		{
+			uint64_t measured = 0;
+			double elapsed = 0.0;
+			do
+			{
+				elapsed += bench.render(context, image, &rays);
+				measured += rays;
+				renders++;
+			} while (elapsed < REGRESSION_MIN_SECONDS);
+
+			rates.push_back(double(measured) / std::max(elapsed, 1e-9));
+			seconds += elapsed;
+		}
+
+		RegressionResult result;
+		result.scene = id;
+		result.width = scene->imgWidth;
+		result.height = scene->imgHeight;
+		result.seconds = seconds / renders;
+		result.rays = double(rays);
+		result.repeats = REGRESSION_REPEATS;
+		meanAndDeviation(rates, result.raysPerSecond, result.raysPerSecondDeviation);
+		result.processPeakMiB = double(peakResidentBytes()) / (1 << 20);
+
+		std::string referenceName = options.regress + "/scene" + std::to_string(id) + ".pfm";
+		FloatImage reference;
+		if (reference.readPFM(referenceName))
+		{
+			result.reference = true;
+			if (imageDifference(image, reference, result.rmse, result.psnr))
+				result.passed = result.psnr >= options.regressPsnr;
+			else
+				result.passed = false;
+		}
+		else if (!options.regressUpdate)
+			result.passed = false;
+
+		std::string speed = "-", limit = "-";
+		for (const RegressionResult& base : baseline)
+		{
+			if (base.scene != id || base.raysPerSecond <= 0.0)
+				continue;
+
+			double change = 100.0 * (result.raysPerSecond / base.raysPerSecond - 1.0);
+			double threshold = slowdownThreshold(result, base, options.regressSlowdown);
+			std::ostringstream text;
+			text << std::showpos << std::fixed << std::setprecision(1) << change << "%";
+			speed = text.str();
+			text.str("");
+			text << std::noshowpos << "-" << threshold << "%";
+			limit = text.str();
+			if (change < -threshold)
+				result.passed = false;
+		}
+
+		if (options.regressUpdate)
+		{
+			if (!image.writePFM(referenceName))
+			{
+				std::cerr << "Could not write " << referenceName << "\n";
+				return 1;
+			}
+		}
+		else if (!result.passed)
+			image.writePFM(options.regress + "/scene" + std::to_string(id) + "_failed.pfm");
+
+		failed = failed || !result.passed;
+		results.push_back(result);
+
+		std::cerr << std::left << std::setw(7) << id << std::right << std::setw(10) << std::to_string(result.width) + "x" + std::to_string(result.height)
+			<< std::fixed << std::setprecision(3) << std::setw(10) << result.seconds << std::setw(10) << result.raysPerSecond / 1e6
+			<< std::setw(10) << result.raysPerSecondDeviation / 1e6 << std::setw(10) << speed << std::setw(10) << limit
+			<< std::setprecision(1) << std::setw(10) << result.processPeakMiB << std::setw(10);
+		if (result.reference)
+			std::cerr << result.psnr;
+		else
+			std::cerr << "-";
+		std::cerr << std::defaultfloat << "  " << (!result.passed ? (result.reference ? "FAILED" : "FAILED, no reference")
+			: result.reference ? "ok" : "no reference") << "\n";
+	}
+
+	std::string summary = options.output + ".json";
+	if (!writeRegressionSummary(summary, settings, results))
+	{
+		std::cerr << "Could not write " << summary << "\n";
+		return 1;
+	}
+
+	std::cerr << "Summary written to " << summary << (options.regressUpdate ? ", references updated in " + options.regress : "") << "\n";
+	return failed ? 1 : 0;
+}
+
+bool benchRequested(const Options& options)
+{
+	return options.checkIsa || options.lightReport || options.textureReport || !options.regress.empty() || options.gbufferReport
+		|| options.irradianceReport || options.causticsReport || options.allocReport || options.traversalReport || options.layoutReport
+		|| options.acceleratorReport || options.bvhStats || !options.bvhObj.empty();
+}
+
+int runBench(const Options& options)
+{
+	if (options.checkIsa)
+		return runIsaCheck(options);
+	if (options.lightReport)
+		return runLightReport(options);
+	if (options.textureReport)
+		return runTextureReport(options);
+	if (!options.regress.empty())
+		return runRegression(options);
+	if (options.gbufferReport)
+		return runGBufferReport(options);
+	if (options.irradianceReport)
+		return runIrradianceReport(options);
+	if (options.causticsReport)
+		return runCausticsReport(options);
+	if (options.allocReport)
+		return runAllocReport();
+	if (options.traversalReport)
+		return runTraversalReport(options);
+	if (options.layoutReport)
+		return runLayoutReport(options);
+	if (options.acceleratorReport)
+		return runAcceleratorReport(options);
+	return runBVHStats(options);
+}
+
+void benchUsage(std::ostream& out)
+{
+	out << "Reports render with --samples, --depth and --seed at --height (default in brackets) on --threads (default "
+		<< BENCH_THREADS << ",\n"
+		"1 for the light and texture reports); those counting per ray render on the calling thread:\n"
+		"  --gbuffer-report on     render scenes 1 and 3, change their materials and render them again from the primary hits\n"
+		"                          kept in a G-buffer and by tracing every ray: time, memory and whether the images match [240]\n"
+		"  --irradiance-report on  render scenes 3 and 4 by path tracing and with an irradiance cache: time, records and\n"
+		"                          error against a reference of 16 times the samples [120]\n"
+		"  --caustics-report on    render scenes 1, 2 and 6 by path tracing and with a caustic photon map: time, photons and\n"
+		"                          error against a reference of 16 times the samples [120]\n"
+		"  --alloc-report on       compare heap and arena allocation of the scene objects when building scenes 1-" << SCENE_COUNT << "\n"
+		"  --traversal-report on   count BVH node visits per ray in scenes 1-" << SCENE_COUNT << " with and without large primitives kept\n"
+		"                          out of the tree [120]\n"
+		"  --accelerator-report on build every scene with each accelerator: build time, memory, cells or nodes visited and\n"
+		"                          speed [120]\n"
+		"  --layout-report on      compare BVH layouts, node formats, prefetching and leaf dispatch on scenes 1-" << SCENE_COUNT << "\n"
+		"                          and a cloud of 200000 spheres: memory, node visits, speed and cache misses [80]\n"
+		"  --check-isa on          render scenes 1-" << SCENE_COUNT << " with every kernel set the CPU supports and check that the images\n"
+		"                          match the scalar ones [60]\n"
+		"  --light-report on       render a floor lit by 1 to 10000 small lights of the same total power with each --lights\n"
+		"                          mode: time and error against a reference [64]\n"
+		"  --texture-report on     render textured objects with caches of 1 to 64 MiB: time, hit rate and bytes read\n"
+		"                          (writes --output.rtex) [120]\n"
+		"  --bvh-stats on          report the shape of the BVH of --scene: nodes, leaves, depths, leaf sizes, SAH cost,\n"
+		"                          sibling overlap and memory, and the nodes and primitives per ray of a sampled ray set\n"
+		"  --bvh-rays N            camera rays of the sampled set, each with a bounce ray where it hits (default 100000)\n"
+		"  --bvh-obj FILE          write the boxes of the BVH of --scene to FILE as an OBJ wireframe, one group per depth\n"
+		"  --bvh-obj-depth D       deepest level written to the wireframe (default: all)\n"
+		"  --regress DIR           render scenes 1-" << SCENE_COUNT << " with fixed seeds, compare them with the references DIR/sceneN.pfm and\n"
+		"                          write time, rays/s, process peak memory and error to --output.json (rays/s is the mean of\n"
+		"                          " << REGRESSION_REPEATS << " measurements of at least " << REGRESSION_MIN_SECONDS << " s each); fails if an image or the speed\n"
+		"                          regressed or a reference is missing [120]\n"
+		"  --regress-update on     store the images of this run as the new references\n"
+		"  --regress-baseline FILE compare rays/s with the .json summary of an earlier run\n"
+		"  --regress-psnr DB       least PSNR an image may have against its reference (default 40)\n"
+		"  --regress-slowdown P    least percentage rays/s may drop below the baseline before failing; the threshold grows to\n"
+		"                          " << REGRESSION_NOISE_FACTOR << " standard deviations of the measurements of both runs (default 10)\n";
+}
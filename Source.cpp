@@ -3,6 +3,7 @@
 #include <string>
 #include <thread>
 #include <iomanip>
+#include <sstream>
 
 #include "const_utility.h"
 #include "camera.h"
@@ -11,296 +12,908 @@
 #include "sphere.h"
 #include "cuboid.h"
 #include "bvh.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "distributed.h"
+#include "progressive.h"
+#include "checkpoint.h"
+#include "thread_pool.h"
+#include "animation.h"
+#include "render_server.h"
+#include "crop.h"
+#include "render_session.h"
+#include "options.h"
+#include "bench.h"
+
+#include <atomic>
+#include <cstdlib>
 
 int THREAD_COUNT;
 
-void scene1(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+void usage()
 {
-	auto ground = make_shared<Lambertian>(colour(0.5, 0.5, 0.5));
-	world.add(make_shared<Sphere>(point(0, -1000, 0), 1000, ground));
+	std::cerr << "Usage: \"Ray Tracing\" [options]\n"
+		"  --scene N               scene to render (1-" << SCENE_COUNT << ", default 3)\n"
+		"  --threads N             render threads (asked for when missing)\n"
+		"  --height N              image height, the width follows the aspect ratio of the scene\n"
+		"  --samples N             samples per pixel (default 5)\n"
+		"  --depth N               maximum bounces (default 5)\n"
+		"  --seed N                base seed of the random streams\n"
+		"  --lights M              direct light at diffuse surfaces: off (default, found by scattered rays only), uniform\n"
+		"                          (a shadow ray to a random emitter) or bvh (emitter picked by a light BVH)\n"
+		"  --env FILE              light the scene with an equirectangular .hdr or .pfm image instead of the sky gradient;\n"
+		"                          --lights uniform or bvh sample it by importance\n"
+		"  --env-scale F           factor applied to the environment image (default 1)\n"
+		"  --output NAME           output file name without extension (default image)\n"
+		"  --coordinator PORT      hand out tiles to workers over TCP (PORT 0 picks a free port)\n"
+		"  --tile N                tile size in pixels for distributed rendering (default 32)\n"
+		"  --spawn-workers N       start N local worker processes connected over loopback\n"
+		"  --tile-timeout S        seconds before the tile of a silent worker is re-queued (default 600)\n"
+		"  --worker-timeout S      seconds the coordinator waits with no worker connected before it gives up (default 300,\n"
+		"                          0 waits for ever); spawned workers are watched, and the frame fails once all have exited\n"
+		"  --worker HOST:PORT      render tiles for the coordinator at HOST:PORT\n"
+		"  --fail-after N          the (first spawned) worker quits after N tiles, to test retries\n"
+		"  --checkpoint FILE       render progressively and save the accumulated samples to FILE\n"
+		"  --checkpoint-interval S seconds between checkpoints (default 60)\n"
+		"  --pass-samples N        samples per pixel added by each progressive pass (default 1)\n"
+		"  --resume FILE           continue the render saved in FILE up to --samples samples per pixel\n"
+		"  --cost-map NAME         render in passes and write the time, BVH nodes and primitive tests of every pixel to\n"
+		"                          NAME.pfm and as false colour to NAME_time.ppm, NAME_nodes.ppm and NAME_primitives.ppm\n"
+		"  --time-limit S          render in passes of --pass-samples until S seconds after the start and write the image\n"
+		"                          reached; --samples, if given, still caps the samples per pixel\n"
+		"  --frames N              render N animation frames, refitting the BVH between frames\n"
+		"  --move-fraction F       share of the objects that move in an animation (default 0.05)\n"
+		"  --dirty-tiles on        after the first frame of an animation, render again only the tiles the moving objects\n"
+		"                          cover before or after they move; shadows and reflections elsewhere keep the old pixels\n"
+		"  --crop X0,Y0,X1,Y1      render only the pixels [X0, X1) x [Y0, Y1) of the frame, with the camera of the full frame\n"
+		"  --composite FILE        write the cropped pixels into a copy of the full-frame .pfm FILE instead of on their own\n"
+		"  --views turntable:N     render N views around the scene in one batch sharing the scene, its BVH and the threads,\n"
+		"  --views stereo:D        or a stereo pair with the eyes D apart, to --output_viewNN.ppm\n"
+		"  --irradiance-cache on   fill an irradiance cache for the view, then render with the indirect light of diffuse\n"
+		"                          surfaces taken from it (not with --lights)\n"
+		"  --irradiance-accuracy A largest error of an irradiance record where it is used (default 0.3)\n"
+		"  --irradiance-rays N     rays traced per irradiance record (default 128)\n"
+		"  --caustics on           trace photons from the emitters through metal and glass into a caustic photon map, then\n"
+		"                          render with the caustics taken from it (not with --lights or --irradiance-cache)\n"
+		"  --photons N             most caustic photons kept, which bounds the memory of the map (default 200000)\n"
+		"  --photon-nearest K      photons gathered for the caustic at a point, at most " << PHOTON_MAX_NEAREST << " (default 50)\n"
+		"  --serve PATH            run a render server on the UNIX socket PATH\n"
+		"  --submit REQUEST        send one request to the server at --socket and print the reply, e.g.\n"
+		"                          \"render scene=2 width=400 spp=4 crop=0,0,200,200 priority=1 out=view.ppm\"; hits=on keeps the\n"
+		"                          primary hits of the view, and later jobs with the same view only shade them\n"
+		"  --socket PATH           socket of the server for --submit (default raytracer.sock)\n"
+		"  --arena on|off          place scene objects and BVH nodes in an arena (default on)\n"
+		"  --bvh-layout L          node order of the flattened BVH: dfs, bfs, veb (default) or off for the pointer tree\n"
+		"  --bvh-quantize on|off   store child boxes of the flattened BVH in 8 bits per coordinate (default off)\n"
+		"  --prefetch on|off       prefetch child nodes during traversal (default off)\n"
+		"  --typed-leaves on|off   test spheres, rectangles and boxes in the flattened BVH without virtual calls (default on)\n"
+		"  --accelerator A         structure rays are traversed with: bvh (default), grid or hgrid (hierarchical grid)\n"
+		"  --grid-density D        cells per primitive of a grid (default 4)\n"
+		"  --isa NAME              intersection kernels to use: scalar, sse4.2, avx2 or avx512 (default: the newest the CPU\n"
+		"                          supports); they test the flat BVH nodes, the spheres and rectangles of its typed leaves\n"
+		"                          and SphereSet leaves\n"
+		"  --make-texture FILE     convert a PPM image into a tiled, mip-mapped texture named after --output (.rtex)\n"
+		"  --texture-cache MIB     memory for texture tiles shared by all threads (default 256)\n";
+	benchUsage(std::cerr);
+}
 
-	for (int a = -11; a < 11; a++)
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
 	{
-		for (int b = -11; b < 11; b++) 
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		std::string value = hasValue ? argv[i + 1] : "";
+
+		if (!hasValue)
+			return false;
+		i++;
+
+		if (arg == "--scene")
+			options.scene = std::stoi(value);
+		else if (arg == "--threads")
+			options.threads = std::stoi(value);
+		else if (arg == "--height")
+			options.height = std::stoi(value);
+		else if (arg == "--samples")
+		{
+			options.settings.samples = std::stoi(value);
+			options.samplesGiven = true;
+		}
+		else if (arg == "--depth")
+			options.settings.maxDepth = std::stoi(value);
+		else if (arg == "--seed")
+			options.settings.seed = std::stoull(value);
+		else if (arg == "--lights")
+		{
+			if (!parseLightSampling(value, options.settings.lightSampling))
+				return false;
+		}
+		else if (arg == "--env")
+			options.environment = value;
+		else if (arg == "--env-scale")
+			options.environmentScale = std::stod(value);
+		else if (arg == "--output")
+			options.output = value;
+		else if (arg == "--coordinator")
+		{
+			options.coordinator = true;
+			options.port = std::stoi(value);
+		}
+		else if (arg == "--tile")
+			options.tileSize = std::stoi(value);
+		else if (arg == "--spawn-workers")
+			options.spawnWorkers = std::stoi(value);
+		else if (arg == "--tile-timeout")
+			options.tileTimeout = std::stoi(value);
+		else if (arg == "--worker-timeout")
+			options.workerTimeout = std::stoi(value);
+		else if (arg == "--worker")
+		{
+			auto colon = value.rfind(':');
+			if (colon == std::string::npos)
+				return false;
+			options.worker = true;
+			options.host = value.substr(0, colon);
+			options.port = std::stoi(value.substr(colon + 1));
+		}
+		else if (arg == "--fail-after")
+			options.failAfter = std::stoi(value);
+		else if (arg == "--checkpoint")
+			options.checkpoint = value;
+		else if (arg == "--checkpoint-interval")
+			options.checkpointInterval = std::stoi(value);
+		else if (arg == "--pass-samples")
+			options.passSamples = std::stoi(value);
+		else if (arg == "--resume")
+			options.resume = value;
+		else if (arg == "--cost-map")
+			options.costMap = value;
+		else if (arg == "--time-limit")
+			options.timeLimit = std::stod(value);
+		else if (arg == "--frames")
+			options.frames = std::stoi(value);
+		else if (arg == "--move-fraction")
+			options.moveFraction = std::stod(value);
+		else if (arg == "--dirty-tiles")
+			options.dirtyTiles = value != "off";
+		else if (arg == "--crop")
 		{
-			point center(a + 0.9 * randomDouble(), 0.2, b + 0.9 * randomDouble());
+			auto numbers = parseNumbers(value);
+			if (numbers.size() != 4)
+				return false;
+			options.crop = { int(numbers[0]), int(numbers[1]), int(numbers[2]), int(numbers[3]) };
+		}
+		else if (arg == "--composite")
+			options.composite = value;
+		else if (arg == "--views")
+			options.views = value;
+		else if (arg == "--gbuffer-report")
+			options.gbufferReport = value != "off";
+		else if (arg == "--irradiance-cache")
+			options.irradianceCache = value != "off";
+		else if (arg == "--irradiance-accuracy")
+			options.irradianceAccuracy = std::stod(value);
+		else if (arg == "--irradiance-rays")
+			options.irradianceRays = std::stoi(value);
+		else if (arg == "--irradiance-report")
+			options.irradianceReport = value != "off";
+		else if (arg == "--caustics")
+			options.caustics = value != "off";
+		else if (arg == "--photons")
+			options.photons = size_t(std::stoull(value));
+		else if (arg == "--photon-nearest")
+			options.photonNearest = std::stoi(value);
+		else if (arg == "--caustics-report")
+			options.causticsReport = value != "off";
+		else if (arg == "--serve")
+			options.serve = value;
+		else if (arg == "--submit")
+			options.submit = value;
+		else if (arg == "--socket")
+			options.socket = value;
+		else if (arg == "--arena")
+			options.arena = value != "off";
+		else if (arg == "--alloc-report")
+			options.allocReport = value != "off";
+		else if (arg == "--traversal-report")
+			options.traversalReport = value != "off";
+		else if (arg == "--bvh-layout")
+		{
+			options.bvh.flat = value != "off";
+			if (options.bvh.flat && !parseLayout(value, options.bvh.layout))
+				return false;
+		}
+		else if (arg == "--bvh-quantize")
+			options.bvh.quantized = value != "off";
+		else if (arg == "--prefetch")
+			options.bvh.prefetch = value != "off";
+		else if (arg == "--typed-leaves")
+			options.bvh.typedLeaves = value != "off";
+		else if (arg == "--accelerator")
+		{
+			if (!parseAccelerator(value, options.bvh.accelerator))
+				return false;
+		}
+		else if (arg == "--grid-density")
+			options.bvh.gridDensity = std::stod(value);
+		else if (arg == "--accelerator-report")
+			options.acceleratorReport = value != "off";
+		else if (arg == "--layout-report")
+			options.layoutReport = value != "off";
+		else if (arg == "--bvh-stats")
+			options.bvhStats = value != "off";
+		else if (arg == "--bvh-rays")
+			options.bvhRays = std::stoi(value);
+		else if (arg == "--bvh-obj")
+			options.bvhObj = value;
+		else if (arg == "--bvh-obj-depth")
+			options.bvhObjDepth = std::stoi(value);
+		else if (arg == "--isa")
+			options.isa = value;
+		else if (arg == "--check-isa")
+			options.checkIsa = value != "off";
+		else if (arg == "--light-report")
+			options.lightReport = value != "off";
+		else if (arg == "--make-texture")
+			options.makeTexture = value;
+		else if (arg == "--texture-cache")
+			options.textureCacheMiB = std::stoi(value);
+		else if (arg == "--texture-report")
+			options.textureReport = value != "off";
+		else if (arg == "--regress")
+			options.regress = value;
+		else if (arg == "--regress-update")
+			options.regressUpdate = value != "off";
+		else if (arg == "--regress-baseline")
+			options.regressBaseline = value;
+		else if (arg == "--regress-psnr")
+			options.regressPsnr = std::stod(value);
+		else if (arg == "--regress-slowdown")
+			options.regressSlowdown = std::stod(value);
+		else
+			return false;
+	}
+	return true;
+}
 
-			if ((center - point(4, 0.2, 0)).length() > 0.9) 
-			{
-				shared_ptr<Material> sphereMaterial;
-				auto materialChooser = randomDouble();
-
-				if (materialChooser < 0.8) 
-				{
-					// lambertian
-					auto albedo = colour::random() * colour::random();
-					sphereMaterial = make_shared<Lambertian>(albedo);
-					world.add(make_shared<Sphere>(center, 0.2, sphereMaterial));
-				}
-				else if (materialChooser < 0.95) 
-				{
-					// metal
-					auto albedo = colour::random(0.5, 1);
-					auto fuzz = randomDouble(0, 0.5);
-					sphereMaterial = make_shared<Metal>(albedo, fuzz);
-					world.add(make_shared<Sphere>(center, 0.2, sphereMaterial));
-				}
-				else 
-				{
-					// glass
-					sphereMaterial = make_shared<Dielectric>(1.5);
-					world.add(make_shared<Sphere>(center, 0.2, sphereMaterial));
-				}
-			}
+/// <summary>
+/// Renders a frame by handing its tiles out to worker processes
+/// </summary>
+int runCoordinator(const Options& options, const std::string& executable)
+{
+	HittableList world; Camera camera; double aspectRatio; int imgWidth; int imgHeight;
+	if (!loadScene(options.scene, world, camera, imgWidth, imgHeight, aspectRatio))
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+
+	DistributedJob job;
+	job.scene = options.scene;
+	job.imgHeight = options.height > 0 ? options.height : imgHeight;
+	job.imgWidth = options.height > 0 ? static_cast<int>(options.height * aspectRatio) : imgWidth;
+	job.settings = options.settings;
+	job.bvh = options.bvh;
+	job.arena = options.arena;
+
+	Coordinator coordinator(job, options.tileSize);
+	coordinator.tileTimeout = options.tileTimeout;
+	coordinator.workerTimeout = options.workerTimeout;
+
+	int port = options.port;
+	if (!coordinator.listen(port))
+	{
+		std::cerr << "Could not listen on port " << options.port << "\n";
+		return 1;
+	}
+	std::cerr << "Coordinator listening on port " << port << " for a " << job.imgWidth << "x" << job.imgHeight << " frame of scene " << job.scene << "\n";
+
+	std::vector<ProcessHandle> processes;
+	for (int i = 0; i < options.spawnWorkers; i++)
+	{
+		std::vector<std::string> args = { executable, "--worker", "127.0.0.1:" + std::to_string(port), "--threads", std::to_string(std::max(options.threads, 1)) };
+		if (!options.environment.empty())
+			args.insert(args.end(), { "--env", options.environment, "--env-scale", std::to_string(options.environmentScale) });
+		if (i == 0 && options.failAfter >= 0)
+		{
+			args.push_back("--fail-after");
+			args.push_back(std::to_string(options.failAfter));
+		}
+
+		ProcessHandle process;
+		if (spawnProcess(args, process))
+		{
+			processes.push_back(process);
+			coordinator.watch(process);
 		}
+		else
+			std::cerr << "Could not start worker " << i << "\n";
 	}
 
-	auto matte = make_shared<Lambertian>(colour(0.4, 0.2, 0.1));
-	world.add(make_shared<Sphere>(point(-4, 1, 0), 1.0, matte));
+	if (options.spawnWorkers > 0 && processes.empty())
+	{
+		std::cerr << "No worker could be started\n";
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	bool complete = coordinator.run();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (auto process : processes)
+		waitProcess(process);
+
+	coordinator.report(seconds);
+
+	if (!complete)
+		return 1;
 
-	auto glass = make_shared<Dielectric>(1.5);
-	world.add(make_shared<Sphere>(point(0, 1, 0), 1.0, glass));
+	coordinator.result().writePPM(options.output + ".ppm");
+	coordinator.result().writePFM(options.output + ".pfm");
+	std::cerr << "Rendered.\n";
+	return 0;
+}
+
+/// <summary>
+/// Writes the per-pixel costs of a render as a float image and one false-colour image per measure, each scaled so the
+/// 99th percentile is white, and prints a summary
+/// </summary>
+/// <param name="costs">Nanoseconds, BVH nodes and primitive tests of every pixel</param>
+/// <param name="name">File name without extension</param>
+void writeCostMap(const FloatImage& costs, const std::string& name)
+{
+	static const char* measures[3] = { "time", "nodes", "primitives" };
 
-	auto metal = make_shared<Metal>(colour(0.7, 0.6, 0.5), 0.0);
-	world.add(make_shared < Sphere > (point(4, 1, 0), 1.0, metal));
+	costs.writePFM(name + ".pfm");
 
-	aspectRatio = 16.0 / 9.0;
-	imgHeight = 1080;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 20;
-	auto aperture = 0.1;
-	auto fDis = 10.0;
+	double totals[3] = { 0.0, 0.0, 0.0 };
+	float largest[3] = { 0.0f, 0.0f, 0.0f };
+	for (size_t i = 0; i < costs.pixels.size(); i++)
+	{
+		totals[i % 3] += costs.pixels[i];
+		largest[i % 3] = std::max(largest[i % 3], costs.pixels[i]);
+	}
 
-	Camera cam(point(13, 2, 3), point(0, 0, 0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+	size_t pixelCount = costs.pixels.size() / 3;
+	std::cerr << "Cost map " << name << ".pfm (time in ns, nodes, primitives per pixel):\n";
+	for (int c = 0; c < 3; c++)
+	{
+		float white = costs.percentile(c, 0.99);
+		costs.writeFalseColour(name + "_" + measures[c] + ".ppm", c, white);
+		std::cerr << "  " << std::left << std::setw(12) << measures[c] << std::right << "mean " << std::setw(12) << totals[c] / pixelCount
+			<< " max " << std::setw(12) << largest[c] << " white at " << white << "\n";
+	}
+	std::cerr << "  " << totals[0] * 1e-9 << " thread-seconds in pixels\n";
 }
 
-void scene2(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+/// <summary>
+/// Prints how long every pass of a timed render took and how many samples per pixel it reached
+/// </summary>
+void logPasses(const ProgressiveRenderer& renderer, int passSamples, double timeLimit, double seconds)
 {
-	auto ground = make_shared<Lambertian>(colour(0.48, 0.83, 0.53));
-	auto light = make_shared<Light>(colour(9.0, 9.0, 9.0));
-	auto white = make_shared<Lambertian>(colour(.73, .73, .73));
-	auto metalGrey = make_shared<Metal>(colour(0.8, 0.8, 0.9), 0.0);
-	auto metalBlue = make_shared<Metal>(colour(0.2, 0.4, 0.9), 0.2);
-	auto metalYellow = make_shared<Metal>(colour(1, 1, 0), 0.0);
-	auto matteRed = make_shared<Lambertian>(colour(0.8, 0.0, 0.0));
-	auto matteGrey = make_shared<Lambertian>(colour(0.25, 0.25, 0.25));
+	double previous = 0.0;
+	for (size_t i = 0; i < renderer.passSeconds.size(); i++)
+	{
+		std::cerr << "  pass " << std::setw(4) << i + 1 << std::setw(10) << std::fixed << std::setprecision(3)
+			<< renderer.passSeconds[i] - previous << " s" << std::defaultfloat << "\n";
+		previous = renderer.passSeconds[i];
+	}
 
-	world.add(make_shared<xzPlane>(123, 423, 147, 412, 554, light));
+	uint32_t fewest, most;
+	renderer.sampleRange(fewest, most);
+	std::cerr << renderer.passSeconds.size() << " passes of " << passSamples << " spp finished within the limit of " << timeLimit
+		<< " s; " << fewest << " to " << most << " samples per pixel reached, render stopped after " << seconds << " s\n";
+}
+
+/// <summary>
+/// Renders progressively with periodic checkpoints, optionally continuing from an earlier checkpoint. Without either,
+/// renders in passes without checkpoints, which is how cost maps are made
+/// </summary>
+int runProgressive(const Options& options, const EnvironmentMap* environment)
+{
+	// the time limit covers building the scene too, as that is part of what the caller waits for
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(options.timeLimit));
+	CheckpointHeader header;
+	AccumulationBuffer start;
 
-	const int boxes = 20;
-	for (int i = 0; i < boxes; i++)
+	if (!options.resume.empty())
 	{
-		for (int j = 0; j < boxes; j++)
+		if (!readCheckpoint(options.resume, header, start))
 		{
-			auto w = 100.0;
-			auto x0 = -1000.0 + i * w;
-			auto z0 = -1000.0 + j * w;
-			auto y0 = 0.0;
-			auto x1 = x0 + w;
-			auto z1 = z0 + w;
-			auto y1 = randomDouble(1, 101);
-
-			world.add(make_shared<Cuboid>(point(x0, y0, z0), point(x1, y1, z1), ground));
+			std::cerr << "Could not read checkpoint " << options.resume << "\n";
+			return 1;
 		}
 	}
+	else
+	{
+		header.scene = options.scene;
+		header.tileSize = options.tileSize;
+		header.passSamples = options.passSamples;
+		header.maxDepth = options.settings.maxDepth;
+		header.lightOff = options.settings.lightOff;
+		for (int c = 0; c < 3; c++)
+			header.background[c] = float(options.settings.background[c]);
+		header.seed = options.settings.seed;
+	}
 
-	world.add(make_shared<Sphere>(point(230, 150, 45), 50, make_shared<Dielectric>(1.5)));
-	world.add(make_shared<Sphere>(point(0, 200, 145), 50, metalGrey));
-	world.add(make_shared<Sphere>(point(360, 150, 145), 70,metalBlue));
-	world.add(make_shared<Sphere>(point(400, 200, 400), 100, matteRed));
-	world.add(make_shared<Sphere>(point(220, 330, 300), 80, metalYellow));
-	
-	for (int j = 0; j < 1000; j++) {
-		world.add(make_shared<Sphere>(point::random(0, 165) + point(0, 300, 0), 10, white));
+	auto scene = buildScene(header.scene, options.resume.empty() ? options.height : header.imgHeight, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << header.scene << "\n";
+		return 1;
 	}
-	
-	world.add(make_shared<xyPlane>(-600, 600, 0, 1000, 600, matteGrey));
-	world.add(make_shared<xyPlane>(-600, 600, 0, 1000, -601, matteGrey));
+	header.imgWidth = scene->imgWidth;
+	header.imgHeight = scene->imgHeight;
 
-	world.add(make_shared<yzPlane>(0, 1000, -601, 600, 600, matteGrey));
-	world.add(make_shared<yzPlane>(0, 1000, -601, 600, -600, matteGrey));
-	
-	world.add(make_shared<xzPlane>(-600, 600, -601, 600, 555, matteGrey));
+	if (!start.counts.empty() && (start.width != scene->imgWidth || start.height != scene->imgHeight))
+	{
+		std::cerr << "Checkpoint " << options.resume << " does not match scene " << header.scene << "\n";
+		return 1;
+	}
+
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings.maxDepth = header.maxDepth;
+	context.settings.lightOff = header.lightOff != 0;
+	context.settings.background = colour(header.background[0], header.background[1], header.background[2]);
+	context.settings.seed = header.seed;
+	// not part of the checkpoint: every light sampling mode converges to the same image, so a resumed render may switch;
+	// the environment map is not stored either and has to be given again
+	context.settings.lightSampling = options.settings.lightSampling;
 
-	aspectRatio = 1.0;
-	imgHeight = 800;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 40;
-	auto aperture = 0.0;
-	auto fDis = 10.0;
+	std::string checkpoint = !options.checkpoint.empty() ? options.checkpoint : options.resume;
+	CheckpointWriter writer(checkpoint, header);
+	// without a sample count a timed render goes on until the deadline; the cap only keeps the pass count finite
+	int samples = options.timeLimit > 0.0 && !options.samplesGiven ? 1 << 24 : options.settings.samples;
+	ProgressiveRenderer renderer(context, header.tileSize, header.passSamples, samples, std::move(start));
+	if (!options.costMap.empty())
+		renderer.recordCosts();
+	if (options.timeLimit > 0.0)
+		renderer.setDeadline(deadline);
 
-	Camera cam(point(478, 278, -600), point(278, 278, 0.0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+	auto begin = std::chrono::steady_clock::now();
+	renderer.render(std::max(options.threads, 1), checkpoint.empty() ? nullptr : &writer, options.checkpointInterval);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	FloatImage image = renderer.buffer.resolve();
+	image.writePPM(options.output + ".ppm");
+	image.writePFM(options.output + ".pfm");
+
+	if (checkpoint.empty())
+		std::cerr << "\nTime taken by program : " << seconds << " secs\n";
+	else
+	{
+		std::cerr << "\nTime taken by program : " << seconds << " secs, " << writer.written << " checkpoints written to " << checkpoint;
+		if (writer.failed > 0)
+			std::cerr << ", " << writer.failed << " failed";
+		std::cerr << "\n";
+	}
+	if (options.timeLimit > 0.0)
+		logPasses(renderer, header.passSamples, options.timeLimit, seconds);
+	if (!options.costMap.empty())
+		writeCostMap(renderer.costs, options.costMap);
+	if (textureCache().lookups() > 0)
+		textureCache().report(std::cerr);
+	std::cerr << "Rendered.\n";
+	return 0;
 }
 
-void scene3(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+/// <summary>
+/// Renders an animation in which a few objects move, keeping the scene, its BVH and the render threads alive
+/// across frames and refitting (or rebuilding) the BVH between frames
+/// </summary>
+int runAnimation(const Options& options, const EnvironmentMap* environment)
 {
-	auto red = make_shared<Lambertian>(colour(.65, .05, .05));
-	auto green = make_shared<Lambertian>(colour(.12, .45, .15));
-	auto blue = make_shared<Lambertian>(colour(0.2, 0.4, 0.9));
-	auto yellow = make_shared<Lambertian>(colour(1, 1, 0));
-	auto lightGrey = make_shared<Lambertian>(colour(.73, .73, .73));
-
-	world.add(make_shared<xyPlane>(0, 555, 0, 555, 555, lightGrey));
-	world.add(make_shared<yzPlane>(0, 555, -100, 555, 555, green));
-	world.add(make_shared<yzPlane>(0, 555, -100, 555, 0, red));
-	world.add(make_shared<xzPlane>(0, 555, -100, 555, 0, lightGrey));
-	world.add(make_shared<xzPlane>(0, 555, -100, 555, 555, lightGrey));
-
-	world.add(make_shared<Cuboid>(point(130, 0, 65), point(295, 165, 230), lightGrey));
-	world.add(make_shared<Cuboid>(point(265, 0, 295), point(430, 330, 460), lightGrey));
-
-	aspectRatio = 1.0;
-	imgHeight = 2160;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 40;
-	auto aperture = 0.0;
-	auto fDis = 10.0;
-
-	Camera cam(point(278, 278, -800), point(278, 278, 0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+
+	ThreadPool pool(std::max(options.threads, 1));
+	Animation animation(scene->world.objects, options.moveFraction);
+	BVH_Node& tree = *scene->root->tree;
+	double buildCost = tree.sahCost() / tree.box.area();
+
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings = options.settings;
+
+	std::vector<Tile> tiles = makeTiles(scene->imgWidth, scene->imgHeight, options.tileSize);
+	std::cerr << "Animating " << animation.size() << " of " << scene->world.objects.size() << " objects over " << options.frames << " frames\n";
+
+	FloatImage image(scene->imgWidth, scene->imgHeight);
+	std::vector<size_t> render(tiles.size());
+	for (size_t i = 0; i < tiles.size(); i++)
+		render[i] = i;
+
+	for (int frame = 0; frame < options.frames; frame++)
+	{
+		BVHUpdateStats stats;
+		if (frame > 0)
+		{
+			std::vector<BoundingBox> changed;
+			animation.addBoxes(changed);
+			animation.apply(frame);
+			animation.addBoxes(changed);
+			stats = updateBVH(tree, buildCost, pool.size());
+			buildAccelerator(*scene->root, options.bvh);
+			*scene->lights = LightBVH(scene->world.objects);
+
+			if (options.dirtyTiles)
+				render = dirtyTiles(context.camera, changed, tiles, scene->imgWidth, scene->imgHeight);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		// tiles not rendered again keep the pixels of the previous frame
+		pool.parallelFor(render.size(), [&](size_t i)
+		{
+			const Tile& tile = tiles[render[i]];
+			std::vector<float> pixels(size_t(tile.width()) * tile.height() * 3);
+			renderTile(context, tile, 1, pixels.data());
+			image.setTile(tile, pixels.data());
+		});
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::string number = std::to_string(frame);
+		image.writePPM(options.output + "_" + std::string(4 - std::min<size_t>(4, number.size()), '0') + number + ".ppm");
+
+		std::cerr << "Frame " << frame << ": BVH update " << stats.seconds * 1000.0 << " ms (cost x" << stats.costRatio
+			<< ", " << stats.rebuiltSubtrees << " subtrees rebuilt" << (stats.fullRebuild ? ", full rebuild" : "")
+			<< "), render " << seconds << " s, " << render.size() << " of " << tiles.size() << " tiles\n";
+	}
+
+	std::cerr << "Rendered.\n";
+	return 0;
+}
+
+/// <summary>
+/// Renders a rectangle of the frame with the camera of the full frame, on its own or into an earlier full-frame image
+/// </summary>
+int runCrop(const Options& options, const EnvironmentMap* environment)
+{
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+
+	const Tile& crop = options.crop;
+	if (crop.x0 < 0 || crop.y0 < 0 || crop.x1 > scene->imgWidth || crop.y1 > scene->imgHeight || crop.width() <= 0 || crop.height() <= 0)
+	{
+		std::cerr << "The crop window does not fit the " << scene->imgWidth << "x" << scene->imgHeight << " frame\n";
+		return 1;
+	}
+
+	FloatImage image;
+	if (!options.composite.empty())
+	{
+		if (!image.readPFM(options.composite))
+		{
+			std::cerr << "Could not read " << options.composite << "\n";
+			return 1;
+		}
+		if (image.width != scene->imgWidth || image.height != scene->imgHeight)
+		{
+			std::cerr << options.composite << " is " << image.width << "x" << image.height << ", the frame is "
+				<< scene->imgWidth << "x" << scene->imgHeight << "\n";
+			return 1;
+		}
+	}
+	else
+		image = FloatImage(crop.width(), crop.height());
+
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings = options.settings;
+
+	ThreadPool pool(std::max(options.threads, 1));
+	std::vector<Tile> tiles = makeCropTiles(crop, options.tileSize);
+	Tile offset = options.composite.empty() ? crop : Tile{ 0, 0, 0, 0 };
+
+	auto start = std::chrono::steady_clock::now();
+	pool.parallelFor(tiles.size(), [&](size_t i)
+	{
+		const Tile& tile = tiles[i];
+		std::vector<float> pixels(size_t(tile.width()) * tile.height() * 3);
+		renderTile(context, tile, 1, pixels.data());
+		image.setTile({ tile.x0 - offset.x0, tile.y0 - offset.y0, tile.x1 - offset.x0, tile.y1 - offset.y0 }, pixels.data());
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	image.writePPM(options.output + ".ppm");
+	image.writePFM(options.output + ".pfm");
+
+	std::cerr << "Rendered " << crop.width() << "x" << crop.height() << " of " << scene->imgWidth << "x" << scene->imgHeight
+		<< " pixels in " << seconds << " s" << (options.composite.empty() ? "" : " into a copy of " + options.composite) << "\n";
+	return 0;
 }
 
-void scene4(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+/// <summary>
+/// Derives the cameras of a batch from the camera of the scene
+/// </summary>
+/// <param name="spec">turntable:N for N views evenly around the point looked at, stereo:D for a left and a right eye
+/// D apart</param>
+/// <returns>False, if the description is not understood</returns>
+bool makeViews(const std::string& spec, const Camera& camera, std::vector<Camera>& views)
 {
-	auto red = make_shared<Lambertian>(colour(.65, .05, .05));
-	auto green = make_shared<Lambertian>(colour(.12, .45, .15));
-	auto blue = make_shared<Lambertian>(colour(0.2, 0.4, 0.9));
-	auto yellow = make_shared<Lambertian>(colour(1, 1, 0));
-	auto lightGrey = make_shared<Lambertian>(colour(.73, .73, .73));
-	auto light = make_shared<Light>(colour(15, 15, 15));
-
-	world.add(make_shared<xyPlane>(0, 555, 0, 555, 555, lightGrey));
-	world.add(make_shared<yzPlane>(0, 555, -100, 555, 555, green));
-	world.add(make_shared<yzPlane>(0, 555, -100, 555, 0, red));
-	world.add(make_shared<xzPlane>(0, 555, -100, 555, 0, lightGrey));
-	world.add(make_shared<xzPlane>(0, 555, -100, 555, 555, lightGrey));
-	world.add(make_shared<xzPlane>(213, 343, 227, 332, 554, light));
-
-	world.add(make_shared<Cuboid>(point(130, 0, 65), point(295, 165, 230), lightGrey));
-	world.add(make_shared<Cuboid>(point(265, 0, 295), point(430, 330, 460), lightGrey));
-
-	aspectRatio = 1.0;
-	imgHeight = 2160;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 40;
-	auto aperture = 0.0;
-	auto fDis = 10.0;
-
-	Camera cam(point(278, 278, -800), point(278, 278, 0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+	size_t colon = spec.find(':');
+	if (colon == std::string::npos)
+		return false;
+
+	std::string kind = spec.substr(0, colon);
+	double value = std::stod(spec.substr(colon + 1));
+
+	if (kind == "turntable" && value >= 1)
+	{
+		int count = int(value);
+		for (int i = 0; i < count; i++)
+			views.push_back(camera.orbited(360.0 * i / count));
+		return true;
+	}
+	if (kind == "stereo" && value > 0.0)
+	{
+		views.push_back(camera.shifted(-0.5 * value));
+		views.push_back(camera.shifted(0.5 * value));
+		return true;
+	}
+	return false;
 }
 
-void scene5(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+/// <summary>
+/// Renders several views of one scene as a single batch: the scene and its BVH are built once, and the tiles of all
+/// views are queued on one thread pool, so threads that finish one view go on with the next
+/// </summary>
+int runViews(const Options& options, const EnvironmentMap* environment)
 {
-	auto red = make_shared<Lambertian>(colour(0.8, 0.0, 0.0));
-	auto light = make_shared<Light>(colour(15.0, 15.0, 15.0));
-	auto black = make_shared<Lambertian>(colour(0.25, 0.25, 0.25));
+	auto buildStart = std::chrono::steady_clock::now();
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
 
-	world.add(make_shared<Sphere>(point(0, -1000, 0), 1000, black));
-	world.add(make_shared<Sphere>(point(0, 2, 0), 2,red));
+	std::vector<Camera> cameras;
+	if (!makeViews(options.views, scene->camera, cameras))
+	{
+		std::cerr << "Unknown views " << options.views << ", expected turntable:N or stereo:D\n";
+		return 1;
+	}
 
-	auto difflight = make_shared<Light>(colour(4, 4, 4));
-	world.add(make_shared<xyPlane>(3, 7, 1, 5, -2, difflight));
+	ThreadPool pool(std::max(options.threads, 1));
+	std::vector<std::unique_ptr<RenderSession>> sessions;
+	std::vector<std::future<FloatImage>> images;
+	std::vector<double> finishedAt(cameras.size(), 0.0);
+	auto start = std::chrono::steady_clock::now();
 
-	aspectRatio = 16.0 / 9.0;
-	imgHeight = 2160;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 20;
-	auto aperture = 0.0;
-	auto fDis = 10.0;
+	for (size_t i = 0; i < cameras.size(); i++)
+	{
+		RenderContext context;
+		context.world = scene->root.get();
+		context.lights = scene->lights.get();
+		context.environment = environment;
+		context.camera = cameras[i];
+		context.imgWidth = scene->imgWidth;
+		context.imgHeight = scene->imgHeight;
+		context.settings = options.settings;
 
-	Camera cam(point(26, 3, 6), point(0, 2, 0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+		sessions.emplace_back(new RenderSession(pool, scene, context, Tile{ 0, 0, 0, 0 }, options.tileSize));
+		sessions.back()->onProgress([&finishedAt, i, start](size_t finished, size_t total)
+		{
+			if (finished == total)
+				finishedAt[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		});
+		images.push_back(sessions.back()->start());
+	}
+
+	std::cerr << "Rendering " << cameras.size() << " views of scene " << options.scene << " (built once in " << buildSeconds * 1000.0
+		<< " ms) on " << pool.size() << " threads\n";
+	std::cerr << std::left << std::setw(6) << "view" << std::right << std::setw(12) << "done at s" << std::setw(14) << "thread-s"
+		<< std::setw(14) << "Mrays" << std::setw(16) << "Mrays/thread-s" << "\n";
+
+	uint64_t totalRays = 0;
+	for (size_t i = 0; i < cameras.size(); i++)
+	{
+		FloatImage image = images[i].get();
+		std::string number = std::to_string(i);
+		std::string name = options.output + "_view" + std::string(2 - std::min<size_t>(2, number.size()), '0') + number;
+		image.writePPM(name + ".ppm");
+		image.writePFM(name + ".pfm");
+
+		uint64_t rays;
+		double seconds;
+		sessions[i]->statistics(rays, seconds);
+		totalRays += rays;
+		std::cerr << std::left << std::setw(6) << i << std::right << std::fixed << std::setprecision(3) << std::setw(12) << finishedAt[i]
+			<< std::setw(14) << seconds << std::setw(14) << rays / 1e6 << std::setw(16) << rays / 1e6 / std::max(seconds, 1e-9)
+			<< std::defaultfloat << "\n";
+	}
+
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "All views: " << wall << " s, " << totalRays / 1e6 / wall << " Mrays/s\n";
+	return 0;
 }
 
-void scene6(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+/// <summary>
+/// Fills an irradiance cache for the scene and renders it with the cache on the tile renderer
+/// </summary>
+int runIrradianceCache(const Options& options, const EnvironmentMap* environment)
 {
-	auto sun = make_shared<Light>(colour(2.0, 2.0, 2.0));
-	auto ground = make_shared<Lambertian>(colour(0.25, 0.25, 0.25));
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
+
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings = options.settings;
 
-	world.add(make_shared<Sphere>(point(0.0, -20000.0, 0.0), 20000.0, ground));
-	world.add(make_shared<Sphere>(point(1250.0, 1250.0, -0.0), 1000.0, sun));
+	ThreadPool pool(std::max(options.threads, 1));
+	IrradianceCache cache = makeIrradianceCache(*scene, options.irradianceAccuracy);
 
-	for (int a = -6; a < 6; a++)
+	auto start = std::chrono::steady_clock::now();
+	fillIrradianceCache(context, cache, pool, options.irradianceRays);
+	double fillSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	context.irradiance = &cache;
+
+	FloatImage image(scene->imgWidth, scene->imgHeight);
+	std::vector<Tile> tiles = makeTiles(scene->imgWidth, scene->imgHeight, options.tileSize);
+	start = std::chrono::steady_clock::now();
+	pool.parallelFor(tiles.size(), [&](size_t i)
 	{
-		for (int b = -4; b < 3; b++)
-		{
-			point center(a * 5 + randomDouble(randomDouble(-1500, 1000), randomDouble(-1500, 1000)), 50, 5 * b + randomDouble(randomDouble(-1500, 1250), randomDouble(-1500, 1250)));
-			
-			shared_ptr<Material> sphereMaterial;
-			auto materialChooser = randomDouble();
+		std::vector<float> pixels(size_t(tiles[i].width()) * tiles[i].height() * 3);
+		renderTile(context, tiles[i], 1, pixels.data());
+		image.setTile(tiles[i], pixels.data());
+	});
+	double renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-			if (materialChooser < 0.4)
-			{
-				// metal
-				auto albedo = colour::random(0.5, 1);
-				auto fuzz = randomDouble(0, 0.25);
-				sphereMaterial = make_shared<Metal>(albedo, fuzz);
-				world.add(make_shared<Sphere>(center, 50, sphereMaterial));
-			}
-			else if (materialChooser < 0.73)
-			{
-				// diffuse
-				auto albedo = colour::random() * colour::random();
-				sphereMaterial = make_shared<Lambertian>(albedo);
-				world.add(make_shared<Sphere>(center, 50, sphereMaterial));
-			}
-			else
-			{
-				// dielectric
-				sphereMaterial = make_shared<Dielectric>(randomDouble(1.25, 2.0));
-				world.add(make_shared<Sphere>(center, 50, sphereMaterial));
-			}
+	image.writePPM(options.output + ".ppm");
+	image.writePFM(options.output + ".pfm");
+	std::cerr << "Irradiance cache: " << cache.size() << " records, " << cache.memoryBytes() / 1024 << " KB, filled in " << fillSeconds
+		<< " s; rendered in " << renderSeconds << " s\n";
+	return 0;
+}
 
-				
-		}
+/// <summary>
+/// Fills a caustic photon map for the scene and renders it with the map on the tile renderer
+/// </summary>
+int runCaustics(const Options& options, const EnvironmentMap* environment)
+{
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
 	}
 
-	aspectRatio = 16.0 / 9.0;
-	imgHeight = 2160;
-	imgWidth = static_cast<int>(imgHeight * aspectRatio);
-	auto vfov = 20;
-	auto aperture = 0.0;
-	auto fDis = 10.0;
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings = options.settings;
+
+	ThreadPool pool(std::max(options.threads, 1));
+	PhotonMap photons = makePhotonMap(*scene, options);
+
+	auto start = std::chrono::steady_clock::now();
+	photons.build(*scene->root, scene->world.objects, *scene->lights, pool);
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	context.photons = &photons;
+
+	FloatImage image(scene->imgWidth, scene->imgHeight);
+	std::vector<Tile> tiles = makeTiles(scene->imgWidth, scene->imgHeight, options.tileSize);
+	start = std::chrono::steady_clock::now();
+	pool.parallelFor(tiles.size(), [&](size_t i)
+	{
+		std::vector<float> pixels(size_t(tiles[i].width()) * tiles[i].height() * 3);
+		renderTile(context, tiles[i], 1, pixels.data());
+		image.setTile(tiles[i], pixels.data());
+	});
+	double renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-	Camera cam(point(-3000.0, 1700, 4500) + 2500 * unitVector(point(3000, -1700, -4500)), point(0, 0, 0), aspectRatio, vfov, aperture, fDis);
-	camera = cam;
+	image.writePPM(options.output + ".ppm");
+	image.writePFM(options.output + ".pfm");
+	std::cerr << "Photon map: " << photons.size() << " caustic photons of " << photons.emittedCount() << " emitted at "
+		<< photons.targetCount() << " metal and glass objects, " << photons.memoryBytes() / 1024 << " KB, built in " << buildSeconds
+		<< " s; rendered in " << renderSeconds << " s\n";
+	return 0;
 }
 
-colour getColour(const Ray& r, const colour& background, BVH_Node root, int depth, bool lightOff)
+/// <summary>
+/// Runs the render server until a client asks it to shut down
+/// </summary>
+int runServer(const Options& options)
 {
-	hitRecord record;
+	ThreadPool pool(std::max(options.threads, int(std::thread::hardware_concurrency())));
+	RenderServer server(pool, options.tileSize);
+
+	if (!server.listen(options.serve))
+	{
+		std::cerr << "Could not listen on " << options.serve << "\n";
+		return 1;
+	}
 
-	if (depth <= 0)
-		return colour(0.0, 0.0, 0.0);
+	std::cerr << "Render server listening on " << options.serve << " with " << pool.size() << " threads\n";
+	server.run();
+	return 0;
+}
+
+/// <summary>
+/// Sends one request to a render server and prints its reply
+/// </summary>
+int runClient(const Options& options)
+{
+	Socket socket = connectLocal(options.socket);
+	std::string reply;
 
-	if (root.hit(r, 0.001, infinity, record))
+	if (!socket.valid() || !socket.sendLine(options.submit) || !socket.receiveLine(reply))
 	{
-		colour objColour;
-		Ray reflected;
-		colour emitted = record.mat_ptr->emitted();
-		
-		if (record.mat_ptr->scatter(r, record, objColour, reflected))
-			return emitted + objColour * getColour(reflected, background, root, depth - 1, lightOff);
-		return emitted;
+		std::cerr << "Could not reach the render server at " << options.socket << "\n";
+		return 1;
 	}
-	else
+
+	std::cout << reply << "\n";
+	return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
+
+/// <summary>
+/// Converts the PPM named by --make-texture into a tiled texture
+/// </summary>
+int runMakeTexture(const Options& options)
+{
+	FloatImage image;
+	if (!image.readPPM(options.makeTexture))
 	{
-		if(lightOff)
-			return background;
-		else
-		{
-			vec3 unitDir = unitVector(r.direction);
-			auto root = 0.5 * (unitDir.y() + 1.0);
-			return (1.0 - root) * colour(1.0, 1.0, 1.0) + root * colour(0.5, 0.7, 1.0);
-		}
+		std::cerr << "Could not read " << options.makeTexture << "\n";
+		return 1;
+	}
+	if (!writeTiledTexture(options.output + ".rtex", image, TEXTURE_TILE_SIZE))
+	{
+		std::cerr << "Could not write " << options.output << ".rtex\n";
+		return 1;
 	}
+	std::cerr << "Wrote " << options.output << ".rtex, " << image.width << "x" << image.height << "\n";
+	return 0;
 }
 
-void split(std::string filename, const int& imgHeight, const int& imgWidth, int start, int end, bool first, const int& samples, const int& maxDepth, const Camera& camera, BVH_Node root, const colour& background, bool lightOff)
+void split(std::string filename, const int& imgHeight, const int& imgWidth, int start, int end, bool first, const int& samples, const int& maxDepth, const Camera& camera, const Hittable& root, const colour& background, bool lightOff, const LightBVH& lights, LightSampling lightSampling, const EnvironmentMap* environment, uint64_t seed)
 {
+	// every thread needs its own random stream
+	seedRandom(mixSeed(seed, start));
+
 	std::ofstream file(filename + ".ppm");
 	if(first)
 		file << "P3\n" << imgWidth << ' ' << imgHeight << "\n255\n";
@@ -318,7 +931,11 @@ void split(std::string filename, const int& imgHeight, const int& imgWidth, int
 				auto u = (j + randomDouble()) / (double(imgWidth) - 1);
 				auto v = (i + randomDouble()) / (double(imgHeight) - 1);
 				Ray ray = camera.getRay(u, v);
-				pixelColour += getColour(ray, background, root, maxDepth, lightOff);
+				ray.spread = camera.pixelSpread(imgHeight);
+				if (lightSampling != LightSampling::Off)
+					pixelColour += getColourWithLights(ray, background, root, lights, environment, lightSampling, maxDepth, lightOff, nullptr);
+				else
+					pixelColour += getColour(ray, background, root, maxDepth, lightOff, environment);
 			}
 
 			auto r = sqrt(pixelColour.x() / samples);
@@ -333,11 +950,11 @@ void split(std::string filename, const int& imgHeight, const int& imgWidth, int
 	file.close();
 }
 
-void combine(int n)
+void combine(int n, const std::string& output)
 {
 	std::ofstream image;
-	std::remove("image.ppm");
-	image.open("image.ppm");
+	std::remove((output + ".ppm").c_str());
+	image.open(output + ".ppm");
 	std::string line;
 	int i;
 
@@ -356,21 +973,106 @@ void combine(int n)
 	image.close();
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	std::cout << "Enter the number of threads: ";
-	std::cin >> THREAD_COUNT;
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		usage();
+		return 1;
+	}
+
+	if (!options.isa.empty())
+	{
+		IsaLevel level;
+		if (!parseIsa(options.isa, level))
+		{
+			usage();
+			return 1;
+		}
+		if (!selectIsa(level))
+		{
+			std::cerr << "This CPU does not support " << isaName(level) << " kernels, it supports up to " << isaName(detectIsa()) << "\n";
+			return 1;
+		}
+	}
+	std::cerr << "Intersection kernels: " << isaName(activeKernels().level) << " (CPU supports " << isaName(detectIsa()) << ")\n";
+
+	if (options.textureCacheMiB > 0)
+		textureCache().setCapacity(size_t(options.textureCacheMiB) << 20);
+
+	if (benchRequested(options))
+		return runBench(options);
+
+	if (!options.makeTexture.empty())
+		return runMakeTexture(options);
+
+	EnvironmentMap environmentMap;
+	const EnvironmentMap* environment = nullptr;
+	if (!options.environment.empty())
+	{
+		if (!environmentMap.load(options.environment, options.environmentScale))
+		{
+			std::cerr << "Could not read environment map " << options.environment << "\n";
+			return 1;
+		}
+		environment = &environmentMap;
+		std::cerr << "Environment map: " << environmentMap.imageWidth() << "x" << environmentMap.imageHeight() << ", "
+			<< environmentMap.memoryBytes() / (1024 * 1024) << " MiB\n";
+	}
+
+	if (options.worker)
+		return runWorker(options.host, options.port, std::max(options.threads, 1), options.failAfter, environment);
+
+	if (options.coordinator)
+		return runCoordinator(options, argv[0]);
+
+	if (!options.checkpoint.empty() || !options.resume.empty() || !options.costMap.empty() || options.timeLimit > 0.0)
+		return runProgressive(options, environment);
+
+	if (options.frames > 0)
+		return runAnimation(options, environment);
+
+	if (options.crop.width() > 0 || options.crop.height() > 0)
+		return runCrop(options, environment);
+
+	if (!options.views.empty())
+		return runViews(options, environment);
+
+	if (options.irradianceCache)
+		return runIrradianceCache(options, environment);
+
+	if (options.caustics)
+		return runCaustics(options, environment);
+
+	if (!options.serve.empty())
+		return runServer(options);
+
+	if (!options.submit.empty())
+		return runClient(options);
+
+	THREAD_COUNT = options.threads;
+	if (THREAD_COUNT <= 0)
+	{
+		std::cout << "Enter the number of threads: ";
+		std::cin >> THREAD_COUNT;
+	}
 	
-	const int samples = 5;
-	const int maxDepth = 5;
-	const bool lightOff = false;
+	const int samples = options.settings.samples;
+	const int maxDepth = options.settings.maxDepth;
+	const bool lightOff = options.settings.lightOff;
 
-	const colour background = colour(0.0, 0.0, 0.0);
+	const colour background = options.settings.background;
 
-	HittableList world; Camera camera; double aspectRatio; int imgWidth; int imgHeight;
-	scene3(world, camera, imgWidth, imgHeight, aspectRatio);
+	auto scene = buildScene(options.scene, options.height, options.arena, options.bvh);
+	if (!scene)
+	{
+		std::cerr << "There is no scene " << options.scene << "\n";
+		return 1;
+	}
 
-	BVH_Node root(world.objects, 0, world.objects.size());
+	const Camera& camera = scene->camera; int imgWidth = scene->imgWidth; int imgHeight = scene->imgHeight;
+	const Hittable& root = *scene->root;
 
 	auto start = clock();
 
@@ -378,17 +1080,19 @@ int main()
 
 	for (int i = THREAD_COUNT - 1; i >= 0; i--)
 	{
-		threads[i] = std::thread(split, "part" + std::to_string(i), imgHeight, imgWidth, (i + 1) * imgHeight / THREAD_COUNT, i * imgHeight / THREAD_COUNT, (i == THREAD_COUNT - 1), samples, maxDepth, camera, root, background, lightOff);
+		threads[i] = std::thread(split, "part" + std::to_string(i), imgHeight, imgWidth, (i + 1) * imgHeight / THREAD_COUNT, i * imgHeight / THREAD_COUNT, (i == THREAD_COUNT - 1), samples, maxDepth, camera, std::cref(root), background, lightOff, std::cref(*scene->lights), options.settings.lightSampling, environment, options.settings.seed);
 	}
 	
 	for (int i = 0; i < THREAD_COUNT; i++)
 		threads[i].join();
 
-	combine(THREAD_COUNT);
+	combine(THREAD_COUNT, options.output);
 
 	auto stop = clock();
 
 	double time_taken = double(stop - start) / CLOCKS_PER_SEC;
 	std::cerr << "\nTime taken by program : " << time_taken  << " secs\n";
+	if (textureCache().lookups() > 0)
+		textureCache().report(std::cerr);
 	std::cerr << "Rendered.\n";
 }
\ No newline at end of file
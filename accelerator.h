@@ -0,0 +1,79 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "const_utility.h"
+#include "hittable.h"
+
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Kinds of acceleration structure a scene can be traversed with
+/// </summary>
+enum class AcceleratorType
+{
+	/// <summary>
+	/// Bounding volume hierarchy, flattened or not according to the rest of the BVHSettings
+	/// </summary>
+	BVH,
+	/// <summary>
+	/// Uniform grid walked cell by cell (see UniformGrid)
+	/// </summary>
+	Grid,
+	/// <summary>
+	/// Coarse grid whose crowded cells hold finer grids of their own
+	/// </summary>
+	HierarchicalGrid
+};
+
+/// <summary>
+/// Reads an accelerator name: bvh, grid or hgrid
+/// </summary>
+/// <returns>False, if the name is unknown</returns>
+inline bool parseAccelerator(const std::string& name, AcceleratorType& type)
+{
+	if (name == "bvh")
+		type = AcceleratorType::BVH;
+	else if (name == "grid")
+		type = AcceleratorType::Grid;
+	else if (name == "hgrid")
+		type = AcceleratorType::HierarchicalGrid;
+	else
+		return false;
+	return true;
+}
+
+inline const char* acceleratorName(AcceleratorType type)
+{
+	switch (type)
+	{
+	case AcceleratorType::Grid: return "grid";
+	case AcceleratorType::HierarchicalGrid: return "hgrid";
+	default: return "bvh";
+	}
+}
+
+/// <summary>
+/// Structure that finds the closest of many primitives along a ray. The renderer only sees the Hittable side of it:
+/// hit finds the closest hit and boundingBox gives the bounds of everything built in
+/// </summary>
+class Accelerator : public Hittable
+{
+public:
+	/// <summary>
+	/// Builds the structure over a set of primitives, replacing whatever it held. The primitives must be bounded and
+	/// there must be at least one; they are referred to, not copied, so they have to outlive the structure
+	/// </summary>
+	/// <param name="objects">Primitives to build over</param>
+	virtual void build(const std::vector<shared_ptr<Hittable>>& objects) = 0;
+	/// <summary>
+	/// Bytes taken by the structure itself, the primitives not counted
+	/// </summary>
+	virtual size_t memoryBytes() const = 0;
+	/// <summary>
+	/// Short name for reports
+	/// </summary>
+	virtual const char* name() const = 0;
+};
+
+#endif
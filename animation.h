@@ -0,0 +1,110 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "const_utility.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+/// <summary>
+/// Moves a few objects of a scene along looping paths, to exercise BVH updates between frames
+/// </summary>
+class Animation
+{
+private:
+	struct Mover
+	{
+		shared_ptr<Hittable> object;
+		vec3 amplitude;
+		double phase;
+		vec3 offset;
+	};
+
+	std::vector<Mover> movers;
+	/// <summary>
+	/// Number of frames in one loop of the paths
+	/// </summary>
+	int period;
+
+	vec3 offsetAt(const Mover& mover, int frame) const
+	{
+		double angle = 2.0 * pi * frame / period + mover.phase;
+		return vec3(mover.amplitude.x() * sin(angle), mover.amplitude.y() * fabs(sin(2.0 * angle)), mover.amplitude.z() * (cos(angle) - cos(mover.phase)));
+	}
+
+public:
+	/// <summary>
+	/// Picks the objects that move
+	/// </summary>
+	/// <param name="objects">Objects of the scene</param>
+	/// <param name="fraction">Share of the objects that move, large objects such as the ground and walls never do</param>
+	/// <param name="period">Number of frames in one loop of the paths</param>
+	Animation(const std::vector<shared_ptr<Hittable>>& objects, double fraction, int period = 48)
+	{
+		this->period = period;
+		if (objects.empty() || fraction <= 0.0)
+			return;
+
+		BoundingBox scene, box;
+		bool first = true;
+		for (const auto& object : objects)
+		{
+			if (object->boundingBox(box))
+			{
+				scene = first ? box : combinedBox(scene, box);
+				first = false;
+			}
+		}
+
+		double sceneSize = (scene.b - scene.a).length();
+		size_t step = std::max<size_t>(1, size_t(1.0 / fraction + 0.5));
+
+		for (size_t i = 0; i < objects.size(); i += step)
+		{
+			if (!objects[i]->boundingBox(box))
+				continue;
+
+			vec3 size = box.b - box.a;
+			if (size.length() > 0.25 * sceneSize || !objects[i]->translate(vec3(0.0, 0.0, 0.0)))
+				continue;
+
+			double extent = std::max(size.x(), std::max(size.y(), size.z()));
+			movers.push_back({ objects[i], vec3(1.5 * extent, extent, 1.5 * extent), 2.0 * pi * i / objects.size(), vec3() });
+		}
+	}
+
+	/// <summary>
+	/// Number of objects that move
+	/// </summary>
+	size_t size() const
+	{
+		return movers.size();
+	}
+
+	/// <summary>
+	/// Adds the bounding boxes the moving objects have now
+	/// </summary>
+	void addBoxes(std::vector<BoundingBox>& boxes) const
+	{
+		BoundingBox box;
+		for (const auto& mover : movers)
+			if (mover.object->boundingBox(box))
+				boxes.push_back(box);
+	}
+
+	/// <summary>
+	/// Moves every moving object to where it is at the given frame
+	/// </summary>
+	void apply(int frame)
+	{
+		for (auto& mover : movers)
+		{
+			vec3 offset = offsetAt(mover, frame);
+			mover.object->translate(offset - mover.offset);
+			mover.offset = offset;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(_MSC_VER) || defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/// <summary>
+/// Allocation counters of a SceneArena
+/// </summary>
+struct ArenaStats
+{
+	/// <summary>
+	/// Number of objects placed in the arena
+	/// </summary>
+	size_t allocations = 0;
+	/// <summary>
+	/// Bytes the objects asked for
+	/// </summary>
+	size_t bytesUsed = 0;
+	/// <summary>
+	/// Bytes taken from the system for the blocks
+	/// </summary>
+	size_t bytesReserved = 0;
+	size_t blocks = 0;
+
+	/// <summary>
+	/// Share of the reserved bytes holding no object (alignment padding and the unused ends of blocks)
+	/// </summary>
+	double fragmentation() const
+	{
+		return bytesReserved > 0 ? 1.0 - double(bytesUsed) / bytesReserved : 0.0;
+	}
+};
+
+/// <summary>
+/// Bump allocator owning the primitives, materials and BVH nodes of one scene. Objects are placed one after the
+/// other in large blocks and are all destroyed together, in reverse order, when the arena is destroyed
+/// </summary>
+class SceneArena
+{
+private:
+	struct Block
+	{
+		char* data;
+		size_t size;
+		size_t used;
+	};
+
+	struct Destructor
+	{
+		void (*destroy)(void*);
+		void* object;
+	};
+
+	std::vector<Block> blocks;
+	std::vector<Destructor> destructors;
+	size_t blockSize;
+	size_t nextBlockSize;
+	ArenaStats counters;
+
+	template <typename T>
+	static void destroy(void* object)
+	{
+		static_cast<T*>(object)->~T();
+	}
+
+public:
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="blockSize">Largest size of a block; larger objects get a block of their own</param>
+	/// <param name="firstBlockSize">Size of the first block, the size doubles with every block up to blockSize so
+	/// small scenes do not reserve a whole large block</param>
+	explicit SceneArena(size_t blockSize = 256 * 1024, size_t firstBlockSize = 4096)
+	{
+		this->blockSize = blockSize;
+		nextBlockSize = std::min(firstBlockSize, blockSize);
+	}
+
+	SceneArena(const SceneArena&) = delete;
+	SceneArena& operator = (const SceneArena&) = delete;
+
+	~SceneArena()
+	{
+		for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+			it->destroy(it->object);
+		for (auto& block : blocks)
+			std::free(block.data);
+	}
+
+	/// <summary>
+	/// Reserves uninitialised memory in the current block, starting a new block when it does not fit
+	/// </summary>
+	void* allocate(size_t size, size_t alignment)
+	{
+		if (!blocks.empty())
+		{
+			// the address is aligned, not the offset: malloc only aligns the block itself to 16 bytes
+			Block& block = blocks.back();
+			uintptr_t start = reinterpret_cast<uintptr_t>(block.data);
+			size_t offset = size_t(((start + block.used + alignment - 1) & ~uintptr_t(alignment - 1)) - start);
+			if (offset + size <= block.size)
+			{
+				block.used = offset + size;
+				counters.allocations++;
+				counters.bytesUsed += size;
+				return block.data + offset;
+			}
+		}
+
+		size_t reserve = std::max(nextBlockSize, size + alignment);
+		nextBlockSize = std::min(nextBlockSize * 2, blockSize);
+		char* data = static_cast<char*>(std::malloc(reserve));
+		if (data == nullptr)
+			throw std::bad_alloc();
+
+		blocks.push_back({ data, reserve, 0 });
+		counters.blocks++;
+		counters.bytesReserved += reserve;
+		return allocate(size, alignment);
+	}
+
+	/// <summary>
+	/// Constructs an object in the arena
+	/// </summary>
+	/// <returns>A shared_ptr without a control block: copying it costs no atomic reference counting, and the
+	/// object lives exactly as long as the arena</returns>
+	template <typename T, typename... Args>
+	std::shared_ptr<T> make(Args&&... args)
+	{
+		void* memory = allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+
+		if (!std::is_trivially_destructible<T>::value)
+			destructors.push_back({ &SceneArena::destroy<T>, object });
+
+		return std::shared_ptr<T>(std::shared_ptr<void>(), object);
+	}
+
+	ArenaStats stats() const
+	{
+		return counters;
+	}
+
+	/// <summary>
+	/// Arena that create() places objects in on the calling thread, null for the ordinary heap
+	/// </summary>
+	static SceneArena*& current()
+	{
+		static thread_local SceneArena* arena = nullptr;
+		return arena;
+	}
+};
+
+/// <summary>
+/// Makes create() use the given arena on this thread until the scope ends
+/// </summary>
+class ArenaScope
+{
+private:
+	SceneArena* previous;
+
+public:
+	explicit ArenaScope(SceneArena* arena)
+	{
+		previous = SceneArena::current();
+		SceneArena::current() = arena;
+	}
+
+	~ArenaScope()
+	{
+		SceneArena::current() = previous;
+	}
+
+	ArenaScope(const ArenaScope&) = delete;
+	ArenaScope& operator = (const ArenaScope&) = delete;
+};
+
+/// <summary>
+/// Counters of the scene objects create() placed on the ordinary heap, over the whole program and all threads
+/// </summary>
+struct HeapStats
+{
+	/// <summary>
+	/// Number of allocations, each holding an object and its reference counts
+	/// </summary>
+	std::atomic<size_t> allocations;
+	/// <summary>
+	/// Bytes the allocations asked for
+	/// </summary>
+	std::atomic<size_t> bytesUsed;
+	/// <summary>
+	/// Bytes the allocator set aside for them, where it can tell
+	/// </summary>
+	std::atomic<size_t> bytesReserved;
+
+	HeapStats() : allocations(0), bytesUsed(0), bytesReserved(0)
+	{}
+};
+
+inline HeapStats& heapStats()
+{
+	static HeapStats stats;
+	return stats;
+}
+
+/// <summary>
+/// Allocator of create() for objects outside an arena: std::allocator, counting into heapStats()
+/// </summary>
+template <typename T>
+struct CountingAllocator
+{
+	typedef T value_type;
+
+	CountingAllocator() = default;
+
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>&)
+	{}
+
+	T* allocate(size_t count)
+	{
+		T* memory = std::allocator<T>().allocate(count);
+		size_t size = count * sizeof(T);
+		size_t reserved = size;
+#if defined(__GLIBC__)
+		// usable size plus the 8-byte chunk header glibc keeps in front of every allocation
+		reserved = malloc_usable_size(memory) + sizeof(size_t);
+#elif defined(_MSC_VER)
+		// over-aligned objects come from _aligned_malloc, which _msize cannot measure
+		if (alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			reserved = _msize(memory);
+#endif
+		HeapStats& stats = heapStats();
+		stats.allocations.fetch_add(1, std::memory_order_relaxed);
+		stats.bytesUsed.fetch_add(size, std::memory_order_relaxed);
+		stats.bytesReserved.fetch_add(reserved, std::memory_order_relaxed);
+		return memory;
+	}
+
+	void deallocate(T* memory, size_t count)
+	{
+		std::allocator<T>().deallocate(memory, count);
+	}
+
+	template <typename U>
+	bool operator == (const CountingAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator != (const CountingAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+/// <summary>
+/// Creates a scene object: in the arena of the current ArenaScope if there is one, otherwise on the heap, object and
+/// reference counts in one allocation as with make_shared
+/// </summary>
+template <typename T, typename... Args>
+std::shared_ptr<T> create(Args&&... args)
+{
+	SceneArena* arena = SceneArena::current();
+	if (arena != nullptr)
+		return arena->make<T>(std::forward<Args>(args)...);
+	return std::allocate_shared<T>(CountingAllocator<T>(), std::forward<Args>(args)...);
+}
+
+#endif
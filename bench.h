@@ -0,0 +1,24 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "options.h"
+
+#include <ostream>
+
+/// <summary>
+/// Whether the options ask for one of the reports of Bench.cpp instead of a render
+/// </summary>
+bool benchRequested(const Options& options);
+
+/// <summary>
+/// Runs the report the options ask for
+/// </summary>
+/// <returns>The exit code of the program</returns>
+int runBench(const Options& options);
+
+/// <summary>
+/// Writes the options of the reports, for the usage text
+/// </summary>
+void benchUsage(std::ostream& out);
+
+#endif
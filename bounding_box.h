@@ -63,6 +63,17 @@ public:
 		}
 		return true;
 	}
+
+	/// <summary>
+	/// Surface area of the box, used by the surface area heuristic (SAH)
+	/// </summary>
+	double area() const
+	{
+		auto dx = b.x() - a.x();
+		auto dy = b.y() - a.y();
+		auto dz = b.z() - a.z();
+		return 2.0 * (dx * dy + dy * dz + dz * dx);
+	}
 };
 
 /// <summary>
@@ -71,7 +82,7 @@ public:
 /// <param name="b1">The first bounding box</param>
 /// <param name="b2">The secong bounding box</param>
 /// <returns>A new bounding box which is the combination of both inputs</returns>
-BoundingBox combinedBox(BoundingBox b1, BoundingBox b2)
+inline BoundingBox combinedBox(BoundingBox b1, BoundingBox b2)
 {
 	// calculates the minimum and maximum x, y and z values to select the end points of the diagonal
 
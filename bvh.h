@@ -3,13 +3,17 @@
 
 #include "const_utility.h"
 #include "hittable.h"
+#include "accelerator.h"
 #include "hittableList.h"
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <vector>
 
 /// <summary>
 /// Contains all the functions required to create and manage a bounding volume hierarchy (BVH) tree
 /// </summary>
-class BVH_Node : public Hittable
+class BVH_Node : public Accelerator
 {
 public:
 	/// <summary>
@@ -24,6 +28,14 @@ public:
 	/// Bounding box of the node
 	/// </summary>
 	BoundingBox box;
+	/// <summary>
+	/// True, if both children are primitives rather than nodes
+	/// </summary>
+	bool leaf = false;
+	/// <summary>
+	/// Surface area of the box when the node was built, to tell how much a refit has loosened it
+	/// </summary>
+	double buildArea = 0.0;
 
 	/// <summary>
 	/// Default constructor
@@ -39,6 +51,16 @@ public:
 	/// <param name="end">(End + 1) index of the objects list in the current node</param>
 	BVH_Node(const std::vector<shared_ptr<Hittable>>& srcObjects, size_t start, size_t end);
 
+	/// <summary>
+	/// Builds the subtree of a node by sorting objects[start, end) in place, so a whole tree is built from one copy of
+	/// the objects list rather than one copy per node
+	/// </summary>
+	/// <param name="objects">List being sorted by the build</param>
+	/// <param name="start">Start index of the objects list in the current node</param>
+	/// <param name="end">(End + 1) index of the objects list in the current node</param>
+	/// <param name="inPlace">Marks this overload, always true</param>
+	BVH_Node(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end, bool inPlace);
+
 	/// <summary>
 	/// Function to check if the bounding box of the current node is intersected by the ray
 	/// </summary>
@@ -54,18 +76,53 @@ public:
 	/// <param name="output">Reference to the bounding box object</param>
 	/// <returns>True</returns>
 	virtual bool boundingBox(BoundingBox& output) const override;
+	/// <summary>
+	/// Builds the tree below this node, as the root, over a copy of the objects list
+	/// </summary>
+	virtual void build(const std::vector<shared_ptr<Hittable>>& objects) override;
+	/// <summary>
+	/// Bytes taken by this node and all nodes below it
+	/// </summary>
+	virtual size_t memoryBytes() const override;
+	virtual const char* name() const override
+	{
+		return "bvh";
+	}
+
+	/// <summary>
+	/// Recomputes the boxes of the node and all nodes below it from the current bounds of the primitives
+	/// </summary>
+	/// <param name="parallelDepth">Number of levels at which the two subtrees are refitted on separate threads</param>
+	void refit(int parallelDepth);
+	/// <summary>
+	/// Surface area heuristic cost of the subtree, not yet divided by the area of the root
+	/// </summary>
+	/// <param name="traversalCost">Cost of visiting a node</param>
+	/// <param name="intersectionCost">Cost of testing a primitive</param>
+	double sahCost(double traversalCost = 1.0, double intersectionCost = 1.0) const;
+	/// <summary>
+	/// Appends every primitive below the node to the list
+	/// </summary>
+	void collect(std::vector<shared_ptr<Hittable>>& primitives) const;
+	/// <summary>
+	/// Rebuilds every topmost subtree whose box has grown by more than the given factor since it was built
+	/// </summary>
+	/// <param name="threshold">Allowed growth of the surface area</param>
+	/// <returns>Number of subtrees rebuilt</returns>
+	int rebuildDegraded(double threshold);
 };
 
-bool BVH_Node::boundingBox(BoundingBox& output) const
+inline bool BVH_Node::boundingBox(BoundingBox& output) const
 {
 	output = box;
 	return true;
 }
 
-bool BVH_Node::hit(const Ray& ray, double tMin, double tMax, hitRecord& record) const
+inline bool BVH_Node::hit(const Ray& ray, double tMin, double tMax, hitRecord& record) const
 {
 	// traverse the BVH tree
 
+	traversalCounters().nodes++;
 	if (!box.hit(ray, tMin, tMax))
 		return false;
 
@@ -75,6 +132,104 @@ bool BVH_Node::hit(const Ray& ray, double tMin, double tMax, hitRecord& record)
 	return hitLeft || hitRight;
 }
 
+inline void BVH_Node::build(const std::vector<shared_ptr<Hittable>>& objects)
+{
+	auto sorted = objects;
+	*this = BVH_Node(sorted, 0, sorted.size(), true);
+}
+
+inline size_t BVH_Node::memoryBytes() const
+{
+	if (leaf)
+		return sizeof(BVH_Node);
+	return sizeof(BVH_Node) + static_cast<BVH_Node*>(left.get())->memoryBytes() + static_cast<BVH_Node*>(right.get())->memoryBytes();
+}
+
+inline void BVH_Node::refit(int parallelDepth)
+{
+	if (!leaf)
+	{
+		auto leftNode = static_cast<BVH_Node*>(left.get());
+		auto rightNode = static_cast<BVH_Node*>(right.get());
+
+		if (parallelDepth > 0)
+		{
+			auto leftDone = std::async(std::launch::async, [=]() { leftNode->refit(parallelDepth - 1); });
+			rightNode->refit(parallelDepth - 1);
+			leftDone.get();
+		}
+		else
+		{
+			leftNode->refit(0);
+			rightNode->refit(0);
+		}
+	}
+
+	BoundingBox boxLeft, boxRight;
+
+	left->boundingBox(boxLeft);
+	right->boundingBox(boxRight);
+
+	box = combinedBox(boxLeft, boxRight);
+}
+
+inline double BVH_Node::sahCost(double traversalCost, double intersectionCost) const
+{
+	double area = box.area();
+
+	if (leaf)
+		return area * (traversalCost + intersectionCost * (left == right ? 1 : 2));
+
+	return area * traversalCost + static_cast<BVH_Node*>(left.get())->sahCost(traversalCost, intersectionCost)
+		+ static_cast<BVH_Node*>(right.get())->sahCost(traversalCost, intersectionCost);
+}
+
+inline void BVH_Node::collect(std::vector<shared_ptr<Hittable>>& primitives) const
+{
+	if (leaf)
+	{
+		primitives.push_back(left);
+		if (right != left)
+			primitives.push_back(right);
+		return;
+	}
+
+	static_cast<BVH_Node*>(left.get())->collect(primitives);
+	static_cast<BVH_Node*>(right.get())->collect(primitives);
+}
+
+inline int BVH_Node::rebuildDegraded(double threshold)
+{
+	if (leaf)
+		return 0;
+
+	int rebuilt = 0;
+
+	for (auto child : { &left, &right })
+	{
+		auto node = static_cast<BVH_Node*>(child->get());
+
+		if (node->box.area() > threshold * node->buildArea)
+		{
+			std::vector<shared_ptr<Hittable>> primitives;
+			node->collect(primitives);
+			*child = create<BVH_Node>(primitives, 0, primitives.size());
+			rebuilt++;
+		}
+		else
+			rebuilt += node->rebuildDegraded(threshold);
+	}
+
+	if (rebuilt > 0)
+	{
+		BoundingBox boxLeft, boxRight;
+		left->boundingBox(boxLeft);
+		right->boundingBox(boxRight);
+		box = combinedBox(boxLeft, boxRight);
+	}
+	return rebuilt;
+}
+
 /// <summary>
 /// Comparator function to sort the objects list
 /// </summary>
@@ -95,33 +250,42 @@ inline bool compareBox(const shared_ptr<Hittable> a, const shared_ptr<Hittable>
 	return b1.a.p[axis] < b2.a.p[axis];
 }
 
-bool compareX(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
+inline bool compareX(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
 {
 	return compareBox(a, b, 0);
 }
 
-bool compareY(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
+inline bool compareY(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
 {
 	return compareBox(a, b, 1);
 }
 
-bool compareZ(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
+inline bool compareZ(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) 
 {
 	return compareBox(a, b, 2);
 }
 
-BVH_Node::BVH_Node(const std::vector<shared_ptr<Hittable>>& srcObjects, size_t start, size_t end)
+inline BVH_Node::BVH_Node(const std::vector<shared_ptr<Hittable>>& srcObjects, size_t start, size_t end)
 {
 	auto objects = srcObjects;
+	*this = BVH_Node(objects, start, end, true);
+}
+
+inline BVH_Node::BVH_Node(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end, bool /*inPlace*/)
+{
 	int axis = randomInt(0, 2);
 	auto comparator = (axis == 0) ? compareX : (axis == 1) ? compareY : compareZ;
 
 	size_t object_span = end - start;
 
 	if (object_span == 1)
+	{
 		left = right = objects[start];
+		leaf = true;
+	}
 	else if (object_span == 2)
 	{
+		leaf = true;
 		if (comparator(objects[start], objects[start + 1]))
 		{
 			left = objects[start];
@@ -137,8 +301,8 @@ BVH_Node::BVH_Node(const std::vector<shared_ptr<Hittable>>& srcObjects, size_t s
 	{
 		std::sort(objects.begin() + start, objects.begin() + end, comparator);
 		auto mid = (start + end) / 2;
-		left = make_shared<BVH_Node>(objects, start, mid);
-		right = make_shared<BVH_Node>(objects, mid, end);
+		left = create<BVH_Node>(objects, start, mid, true);
+		right = create<BVH_Node>(objects, mid, end, true);
 	}
 
 	BoundingBox boxLeft, boxRight;
@@ -147,6 +311,159 @@ BVH_Node::BVH_Node(const std::vector<shared_ptr<Hittable>>& srcObjects, size_t s
 	right->boundingBox(boxRight);
 
 	box = combinedBox(boxLeft, boxRight);
+	buildArea = box.area();
+}
+
+/// <summary>
+/// What updateBVH did to the tree
+/// </summary>
+struct BVHUpdateStats
+{
+	/// <summary>
+	/// SAH cost of the refitted tree relative to the cost it had when it was built
+	/// </summary>
+	double costRatio = 1.0;
+	int rebuiltSubtrees = 0;
+	bool fullRebuild = false;
+	double seconds = 0.0;
+};
+
+/// <summary>
+/// Brings a BVH up to date after some of its primitives moved: the boxes are refitted bottom-up, subtrees whose box
+/// grew past partialThreshold are rebuilt, and if the whole tree still costs more than fullThreshold times its
+/// cost when built, the tree is rebuilt from scratch. The root is rebuilt in place, so pointers to it stay valid
+/// </summary>
+/// <param name="root">Root of the tree</param>
+/// <param name="buildCost">SAH cost of the tree when it was last fully built; updated on a full rebuild</param>
+/// <param name="threads">Number of threads available for the refit</param>
+/// <param name="partialThreshold">Allowed growth of the surface area of a subtree</param>
+/// <param name="fullThreshold">Allowed growth of the SAH cost of the whole tree</param>
+inline BVHUpdateStats updateBVH(BVH_Node& root, double& buildCost, int threads, double partialThreshold = 2.0, double fullThreshold = 1.3)
+{
+	auto start = std::chrono::steady_clock::now();
+	BVHUpdateStats stats;
+
+	int parallelDepth = 0;
+	while ((2 << parallelDepth) <= threads)
+		parallelDepth++;
+
+	root.refit(parallelDepth);
+	stats.rebuiltSubtrees = root.rebuildDegraded(partialThreshold);
+
+	double cost = root.sahCost() / root.box.area();
+	stats.costRatio = cost / buildCost;
+
+	if (stats.costRatio > fullThreshold)
+	{
+		std::vector<shared_ptr<Hittable>> primitives;
+		root.collect(primitives);
+		root = BVH_Node(primitives, 0, primitives.size());
+		buildCost = root.sahCost() / root.box.area();
+		stats.fullRebuild = true;
+	}
+
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+/// <summary>
+/// Top level of a scene: a BVH over the ordinary primitives plus a short list of primitives that would ruin its
+/// bounds. Unbounded primitives such as a GroundPlane, and primitives much larger than the typical one (a ground or a
+/// sun modelled as a sphere of radius 20000), overlap nearly every node, so every ray would have to descend into
+/// them; instead they are tested once per ray, next to the tree
+/// </summary>
+class SceneBVH : public Hittable
+{
+public:
+	/// <summary>
+	/// BVH over the ordinary primitives, null if there are none
+	/// </summary>
+	shared_ptr<BVH_Node> tree;
+	/// <summary>
+	/// Primitives kept out of the tree
+	/// </summary>
+	std::vector<shared_ptr<Hittable>> large;
+	/// <summary>
+	/// Structure traversed instead of the tree when set: a copy of the tree laid out for fast traversal (see FlatBVH)
+	/// or a grid over the same primitives. It has to be rebuilt whenever the tree changes
+	/// </summary>
+	shared_ptr<Accelerator> accelerator;
+
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="objects">Primitives of the scene</param>
+	/// <param name="largeFactor">A primitive whose box diagonal is more than this many times the median diagonal is
+	/// kept out of the tree; 0 puts every bounded primitive in the tree</param>
+	SceneBVH(const std::vector<shared_ptr<Hittable>>& objects, double largeFactor = 16.0);
+
+	virtual bool hit(const Ray& ray, double tMin, double tMax, hitRecord& record) const override;
+	virtual bool boundingBox(BoundingBox& output) const override;
+};
+
+inline SceneBVH::SceneBVH(const std::vector<shared_ptr<Hittable>>& objects, double largeFactor)
+{
+	std::vector<double> diagonals;
+	BoundingBox box;
+
+	for (const auto& object : objects)
+		if (object->boundingBox(box))
+			diagonals.push_back((box.b - box.a).length());
+
+	double limit = infinity;
+	if (largeFactor > 0.0 && !diagonals.empty())
+	{
+		std::nth_element(diagonals.begin(), diagonals.begin() + diagonals.size() / 2, diagonals.end());
+		limit = largeFactor * diagonals[diagonals.size() / 2];
+	}
+
+	std::vector<shared_ptr<Hittable>> bounded;
+	for (const auto& object : objects)
+	{
+		if (object->boundingBox(box) && (box.b - box.a).length() <= limit)
+			bounded.push_back(object);
+		else
+			large.push_back(object);
+	}
+
+	if (!bounded.empty())
+		tree = create<BVH_Node>(bounded, 0, bounded.size());
+}
+
+inline bool SceneBVH::hit(const Ray& ray, double tMin, double tMax, hitRecord& record) const
+{
+	// the tree first: its primitives usually lie in front of the ground and sky, so tMax shrinks before they are tested
+	const Hittable* primary = accelerator ? accelerator.get() : tree.get();
+	bool hitAnything = primary != nullptr && primary->hit(ray, tMin, tMax, record);
+	if (hitAnything)
+		tMax = record.t;
+
+	for (const auto& object : large)
+	{
+		if (object->hit(ray, tMin, tMax, record))
+		{
+			hitAnything = true;
+			tMax = record.t;
+		}
+	}
+
+	return hitAnything;
+}
+
+inline bool SceneBVH::boundingBox(BoundingBox& output) const
+{
+	BoundingBox box;
+	bool bounded = tree && tree->boundingBox(output);
+
+	for (const auto& object : large)
+	{
+		if (!object->boundingBox(box))
+			return false;
+		output = bounded ? combinedBox(output, box) : box;
+		bounded = true;
+	}
+
+	return bounded;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,232 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include "const_utility.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Shape and cost of a BVH_Node tree, to judge how well it was built
+/// </summary>
+struct BVHStats
+{
+	/// <summary>
+	/// Nodes of the tree, leaves included
+	/// </summary>
+	size_t nodes = 0;
+	size_t leaves = 0;
+	size_t primitives = 0;
+	int maxDepth = 0;
+	double meanLeafDepth = 0.0;
+	/// <summary>
+	/// Number of leaves at every depth, the root at depth 0
+	/// </summary>
+	std::vector<size_t> leafDepths;
+	/// <summary>
+	/// Number of leaves holding every number of primitives
+	/// </summary>
+	std::vector<size_t> leafSizes;
+	/// <summary>
+	/// Surface area heuristic cost, divided by the area of the root: the expected node visits plus primitive tests of a
+	/// ray through the root box that visits every box it crosses
+	/// </summary>
+	double sahCost = 0.0;
+	/// <summary>
+	/// Surface area of the overlap of the two children of every interior node, summed and divided by the summed area
+	/// of the interior nodes: 0 for children that never share space, 1 if every pair covers the same box
+	/// </summary>
+	double overlapRatio = 0.0;
+	size_t memoryBytes = 0;
+	/// <summary>
+	/// Rays of the sampled set, and the nodes visited and primitives tested per ray. Camera rays start at the eye,
+	/// bounce rays where the camera rays hit
+	/// </summary>
+	uint64_t cameraRays = 0;
+	double cameraNodesPerRay = 0.0;
+	double cameraPrimitivesPerRay = 0.0;
+	uint64_t bounceRays = 0;
+	double bounceNodesPerRay = 0.0;
+	double bouncePrimitivesPerRay = 0.0;
+};
+
+/// <summary>
+/// Surface area of the space two boxes share, 0 if they do not overlap
+/// </summary>
+inline double overlapArea(const BoundingBox& first, const BoundingBox& second)
+{
+	double extent[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		extent[axis] = fmin(first.b[axis], second.b[axis]) - fmax(first.a[axis], second.a[axis]);
+		if (extent[axis] <= 0.0)
+			return 0.0;
+	}
+	return 2.0 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+}
+
+/// <summary>
+/// Adds the node and the nodes below it to the counts
+/// </summary>
+/// <param name="interiorArea">Sum of the areas of the interior nodes</param>
+/// <param name="overlap">Sum of the areas of the overlap of their children</param>
+/// <param name="leafDepthSum">Sum of the depths of the leaves</param>
+inline void gatherBVHStats(const BVH_Node& node, int depth, BVHStats& stats, double& interiorArea, double& overlap, double& leafDepthSum)
+{
+	stats.nodes++;
+	stats.maxDepth = std::max(stats.maxDepth, depth);
+
+	if (node.leaf)
+	{
+		size_t size = node.left == node.right ? 1 : 2;
+		stats.leaves++;
+		stats.primitives += size;
+		leafDepthSum += depth;
+
+		if (stats.leafDepths.size() <= size_t(depth))
+			stats.leafDepths.resize(depth + 1, 0);
+		stats.leafDepths[depth]++;
+		if (stats.leafSizes.size() <= size)
+			stats.leafSizes.resize(size + 1, 0);
+		stats.leafSizes[size]++;
+		return;
+	}
+
+	auto left = static_cast<const BVH_Node*>(node.left.get());
+	auto right = static_cast<const BVH_Node*>(node.right.get());
+	interiorArea += node.box.area();
+	overlap += overlapArea(left->box, right->box);
+
+	gatherBVHStats(*left, depth + 1, stats, interiorArea, overlap, leafDepthSum);
+	gatherBVHStats(*right, depth + 1, stats, interiorArea, overlap, leafDepthSum);
+}
+
+/// <summary>
+/// Measures the shape of a tree: node, leaf and primitive counts, the depths of the leaves and their sizes, the SAH
+/// cost, the overlap of siblings and the memory of the nodes. The traversal fields are left at 0
+/// </summary>
+inline BVHStats analyzeBVH(const BVH_Node& root)
+{
+	BVHStats stats;
+	double interiorArea = 0.0, overlap = 0.0, leafDepthSum = 0.0;
+	gatherBVHStats(root, 0, stats, interiorArea, overlap, leafDepthSum);
+
+	double rootArea = root.box.area();
+	stats.sahCost = rootArea > 0.0 ? root.sahCost() / rootArea : 0.0;
+	stats.overlapRatio = interiorArea > 0.0 ? overlap / interiorArea : 0.0;
+	stats.meanLeafDepth = stats.leaves > 0 ? leafDepthSum / stats.leaves : 0.0;
+	stats.memoryBytes = root.memoryBytes();
+	return stats;
+}
+
+/// <summary>
+/// Traverses a tree with a sampled set of rays and fills in the traversal fields of the stats. The camera rays go
+/// through random points of the frame; wherever one hits the scene, a bounce ray leaves the hit in a cosine-weighted
+/// random direction, as the diffuse bounces of the path tracer do. Only the traversal of the tree is counted, the rays
+/// are found against the whole scene
+/// </summary>
+/// <param name="tree">Tree to measure</param>
+/// <param name="world">Whole scene, for the hits the bounce rays start from</param>
+/// <param name="camera">Camera the rays start from</param>
+/// <param name="count">Number of camera rays</param>
+/// <param name="seed">Seed of the random stream of the calling thread, which is replaced</param>
+/// <param name="stats">Receives the traversal counts</param>
+inline void measureBVHTraversal(const BVH_Node& tree, const Hittable& world, const Camera& camera, size_t count, uint64_t seed, BVHStats& stats)
+{
+	seedRandom(seed);
+	TraversalCounters& counters = traversalCounters();
+	uint64_t cameraNodes = 0, cameraPrimitives = 0, bounceNodes = 0, bouncePrimitives = 0;
+	stats.cameraRays = 0;
+	stats.bounceRays = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		Ray ray = camera.getRay(randomDouble(), randomDouble());
+
+		hitRecord record;
+		TraversalCounters before = counters;
+		tree.hit(ray, 0.001, infinity, record);
+		cameraNodes += counters.nodes - before.nodes;
+		cameraPrimitives += counters.primitives - before.primitives;
+		stats.cameraRays++;
+
+		hitRecord found;
+		if (!world.hit(ray, 0.001, infinity, found))
+			continue;
+		found.object->surfaceInteraction(ray, found);
+
+		Ray bounce(found.p, found.normal + randomUnitVector());
+		if (bounce.direction.nearZero())
+			bounce.direction = found.normal;
+		before = counters;
+		tree.hit(bounce, 0.001, infinity, record);
+		bounceNodes += counters.nodes - before.nodes;
+		bouncePrimitives += counters.primitives - before.primitives;
+		stats.bounceRays++;
+	}
+
+	double cameraRays = double(std::max<uint64_t>(stats.cameraRays, 1));
+	double bounceRays = double(std::max<uint64_t>(stats.bounceRays, 1));
+	stats.cameraNodesPerRay = cameraNodes / cameraRays;
+	stats.cameraPrimitivesPerRay = cameraPrimitives / cameraRays;
+	stats.bounceNodesPerRay = bounceNodes / bounceRays;
+	stats.bouncePrimitivesPerRay = bouncePrimitives / bounceRays;
+}
+
+/// <summary>
+/// Writes the boxes of the nodes of a tree as an OBJ wireframe: eight vertices and twelve line elements per box, in
+/// one group per depth (depth_0 for the root), so a viewer can show the levels one at a time
+/// </summary>
+/// <param name="root">Root of the tree</param>
+/// <param name="path">File to write</param>
+/// <param name="maxDepth">Deepest level written, -1 for all of them</param>
+/// <returns>False, if the file could not be written</returns>
+inline bool writeBVHObj(const BVH_Node& root, const std::string& path, int maxDepth = -1)
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	file << "# BVH boxes, one group per depth\n";
+
+	// level by level, so every group is written in one piece
+	std::vector<const BVH_Node*> level{ &root };
+	size_t vertices = 0;
+	for (int depth = 0; !level.empty() && (maxDepth < 0 || depth <= maxDepth); depth++)
+	{
+		file << "g depth_" << depth << "\n";
+		std::vector<const BVH_Node*> next;
+		for (const BVH_Node* node : level)
+		{
+			const BoundingBox& box = node->box;
+			for (int corner = 0; corner < 8; corner++)
+			{
+				file << "v " << (corner & 1 ? box.b.x() : box.a.x()) << " " << (corner & 2 ? box.b.y() : box.a.y()) << " "
+					<< (corner & 4 ? box.b.z() : box.a.z()) << "\n";
+			}
+
+			// the edges join corners that differ in one bit; OBJ counts vertices from 1
+			for (int corner = 0; corner < 8; corner++)
+				for (int bit = 1; bit < 8; bit <<= 1)
+					if (!(corner & bit))
+						file << "l " << vertices + corner + 1 << " " << vertices + (corner | bit) + 1 << "\n";
+			vertices += 8;
+
+			if (!node->leaf)
+			{
+				next.push_back(static_cast<const BVH_Node*>(node->left.get()));
+				next.push_back(static_cast<const BVH_Node*>(node->right.get()));
+			}
+		}
+		level = std::move(next);
+	}
+	return bool(file);
+}
+
+#endif
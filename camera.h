@@ -41,6 +41,21 @@ private:
     /// Radius of the lens of the camera
     /// </summary>
     double lensRadius;
+    /// <summary>
+    /// Height of the viewport at unit distance from the camera
+    /// </summary>
+    double viewHeight;
+    /// <summary>
+    /// Distance from the camera to the plane in focus, where the viewport lies
+    /// </summary>
+    double focusDistance;
+    /// <summary>
+    /// Point the camera looks at, and the settings it was created with, so other views can be derived from it
+    /// </summary>
+    point target;
+    double aspectRatio;
+    double fieldOfView;
+    double aperture;
 
 public:
     /// <summary>
@@ -77,6 +92,72 @@ public:
         vertical = viewportHeight * v * focusDistance;
         lowerLeft = origin - horizontal / 2.0 - vertical / 2.0 - w * focusDistance;
         lensRadius = aperture / 2.0;
+        viewHeight = viewportHeight;
+        this->focusDistance = focusDistance;
+        target = lookAt;
+        aspectRatio = aspect;
+        fieldOfView = vfov;
+        this->aperture = aperture;
+    }
+
+    /// <summary>
+    /// The same camera moved around the vertical axis through the point it looks at
+    /// </summary>
+    /// <param name="degrees">Angle to turn by, counter-clockwise seen from above</param>
+    Camera orbited(double degrees) const
+    {
+        double angle = radians(degrees);
+        vec3 d = origin - target;
+        vec3 turned(d.x() * cos(angle) + d.z() * sin(angle), d.y(), -d.x() * sin(angle) + d.z() * cos(angle));
+        return Camera(target + turned, target, aspectRatio, fieldOfView, aperture, focusDistance);
+    }
+
+    /// <summary>
+    /// The same camera moved sideways, looking in the same direction, e.g. one eye of a stereo pair
+    /// </summary>
+    /// <param name="distance">Distance to move to the right of the view</param>
+    Camera shifted(double distance) const
+    {
+        return Camera(origin + distance * u, target + distance * u, aspectRatio, fieldOfView, aperture, focusDistance);
+    }
+
+    /// <summary>
+    /// Angle between the rays through neighbouring pixels, the spread of a camera ray
+    /// </summary>
+    /// <param name="imgHeight">Height of the image in pixels</param>
+    double pixelSpread(int imgHeight) const
+    {
+        return viewHeight / imgHeight;
+    }
+
+    /// <summary>
+    /// Finds where a point shows up on the screen, the inverse of getRay
+    /// </summary>
+    /// <param name="p">Point in space</param>
+    /// <param name="x">Receives the x co-ordinate on the screen, 0 to 1 across the viewport</param>
+    /// <param name="y">Receives the y co-ordinate on the screen, 0 to 1 up the viewport</param>
+    /// <param name="blurX">Receives how far the lens can move the point away from x, in the same units</param>
+    /// <param name="blurY">Receives how far the lens can move the point away from y, in the same units</param>
+    /// <returns>False, if the point is not in front of the camera</returns>
+    bool project(const point& p, double& x, double& y, double& blurX, double& blurY) const
+    {
+        vec3 d = p - origin;
+        double depth = -dot(d, w);
+        if (depth <= 1e-8)
+            return false;
+
+        // the ray through the lens centre meets the plane in focus at this point; rays from elsewhere on the lens
+        // meet it up to lensRadius * |1 - focusDistance / depth| away
+        vec3 q = origin + d * (focusDistance / depth) - lowerLeft;
+        double width = horizontal.length();
+        double height = vertical.length();
+        double blur = lensRadius * fabs(1.0 - focusDistance / depth);
+
+        x = dot(q, u) / width;
+        y = dot(q, v) / height;
+        blurX = blur / width;
+        blurY = blur / height;
+        return true;
     }
 
     /// <summary>
@@ -87,7 +168,19 @@ public:
     /// <returns>The created ray object</returns>
     Ray getRay(double x, double y) const 
     {
-        vec3 random = lensRadius * random_in_unit_disk();
+        return getRay(x, y, random_in_unit_disk());
+    }
+
+    /// <summary>
+    /// Gets the ray from a given point on the camera lens to a point on the screen
+    /// </summary>
+    /// <param name="x">x co-ordinate of the point on the screen</param>
+    /// <param name="y">y co-ordinate of the point on the screen</param>
+    /// <param name="lens">Point in the unit disk, scaled to the lens</param>
+    /// <returns>The created ray object</returns>
+    Ray getRay(double x, double y, const vec3& lens) const
+    {
+        vec3 random = lensRadius * lens;
         vec3 offset = u * random.x() + v * random.y();
 
         return Ray(origin + offset, lowerLeft + x * horizontal + y * vertical - (origin + offset));
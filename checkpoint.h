@@ -0,0 +1,213 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "image.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+// lean, so winsock2.h can still be included after it
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+/// <summary>
+/// Fixed-size header of a checkpoint file. It is followed by the sample sums (three floats per pixel) and the
+/// sample counts (one uint32 per pixel). The seed and the per-pixel counts are the whole sampler state: the random
+/// stream of every tile row is derived from the seed, the pass number and the row, so a resumed render continues
+/// each tile with exactly the streams it would have used
+/// </summary>
+struct CheckpointHeader
+{
+	char magic[4] = { 'R', 'T', 'C', 'K' };
+	uint32_t version = 1;
+	int32_t scene = 0;
+	int32_t imgWidth = 0;
+	int32_t imgHeight = 0;
+	int32_t tileSize = 0;
+	int32_t passSamples = 0;
+	int32_t maxDepth = 0;
+	int32_t lightOff = 0;
+	float background[3] = { 0.0f, 0.0f, 0.0f };
+	uint64_t seed = 0;
+};
+
+/// <summary>
+/// Moves a file over another in one step, so the target is either the old file or the new one, never missing
+/// </summary>
+/// <returns>True, if the file was moved</returns>
+inline bool replaceFile(const std::string& source, const std::string& target)
+{
+#ifdef _WIN32
+	// the narrow names are in the ANSI code page, as std::ofstream takes them
+	auto widen = [](const std::string& name)
+	{
+		int length = MultiByteToWideChar(CP_ACP, 0, name.c_str(), -1, nullptr, 0);
+		std::wstring wide(length > 0 ? length : 1, L'\0');
+		MultiByteToWideChar(CP_ACP, 0, name.c_str(), -1, &wide[0], length);
+		return wide;
+	};
+	std::wstring from = widen(source), to = widen(target);
+	return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	// rename replaces an existing target atomically on POSIX
+	return std::rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
+
+/// <summary>
+/// Writes a checkpoint to a temporary file first and renames it over the old one, so a crash while writing never
+/// destroys the last good checkpoint
+/// </summary>
+/// <returns>True, if the checkpoint was written</returns>
+inline bool writeCheckpoint(const std::string& filename, const CheckpointHeader& header, const AccumulationBuffer& buffer)
+{
+	std::string temporary = filename + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary);
+		if (!file)
+			return false;
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(buffer.sums.data()), buffer.sums.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(buffer.counts.data()), buffer.counts.size() * sizeof(uint32_t));
+		if (!file)
+			return false;
+	}
+
+	return replaceFile(temporary, filename);
+}
+
+/// <summary>
+/// Reads a checkpoint written by writeCheckpoint
+/// </summary>
+/// <returns>False, if the file is missing, truncated or not a checkpoint</returns>
+inline bool readCheckpoint(const std::string& filename, CheckpointHeader& header, AccumulationBuffer& buffer)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		return false;
+
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || std::memcmp(header.magic, "RTCK", 4) != 0 || header.version != 1 || header.imgWidth <= 0 || header.imgHeight <= 0)
+		return false;
+
+	buffer = AccumulationBuffer(header.imgWidth, header.imgHeight);
+	file.read(reinterpret_cast<char*>(buffer.sums.data()), buffer.sums.size() * sizeof(float));
+	file.read(reinterpret_cast<char*>(buffer.counts.data()), buffer.counts.size() * sizeof(uint32_t));
+	return bool(file);
+}
+
+/// <summary>
+/// Writes checkpoints on its own thread. Render threads only pay for copying the buffer into the writer; if a
+/// checkpoint is requested while the previous one is still being written, the newer snapshot replaces the waiting one
+/// </summary>
+class CheckpointWriter
+{
+private:
+	std::string filename;
+	CheckpointHeader header;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	AccumulationBuffer waiting;
+	bool hasWaiting = false;
+	bool writing = false;
+	bool stopping = false;
+	std::thread thread;
+
+	void run()
+	{
+		AccumulationBuffer snapshot;
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (true)
+		{
+			wake.wait(lock, [this]() { return hasWaiting || stopping; });
+			if (!hasWaiting)
+				return;
+
+			std::swap(snapshot, waiting);
+			hasWaiting = false;
+			writing = true;
+			lock.unlock();
+
+			bool ok = writeCheckpoint(filename, header, snapshot);
+			if (!ok)
+				std::cerr << "\nCould not write checkpoint " << filename << "\n";
+
+			lock.lock();
+			writing = false;
+			if (ok)
+				written++;
+			else
+				failed++;
+			wake.notify_all();
+		}
+	}
+
+public:
+	/// <summary>
+	/// Number of checkpoints written so far
+	/// </summary>
+	int written = 0;
+
+	/// <summary>
+	/// Number of checkpoints that could not be written
+	/// </summary>
+	int failed = 0;
+
+	CheckpointWriter(const std::string& filename, const CheckpointHeader& header)
+	{
+		this->filename = filename;
+		this->header = header;
+		thread = std::thread(&CheckpointWriter::run, this);
+	}
+
+	~CheckpointWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		thread.join();
+	}
+
+	/// <summary>
+	/// Queues a copy of the buffer to be written. The caller must keep other threads from changing the buffer
+	/// during the call
+	/// </summary>
+	void save(const AccumulationBuffer& buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		waiting.width = buffer.width;
+		waiting.height = buffer.height;
+		waiting.sums = buffer.sums;
+		waiting.counts = buffer.counts;
+		hasWaiting = true;
+		wake.notify_all();
+	}
+
+	/// <summary>
+	/// Blocks until every queued checkpoint is on disk
+	/// </summary>
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [this]() { return !hasWaiting && !writing; });
+	}
+};
+
+#endif
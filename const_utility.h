@@ -4,8 +4,10 @@
 #include <random>
 #include <limits>
 #include <memory>
+#include <cstdint>
 #include "vec3.h"
 #include "ray.h"
+#include "arena.h"
 
 using std::shared_ptr;
 using std::make_shared;
@@ -24,14 +26,56 @@ inline double radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+/// <summary>
+/// Gets the random number generator of the calling thread
+/// </summary>
+inline std::mt19937& randomGenerator()
+{
+    static thread_local std::mt19937 generator;
+    return generator;
+}
+
 /// <summary>
 /// Generates a random double in the range (0, 1)
 /// </summary>
 inline double randomDouble() 
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(randomGenerator());
+}
+
+/// <summary>
+/// Reseeds both random number generators of the calling thread
+/// </summary>
+/// <param name="seed">New seed</param>
+inline void seedRandom(uint64_t seed)
+{
+    std::seed_seq sequence{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) };
+    randomGenerator().seed(sequence);
+    rdGenerator().seed(sequence);
+}
+
+/// <summary>
+/// Resets both random number generators of the calling thread to their default state
+/// </summary>
+inline void resetRandom()
+{
+    randomGenerator().seed(std::mt19937::default_seed);
+    rdGenerator().seed(std::mt19937::default_seed);
+}
+
+/// <summary>
+/// Mixes a value into a seed (splitmix64 finalizer), so that neighbouring tiles, rows and passes get unrelated streams
+/// </summary>
+/// <param name="seed">Seed to mix into</param>
+/// <param name="value">Value to mix</param>
+/// <returns>The new seed</returns>
+inline uint64_t mixSeed(uint64_t seed, uint64_t value)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull * (value + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
 
 /// <summary>
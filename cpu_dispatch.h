@@ -0,0 +1,658 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_DISPATCH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang compile a function for an instruction set other than the one of the build when it carries a target
+// attribute; MSVC accepts every intrinsic anywhere, so the kernels need no attribute there
+#if defined(__GNUC__) || defined(__clang__)
+#define ISA_TARGET(name) __attribute__((target(name)))
+#else
+#define ISA_TARGET(name)
+#endif
+
+/// <summary>
+/// Instruction set a group of kernels is compiled for, from the oldest to the newest
+/// </summary>
+enum class IsaLevel
+{
+	/// <summary>
+	/// Plain C++, whatever the compiler makes of it for the build's target
+	/// </summary>
+	Scalar,
+	/// <summary>
+	/// 128-bit vectors, two doubles per instruction
+	/// </summary>
+	SSE42,
+	/// <summary>
+	/// 256-bit vectors, four doubles per instruction
+	/// </summary>
+	AVX2,
+	/// <summary>
+	/// 512-bit vectors, eight doubles per instruction
+	/// </summary>
+	AVX512
+};
+
+inline const char* isaName(IsaLevel level)
+{
+	switch (level)
+	{
+	case IsaLevel::SSE42: return "sse4.2";
+	case IsaLevel::AVX2: return "avx2";
+	case IsaLevel::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+/// <summary>
+/// Reads an instruction set name: scalar, sse4.2, avx2 or avx512
+/// </summary>
+/// <returns>False, if the name is unknown</returns>
+inline bool parseIsa(const std::string& name, IsaLevel& level)
+{
+	for (IsaLevel candidate : { IsaLevel::Scalar, IsaLevel::SSE42, IsaLevel::AVX2, IsaLevel::AVX512 })
+	{
+		if (name == isaName(candidate))
+		{
+			level = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+/// <summary>
+/// Newest instruction set both the CPU and the operating system support, read once through CPUID
+/// </summary>
+inline IsaLevel detectIsa()
+{
+	static const IsaLevel detected = []()
+	{
+		IsaLevel level = IsaLevel::Scalar;
+#if defined(CPU_DISPATCH_X86) && (defined(__GNUC__) || defined(__clang__))
+		// libgcc also checks through XGETBV that the OS saves the wide registers
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2"))
+			level = IsaLevel::SSE42;
+		if (level == IsaLevel::SSE42 && __builtin_cpu_supports("avx2"))
+			level = IsaLevel::AVX2;
+		if (level == IsaLevel::AVX2 && __builtin_cpu_supports("avx512f"))
+			level = IsaLevel::AVX512;
+#elif defined(CPU_DISPATCH_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int highest = info[0];
+		__cpuid(info, 1);
+		bool sse42 = (info[2] & (1 << 20)) != 0;
+		bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+		bool osSavesAvx512 = osSavesAvx && (_xgetbv(0) & 0xe6) == 0xe6;
+		int extended[4] = { 0, 0, 0, 0 };
+		if (highest >= 7)
+			__cpuidex(extended, 7, 0);
+
+		if (sse42)
+			level = IsaLevel::SSE42;
+		if (sse42 && osSavesAvx && (extended[1] & (1 << 5)) != 0)
+			level = IsaLevel::AVX2;
+		if (level == IsaLevel::AVX2 && osSavesAvx512 && (extended[1] & (1 << 16)) != 0)
+			level = IsaLevel::AVX512;
+#endif
+		return level;
+	}();
+	return detected;
+}
+
+/// <summary>
+/// Number of spheres a SphereSet leaf holds and the sphere kernel tests at once
+/// </summary>
+const int KERNEL_LANES = 8;
+
+/// <summary>
+/// Computes half of b and the discriminant of the ray-sphere quadratic for KERNEL_LANES spheres whose centers and
+/// radii start at the given pointers
+/// </summary>
+typedef void (*SphereLanesKernel)(const float* cx, const float* cy, const float* cz, const float* radii,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES]);
+
+/// <summary>
+/// Slab test of the two child boxes of a quantized BVH node, coordinate = base + q * scale
+/// </summary>
+/// <returns>Bit 0 set if the ray enters the first box within [tMin, tMax), bit 1 for the second; the entry
+/// distances of the boxes hit are written to entry</returns>
+typedef unsigned (*ChildBoxesKernel)(const float base[3], const double scale[3], const uint8_t qlo[2][3], const uint8_t qhi[2][3],
+	const double origin[3], const double inverse[3], double tMin, double tMax, double entry[2]);
+
+/// <summary>
+/// Slab test of one box stored in floats, the node of a float FlatBVH
+/// </summary>
+/// <returns>True, if the ray enters the box within [tMin, tMax); the entry distance is written to tEntry</returns>
+typedef bool (*FloatBoxKernel)(const float lo[3], const float hi[3], const double origin[3], const double inverse[3],
+	double tMin, double tMax, double& tEntry);
+
+/// <summary>
+/// Computes half of b and the discriminant of the ray-sphere quadratic, as intersectSphere does, for count spheres
+/// (at most KERNEL_LANES) stored in doubles, those of a typed FlatBVH leaf. The arrays must be readable for
+/// KERNEL_LANES - 1 spheres past the last one
+/// </summary>
+typedef void (*LeafSpheresKernel)(const double* cx, const double* cy, const double* cz, const double* radii, int count,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES]);
+
+/// <summary>
+/// Axis-aligned rectangles, one array per field, see intersectRectangle. The arrays must be readable for
+/// KERNEL_LANES - 1 rectangles past the last one, with valid axes
+/// </summary>
+struct RectangleLanes
+{
+	const double* k;
+	const double* lo0;
+	const double* hi0;
+	const double* lo1;
+	const double* hi1;
+	const int32_t* normal;
+	const int32_t* axis0;
+	const int32_t* axis1;
+};
+
+/// <summary>
+/// Intersects count rectangles (at most KERNEL_LANES) starting at first, those of a typed FlatBVH leaf
+/// </summary>
+/// <returns>Bit i set if rectangle first + i is hit within [tMin, tMax] as intersectRectangle decides; the distance
+/// and the coordinates of every such hit are written to t, u and v</returns>
+typedef unsigned (*LeafRectanglesKernel)(const RectangleLanes& rectangles, size_t first, int count, const double origin[3],
+	const double direction[3], double tMin, double tMax, double t[KERNEL_LANES], double u[KERNEL_LANES], double v[KERNEL_LANES]);
+
+/// <summary>
+/// The vectorized kernels compiled for one instruction set: the SphereSet leaf test, the node tests of the float and
+/// the quantized FlatBVH and the spheres and rectangles of its typed leaves. Primitives without a place in the typed
+/// leaves are always tested by their own scalar code
+/// </summary>
+struct IntersectionKernels
+{
+	IsaLevel level;
+	SphereLanesKernel sphereLanes;
+	ChildBoxesKernel childBoxes;
+	FloatBoxKernel floatBox;
+	LeafSpheresKernel leafSpheres;
+	LeafRectanglesKernel leafRectangles;
+};
+
+// Every version evaluates the same expressions in the same order and none may fuse a multiply and an add, so all
+// of them return bit-identical results and the choice of kernels never changes an image
+#if defined(__clang__)
+#pragma float_control(push)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+inline void sphereLanesScalar(const float* cx, const float* cy, const float* cz, const float* radii,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	for (int i = 0; i < KERNEL_LANES; i++)
+	{
+		double ocx = origin[0] - cx[i];
+		double ocy = origin[1] - cy[i];
+		double ocz = origin[2] - cz[i];
+		double radius = radii[i];
+
+		halfB[i] = ocx * direction[0] + ocy * direction[1] + ocz * direction[2];
+		double c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+		discriminant[i] = halfB[i] * halfB[i] - a * c;
+	}
+}
+
+inline unsigned childBoxesScalar(const float base[3], const double scale[3], const uint8_t qlo[2][3], const uint8_t qhi[2][3],
+	const double origin[3], const double inverse[3], double tMin, double tMax, double entry[2])
+{
+	unsigned mask = 0;
+	for (int side = 0; side < 2; side++)
+	{
+		double tNear = tMin;
+		double tFar = tMax;
+		bool hit = true;
+		for (int k = 0; k < 3 && hit; k++)
+		{
+			double t0 = (base[k] + qlo[side][k] * scale[k] - origin[k]) * inverse[k];
+			double t1 = (base[k] + qhi[side][k] * scale[k] - origin[k]) * inverse[k];
+			if (inverse[k] < 0.0)
+				std::swap(t0, t1);
+
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+			hit = tFar > tNear;
+		}
+		if (hit)
+		{
+			entry[side] = tNear;
+			mask |= 1u << side;
+		}
+	}
+	return mask;
+}
+
+/// <summary>
+/// Folds the slabs of the three axes, already clamped to [tMin, tMax], in axis order; a tie keeps the earlier value,
+/// so the vector versions end with the same entry distance as the scalar one
+/// </summary>
+inline bool foldSlabs(const double tNear[3], const double tFar[3], double& tEntry)
+{
+	double entry = tNear[0];
+	double exit = tFar[0];
+	for (int k = 1; k < 3; k++)
+	{
+		entry = tNear[k] > entry ? tNear[k] : entry;
+		exit = tFar[k] < exit ? tFar[k] : exit;
+	}
+	tEntry = entry;
+	return exit > entry;
+}
+
+inline bool floatBoxScalar(const float lo[3], const float hi[3], const double origin[3], const double inverse[3],
+	double tMin, double tMax, double& tEntry)
+{
+	for (int k = 0; k < 3; k++)
+	{
+		double t0 = (double(lo[k]) - origin[k]) * inverse[k];
+		double t1 = (double(hi[k]) - origin[k]) * inverse[k];
+		if (inverse[k] < 0.0)
+			std::swap(t0, t1);
+
+		tMin = t0 > tMin ? t0 : tMin;
+		tMax = t1 < tMax ? t1 : tMax;
+		if (tMax <= tMin)
+			return false;
+	}
+	tEntry = tMin;
+	return true;
+}
+
+inline void leafSpheresScalar(const double* cx, const double* cy, const double* cz, const double* radii, int count,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	for (int i = 0; i < count; i++)
+	{
+		double ocx = origin[0] - cx[i];
+		double ocy = origin[1] - cy[i];
+		double ocz = origin[2] - cz[i];
+
+		halfB[i] = ocx * direction[0] + ocy * direction[1] + ocz * direction[2];
+		double c = ocx * ocx + ocy * ocy + ocz * ocz - radii[i] * radii[i];
+		discriminant[i] = halfB[i] * halfB[i] - a * c;
+	}
+}
+
+inline unsigned leafRectanglesScalar(const RectangleLanes& rectangles, size_t first, int count, const double origin[3],
+	const double direction[3], double tMin, double tMax, double t[KERNEL_LANES], double u[KERNEL_LANES], double v[KERNEL_LANES])
+{
+	unsigned mask = 0;
+	for (int i = 0; i < count; i++)
+	{
+		size_t j = first + i;
+		int normal = rectangles.normal[j];
+		int axis0 = rectangles.axis0[j];
+		int axis1 = rectangles.axis1[j];
+
+		t[i] = (rectangles.k[j] - origin[normal]) / direction[normal];
+		u[i] = origin[axis0] + t[i] * direction[axis0];
+		v[i] = origin[axis1] + t[i] * direction[axis1];
+		if (!(t[i] < tMin || t[i] > tMax || u[i] < rectangles.lo0[j] || u[i] > rectangles.hi0[j] || v[i] < rectangles.lo1[j] || v[i] > rectangles.hi1[j]))
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+#ifdef CPU_DISPATCH_X86
+
+ISA_TARGET("sse4.2") inline void sphereLanesSSE42(const float* cx, const float* cy, const float* cz, const float* radii,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	const __m128d ox = _mm_set1_pd(origin[0]), oy = _mm_set1_pd(origin[1]), oz = _mm_set1_pd(origin[2]);
+	const __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+	const __m128d va = _mm_set1_pd(a);
+
+	for (int i = 0; i < KERNEL_LANES; i += 4)
+	{
+		__m128 x4 = _mm_loadu_ps(cx + i), y4 = _mm_loadu_ps(cy + i), z4 = _mm_loadu_ps(cz + i), r4 = _mm_loadu_ps(radii + i);
+		for (int half = 0; half < 2; half++)
+		{
+			__m128d ocx = _mm_sub_pd(ox, _mm_cvtps_pd(x4));
+			__m128d ocy = _mm_sub_pd(oy, _mm_cvtps_pd(y4));
+			__m128d ocz = _mm_sub_pd(oz, _mm_cvtps_pd(z4));
+			__m128d radius = _mm_cvtps_pd(r4);
+
+			__m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+			__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(radius, radius));
+			_mm_storeu_pd(halfB + i + 2 * half, b);
+			_mm_storeu_pd(discriminant + i + 2 * half, _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(va, c)));
+
+			x4 = _mm_movehl_ps(x4, x4);
+			y4 = _mm_movehl_ps(y4, y4);
+			z4 = _mm_movehl_ps(z4, z4);
+			r4 = _mm_movehl_ps(r4, r4);
+		}
+	}
+}
+
+ISA_TARGET("avx2") inline void sphereLanesAVX2(const float* cx, const float* cy, const float* cz, const float* radii,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	const __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+	const __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+	const __m256d va = _mm256_set1_pd(a);
+
+	for (int i = 0; i < KERNEL_LANES; i += 4)
+	{
+		__m256d ocx = _mm256_sub_pd(ox, _mm256_cvtps_pd(_mm_loadu_ps(cx + i)));
+		__m256d ocy = _mm256_sub_pd(oy, _mm256_cvtps_pd(_mm_loadu_ps(cy + i)));
+		__m256d ocz = _mm256_sub_pd(oz, _mm256_cvtps_pd(_mm_loadu_ps(cz + i)));
+		__m256d radius = _mm256_cvtps_pd(_mm_loadu_ps(radii + i));
+
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+			_mm256_mul_pd(radius, radius));
+		_mm256_storeu_pd(halfB + i, b);
+		_mm256_storeu_pd(discriminant + i, _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(va, c)));
+	}
+}
+
+ISA_TARGET("avx512f") inline void sphereLanesAVX512(const float* cx, const float* cy, const float* cz, const float* radii,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	__m512d ocx = _mm512_sub_pd(_mm512_set1_pd(origin[0]), _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(cx)));
+	__m512d ocy = _mm512_sub_pd(_mm512_set1_pd(origin[1]), _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(cy)));
+	__m512d ocz = _mm512_sub_pd(_mm512_set1_pd(origin[2]), _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(cz)));
+	__m512d radius = _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(radii));
+
+	__m512d b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, _mm512_set1_pd(direction[0])), _mm512_mul_pd(ocy, _mm512_set1_pd(direction[1]))),
+		_mm512_mul_pd(ocz, _mm512_set1_pd(direction[2])));
+	__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)),
+		_mm512_mul_pd(radius, radius));
+	_mm512_storeu_pd(halfB, b);
+	_mm512_storeu_pd(discriminant, _mm512_sub_pd(_mm512_mul_pd(b, b), _mm512_mul_pd(_mm512_set1_pd(a), c)));
+}
+
+/// <summary>
+/// Both children side by side in one register. maxpd and minpd return their second operand when the first is NaN,
+/// which keeps tMin and tMax for a 0 * infinity slab just like the comparisons of the scalar version. Two boxes do
+/// not fill a wider register, so the AVX2 and AVX-512 tables use this version as well
+/// </summary>
+ISA_TARGET("sse4.2") inline unsigned childBoxesSSE42(const float base[3], const double scale[3], const uint8_t qlo[2][3], const uint8_t qhi[2][3],
+	const double origin[3], const double inverse[3], double tMin, double tMax, double entry[2])
+{
+	__m128d tNear = _mm_set1_pd(tMin);
+	__m128d tFar = _mm_set1_pd(tMax);
+
+	for (int k = 0; k < 3; k++)
+	{
+		__m128d b = _mm_set1_pd(base[k]);
+		__m128d s = _mm_set1_pd(scale[k]);
+		__m128d o = _mm_set1_pd(origin[k]);
+		__m128d inv = _mm_set1_pd(inverse[k]);
+
+		__m128d lo = _mm_add_pd(b, _mm_mul_pd(_mm_set_pd(qlo[1][k], qlo[0][k]), s));
+		__m128d hi = _mm_add_pd(b, _mm_mul_pd(_mm_set_pd(qhi[1][k], qhi[0][k]), s));
+		__m128d t0 = _mm_mul_pd(_mm_sub_pd(lo, o), inv);
+		__m128d t1 = _mm_mul_pd(_mm_sub_pd(hi, o), inv);
+		if (inverse[k] < 0.0)
+			std::swap(t0, t1);
+
+		tNear = _mm_max_pd(t0, tNear);
+		tFar = _mm_min_pd(t1, tFar);
+	}
+
+	_mm_storeu_pd(entry, tNear);
+	return unsigned(_mm_movemask_pd(_mm_cmpgt_pd(tFar, tNear)));
+}
+
+/// <summary>
+/// x and y side by side in one register, z twice in the other
+/// </summary>
+ISA_TARGET("sse4.2") inline bool floatBoxSSE42(const float lo[3], const float hi[3], const double origin[3], const double inverse[3],
+	double tMin, double tMax, double& tEntry)
+{
+	double tNear[4];
+	double tFar[4];
+
+	for (int half = 0; half < 2; half++)
+	{
+		int k0 = 2 * half;
+		int k1 = half == 0 ? 1 : 2;
+		__m128d o = _mm_set_pd(origin[k1], origin[k0]);
+		__m128d inv = _mm_set_pd(inverse[k1], inverse[k0]);
+
+		__m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set_pd(lo[k1], lo[k0]), o), inv);
+		__m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set_pd(hi[k1], hi[k0]), o), inv);
+		__m128d negative = _mm_cmplt_pd(inv, _mm_setzero_pd());
+
+		_mm_storeu_pd(tNear + k0, _mm_max_pd(_mm_blendv_pd(t0, t1, negative), _mm_set1_pd(tMin)));
+		_mm_storeu_pd(tFar + k0, _mm_min_pd(_mm_blendv_pd(t1, t0, negative), _mm_set1_pd(tMax)));
+	}
+	return foldSlabs(tNear, tFar, tEntry);
+}
+
+/// <summary>
+/// x, y and z in one register, the fourth lane repeating x. The AVX-512 table uses this version as well
+/// </summary>
+ISA_TARGET("avx2") inline bool floatBoxAVX2(const float lo[3], const float hi[3], const double origin[3], const double inverse[3],
+	double tMin, double tMax, double& tEntry)
+{
+	__m256d o = _mm256_set_pd(origin[0], origin[2], origin[1], origin[0]);
+	__m256d inv = _mm256_set_pd(inverse[0], inverse[2], inverse[1], inverse[0]);
+
+	__m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set_pd(lo[0], lo[2], lo[1], lo[0]), o), inv);
+	__m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set_pd(hi[0], hi[2], hi[1], hi[0]), o), inv);
+	__m256d negative = _mm256_cmp_pd(inv, _mm256_setzero_pd(), _CMP_LT_OQ);
+
+	double tNear[4];
+	double tFar[4];
+	_mm256_storeu_pd(tNear, _mm256_max_pd(_mm256_blendv_pd(t0, t1, negative), _mm256_set1_pd(tMin)));
+	_mm256_storeu_pd(tFar, _mm256_min_pd(_mm256_blendv_pd(t1, t0, negative), _mm256_set1_pd(tMax)));
+	return foldSlabs(tNear, tFar, tEntry);
+}
+
+ISA_TARGET("sse4.2") inline void leafSpheresSSE42(const double* cx, const double* cy, const double* cz, const double* radii, int count,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	const __m128d ox = _mm_set1_pd(origin[0]), oy = _mm_set1_pd(origin[1]), oz = _mm_set1_pd(origin[2]);
+	const __m128d dx = _mm_set1_pd(direction[0]), dy = _mm_set1_pd(direction[1]), dz = _mm_set1_pd(direction[2]);
+
+	for (int i = 0; i < count; i += 2)
+	{
+		__m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(cx + i));
+		__m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(cy + i));
+		__m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(cz + i));
+		__m128d radius = _mm_loadu_pd(radii + i);
+
+		__m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+		__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(radius, radius));
+		_mm_storeu_pd(halfB + i, b);
+		_mm_storeu_pd(discriminant + i, _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(_mm_set1_pd(a), c)));
+	}
+}
+
+ISA_TARGET("avx2") inline void leafSpheresAVX2(const double* cx, const double* cy, const double* cz, const double* radii, int count,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	const __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+	const __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+
+	for (int i = 0; i < count; i += 4)
+	{
+		__m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(cx + i));
+		__m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(cy + i));
+		__m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(cz + i));
+		__m256d radius = _mm256_loadu_pd(radii + i);
+
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+			_mm256_mul_pd(radius, radius));
+		_mm256_storeu_pd(halfB + i, b);
+		_mm256_storeu_pd(discriminant + i, _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(_mm256_set1_pd(a), c)));
+	}
+}
+
+ISA_TARGET("avx512f") inline void leafSpheresAVX512(const double* cx, const double* cy, const double* cz, const double* radii, int,
+	const double origin[3], const double direction[3], double a, double halfB[KERNEL_LANES], double discriminant[KERNEL_LANES])
+{
+	__m512d ocx = _mm512_sub_pd(_mm512_set1_pd(origin[0]), _mm512_loadu_pd(cx));
+	__m512d ocy = _mm512_sub_pd(_mm512_set1_pd(origin[1]), _mm512_loadu_pd(cy));
+	__m512d ocz = _mm512_sub_pd(_mm512_set1_pd(origin[2]), _mm512_loadu_pd(cz));
+	__m512d radius = _mm512_loadu_pd(radii);
+
+	__m512d b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, _mm512_set1_pd(direction[0])), _mm512_mul_pd(ocy, _mm512_set1_pd(direction[1]))),
+		_mm512_mul_pd(ocz, _mm512_set1_pd(direction[2])));
+	__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)),
+		_mm512_mul_pd(radius, radius));
+	_mm512_storeu_pd(halfB, b);
+	_mm512_storeu_pd(discriminant, _mm512_sub_pd(_mm512_mul_pd(b, b), _mm512_mul_pd(_mm512_set1_pd(a), c)));
+}
+
+/// <summary>
+/// Without gathers the coordinates along the axes of each rectangle are loaded one by one
+/// </summary>
+ISA_TARGET("sse4.2") inline unsigned leafRectanglesSSE42(const RectangleLanes& rectangles, size_t first, int count, const double origin[3],
+	const double direction[3], double tMin, double tMax, double t[KERNEL_LANES], double u[KERNEL_LANES], double v[KERNEL_LANES])
+{
+	unsigned mask = 0;
+	for (int i = 0; i < count; i += 2)
+	{
+		size_t j = first + i;
+		const int32_t* normal = rectangles.normal + j;
+		const int32_t* axis0 = rectangles.axis0 + j;
+		const int32_t* axis1 = rectangles.axis1 + j;
+
+		__m128d tt = _mm_div_pd(_mm_sub_pd(_mm_loadu_pd(rectangles.k + j), _mm_set_pd(origin[normal[1]], origin[normal[0]])),
+			_mm_set_pd(direction[normal[1]], direction[normal[0]]));
+		__m128d uu = _mm_add_pd(_mm_set_pd(origin[axis0[1]], origin[axis0[0]]), _mm_mul_pd(tt, _mm_set_pd(direction[axis0[1]], direction[axis0[0]])));
+		__m128d vv = _mm_add_pd(_mm_set_pd(origin[axis1[1]], origin[axis1[0]]), _mm_mul_pd(tt, _mm_set_pd(direction[axis1[1]], direction[axis1[0]])));
+
+		__m128d miss = _mm_or_pd(_mm_cmplt_pd(tt, _mm_set1_pd(tMin)), _mm_cmpgt_pd(tt, _mm_set1_pd(tMax)));
+		miss = _mm_or_pd(miss, _mm_or_pd(_mm_cmplt_pd(uu, _mm_loadu_pd(rectangles.lo0 + j)), _mm_cmpgt_pd(uu, _mm_loadu_pd(rectangles.hi0 + j))));
+		miss = _mm_or_pd(miss, _mm_or_pd(_mm_cmplt_pd(vv, _mm_loadu_pd(rectangles.lo1 + j)), _mm_cmpgt_pd(vv, _mm_loadu_pd(rectangles.hi1 + j))));
+
+		_mm_storeu_pd(t + i, tt);
+		_mm_storeu_pd(u + i, uu);
+		_mm_storeu_pd(v + i, vv);
+		mask |= unsigned(~_mm_movemask_pd(miss) & 3) << i;
+	}
+	return mask & ((1u << count) - 1);
+}
+
+ISA_TARGET("avx2") inline unsigned leafRectanglesAVX2(const RectangleLanes& rectangles, size_t first, int count, const double origin[3],
+	const double direction[3], double tMin, double tMax, double t[KERNEL_LANES], double u[KERNEL_LANES], double v[KERNEL_LANES])
+{
+	// the masked gathers start from a defined register; the unmasked ones leave GCC warning about an uninitialized one
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+	unsigned mask = 0;
+	for (int i = 0; i < count; i += 4)
+	{
+		size_t j = first + i;
+		__m128i normal = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rectangles.normal + j));
+		__m128i axis0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rectangles.axis0 + j));
+		__m128i axis1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rectangles.axis1 + j));
+
+		__m256d tt = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(rectangles.k + j), _mm256_mask_i32gather_pd(zero, origin, normal, all, 8)),
+			_mm256_mask_i32gather_pd(zero, direction, normal, all, 8));
+		__m256d uu = _mm256_add_pd(_mm256_mask_i32gather_pd(zero, origin, axis0, all, 8), _mm256_mul_pd(tt, _mm256_mask_i32gather_pd(zero, direction, axis0, all, 8)));
+		__m256d vv = _mm256_add_pd(_mm256_mask_i32gather_pd(zero, origin, axis1, all, 8), _mm256_mul_pd(tt, _mm256_mask_i32gather_pd(zero, direction, axis1, all, 8)));
+
+		__m256d miss = _mm256_or_pd(_mm256_cmp_pd(tt, _mm256_set1_pd(tMin), _CMP_LT_OQ), _mm256_cmp_pd(tt, _mm256_set1_pd(tMax), _CMP_GT_OQ));
+		miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(uu, _mm256_loadu_pd(rectangles.lo0 + j), _CMP_LT_OQ),
+			_mm256_cmp_pd(uu, _mm256_loadu_pd(rectangles.hi0 + j), _CMP_GT_OQ)));
+		miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(vv, _mm256_loadu_pd(rectangles.lo1 + j), _CMP_LT_OQ),
+			_mm256_cmp_pd(vv, _mm256_loadu_pd(rectangles.hi1 + j), _CMP_GT_OQ)));
+
+		_mm256_storeu_pd(t + i, tt);
+		_mm256_storeu_pd(u + i, uu);
+		_mm256_storeu_pd(v + i, vv);
+		mask |= unsigned(~_mm256_movemask_pd(miss) & 15) << i;
+	}
+	return mask & ((1u << count) - 1);
+}
+
+ISA_TARGET("avx512f") inline unsigned leafRectanglesAVX512(const RectangleLanes& rectangles, size_t first, int count, const double origin[3],
+	const double direction[3], double tMin, double tMax, double t[KERNEL_LANES], double u[KERNEL_LANES], double v[KERNEL_LANES])
+{
+	__m256i normal = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rectangles.normal + first));
+	__m256i axis0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rectangles.axis0 + first));
+	__m256i axis1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rectangles.axis1 + first));
+	// masked gathers for the same reason as in the AVX2 version
+	const __m512d zero = _mm512_setzero_pd();
+
+	__m512d tt = _mm512_div_pd(_mm512_sub_pd(_mm512_loadu_pd(rectangles.k + first), _mm512_mask_i32gather_pd(zero, 0xff, normal, origin, 8)),
+		_mm512_mask_i32gather_pd(zero, 0xff, normal, direction, 8));
+	__m512d uu = _mm512_add_pd(_mm512_mask_i32gather_pd(zero, 0xff, axis0, origin, 8), _mm512_mul_pd(tt, _mm512_mask_i32gather_pd(zero, 0xff, axis0, direction, 8)));
+	__m512d vv = _mm512_add_pd(_mm512_mask_i32gather_pd(zero, 0xff, axis1, origin, 8), _mm512_mul_pd(tt, _mm512_mask_i32gather_pd(zero, 0xff, axis1, direction, 8)));
+
+	__mmask8 miss = _mm512_cmp_pd_mask(tt, _mm512_set1_pd(tMin), _CMP_LT_OQ) | _mm512_cmp_pd_mask(tt, _mm512_set1_pd(tMax), _CMP_GT_OQ)
+		| _mm512_cmp_pd_mask(uu, _mm512_loadu_pd(rectangles.lo0 + first), _CMP_LT_OQ) | _mm512_cmp_pd_mask(uu, _mm512_loadu_pd(rectangles.hi0 + first), _CMP_GT_OQ)
+		| _mm512_cmp_pd_mask(vv, _mm512_loadu_pd(rectangles.lo1 + first), _CMP_LT_OQ) | _mm512_cmp_pd_mask(vv, _mm512_loadu_pd(rectangles.hi1 + first), _CMP_GT_OQ);
+
+	_mm512_storeu_pd(t, tt);
+	_mm512_storeu_pd(u, uu);
+	_mm512_storeu_pd(v, vv);
+	return ~unsigned(miss) & ((1u << count) - 1);
+}
+
+#endif
+
+#if defined(__clang__)
+#pragma float_control(pop)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+/// <summary>
+/// Kernels for the given instruction set, which the CPU must support
+/// </summary>
+inline IntersectionKernels kernelsFor(IsaLevel level)
+{
+#ifdef CPU_DISPATCH_X86
+	switch (level)
+	{
+	case IsaLevel::SSE42: return { level, sphereLanesSSE42, childBoxesSSE42, floatBoxSSE42, leafSpheresSSE42, leafRectanglesSSE42 };
+	case IsaLevel::AVX2: return { level, sphereLanesAVX2, childBoxesSSE42, floatBoxAVX2, leafSpheresAVX2, leafRectanglesAVX2 };
+	case IsaLevel::AVX512: return { level, sphereLanesAVX512, childBoxesSSE42, floatBoxAVX2, leafSpheresAVX512, leafRectanglesAVX512 };
+	default: break;
+	}
+#endif
+	return { IsaLevel::Scalar, sphereLanesScalar, childBoxesScalar, floatBoxScalar, leafSpheresScalar, leafRectanglesScalar };
+}
+
+/// <summary>
+/// Kernels the intersection code calls, the newest ones the CPU supports unless selectIsa() chose others
+/// </summary>
+inline IntersectionKernels& activeKernels()
+{
+	static IntersectionKernels kernels = kernelsFor(detectIsa());
+	return kernels;
+}
+
+/// <summary>
+/// Switches every thread to the kernels of the given instruction set; only to be called while nothing renders
+/// </summary>
+/// <returns>False, if the CPU does not support the instruction set</returns>
+inline bool selectIsa(IsaLevel level)
+{
+	if (level > detectIsa())
+		return false;
+	activeKernels() = kernelsFor(level);
+	return true;
+}
+
+#endif
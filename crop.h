@@ -0,0 +1,110 @@
+#ifndef CROP_H
+#define CROP_H
+
+#include "const_utility.h"
+#include "bounding_box.h"
+#include "camera.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/// <summary>
+/// Finds the pixels a box can cover: the rectangle around the projections of its corners, widened by the blur of the
+/// lens and by the one pixel a sample can be jittered
+/// </summary>
+/// <param name="camera">Camera of the render</param>
+/// <param name="box">Box in space</param>
+/// <param name="imgWidth">Width of the image</param>
+/// <param name="imgHeight">Height of the image</param>
+/// <returns>The rectangle, clipped to the image and empty if the box is off screen; the whole image if part of the box
+/// lies behind the camera, as its projection is then unbounded</returns>
+inline Tile projectBox(const Camera& camera, const BoundingBox& box, int imgWidth, int imgHeight)
+{
+	Tile whole = { 0, 0, imgWidth, imgHeight };
+	double left = infinity, right = -infinity, bottom = infinity, top = -infinity;
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		point p((corner & 1) ? box.b.x() : box.a.x(), (corner & 2) ? box.b.y() : box.a.y(), (corner & 4) ? box.b.z() : box.a.z());
+		double x, y, blurX, blurY;
+		if (!camera.project(p, x, y, blurX, blurY))
+			return whole;
+
+		left = std::min(left, x - blurX);
+		right = std::max(right, x + blurX);
+		bottom = std::min(bottom, y - blurY);
+		top = std::max(top, y + blurY);
+	}
+
+	// renderPixel maps pixel x to (x + [0, 1)) / (imgWidth - 1) across and row y to (imgHeight - 1 - y + [0, 1)) /
+	// (imgHeight - 1) up the viewport
+	double columns = double(imgWidth) - 1;
+	double rows = double(imgHeight) - 1;
+	double x0 = std::floor(left * columns) - 1, x1 = std::floor(right * columns) + 1;
+	double y0 = std::floor((1.0 - top) * rows) - 1, y1 = std::floor((1.0 - bottom) * rows) + 2;
+
+	Tile rect;
+	rect.x0 = int(clamp(x0, 0.0, double(imgWidth)));
+	rect.x1 = int(clamp(x1, 0.0, double(imgWidth)));
+	rect.y0 = int(clamp(y0, 0.0, double(imgHeight)));
+	rect.y1 = int(clamp(y1, 0.0, double(imgHeight)));
+	if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0)
+		return { 0, 0, 0, 0 };
+	return rect;
+}
+
+/// <summary>
+/// Picks the tiles that overlap the projection of any of the boxes, e.g. the boxes of objects before and after they
+/// changed. Only what the camera sees directly is covered: shadows, reflections and light the boxes cast elsewhere are
+/// not
+/// </summary>
+/// <param name="camera">Camera of the render</param>
+/// <param name="boxes">Boxes of whatever changed</param>
+/// <param name="tiles">Tiles of the image</param>
+/// <param name="imgWidth">Width of the image</param>
+/// <param name="imgHeight">Height of the image</param>
+/// <returns>Indices of the tiles to render again, in order</returns>
+inline std::vector<size_t> dirtyTiles(const Camera& camera, const std::vector<BoundingBox>& boxes, const std::vector<Tile>& tiles,
+	int imgWidth, int imgHeight)
+{
+	std::vector<Tile> rects;
+	for (const BoundingBox& box : boxes)
+	{
+		Tile rect = projectBox(camera, box, imgWidth, imgHeight);
+		if (rect.width() > 0 && rect.height() > 0)
+			rects.push_back(rect);
+	}
+
+	std::vector<size_t> dirty;
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		const Tile& tile = tiles[i];
+		for (const Tile& rect : rects)
+		{
+			if (rect.x0 < tile.x1 && tile.x0 < rect.x1 && rect.y0 < tile.y1 && tile.y0 < rect.y1)
+			{
+				dirty.push_back(i);
+				break;
+			}
+		}
+	}
+	return dirty;
+}
+
+/// <summary>
+/// Cuts a rectangle of the image into tiles of (at most) size x size pixels, in row-major order
+/// </summary>
+/// <param name="crop">Rectangle of the image</param>
+/// <param name="size">Width and height of a tile</param>
+/// <returns>List of tiles covering the rectangle, in image co-ordinates</returns>
+inline std::vector<Tile> makeCropTiles(const Tile& crop, int size)
+{
+	std::vector<Tile> tiles = makeTiles(crop.width(), crop.height(), size);
+	for (Tile& tile : tiles)
+		tile = { tile.x0 + crop.x0, tile.y0 + crop.y0, tile.x1 + crop.x0, tile.y1 + crop.y0 };
+	return tiles;
+}
+
+#endif
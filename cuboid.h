@@ -1,6 +1,65 @@
+#ifndef CUBOID_H
+#define CUBOID_H
+
 #include "hittable.h"
+#include "hittableList.h"
 #include "vec3.h"
 
+/// <summary>
+/// Ray intersection with the rectangle lo0 <= p[axis0] <= hi0, lo1 <= p[axis1] <= hi1 of the plane p[normal] = k,
+/// shared by the three plane classes and the typed leaves of FlatBVH
+/// </summary>
+/// <param name="t">Receives the distance of the hit</param>
+/// <param name="u">Receives p[axis0] at the hit</param>
+/// <param name="v">Receives p[axis1] at the hit</param>
+/// <returns>True, if the ray hits the rectangle within [tMin, tMax]</returns>
+inline bool intersectRectangle(int normal, int axis0, int axis1, double k, double lo0, double hi0, double lo1, double hi1,
+    const Ray& r, double tMin, double tMax, double& t, double& u, double& v)
+{
+    t = (k - r.origin[normal]) / r.direction[normal];
+
+    if (t < tMin || t > tMax)
+        return false;
+
+    u = r.origin[axis0] + t * r.direction[axis0];
+    v = r.origin[axis1] + t * r.direction[axis1];
+
+    return !(u < lo0 || u > hi0 || v < lo1 || v > hi1);
+}
+
+/// <summary>
+/// Picks a point uniformly on a rectangle, see intersectRectangle, and converts its density to solid angle at from
+/// </summary>
+/// <returns>False, if from lies in the plane of the rectangle</returns>
+inline bool sampleRectangle(int normal, int axis0, int axis1, double k, double lo0, double hi0, double lo1, double hi1,
+    const point& from, double u1, double u2, point& sample, double& pdf)
+{
+    sample[normal] = k;
+    sample[axis0] = lo0 + u1 * (hi0 - lo0);
+    sample[axis1] = lo1 + u2 * (hi1 - lo1);
+
+    vec3 toSample = sample - from;
+    double distanceSquared = toSample.length_squared();
+    double cosine = fabs(toSample[normal]) / sqrt(distanceSquared);
+    double area = (hi0 - lo0) * (hi1 - lo1);
+    if (cosine <= 0.0 || area <= 0.0)
+        return false;
+
+    pdf = distanceSquared / (cosine * area);
+    return true;
+}
+
+/// <summary>
+/// Density per solid angle with which sampleRectangle picks a point of the rectangle
+/// </summary>
+inline double rectanglePdf(int normal, double area, const point& from, const point& onSurface)
+{
+    vec3 toSample = onSurface - from;
+    double distanceSquared = toSample.length_squared();
+    double cosine = fabs(toSample[normal]) / sqrt(distanceSquared);
+    return cosine > 0.0 && area > 0.0 ? distanceSquared / (cosine * area) : 0.0;
+}
+
 /// <summary>
 /// Contains all funcitons used to create and manage xy planes
 /// </summary>
@@ -24,33 +83,69 @@ public:
 	}
 
 	virtual bool hit(const Ray& r, double t_min, double t_max, hitRecord& rec) const override;
+	virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override;
+    virtual Material* material() const override
+    {
+        return mat_ptr.get();
+    }
+    virtual double area() const override
+    {
+        return (x1 - x0) * (y1 - y0);
+    }
+    virtual bool sampleSurface(const point& from, double u1, double u2, point& sample, double& pdf) const override
+    {
+        return sampleRectangle(2, 0, 1, k, x0, x1, y0, y1, from, u1, u2, sample, pdf);
+    }
+    virtual double surfacePdf(const point& from, const point& onSurface) const override
+    {
+        return rectanglePdf(2, area(), from, onSurface);
+    }
+    virtual bool samplePoint(double u1, double u2, point& sample, vec3& normal) const override
+    {
+        sample = point(x0 + u1 * (x1 - x0), y0 + u2 * (y1 - y0), k);
+        normal = vec3(0.0, 0.0, 1.0);
+        return area() > 0.0;
+    }
     virtual bool boundingBox(BoundingBox& output) const override
     {
         output = BoundingBox(point(x0, y0, k - 0.0001), point(x1, y1, k + 0.0001));
         return true;
     }
+    virtual bool translate(const vec3& offset) override
+    {
+        x0 += offset.x(); x1 += offset.x();
+        y0 += offset.y(); y1 += offset.y();
+        k += offset.z();
+        return true;
+    }
 };
 
-bool xyPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const 
+inline bool xyPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
 {
-    auto t = (k - r.origin.z()) / r.direction.z();
-    
-    if (t < tMin || t > tMax)
-        return false;
-    
-    auto x = r.origin.x() + t * r.direction.x();
-    auto y = r.origin.y() + t * r.direction.y();
+    traversalCounters().primitives++;
 
-    if (x < x0 || x > x1 || y < y0 || y > y1)
+    double t, u, v;
+    if (!intersectRectangle(2, 0, 1, k, x0, x1, y0, y1, r, tMin, tMax, t, u, v))
         return false;
 
     rec.t = t;
-    rec.setFaceNormal(r, vec3(0.0, 0.0, 1.0));
-    rec.mat_ptr = mat_ptr;
-    rec.p = r.at(t);
+    rec.object = this;
+    rec.primitive = 0;
+    rec.u = u;
+    rec.v = v;
     return true;
 }
 
+inline void xyPlane::surfaceInteraction(const Ray& r, hitRecord& rec) const
+{
+    rec.u = (rec.u - x0) / (x1 - x0);
+    rec.v = (rec.v - y0) / (y1 - y0);
+    rec.uvScale = 1.0 / fmax(x1 - x0, y1 - y0);
+    rec.setFaceNormal(r, vec3(0.0, 0.0, 1.0));
+    rec.mat_ptr = mat_ptr.get();
+    rec.p = r.at(rec.t);
+}
+
 /// <summary>
 /// Contains all functions used to create and manage yz planes
 /// </summary>
@@ -74,33 +169,69 @@ public:
     }
 
     virtual bool hit(const Ray& r, double t_min, double t_max, hitRecord& rec) const override;
+    virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override;
+    virtual Material* material() const override
+    {
+        return mat_ptr.get();
+    }
+    virtual double area() const override
+    {
+        return (y1 - y0) * (z1 - z0);
+    }
+    virtual bool sampleSurface(const point& from, double u1, double u2, point& sample, double& pdf) const override
+    {
+        return sampleRectangle(0, 1, 2, k, y0, y1, z0, z1, from, u1, u2, sample, pdf);
+    }
+    virtual double surfacePdf(const point& from, const point& onSurface) const override
+    {
+        return rectanglePdf(0, area(), from, onSurface);
+    }
+    virtual bool samplePoint(double u1, double u2, point& sample, vec3& normal) const override
+    {
+        sample = point(k, y0 + u1 * (y1 - y0), z0 + u2 * (z1 - z0));
+        normal = vec3(1.0, 0.0, 0.0);
+        return area() > 0.0;
+    }
     virtual bool boundingBox(BoundingBox& output) const override
     {
         output = BoundingBox(point(k - 0.0001, y0, z0), point(k + 0.0001, y1, z1));
         return true;
     }
+    virtual bool translate(const vec3& offset) override
+    {
+        y0 += offset.y(); y1 += offset.y();
+        z0 += offset.z(); z1 += offset.z();
+        k += offset.x();
+        return true;
+    }
 };
 
-bool yzPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+inline bool yzPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
 {
-    auto t = (k - r.origin.x()) / r.direction.x();
+    traversalCounters().primitives++;
 
-    if (t < tMin || t > tMax)
-        return false;
-
-    auto y = r.origin.y() + t * r.direction.y();
-    auto z = r.origin.z() + t * r.direction.z();
-
-    if (y < y0 || y > y1 || z < z0 || z > z1)
+    double t, u, v;
+    if (!intersectRectangle(0, 1, 2, k, y0, y1, z0, z1, r, tMin, tMax, t, u, v))
         return false;
 
     rec.t = t;
-    rec.setFaceNormal(r, vec3(1.0, 0.0, 0.0));
-    rec.mat_ptr = mat_ptr;
-    rec.p = r.at(t);
+    rec.object = this;
+    rec.primitive = 0;
+    rec.u = u;
+    rec.v = v;
     return true;
 }
 
+inline void yzPlane::surfaceInteraction(const Ray& r, hitRecord& rec) const
+{
+    rec.u = (rec.u - y0) / (y1 - y0);
+    rec.v = (rec.v - z0) / (z1 - z0);
+    rec.uvScale = 1.0 / fmax(y1 - y0, z1 - z0);
+    rec.setFaceNormal(r, vec3(1.0, 0.0, 0.0));
+    rec.mat_ptr = mat_ptr.get();
+    rec.p = r.at(rec.t);
+}
+
 /// <summary>
 /// Contains all functions to create and manage xz planes
 /// </summary>
@@ -124,33 +255,133 @@ public:
     }
 
     virtual bool hit(const Ray& r, double t_min, double t_max, hitRecord& rec) const override;
+    virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override;
+    virtual Material* material() const override
+    {
+        return mat_ptr.get();
+    }
+    virtual double area() const override
+    {
+        return (x1 - x0) * (z1 - z0);
+    }
+    virtual bool sampleSurface(const point& from, double u1, double u2, point& sample, double& pdf) const override
+    {
+        return sampleRectangle(1, 0, 2, k, x0, x1, z0, z1, from, u1, u2, sample, pdf);
+    }
+    virtual double surfacePdf(const point& from, const point& onSurface) const override
+    {
+        return rectanglePdf(1, area(), from, onSurface);
+    }
+    virtual bool samplePoint(double u1, double u2, point& sample, vec3& normal) const override
+    {
+        sample = point(x0 + u1 * (x1 - x0), k, z0 + u2 * (z1 - z0));
+        normal = vec3(0.0, 1.0, 0.0);
+        return area() > 0.0;
+    }
     virtual bool boundingBox(BoundingBox& output) const override
     {
         output = BoundingBox(point(x0, k - 0.0001, z0), point(x1, k + 0.0001, z1));
         return true;
     }
+    virtual bool translate(const vec3& offset) override
+    {
+        x0 += offset.x(); x1 += offset.x();
+        z0 += offset.z(); z1 += offset.z();
+        k += offset.y();
+        return true;
+    }
 };
 
-bool xzPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const 
+inline bool xzPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
 {
-    auto t = (k - r.origin.y()) / r.direction.y();
-    
-    if (t < tMin || t > tMax)
+    traversalCounters().primitives++;
+
+    double t, u, v;
+    if (!intersectRectangle(1, 0, 2, k, x0, x1, z0, z1, r, tMin, tMax, t, u, v))
+        return false;
+
+    rec.t = t;
+    rec.object = this;
+    rec.primitive = 0;
+    rec.u = u;
+    rec.v = v;
+    return true;
+}
+
+inline void xzPlane::surfaceInteraction(const Ray& r, hitRecord& rec) const
+{
+    rec.u = (rec.u - x0) / (x1 - x0);
+    rec.v = (rec.v - z0) / (z1 - z0);
+    rec.uvScale = 1.0 / fmax(x1 - x0, z1 - z0);
+    rec.setFaceNormal(r, vec3(0.0, 1.0, 0.0));
+    rec.mat_ptr = mat_ptr.get();
+    rec.p = r.at(rec.t);
+}
+
+/// <summary>
+/// Infinite horizontal plane, for grounds that would otherwise be modelled as an enormous sphere. It has no bounding
+/// box, so it is kept out of the BVH and tested on its own
+/// </summary>
+class GroundPlane : public Hittable
+{
+public:
+    /// <summary>
+    /// Height of the plane
+    /// </summary>
+    double k;
+    shared_ptr<Material> mat_ptr;
+
+    GroundPlane()
+    {}
+
+    GroundPlane(double k, shared_ptr<Material> mat_ptr)
+    {
+        this->k = k;
+        this->mat_ptr = mat_ptr;
+    }
+
+    virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override;
+    virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override;
+    virtual Material* material() const override
+    {
+        return mat_ptr.get();
+    }
+    virtual bool boundingBox(BoundingBox& /*output*/) const override
+    {
         return false;
+    }
+    virtual bool translate(const vec3& offset) override
+    {
+        k += offset.y();
+        return true;
+    }
+};
+
+inline bool GroundPlane::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+{
+    traversalCounters().primitives++;
 
-    auto x = r.origin.x() + t * r.direction.x();
-    auto z = r.origin.z() + t * r.direction.z();
+    auto t = (k - r.origin.y()) / r.direction.y();
 
-    if (x < x0 || x > x1 || z < z0 || z > z1)
+    if (t < tMin || t > tMax)
         return false;
 
     rec.t = t;
-    rec.setFaceNormal(r, vec3(0.0, 1.0, 0.0));
-    rec.mat_ptr = mat_ptr;
-    rec.p = r.at(t);
+    rec.object = this;
+    rec.primitive = 0;
     return true;
 }
 
+inline void GroundPlane::surfaceInteraction(const Ray& r, hitRecord& rec) const
+{
+    rec.p = r.at(rec.t);
+    rec.u = rec.p.x();
+    rec.v = rec.p.z();
+    rec.uvScale = 1.0;
+    rec.setFaceNormal(r, vec3(0.0, 1.0, 0.0));
+    rec.mat_ptr = mat_ptr.get();
+}
+
 /// <summary>
 /// Contains all functions to create and manage a box
 /// </summary>
@@ -169,14 +400,14 @@ public:
         this->a = a;
         this->b = b;
 
-        cuboid.add(make_shared<xyPlane>(a.x(), b.x(), a.y(), b.y(), a.z(), mat_ptr));
-        cuboid.add(make_shared<xyPlane>(a.x(), b.x(), a.y(), b.y(), b.z(), mat_ptr));
+        cuboid.add(create<xyPlane>(a.x(), b.x(), a.y(), b.y(), a.z(), mat_ptr));
+        cuboid.add(create<xyPlane>(a.x(), b.x(), a.y(), b.y(), b.z(), mat_ptr));
 
-        cuboid.add(make_shared<yzPlane>(a.y(), b.y(), a.z(), b.z(), b.x(), mat_ptr));
-        cuboid.add(make_shared<yzPlane>(a.y(), b.y(), a.z(), b.z(), a.x(), mat_ptr));
+        cuboid.add(create<yzPlane>(a.y(), b.y(), a.z(), b.z(), b.x(), mat_ptr));
+        cuboid.add(create<yzPlane>(a.y(), b.y(), a.z(), b.z(), a.x(), mat_ptr));
 
-        cuboid.add(make_shared<xzPlane>(a.x(), b.x(), a.z(), b.z(), b.y(), mat_ptr));
-        cuboid.add(make_shared<xzPlane>(a.x(), b.x(), a.z(), b.z(), a.y(), mat_ptr));
+        cuboid.add(create<xzPlane>(a.x(), b.x(), a.z(), b.z(), b.y(), mat_ptr));
+        cuboid.add(create<xzPlane>(a.x(), b.x(), a.z(), b.z(), a.y(), mat_ptr));
     }
 
     virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& record) const override;
@@ -185,9 +416,16 @@ public:
         output = BoundingBox(a, b);
         return true;
     }
+    virtual bool translate(const vec3& offset) override
+    {
+        a += offset;
+        b += offset;
+        return cuboid.translate(offset);
+    }
 };
 
-bool Cuboid::hit(const Ray& r, double tMin, double tMax, hitRecord& record) const
+inline bool Cuboid::hit(const Ray& r, double tMin, double tMax, hitRecord& record) const
 {
     return cuboid.hit(r, tMin, tMax, record);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,505 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "const_utility.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "image.h"
+#include "net.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+typedef HANDLE ProcessHandle;
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+typedef pid_t ProcessHandle;
+#endif
+
+/// <summary>
+/// Types of the messages exchanged between the coordinator and its workers
+/// </summary>
+enum MessageType : uint32_t
+{
+	MSG_HELLO = 1,		// worker -> coordinator: name, thread count
+	MSG_JOB = 2,		// coordinator -> worker: DistributedJob
+	MSG_REQUEST = 3,	// worker -> coordinator: asks for the next tile
+	MSG_TILE = 4,		// coordinator -> worker: tile index and rectangle
+	MSG_RESULT = 5,		// worker -> coordinator: tile index, render seconds, floats
+	MSG_DONE = 6		// coordinator -> worker: no tiles left
+};
+
+/// <summary>
+/// Describes the frame every worker renders a part of. Workers build the scene themselves from its number, with the
+/// accelerator and memory layout of the coordinator
+/// </summary>
+struct DistributedJob
+{
+	int32_t scene = 3;
+	int32_t imgWidth = 0;
+	int32_t imgHeight = 0;
+	RenderSettings settings;
+	BVHSettings bvh;
+	bool arena = true;
+};
+
+/// <summary>
+/// What the coordinator knows about one worker connection
+/// </summary>
+struct WorkerStats
+{
+	std::string name;
+	int threads = 0;
+	int tiles = 0;
+	long long pixels = 0;
+	/// <summary>
+	/// Time spent rendering, as reported by the worker
+	/// </summary>
+	double renderSeconds = 0.0;
+	bool lost = false;
+};
+
+/// <summary>
+/// Starts another process
+/// </summary>
+/// <param name="args">Path of the executable followed by its arguments</param>
+/// <param name="process">Receives the handle of the process</param>
+/// <returns>True, if the process was started</returns>
+inline bool spawnProcess(const std::vector<std::string>& args, ProcessHandle& process)
+{
+#ifdef _WIN32
+	std::string commandLine;
+	for (const auto& arg : args)
+		commandLine += "\"" + arg + "\" ";
+
+	STARTUPINFOA startup = {};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION info = {};
+
+	if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &info))
+		return false;
+
+	CloseHandle(info.hThread);
+	process = info.hProcess;
+	return true;
+#else
+	std::vector<char*> argv;
+	for (const auto& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	return posix_spawn(&process, argv[0], nullptr, nullptr, argv.data(), environ) == 0;
+#endif
+}
+
+/// <summary>
+/// Waits for a process started by spawnProcess to exit
+/// </summary>
+inline void waitProcess(ProcessHandle process)
+{
+#ifdef _WIN32
+	WaitForSingleObject(process, INFINITE);
+	CloseHandle(process);
+#else
+	int status;
+	waitpid(process, &status, 0);
+#endif
+}
+
+/// <summary>
+/// Whether a process started by spawnProcess is still running. On POSIX an exited process is reaped, after which
+/// waitProcess returns at once
+/// </summary>
+inline bool processRunning(ProcessHandle process)
+{
+#ifdef _WIN32
+	return WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+#else
+	int status;
+	return waitpid(process, &status, WNOHANG) == 0;
+#endif
+}
+
+/// <summary>
+/// Hands out the tiles of one frame to workers connecting over TCP, re-queues the tile of any worker that fails
+/// and assembles the results
+/// </summary>
+class Coordinator
+{
+private:
+	DistributedJob job;
+	std::vector<Tile> tiles;
+	FloatImage image;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<int> pending;
+	std::vector<int> attempts;
+	int completed = 0;
+	bool failed = false;
+	std::vector<WorkerStats> workers;
+	std::vector<Socket*> connections;
+	/// <summary>
+	/// Local worker processes; once all of them have exited and no connection is left, no worker will come
+	/// </summary>
+	std::vector<ProcessHandle> children;
+
+	Socket server;
+	std::vector<std::thread> threads;
+
+	bool finished() const
+	{
+		return failed || completed == int(tiles.size());
+	}
+
+	/// <summary>
+	/// Puts a tile back in the queue after its worker failed
+	/// </summary>
+	void requeue(int tile, int worker)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		workers[worker].lost = true;
+
+		if (++attempts[tile] >= maxAttempts)
+		{
+			std::cerr << "\nTile " << tile << " failed " << attempts[tile] << " times, giving up.\n";
+			failed = true;
+		}
+		else
+		{
+			std::cerr << "\nLost worker " << workers[worker].name << ", tile " << tile << " re-queued.\n";
+			pending.push_front(tile);
+		}
+		changed.notify_all();
+	}
+
+	/// <summary>
+	/// Talks to one worker until the frame is finished or the worker fails
+	/// </summary>
+	void serve(Socket socket, int worker)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			connections.push_back(&socket);
+		}
+
+		socket.setReceiveTimeout(tileTimeout);
+		converse(socket, worker);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		connections.erase(std::find(connections.begin(), connections.end(), &socket));
+	}
+
+	void converse(Socket& socket, int worker)
+	{
+		uint32_t type;
+		std::vector<char> payload;
+
+		if (!receiveMessage(socket, type, payload) || type != MSG_HELLO)
+			return;
+
+		MessageReader hello(payload);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			workers[worker].name = hello.getString();
+			workers[worker].threads = hello.get<int32_t>();
+		}
+
+		if (!sendMessage(socket, MSG_JOB, MessageWriter().put(job)))
+			return;
+
+		while (true)
+		{
+			if (!receiveMessage(socket, type, payload) || type != MSG_REQUEST)
+				return;
+
+			int tile;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this]() { return !pending.empty() || finished(); });
+
+				if (finished())
+				{
+					lock.unlock();
+					sendMessage(socket, MSG_DONE, MessageWriter());
+					return;
+				}
+				tile = pending.front();
+				pending.pop_front();
+			}
+
+			const Tile& rect = tiles[tile];
+			if (!sendMessage(socket, MSG_TILE, MessageWriter().put(int32_t(tile)).put(rect)) ||
+				!receiveMessage(socket, type, payload) || type != MSG_RESULT)
+			{
+				requeue(tile, worker);
+				return;
+			}
+
+			MessageReader result(payload);
+			int index = result.get<int32_t>();
+			double seconds = result.get<double>();
+			std::vector<float> pixels(size_t(rect.width()) * rect.height() * 3);
+			result.getBytes(pixels.data(), pixels.size() * sizeof(float));
+
+			if (result.failed || index != tile)
+			{
+				requeue(tile, worker);
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			image.setTile(rect, pixels.data());
+			completed++;
+			workers[worker].tiles++;
+			workers[worker].pixels += (long long)rect.width() * rect.height();
+			workers[worker].renderSeconds += seconds;
+			std::cerr << "\r" << completed << " / " << tiles.size() << " tiles " << std::flush;
+			changed.notify_all();
+		}
+	}
+
+	void acceptLoop()
+	{
+		while (true)
+		{
+			Socket socket = server.accept();
+			if (!socket.valid())
+				return;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (finished())
+				return;
+
+			workers.push_back(WorkerStats());
+			threads.emplace_back(&Coordinator::serve, this, std::move(socket), int(workers.size()) - 1);
+		}
+	}
+
+public:
+	/// <summary>
+	/// Seconds a worker may take to answer before its tile is given to someone else
+	/// </summary>
+	int tileTimeout = 600;
+	/// <summary>
+	/// Number of times a tile may be handed out before the frame is abandoned
+	/// </summary>
+	int maxAttempts = 4;
+	/// <summary>
+	/// Seconds the coordinator waits with tiles left but no worker connected before it abandons the frame; 0 waits
+	/// for ever
+	/// </summary>
+	int workerTimeout = 300;
+
+	Coordinator(const DistributedJob& job, int tileSize)
+	{
+		this->job = job;
+		tiles = makeTiles(job.imgWidth, job.imgHeight, tileSize);
+		attempts.assign(tiles.size(), 0);
+		image = FloatImage(job.imgWidth, job.imgHeight);
+
+		for (int i = 0; i < int(tiles.size()); i++)
+			pending.push_back(i);
+	}
+
+	/// <summary>
+	/// Starts listening for workers
+	/// </summary>
+	/// <param name="port">Port to listen on, 0 lets the system pick one; receives the port actually used</param>
+	/// <returns>False, if the port could not be opened</returns>
+	bool listen(int& port)
+	{
+		server = listenTcp(port);
+		return server.valid();
+	}
+
+	/// <summary>
+	/// Adds a local worker process to those the coordinator waits for; only before run()
+	/// </summary>
+	void watch(ProcessHandle process)
+	{
+		children.push_back(process);
+	}
+
+	/// <summary>
+	/// Serves workers until every tile is done, a tile failed too often, or no worker is left to do the rest
+	/// </summary>
+	/// <returns>True, if every tile was rendered</returns>
+	bool run()
+	{
+		std::thread acceptor(&Coordinator::acceptLoop, this);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto idleSince = std::chrono::steady_clock::now();
+			while (!finished())
+			{
+				changed.wait_for(lock, std::chrono::milliseconds(200));
+				if (finished())
+					break;
+
+				auto now = std::chrono::steady_clock::now();
+				if (!connections.empty())
+					idleSince = now;
+				else if (!children.empty() && std::none_of(children.begin(), children.end(), processRunning))
+				{
+					std::cerr << "\nEvery worker has exited with " << tiles.size() - completed << " tiles left, giving up.\n";
+					failed = true;
+				}
+				else if (workerTimeout > 0 && now - idleSince > std::chrono::seconds(workerTimeout))
+				{
+					std::cerr << "\nNo worker for " << workerTimeout << " s with " << tiles.size() - completed << " tiles left, giving up.\n";
+					failed = true;
+				}
+			}
+			changed.notify_all();
+
+			// wake up every connection still waiting on its worker
+			for (Socket* connection : connections)
+				connection->shutdown();
+		}
+
+		server.shutdown();
+		server.close();
+		acceptor.join();
+
+		for (auto& thread : threads)
+			thread.join();
+
+		return !failed;
+	}
+
+	const FloatImage& result() const
+	{
+		return image;
+	}
+
+	/// <summary>
+	/// Prints the tiles, pixels and sample throughput of every worker
+	/// </summary>
+	void report(double wallSeconds) const
+	{
+		std::cerr << "\n" << std::left << std::setw(28) << "worker" << std::right << std::setw(8) << "threads"
+			<< std::setw(8) << "tiles" << std::setw(12) << "pixels" << std::setw(12) << "render s" << std::setw(14) << "Msamples/s" << "\n";
+
+		long long totalPixels = 0;
+		for (const auto& worker : workers)
+		{
+			double rate = worker.renderSeconds > 0.0 ? worker.pixels * double(job.settings.samples) / worker.renderSeconds / 1e6 : 0.0;
+			totalPixels += worker.pixels;
+
+			std::cerr << std::left << std::setw(28) << (worker.name + (worker.lost ? " (lost)" : "")) << std::right
+				<< std::setw(8) << worker.threads << std::setw(8) << worker.tiles << std::setw(12) << worker.pixels
+				<< std::setw(12) << std::fixed << std::setprecision(2) << worker.renderSeconds
+				<< std::setw(14) << std::setprecision(3) << rate << "\n";
+		}
+
+		std::cerr << "Total: " << totalPixels * double(job.settings.samples) / wallSeconds / 1e6 << " Msamples/s over "
+			<< wallSeconds << " s\n" << std::defaultfloat;
+	}
+};
+
+/// <summary>
+/// Connects to a coordinator and renders tiles until it has none left
+/// </summary>
+/// <param name="host">Host name or address of the coordinator</param>
+/// <param name="port">Port of the coordinator</param>
+/// <param name="threadCount">Number of threads used to render each tile</param>
+/// <param name="failAfter">If not negative, the worker quits without answering after this many tiles (to test retries)</param>
+/// <param name="environment">Light of the sky, null for the gradient; every worker reads its own copy of the map</param>
+/// <returns>Exit code of the worker</returns>
+inline int runWorker(const std::string& host, int port, int threadCount, int failAfter, const EnvironmentMap* environment)
+{
+	Socket socket;
+
+	// workers may be started before the coordinator, keep trying for a while
+	for (int attempt = 0; attempt < 100 && !socket.valid(); attempt++)
+	{
+		socket = connectTcp(host, port);
+		if (!socket.valid())
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+
+	if (!socket.valid())
+	{
+		std::cerr << "Could not connect to " << host << ":" << port << "\n";
+		return 1;
+	}
+
+	char hostName[256] = "worker";
+	gethostname(hostName, sizeof(hostName));
+#ifdef _WIN32
+	std::string name = std::string(hostName) + ":" + std::to_string(_getpid());
+#else
+	std::string name = std::string(hostName) + ":" + std::to_string(getpid());
+#endif
+
+	if (!sendMessage(socket, MSG_HELLO, MessageWriter().putString(name).put(int32_t(threadCount))))
+		return 1;
+
+	uint32_t type;
+	std::vector<char> payload;
+
+	if (!receiveMessage(socket, type, payload) || type != MSG_JOB)
+		return 1;
+
+	DistributedJob job = MessageReader(payload).get<DistributedJob>();
+	auto scene = buildScene(job.scene, job.imgHeight, job.arena, job.bvh);
+
+	if (!scene || scene->imgWidth != job.imgWidth || scene->imgHeight != job.imgHeight)
+	{
+		std::cerr << "Worker " << name << " could not build scene " << job.scene << " at " << job.imgWidth << "x" << job.imgHeight << "\n";
+		return 1;
+	}
+
+	RenderContext context;
+	context.world = scene->root.get();
+	context.lights = scene->lights.get();
+	context.environment = environment;
+	context.camera = scene->camera;
+	context.imgWidth = scene->imgWidth;
+	context.imgHeight = scene->imgHeight;
+	context.settings = job.settings;
+
+	std::vector<float> pixels;
+	for (int done = 0; ; done++)
+	{
+		if (!sendMessage(socket, MSG_REQUEST, MessageWriter()) || !receiveMessage(socket, type, payload) || type != MSG_TILE)
+			return 0;
+
+		if (done == failAfter)
+		{
+			std::cerr << "Worker " << name << " failing on purpose\n";
+			return 2;
+		}
+
+		MessageReader reader(payload);
+		int32_t index = reader.get<int32_t>();
+		Tile tile = reader.get<Tile>();
+
+		auto start = std::chrono::steady_clock::now();
+		pixels.assign(size_t(tile.width()) * tile.height() * 3, 0.0f);
+		renderTile(context, tile, threadCount, pixels.data());
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		MessageWriter result;
+		result.put(index).put(seconds).putBytes(pixels.data(), pixels.size() * sizeof(float));
+		if (!sendMessage(socket, MSG_RESULT, result))
+			return 1;
+	}
+}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "const_utility.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Packs a linear colour into the shared-exponent format of Radiance HDR files: three 8-bit mantissas and one 8-bit
+/// exponent, about 1% relative precision over a range far wider than any image needs, in a quarter of the memory of
+/// three floats
+/// </summary>
+inline uint32_t packRGBE(float r, float g, float b)
+{
+	float largest = std::max(r, std::max(g, b));
+	if (!(largest > 1e-32f))
+		return 0;
+
+	int exponent;
+	float scale = std::frexp(largest, &exponent) * 256.0f / largest;
+	uint32_t red = uint32_t(std::max(r, 0.0f) * scale);
+	uint32_t green = uint32_t(std::max(g, 0.0f) * scale);
+	uint32_t blue = uint32_t(std::max(b, 0.0f) * scale);
+	return red | (green << 8) | (blue << 16) | (uint32_t(exponent + 128) << 24);
+}
+
+inline colour unpackRGBE(uint32_t rgbe)
+{
+	uint32_t exponent = rgbe >> 24;
+	if (exponent == 0)
+		return colour(0.0, 0.0, 0.0);
+
+	double scale = std::ldexp(1.0, int(exponent) - (128 + 8));
+	return colour(((rgbe & 0xff) + 0.5) * scale, (((rgbe >> 8) & 0xff) + 0.5) * scale, (((rgbe >> 16) & 0xff) + 0.5) * scale);
+}
+
+/// <summary>
+/// Table for drawing an index in proportion to a list of weights in constant time (Vose's alias method): every slot
+/// keeps its own index with some probability and hands the rest of its share to one alias
+/// </summary>
+class AliasTable
+{
+private:
+	std::vector<float> keep;
+	std::vector<uint32_t> alias;
+	std::vector<float> probabilities;
+
+public:
+	AliasTable()
+	{}
+
+	/// <summary>
+	/// Builds the table; the weights need not be normalised, but must not all be zero
+	/// </summary>
+	explicit AliasTable(const std::vector<double>& weights)
+	{
+		size_t n = weights.size();
+		keep.resize(n);
+		alias.resize(n);
+		probabilities.resize(n);
+
+		double total = 0.0;
+		for (double weight : weights)
+			total += weight;
+
+		std::vector<double> scaled(n);
+		std::vector<uint32_t> small, large;
+		for (size_t i = 0; i < n; i++)
+		{
+			probabilities[i] = float(weights[i] / total);
+			scaled[i] = weights[i] / total * n;
+			(scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			uint32_t less = small.back();
+			small.pop_back();
+			uint32_t more = large.back();
+
+			keep[less] = float(scaled[less]);
+			alias[less] = more;
+			scaled[more] -= 1.0 - scaled[less];
+			if (scaled[more] < 1.0)
+			{
+				large.pop_back();
+				small.push_back(more);
+			}
+		}
+
+		// whatever is left is 1 up to rounding
+		for (uint32_t i : large)
+		{
+			keep[i] = 1.0f;
+			alias[i] = i;
+		}
+		for (uint32_t i : small)
+		{
+			keep[i] = 1.0f;
+			alias[i] = i;
+		}
+	}
+
+	size_t size() const
+	{
+		return keep.size();
+	}
+
+	/// <summary>
+	/// Draws an index
+	/// </summary>
+	/// <param name="u">Uniform random number in [0, 1)</param>
+	uint32_t sample(double u) const
+	{
+		double scaled = u * keep.size();
+		size_t i = std::min(size_t(scaled), keep.size() - 1);
+		return scaled - i < keep[i] ? uint32_t(i) : alias[i];
+	}
+
+	/// <summary>
+	/// Probability of drawing the index
+	/// </summary>
+	double probability(size_t i) const
+	{
+		return probabilities[i];
+	}
+
+	size_t memoryBytes() const
+	{
+		return keep.capacity() * sizeof(float) + alias.capacity() * sizeof(uint32_t) + probabilities.capacity() * sizeof(float);
+	}
+};
+
+/// <summary>
+/// Light arriving from infinitely far away in every direction, read from an equirectangular image: the top row looks
+/// straight up (+y), the bottom row straight down, and the columns go once around the y axis starting at +x towards
+/// +z. Texels are kept as RGBE, and directions are importance sampled through an alias table over cells of at most
+/// SAMPLING_WIDTH columns, each cell drawn in proportion to the light it sends and then sampled uniformly, so a bright
+/// sun is found by most samples without a table as large as an 8K map
+/// </summary>
+class EnvironmentMap
+{
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<uint32_t> texels;
+	double scale = 1.0;
+
+	/// <summary>
+	/// Pixels per cell side of the sampling table, and the number of cells across and down
+	/// </summary>
+	int cellSize = 1;
+	int cellsX = 0;
+	int cellsY = 0;
+	AliasTable cells;
+
+	static double luminance(const colour& c)
+	{
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+	/// <summary>
+	/// Reads one scanline of a Radiance HDR file, flat or run-length encoded per channel
+	/// </summary>
+	static bool readScanline(std::ifstream& file, int width, uint32_t* row)
+	{
+		unsigned char start[4];
+		if (!file.read(reinterpret_cast<char*>(start), 4))
+			return false;
+
+		bool encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width;
+		if (!encoded)
+		{
+			row[0] = start[0] | (start[1] << 8) | (start[2] << 16) | (uint32_t(start[3]) << 24);
+			for (int x = 1; x < width; x++)
+			{
+				unsigned char texel[4];
+				if (!file.read(reinterpret_cast<char*>(texel), 4))
+					return false;
+				row[x] = texel[0] | (texel[1] << 8) | (texel[2] << 16) | (uint32_t(texel[3]) << 24);
+			}
+			return true;
+		}
+
+		std::vector<unsigned char> channel(width);
+		for (int c = 0; c < 4; c++)
+		{
+			for (int x = 0; x < width; )
+			{
+				int count = file.get();
+				if (count == EOF)
+					return false;
+
+				if (count > 128)
+				{
+					// a run of one value
+					count -= 128;
+					int value = file.get();
+					if (value == EOF || x + count > width)
+						return false;
+					std::fill(channel.begin() + x, channel.begin() + x + count, (unsigned char)value);
+				}
+				else
+				{
+					if (count == 0 || x + count > width || !file.read(reinterpret_cast<char*>(&channel[x]), count))
+						return false;
+				}
+				x += count;
+			}
+			for (int x = 0; x < width; x++)
+				row[x] |= uint32_t(channel[x]) << (8 * c);
+		}
+		return true;
+	}
+
+	bool loadHDR(std::ifstream& file)
+	{
+		std::string line;
+		bool rgbe = false;
+		while (std::getline(file, line) && !line.empty())
+			if (line == "FORMAT=32-bit_rle_rgbe")
+				rgbe = true;
+
+		// only the usual orientation: rows from the top, columns from the left
+		char sign[2][3];
+		if (!std::getline(file, line) || std::sscanf(line.c_str(), "%2s %d %2s %d", sign[0], &height, sign[1], &width) != 4
+			|| std::strcmp(sign[0], "-Y") != 0 || std::strcmp(sign[1], "+X") != 0 || !rgbe || width <= 0 || height <= 0)
+			return false;
+
+		texels.assign(size_t(width) * height, 0);
+		for (int y = 0; y < height; y++)
+			if (!readScanline(file, width, &texels[size_t(y) * width]))
+				return false;
+		return true;
+	}
+
+	bool loadPFM(std::ifstream& file)
+	{
+		std::string type;
+		double endianness;
+		file >> type >> width >> height >> endianness;
+		file.get();
+		if (!file || (type != "PF" && type != "Pf") || width <= 0 || height <= 0)
+			return false;
+
+		// floats in the byte order of this machine only, which is little-endian on every target of this program
+		if (endianness > 0.0)
+			return false;
+
+		int channels = type == "PF" ? 3 : 1;
+		std::vector<float> row(size_t(width) * channels);
+		texels.assign(size_t(width) * height, 0);
+
+		// PFM stores the bottom row first
+		for (int y = height - 1; y >= 0; y--)
+		{
+			if (!file.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float)))
+				return false;
+			for (int x = 0; x < width; x++)
+			{
+				const float* texel = &row[size_t(x) * channels];
+				texels[size_t(y) * width + x] = packRGBE(texel[0], texel[channels == 3 ? 1 : 0], texel[channels == 3 ? 2 : 0]);
+			}
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Image coordinates in [0, 1) of a direction
+	/// </summary>
+	static void toImage(const vec3& direction, double& u, double& v)
+	{
+		vec3 d = unitVector(direction);
+		double phi = atan2(d.z(), d.x());
+		if (phi < 0.0)
+			phi += 2.0 * pi;
+		u = phi / (2.0 * pi);
+		v = acos(clamp(d.y(), -1.0, 1.0)) / pi;
+	}
+
+	/// <summary>
+	/// Builds the sampling table over cells of cellSize x cellSize pixels, each weighted by the light it sends
+	/// </summary>
+	void buildCells()
+	{
+		cellSize = (width + SAMPLING_WIDTH - 1) / SAMPLING_WIDTH;
+		cellsX = (width + cellSize - 1) / cellSize;
+		cellsY = (height + cellSize - 1) / cellSize;
+
+		std::vector<double> weights(size_t(cellsX) * cellsY, 0.0);
+		for (int y = 0; y < height; y++)
+		{
+			// rows near the poles cover less solid angle
+			double sinTheta = sin(pi * (y + 0.5) / height);
+			double* cellRow = &weights[size_t(y / cellSize) * cellsX];
+			for (int x = 0; x < width; x++)
+				cellRow[x / cellSize] += luminance(unpackRGBE(texels[size_t(y) * width + x])) * sinTheta;
+		}
+
+		double total = 0.0;
+		for (double weight : weights)
+			total += weight;
+		if (total <= 0.0)
+			std::fill(weights.begin(), weights.end(), 1.0);
+
+		cells = AliasTable(weights);
+	}
+
+public:
+	/// <summary>
+	/// Widest sampling table, in cells; larger maps share one cell between several pixels
+	/// </summary>
+	static const int SAMPLING_WIDTH = 2048;
+
+	EnvironmentMap()
+	{}
+
+	/// <summary>
+	/// Reads an equirectangular Radiance HDR (.hdr) or PFM (.pfm) image
+	/// </summary>
+	/// <param name="filename">Name of the file; the extension decides the format</param>
+	/// <param name="scale">Factor applied to every texel</param>
+	/// <returns>False, if the file could not be read</returns>
+	bool load(const std::string& filename, double scale)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		if (!file)
+			return false;
+
+		this->scale = scale;
+		bool pfm = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0;
+		if (!(pfm ? loadPFM(file) : loadHDR(file)))
+		{
+			width = height = 0;
+			texels.clear();
+			return false;
+		}
+
+		buildCells();
+		return true;
+	}
+
+	int imageWidth() const
+	{
+		return width;
+	}
+
+	int imageHeight() const
+	{
+		return height;
+	}
+
+	/// <summary>
+	/// Radiance arriving from a direction
+	/// </summary>
+	colour radiance(const vec3& direction) const
+	{
+		double u, v;
+		toImage(direction, u, v);
+		int x = std::min(int(u * width), width - 1);
+		int y = std::min(int(v * height), height - 1);
+		return scale * unpackRGBE(texels[size_t(y) * width + x]);
+	}
+
+	/// <summary>
+	/// Picks a direction in proportion to the light arriving from it
+	/// </summary>
+	/// <param name="u1">Uniform random number in [0, 1), picks the cell</param>
+	/// <param name="u2">Uniform random number in [0, 1), across the cell</param>
+	/// <param name="u3">Uniform random number in [0, 1), down the cell</param>
+	/// <param name="direction">Receives the unit direction</param>
+	/// <param name="pdf">Receives the density of the direction per solid angle</param>
+	/// <returns>False, if the direction falls on a pole, where the density is not defined</returns>
+	bool sample(double u1, double u2, double u3, vec3& direction, double& pdf) const
+	{
+		uint32_t cell = cells.sample(u1);
+		int cx = int(cell % cellsX);
+		int cy = int(cell / cellsX);
+
+		// the last cells of a row or column may be cut short by the edge of the image
+		int x0 = cx * cellSize, x1 = std::min(x0 + cellSize, width);
+		int y0 = cy * cellSize, y1 = std::min(y0 + cellSize, height);
+		double u = (x0 + u2 * (x1 - x0)) / width;
+		double v = (y0 + u3 * (y1 - y0)) / height;
+
+		double theta = pi * v;
+		double phi = 2.0 * pi * u;
+		double sinTheta = sin(theta);
+		if (sinTheta <= 0.0)
+			return false;
+
+		direction = vec3(sinTheta * cos(phi), cos(theta), sinTheta * sin(phi));
+		double area = double(x1 - x0) / width * (y1 - y0) / height;
+		pdf = cells.probability(cell) / area / (2.0 * pi * pi * sinTheta);
+		return true;
+	}
+
+	/// <summary>
+	/// Density per solid angle with which sample() picks a direction
+	/// </summary>
+	double pdf(const vec3& direction) const
+	{
+		double u, v;
+		toImage(direction, u, v);
+		double sinTheta = sin(pi * v);
+		if (sinTheta <= 0.0)
+			return 0.0;
+
+		int cx = std::min(int(u * width), width - 1) / cellSize;
+		int cy = std::min(int(v * height), height - 1) / cellSize;
+		int x0 = cx * cellSize, x1 = std::min(x0 + cellSize, width);
+		int y0 = cy * cellSize, y1 = std::min(y0 + cellSize, height);
+		double area = double(x1 - x0) / width * (y1 - y0) / height;
+		return cells.probability(size_t(cy) * cellsX + cx) / area / (2.0 * pi * pi * sinTheta);
+	}
+
+	/// <summary>
+	/// Memory held by the texels and the sampling table
+	/// </summary>
+	size_t memoryBytes() const
+	{
+		return texels.capacity() * sizeof(uint32_t) + cells.memoryBytes();
+	}
+};
+
+#endif
@@ -0,0 +1,905 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "bvh.h"
+#include "cpu_dispatch.h"
+#include "cuboid.h"
+#include "grid.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+/// <summary>
+/// Asks the CPU to start loading a cache line that will be needed soon
+/// </summary>
+inline void prefetchLine(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(address);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+}
+
+/// <summary>
+/// 2^exponent, built from the bits of a double instead of calling ldexp in the traversal loop
+/// </summary>
+inline double powerOfTwo(int exponent)
+{
+	uint64_t bits = uint64_t(exponent + 1023) << 52;
+	double value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/// <summary>
+/// Order in which the nodes of a FlatBVH are stored. The two children of a node always share one 64-byte cache line;
+/// the layout decides which lines end up next to each other
+/// </summary>
+enum class BVHLayout
+{
+	/// <summary>
+	/// Children after their parent, the left subtree before the right one
+	/// </summary>
+	DepthFirst,
+	/// <summary>
+	/// Level by level
+	/// </summary>
+	BreadthFirst,
+	/// <summary>
+	/// van Emde Boas: the top half of the levels first, then every subtree hanging below it, each laid out the same
+	/// way, so any path from the root crosses few pages and cache lines whatever their size
+	/// </summary>
+	VanEmdeBoas
+};
+
+/// <summary>
+/// Settings of the acceleration structure of a scene
+/// </summary>
+struct BVHSettings
+{
+	/// <summary>
+	/// Primitives this many times larger than the median one are kept out of the BVH, see SceneBVH; 0 keeps all
+	/// bounded primitives in the tree
+	/// </summary>
+	double largeFactor = 16.0;
+	/// <summary>
+	/// Structure the primitives of the tree are traversed with; the BVH_Node tree is built for every kind, as the
+	/// refit of animations works on it
+	/// </summary>
+	AcceleratorType accelerator = AcceleratorType::BVH;
+	/// <summary>
+	/// Cells per primitive of a grid
+	/// </summary>
+	double gridDensity = 4.0;
+	/// <summary>
+	/// If set, the tree is traversed as a FlatBVH instead of following BVH_Node pointers
+	/// </summary>
+	bool flat = true;
+	/// <summary>
+	/// Copy spheres, rectangles and boxes into the leaves of the FlatBVH and test them without virtual calls
+	/// </summary>
+	bool typedLeaves = true;
+	BVHLayout layout = BVHLayout::VanEmdeBoas;
+	/// <summary>
+	/// Store the boxes of the children with 8 bits per coordinate, relative to the box of their parent
+	/// </summary>
+	bool quantized = false;
+	/// <summary>
+	/// Prefetch the cache line of the children while the current node is tested
+	/// </summary>
+	bool prefetch = false;
+};
+
+/// <summary>
+/// Reads a layout name: dfs, bfs or veb
+/// </summary>
+/// <returns>False, if the name is unknown</returns>
+inline bool parseLayout(const std::string& name, BVHLayout& layout)
+{
+	if (name == "dfs")
+		layout = BVHLayout::DepthFirst;
+	else if (name == "bfs")
+		layout = BVHLayout::BreadthFirst;
+	else if (name == "veb")
+		layout = BVHLayout::VanEmdeBoas;
+	else
+		return false;
+	return true;
+}
+
+inline const char* layoutName(BVHLayout layout)
+{
+	switch (layout)
+	{
+	case BVHLayout::DepthFirst: return "dfs";
+	case BVHLayout::BreadthFirst: return "bfs";
+	default: return "veb";
+	}
+}
+
+/// <summary>
+/// A BVH_Node tree copied into one array of 32-byte nodes, two per cache line, with the primitives of the leaves in a
+/// second array. Traversal walks an explicit stack instead of recursing through virtual calls and shared_ptrs. Nodes
+/// come in two formats: float nodes hold their own box, quantized nodes hold the boxes of both children in 8 bits per
+/// coordinate, so one node fetch tests two boxes. Leaves copy the geometry of the primitive types the renderer knows
+/// (spheres, axis-aligned rectangles and the rectangles of boxes) into arrays of their own and test them with the
+/// kernels of cpu_dispatch.h; any other Hittable is called through its virtual hit
+/// </summary>
+class FlatBVH : public Accelerator
+{
+private:
+	/// <summary>
+	/// Node with its own box. count is 0 for interior nodes, whose children are child and child + 1; leaves hold
+	/// count primitives described by leaves[child]
+	/// </summary>
+	struct FloatNode
+	{
+		float lo[3];
+		float hi[3];
+		uint32_t child;
+		uint16_t count;
+		uint16_t axis;
+	};
+
+	/// <summary>
+	/// Node holding the boxes of its two children, each coordinate stored as origin + q * 2^exponent. count and child
+	/// mean the same as in FloatNode; leaves leave the boxes unused
+	/// </summary>
+	struct QuantizedNode
+	{
+		float origin[3];
+		int8_t exponent[3];
+		uint8_t count;
+		uint8_t qlo[2][3];
+		uint8_t qhi[2][3];
+		uint32_t child;
+	};
+
+	struct alignas(64) FloatPair
+	{
+		FloatNode node[2];
+	};
+
+	struct alignas(64) QuantizedPair
+	{
+		QuantizedNode node[2];
+	};
+
+	/// <summary>
+	/// Primitives of a leaf, by type: spheres[firstSphere, firstSphere + sphereCount) and likewise for the rectangles
+	/// and the primitives only known as Hittable
+	/// </summary>
+	struct Leaf
+	{
+		uint32_t firstSphere;
+		uint32_t firstRectangle;
+		uint32_t firstOther;
+		uint8_t sphereCount;
+		uint8_t rectangleCount;
+		uint8_t otherCount;
+	};
+
+	/// <summary>
+	/// Spheres of the typed leaves, one array per coordinate for the sphere kernel. Once built, the arrays of numbers
+	/// hold KERNEL_LANES - 1 unused spheres past the last one, so the kernels may load whole vectors
+	/// </summary>
+	struct SphereArrays
+	{
+		std::vector<double> x, y, z, radius;
+		std::vector<const Hittable*> object;
+
+		void add(const point& center, double r, const Hittable* sphere)
+		{
+			x.push_back(center.x());
+			y.push_back(center.y());
+			z.push_back(center.z());
+			radius.push_back(r);
+			object.push_back(sphere);
+		}
+
+		void pad()
+		{
+			for (auto array : { &x, &y, &z, &radius })
+				array->resize(object.size() + KERNEL_LANES - 1, 0.0);
+		}
+
+		size_t bytes() const
+		{
+			return x.size() * 4 * sizeof(double) + object.size() * sizeof(const Hittable*);
+		}
+	};
+
+	/// <summary>
+	/// Axis-aligned rectangles of the typed leaves, see intersectRectangle, one array per field for the rectangle
+	/// kernel and padded like the spheres; object is the xyPlane, yzPlane or xzPlane each was copied from
+	/// </summary>
+	struct RectangleArrays
+	{
+		std::vector<double> k, lo0, hi0, lo1, hi1;
+		std::vector<int32_t> normal, axis0, axis1;
+		std::vector<const Hittable*> object;
+
+		void add(double plane, double min0, double max0, double min1, double max1, int32_t n, int32_t a0, int32_t a1, const Hittable* rectangle)
+		{
+			k.push_back(plane);
+			lo0.push_back(min0);
+			hi0.push_back(max0);
+			lo1.push_back(min1);
+			hi1.push_back(max1);
+			normal.push_back(n);
+			axis0.push_back(a0);
+			axis1.push_back(a1);
+			object.push_back(rectangle);
+		}
+
+		void pad()
+		{
+			for (auto array : { &k, &lo0, &hi0, &lo1, &hi1 })
+				array->resize(object.size() + KERNEL_LANES - 1, 0.0);
+			for (auto array : { &normal, &axis0, &axis1 })
+				array->resize(object.size() + KERNEL_LANES - 1, 0);
+		}
+
+		RectangleLanes lanes() const
+		{
+			return { k.data(), lo0.data(), hi0.data(), lo1.data(), hi1.data(), normal.data(), axis0.data(), axis1.data() };
+		}
+
+		size_t bytes() const
+		{
+			return k.size() * (5 * sizeof(double) + 3 * sizeof(int32_t)) + object.size() * sizeof(const Hittable*);
+		}
+	};
+
+	/// <summary>
+	/// Node of the tree being flattened
+	/// </summary>
+	struct SourceNode
+	{
+		BoundingBox box;
+		int left = -1;
+		int right = -1;
+		uint32_t firstPrimitive = 0;
+		uint32_t count = 0;
+		int axis = 0;
+	};
+
+	std::vector<FloatPair> floatPairs;
+	std::vector<QuantizedPair> quantizedPairs;
+	std::vector<Leaf> leaves;
+	SphereArrays spheres;
+	RectangleArrays rectangles;
+	std::vector<const Hittable*> primitives;
+	BoundingBox rootBox;
+	BVHLayout layout;
+	bool typedLeaves;
+	bool quantized;
+	bool prefetch;
+	size_t nodeCount = 0;
+
+	/// <summary>
+	/// Copies the rectangle into the leaf if it is one of the three plane classes
+	/// </summary>
+	/// <returns>False, if it is not</returns>
+	bool addRectangle(const Hittable* object, Leaf& leaf)
+	{
+		if (auto xy = dynamic_cast<const xyPlane*>(object))
+			rectangles.add(xy->k, xy->x0, xy->x1, xy->y0, xy->y1, 2, 0, 1, object);
+		else if (auto yz = dynamic_cast<const yzPlane*>(object))
+			rectangles.add(yz->k, yz->y0, yz->y1, yz->z0, yz->z1, 0, 1, 2, object);
+		else if (auto xz = dynamic_cast<const xzPlane*>(object))
+			rectangles.add(xz->k, xz->x0, xz->x1, xz->z0, xz->z1, 1, 0, 2, object);
+		else
+			return false;
+
+		leaf.rectangleCount++;
+		return true;
+	}
+
+	/// <summary>
+	/// Adds a primitive to the leaf being built, to the array of its type
+	/// </summary>
+	void addPrimitive(const Hittable* object, Leaf& leaf)
+	{
+		if (typedLeaves)
+		{
+			if (auto sphere = dynamic_cast<const Sphere*>(object))
+			{
+				spheres.add(sphere->center, sphere->radius, object);
+				leaf.sphereCount++;
+				return;
+			}
+
+			if (addRectangle(object, leaf))
+				return;
+
+			// a box is its six rectangles; they keep their order, so ties between faces resolve as in Cuboid::hit
+			auto box = dynamic_cast<const Cuboid*>(object);
+			if (box != nullptr && std::all_of(box->cuboid.objects.begin(), box->cuboid.objects.end(),
+				[](const shared_ptr<Hittable>& side) { return dynamic_cast<const xyPlane*>(side.get()) || dynamic_cast<const yzPlane*>(side.get())
+					|| dynamic_cast<const xzPlane*>(side.get()); }))
+			{
+				for (const auto& side : box->cuboid.objects)
+					addRectangle(side.get(), leaf);
+				return;
+			}
+		}
+
+		primitives.push_back(object);
+		leaf.otherCount++;
+	}
+
+	/// <summary>
+	/// Copies the tree below node into source, depth first
+	/// </summary>
+	int gather(const BVH_Node* node, std::vector<SourceNode>& source)
+	{
+		int index = int(source.size());
+		source.push_back(SourceNode());
+		source[index].box = node->box;
+
+		if (node->leaf)
+		{
+			Leaf leaf = { uint32_t(spheres.object.size()), uint32_t(rectangles.object.size()), uint32_t(primitives.size()), 0, 0, 0 };
+			addPrimitive(node->left.get(), leaf);
+			if (node->right != node->left)
+				addPrimitive(node->right.get(), leaf);
+
+			source[index].firstPrimitive = uint32_t(leaves.size());
+			source[index].count = node->right != node->left ? 2 : 1;
+			leaves.push_back(leaf);
+			return index;
+		}
+
+		int left = gather(static_cast<const BVH_Node*>(node->left.get()), source);
+		int right = gather(static_cast<const BVH_Node*>(node->right.get()), source);
+		source[index].left = left;
+		source[index].right = right;
+
+		// the axis along which the children lie furthest apart decides which one is visited first
+		const BoundingBox& a = source[left].box;
+		const BoundingBox& b = source[right].box;
+		double best = -1.0;
+		for (int k = 0; k < 3; k++)
+		{
+			double distance = fabs((b.a[k] + b.b[k]) - (a.a[k] + a.b[k]));
+			if (distance > best)
+			{
+				best = distance;
+				source[index].axis = k;
+			}
+		}
+		return index;
+	}
+
+	int height(const std::vector<SourceNode>& source, int node) const
+	{
+		if (source[node].left < 0)
+			return 0;
+		return 1 + std::max(height(source, source[node].left), height(source, source[node].right));
+	}
+
+	/// <summary>
+	/// Lays out the children pairs of the interior nodes less than depth levels below node in van Emde Boas order
+	/// </summary>
+	void vanEmdeBoas(const std::vector<SourceNode>& source, int node, int depth, std::vector<int>& order) const
+	{
+		if (source[node].left < 0 || depth <= 0)
+			return;
+
+		if (depth == 1)
+		{
+			order.push_back(node);
+			return;
+		}
+
+		int top = depth / 2;
+		vanEmdeBoas(source, node, top, order);
+
+		// the subtrees hanging below the top part, left to right
+		std::vector<int> level = { node };
+		for (int d = 0; d < top; d++)
+		{
+			std::vector<int> next;
+			for (int n : level)
+			{
+				if (source[n].left >= 0)
+				{
+					next.push_back(source[n].left);
+					next.push_back(source[n].right);
+				}
+			}
+			level.swap(next);
+		}
+
+		for (int n : level)
+			vanEmdeBoas(source, n, depth - top, order);
+	}
+
+	/// <summary>
+	/// Interior nodes in the order their children pairs are stored
+	/// </summary>
+	std::vector<int> pairOrder(const std::vector<SourceNode>& source, BVHLayout layout) const
+	{
+		std::vector<int> order;
+		if (layout == BVHLayout::BreadthFirst)
+		{
+			if (source[0].left >= 0)
+				order.push_back(0);
+			for (size_t i = 0; i < order.size(); i++)
+				for (int child : { source[order[i]].left, source[order[i]].right })
+					if (source[child].left >= 0)
+						order.push_back(child);
+		}
+		else if (layout == BVHLayout::DepthFirst)
+		{
+			std::vector<int> stack = { 0 };
+			while (!stack.empty())
+			{
+				int node = stack.back();
+				stack.pop_back();
+				if (source[node].left < 0)
+					continue;
+				order.push_back(node);
+				stack.push_back(source[node].right);
+				stack.push_back(source[node].left);
+			}
+		}
+		else
+			vanEmdeBoas(source, 0, height(source, 0), order);
+		return order;
+	}
+
+	/// <summary>
+	/// Stores the box of a child in a quantized node, rounding outwards so the stored box always contains the real one
+	/// </summary>
+	static void quantize(QuantizedNode& node, int side, const BoundingBox& box)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double scale = std::ldexp(1.0, node.exponent[k]);
+			double lo = std::floor((box.a[k] - node.origin[k]) / scale);
+			double hi = std::ceil((box.b[k] - node.origin[k]) / scale);
+
+			// the division may round the wrong way by one step
+			while (lo > 0 && node.origin[k] + lo * scale > box.a[k])
+				lo--;
+			while (hi < 255 && node.origin[k] + hi * scale < box.b[k])
+				hi++;
+
+			node.qlo[side][k] = uint8_t(std::min(std::max(lo, 0.0), 255.0));
+			node.qhi[side][k] = uint8_t(std::min(std::max(hi, 0.0), 255.0));
+		}
+	}
+
+	void buildQuantized(const std::vector<SourceNode>& source, const std::vector<int>& order, const std::vector<uint32_t>& slot)
+	{
+		quantizedPairs.assign(order.size() + 1, QuantizedPair());
+
+		auto fill = [&](int index, QuantizedNode& node)
+		{
+			const SourceNode& from = source[index];
+			if (from.left < 0)
+			{
+				node.count = uint8_t(from.count);
+				node.child = from.firstPrimitive;
+				return;
+			}
+
+			node.count = 0;
+			node.child = 2 * slot[index];
+			for (int k = 0; k < 3; k++)
+			{
+				// origin rounded down, and a power of two step that spans the box in 255 steps
+				float origin = float(from.box.a[k]);
+				if (origin > from.box.a[k])
+					origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+				node.origin[k] = origin;
+
+				double extent = from.box.b[k] - origin;
+				int exponent = extent > 0.0 ? std::max(int(std::ceil(std::log2(extent / 255.0))), -126) : -126;
+				while (exponent < 127 && origin + 255.0 * std::ldexp(1.0, exponent) < from.box.b[k])
+					exponent++;
+				node.exponent[k] = int8_t(exponent);
+			}
+			quantize(node, 0, source[from.left].box);
+			quantize(node, 1, source[from.right].box);
+		};
+
+		fill(0, quantizedPairs[0].node[0]);
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			fill(source[order[i]].left, quantizedPairs[i + 1].node[0]);
+			fill(source[order[i]].right, quantizedPairs[i + 1].node[1]);
+		}
+	}
+
+	void buildFloat(const std::vector<SourceNode>& source, const std::vector<int>& order, const std::vector<uint32_t>& slot)
+	{
+		floatPairs.assign(order.size() + 1, FloatPair());
+
+		auto fill = [&](int index, FloatNode& node)
+		{
+			const SourceNode& from = source[index];
+			for (int k = 0; k < 3; k++)
+			{
+				node.lo[k] = std::nextafter(float(from.box.a[k]), -std::numeric_limits<float>::infinity());
+				node.hi[k] = std::nextafter(float(from.box.b[k]), std::numeric_limits<float>::infinity());
+			}
+			node.axis = uint16_t(from.axis);
+
+			if (from.left < 0)
+			{
+				node.count = uint16_t(from.count);
+				node.child = from.firstPrimitive;
+			}
+			else
+			{
+				node.count = 0;
+				node.child = 2 * slot[index];
+			}
+		};
+
+		fill(0, floatPairs[0].node[0]);
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			fill(source[order[i]].left, floatPairs[i + 1].node[0]);
+			fill(source[order[i]].right, floatPairs[i + 1].node[1]);
+		}
+	}
+
+	/// <summary>
+	/// Slab test, the entry distance is returned through tEntry
+	/// </summary>
+	static bool hitBox(const double lo[3], const double hi[3], const double origin[3], const double inverse[3], double tMin, double tMax, double& tEntry)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double t0 = (lo[k] - origin[k]) * inverse[k];
+			double t1 = (hi[k] - origin[k]) * inverse[k];
+			if (inverse[k] < 0.0)
+				std::swap(t0, t1);
+
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+			if (tMax <= tMin)
+				return false;
+		}
+		tEntry = tMin;
+		return true;
+	}
+
+	/// <summary>
+	/// Tests the primitives of a leaf, type by type, and lowers tMax to the closest hit. The spheres and rectangles go
+	/// through the kernels, which compute every lane against the tMax the leaf started with; the hits are then taken in
+	/// order as the scalar loops took them
+	/// </summary>
+	bool hitLeaf(const Leaf& leaf, const Ray& r, double tMin, double& tMax, hitRecord& rec) const
+	{
+		TraversalCounters& counters = traversalCounters();
+		counters.primitives += leaf.sphereCount + leaf.rectangleCount;
+		bool hitAnything = false;
+
+		if (leaf.sphereCount + leaf.rectangleCount > 0)
+		{
+			const IntersectionKernels& kernels = activeKernels();
+			const double origin[3] = { r.origin.x(), r.origin.y(), r.origin.z() };
+			const double direction[3] = { r.direction.x(), r.direction.y(), r.direction.z() };
+			const double a = r.direction.length_squared();
+
+			for (uint32_t first = leaf.firstSphere, end = first + leaf.sphereCount; first < end; first += KERNEL_LANES)
+			{
+				int count = int(std::min<uint32_t>(end - first, KERNEL_LANES));
+				double halfB[KERNEL_LANES];
+				double discriminant[KERNEL_LANES];
+				kernels.leafSpheres(&spheres.x[first], &spheres.y[first], &spheres.z[first], &spheres.radius[first], count,
+					origin, direction, a, halfB, discriminant);
+
+				// the roots are taken as intersectSphere takes them
+				for (int i = 0; i < count; i++)
+				{
+					if (discriminant[i] < 0)
+						continue;
+
+					double sqrtD = sqrt(discriminant[i]);
+					double root = (-halfB[i] - sqrtD) / a;
+					if (root < tMin || tMax < root)
+					{
+						root = (-halfB[i] + sqrtD) / a;
+						if (root < tMin || tMax < root)
+							continue;
+					}
+
+					hitAnything = true;
+					tMax = root;
+					rec.t = root;
+					rec.object = spheres.object[first + i];
+					rec.primitive = 0;
+				}
+			}
+
+			const RectangleLanes lanes = rectangles.lanes();
+			for (uint32_t first = leaf.firstRectangle, end = first + leaf.rectangleCount; first < end; first += KERNEL_LANES)
+			{
+				int count = int(std::min<uint32_t>(end - first, KERNEL_LANES));
+				double t[KERNEL_LANES];
+				double u[KERNEL_LANES];
+				double v[KERNEL_LANES];
+				unsigned mask = kernels.leafRectangles(lanes, first, count, origin, direction, tMin, tMax, t, u, v);
+
+				for (int i = 0; i < count; i++)
+				{
+					// a hit only counts if no earlier rectangle of the leaf lowered tMax below it
+					if ((mask & (1u << i)) == 0 || t[i] > tMax)
+						continue;
+
+					hitAnything = true;
+					tMax = t[i];
+					rec.t = t[i];
+					rec.object = rectangles.object[first + i];
+					rec.primitive = 0;
+					rec.u = u[i];
+					rec.v = v[i];
+				}
+			}
+		}
+
+		for (uint32_t i = leaf.firstOther; i < leaf.firstOther + leaf.otherCount; i++)
+		{
+			if (primitives[i]->hit(r, tMin, tMax, rec))
+			{
+				hitAnything = true;
+				tMax = rec.t;
+			}
+		}
+
+		return hitAnything;
+	}
+
+	bool hitFloat(const Ray& r, double tMin, double tMax, hitRecord& rec) const;
+	bool hitQuantized(const Ray& r, double tMin, double tMax, hitRecord& rec) const;
+
+public:
+	/// <summary>
+	/// Parameterized constructor; the tree is empty until built
+	/// </summary>
+	/// <param name="layout">Order of the nodes in memory</param>
+	/// <param name="quantized">Store child boxes in 8 bits per coordinate</param>
+	/// <param name="prefetch">Prefetch the children of a node while it is tested</param>
+	/// <param name="typedLeaves">Test spheres and rectangles without virtual calls</param>
+	FlatBVH(BVHLayout layout, bool quantized, bool prefetch, bool typedLeaves)
+	{
+		this->layout = layout;
+		this->quantized = quantized;
+		this->prefetch = prefetch;
+		this->typedLeaves = typedLeaves;
+	}
+
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="tree">Tree to copy</param>
+	/// <param name="layout">Order of the nodes in memory</param>
+	/// <param name="quantized">Store child boxes in 8 bits per coordinate</param>
+	/// <param name="prefetch">Prefetch the children of a node while it is tested</param>
+	/// <param name="typedLeaves">Test spheres and rectangles without virtual calls</param>
+	FlatBVH(const BVH_Node& tree, BVHLayout layout, bool quantized, bool prefetch, bool typedLeaves)
+	{
+		this->layout = layout;
+		this->quantized = quantized;
+		this->prefetch = prefetch;
+		this->typedLeaves = typedLeaves;
+		rootBox = tree.box;
+
+		std::vector<SourceNode> source;
+		gather(&tree, source);
+		nodeCount = source.size();
+
+		std::vector<int> order = pairOrder(source, layout);
+		std::vector<uint32_t> slot(source.size(), 0);
+		for (size_t i = 0; i < order.size(); i++)
+			slot[order[i]] = uint32_t(i + 1);
+
+		if (quantized)
+			buildQuantized(source, order, slot);
+		else
+			buildFloat(source, order, slot);
+
+		spheres.pad();
+		rectangles.pad();
+	}
+
+	/// <summary>
+	/// Number of nodes, the unused second slot of the root's cache line not counted
+	/// </summary>
+	size_t size() const
+	{
+		return nodeCount;
+	}
+
+	/// <summary>
+	/// Builds a BVH_Node tree over the objects and copies it, with the layout and node format of this one
+	/// </summary>
+	virtual void build(const std::vector<shared_ptr<Hittable>>& objects) override
+	{
+		BVH_Node tree;
+		tree.build(objects);
+		*this = FlatBVH(tree, layout, quantized, prefetch, typedLeaves);
+	}
+
+	/// <summary>
+	/// Bytes taken by the nodes and the leaves
+	/// </summary>
+	virtual size_t memoryBytes() const override
+	{
+		return floatPairs.size() * sizeof(FloatPair) + quantizedPairs.size() * sizeof(QuantizedPair) + leaves.size() * sizeof(Leaf)
+			+ spheres.bytes() + rectangles.bytes() + primitives.size() * sizeof(const Hittable*);
+	}
+
+	virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override
+	{
+		return quantized ? hitQuantized(r, tMin, tMax, rec) : hitFloat(r, tMin, tMax, rec);
+	}
+
+	virtual bool boundingBox(BoundingBox& output) const override
+	{
+		output = rootBox;
+		return true;
+	}
+
+	virtual const char* name() const override
+	{
+		return "flat bvh";
+	}
+};
+
+inline bool FlatBVH::hitFloat(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+{
+	const double origin[3] = { r.origin.x(), r.origin.y(), r.origin.z() };
+	const double inverse[3] = { 1.0 / r.direction.x(), 1.0 / r.direction.y(), 1.0 / r.direction.z() };
+	const FloatNode* nodes = &floatPairs[0].node[0];
+	TraversalCounters& counters = traversalCounters();
+	const FloatBoxKernel floatBox = activeKernels().floatBox;
+
+	bool hitAnything = false;
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const FloatNode& node = nodes[stack[--top]];
+		counters.nodes++;
+
+		double tEntry;
+		if (!floatBox(node.lo, node.hi, origin, inverse, tMin, tMax, tEntry))
+			continue;
+
+		if (node.count > 0)
+		{
+			if (hitLeaf(leaves[node.child], r, tMin, tMax, rec))
+				hitAnything = true;
+			continue;
+		}
+
+		if (prefetch)
+			prefetchLine(nodes + node.child);
+
+		// the child on the side the ray comes from is popped first
+		bool rightFirst = r.direction[node.axis] < 0.0;
+		stack[top++] = node.child + (rightFirst ? 0 : 1);
+		stack[top++] = node.child + (rightFirst ? 1 : 0);
+	}
+
+	return hitAnything;
+}
+
+inline bool FlatBVH::hitQuantized(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+{
+	const double origin[3] = { r.origin.x(), r.origin.y(), r.origin.z() };
+	const double inverse[3] = { 1.0 / r.direction.x(), 1.0 / r.direction.y(), 1.0 / r.direction.z() };
+	const QuantizedNode* nodes = &quantizedPairs[0].node[0];
+	TraversalCounters& counters = traversalCounters();
+	const ChildBoxesKernel childBoxes = activeKernels().childBoxes;
+
+	double lo[3] = { rootBox.a[0], rootBox.a[1], rootBox.a[2] };
+	double hi[3] = { rootBox.b[0], rootBox.b[1], rootBox.b[2] };
+	double tEntry;
+	counters.nodes++;
+	if (!hitBox(lo, hi, origin, inverse, tMin, tMax, tEntry))
+		return false;
+
+	bool hitAnything = false;
+	uint32_t stack[64];
+	double entries[64];
+	int top = 0;
+	stack[top] = 0;
+	entries[top++] = tEntry;
+
+	while (top > 0)
+	{
+		top--;
+		if (entries[top] >= tMax)
+			continue;
+
+		const QuantizedNode& node = nodes[stack[top]];
+
+		if (node.count > 0)
+		{
+			if (hitLeaf(leaves[node.child], r, tMin, tMax, rec))
+				hitAnything = true;
+			continue;
+		}
+
+		if (prefetch)
+			prefetchLine(nodes + node.child);
+
+		// both child boxes come with this node and are tested in one kernel call
+		double scale[3];
+		for (int k = 0; k < 3; k++)
+			scale[k] = powerOfTwo(node.exponent[k]);
+
+		counters.nodes += 2;
+		double childEntry[2];
+		unsigned mask = childBoxes(node.origin, scale, node.qlo, node.qhi, origin, inverse, tMin, tMax, childEntry);
+		bool hitChild[2] = { (mask & 1) != 0, (mask & 2) != 0 };
+
+		// the nearer child is pushed last, so it is popped first
+		int first = hitChild[0] && hitChild[1] && childEntry[1] < childEntry[0] ? 1 : 0;
+		for (int side : { 1 - first, first })
+		{
+			if (hitChild[side])
+			{
+				stack[top] = node.child + side;
+				entries[top++] = childEntry[side];
+			}
+		}
+	}
+
+	return hitAnything;
+}
+
+/// <summary>
+/// Replaces the pointer-based traversal of a scene's tree by a FlatBVH built with the given settings, or goes back to
+/// the pointer-based one if the settings ask for no flat tree. Called again after the tree was refitted or rebuilt
+/// </summary>
+inline void flattenScene(SceneBVH& root, const BVHSettings& settings)
+{
+	if (settings.flat && root.tree)
+		root.accelerator = create<FlatBVH>(*root.tree, settings.layout, settings.quantized, settings.prefetch, settings.typedLeaves);
+	else
+		root.accelerator = nullptr;
+}
+
+/// <summary>
+/// Sets up the structure a scene's tree is traversed with: a FlatBVH or the tree itself as flattenScene decides, or a
+/// grid over the primitives of the tree. Called again after the tree was refitted or rebuilt
+/// </summary>
+inline void buildAccelerator(SceneBVH& root, const BVHSettings& settings)
+{
+	if (settings.accelerator == AcceleratorType::BVH || !root.tree)
+	{
+		flattenScene(root, settings);
+		return;
+	}
+
+	std::vector<shared_ptr<Hittable>> primitives;
+	root.tree->collect(primitives);
+	auto grid = create<UniformGrid>(settings.accelerator == AcceleratorType::HierarchicalGrid, settings.gridDensity);
+	grid->build(primitives);
+	root.accelerator = grid;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "const_utility.h"
+#include "hittable.h"
+
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// What traversal found for one camera ray: the same fields BVH traversal fills in a hitRecord. The material is not
+/// stored; it is looked up from the object when the hit is shaded, so edits to materials show up
+/// </summary>
+struct PrimaryHit
+{
+	/// <summary>
+	/// Primitive hit, null if the ray left the scene
+	/// </summary>
+	const Hittable* object;
+	uint32_t primitive;
+	double t;
+	double u, v;
+};
+
+/// <summary>
+/// Primary hits of every sample of every pixel of a frame. The first render that uses it records the hits; once
+/// ready, later renders with the same camera, geometry, resolution, sample count and seed take the hits from here
+/// instead of tracing camera rays, which pays off when only materials change between renders
+/// </summary>
+class GBuffer
+{
+public:
+	int width = 0;
+	int height = 0;
+	int samples = 0;
+	/// <summary>
+	/// Set once a render has filled every hit; until then renders record into the buffer
+	/// </summary>
+	bool ready = false;
+	std::vector<PrimaryHit> hits;
+
+	GBuffer()
+	{}
+
+	GBuffer(int width, int height, int samples)
+	{
+		this->width = width;
+		this->height = height;
+		this->samples = samples;
+		hits.assign(size_t(width) * height * samples, PrimaryHit{ nullptr, 0, 0.0, 0.0, 0.0 });
+	}
+
+	/// <summary>
+	/// Hits of the samples of one pixel, in the order they are taken
+	/// </summary>
+	PrimaryHit* at(int x, int y)
+	{
+		return &hits[(size_t(y) * width + x) * samples];
+	}
+
+	/// <summary>
+	/// Whether the buffer was made for a frame of this size and sample count
+	/// </summary>
+	bool matches(int imgWidth, int imgHeight, int samplesPerPixel) const
+	{
+		return width == imgWidth && height == imgHeight && samples == samplesPerPixel;
+	}
+
+	size_t memoryBytes() const
+	{
+		return hits.size() * sizeof(PrimaryHit);
+	}
+};
+
+#endif
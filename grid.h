@@ -0,0 +1,331 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "const_utility.h"
+#include "accelerator.h"
+#include "hittable.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// Most cells a grid may have along one axis
+/// </summary>
+const int GRID_MAX_RESOLUTION = 256;
+
+/// <summary>
+/// Cells of a hierarchical grid holding more primitives than this get a grid of their own
+/// </summary>
+const int GRID_SPLIT_COUNT = 8;
+
+/// <summary>
+/// Levels of grids below the top one in a hierarchical grid
+/// </summary>
+const int GRID_MAX_DEPTH = 2;
+
+/// <summary>
+/// Regular grid of cells over the bounds of the primitives, each cell listing the primitives whose boxes overlap it.
+/// A ray walks the cells it crosses in order (3D-DDA) and stops at the first cell that holds the closest hit found so
+/// far, so for scenes of evenly spread, similarly sized primitives it visits few cells and no hierarchy.
+/// Primitives spanning several cells are listed, and may be tested, once per cell.
+/// As a hierarchical grid the top level is coarse and every cell holding more than GRID_SPLIT_COUNT primitives
+/// gets a finer grid over the cell, which adapts the resolution to scenes whose primitives are bunched together
+/// </summary>
+class UniformGrid : public Accelerator
+{
+private:
+	bool hierarchical;
+	/// <summary>
+	/// Cells per primitive
+	/// </summary>
+	double density;
+	int depth;
+
+	BoundingBox bounds;
+	int resolution[3] = { 0, 0, 0 };
+	double cellSize[3] = { 0.0, 0.0, 0.0 };
+	double inverseCellSize[3] = { 0.0, 0.0, 0.0 };
+	/// <summary>
+	/// Primitives of cell c are primitives[items[cellStart[c]]] to primitives[items[cellStart[c + 1] - 1]]
+	/// </summary>
+	std::vector<uint32_t> cellStart;
+	std::vector<uint32_t> items;
+	std::vector<const Hittable*> primitives;
+	/// <summary>
+	/// For a hierarchical grid, the index in children of the grid of each cell, -1 if the cell has none
+	/// </summary>
+	std::vector<int32_t> cellChild;
+	std::vector<shared_ptr<UniformGrid>> children;
+
+	UniformGrid(bool hierarchical, double density, int depth)
+	{
+		this->hierarchical = hierarchical;
+		this->density = density;
+		this->depth = depth;
+	}
+
+	/// <summary>
+	/// Cell range along one axis covered by [lo, hi]
+	/// </summary>
+	void cellRange(int axis, double lo, double hi, int& first, int& last) const
+	{
+		first = clampCell(axis, int(std::floor((lo - bounds.a[axis]) * inverseCellSize[axis])));
+		last = clampCell(axis, int(std::floor((hi - bounds.a[axis]) * inverseCellSize[axis])));
+	}
+
+	int clampCell(int axis, int cell) const
+	{
+		return std::min(std::max(cell, 0), resolution[axis] - 1);
+	}
+
+	size_t cellIndex(int x, int y, int z) const
+	{
+		return (size_t(z) * resolution[1] + y) * resolution[0] + x;
+	}
+
+	/// <summary>
+	/// Builds the grid over the primitives inside the given bounds
+	/// </summary>
+	/// <param name="objects">Primitives overlapping the bounds</param>
+	/// <param name="boxes">Their bounding boxes</param>
+	/// <param name="region">Bounds of the grid</param>
+	/// <param name="cellsPerPrimitive">Number of cells to aim for, per primitive</param>
+	void buildIn(const std::vector<const Hittable*>& objects, const std::vector<BoundingBox>& boxes, const BoundingBox& region,
+		double cellsPerPrimitive)
+	{
+		bounds = region;
+		primitives = objects;
+
+		// cubic cells, as many as asked for; flat sides get the size of a cell rather than a volume of zero
+		vec3 extent = bounds.b - bounds.a;
+		double largest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+		double thinnest = std::max(largest * 1e-3, 1e-9);
+		double volume = std::max(extent.x(), thinnest) * std::max(extent.y(), thinnest) * std::max(extent.z(), thinnest);
+		double cellsPerUnit = std::cbrt(cellsPerPrimitive * objects.size() / volume);
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			resolution[axis] = int(clamp(std::round(extent[axis] * cellsPerUnit), 1.0, double(GRID_MAX_RESOLUTION)));
+			cellSize[axis] = std::max(extent[axis], thinnest) / resolution[axis];
+			inverseCellSize[axis] = 1.0 / cellSize[axis];
+		}
+
+		size_t cells = size_t(resolution[0]) * resolution[1] * resolution[2];
+		std::vector<int> first(objects.size() * 3), last(objects.size() * 3);
+
+		// two passes: count the primitives of every cell, then fill them in behind the prefix sums
+		cellStart.assign(cells + 1, 0);
+		for (size_t i = 0; i < objects.size(); i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+				cellRange(axis, boxes[i].a[axis], boxes[i].b[axis], first[i * 3 + axis], last[i * 3 + axis]);
+			for (int z = first[i * 3 + 2]; z <= last[i * 3 + 2]; z++)
+				for (int y = first[i * 3 + 1]; y <= last[i * 3 + 1]; y++)
+					for (int x = first[i * 3]; x <= last[i * 3]; x++)
+						cellStart[cellIndex(x, y, z) + 1]++;
+		}
+		for (size_t c = 0; c < cells; c++)
+			cellStart[c + 1] += cellStart[c];
+
+		items.assign(cellStart[cells], 0);
+		std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+		for (size_t i = 0; i < objects.size(); i++)
+			for (int z = first[i * 3 + 2]; z <= last[i * 3 + 2]; z++)
+				for (int y = first[i * 3 + 1]; y <= last[i * 3 + 1]; y++)
+					for (int x = first[i * 3]; x <= last[i * 3]; x++)
+						items[fill[cellIndex(x, y, z)]++] = uint32_t(i);
+
+		cellChild.clear();
+		children.clear();
+		if (!hierarchical || depth >= GRID_MAX_DEPTH)
+			return;
+
+		cellChild.assign(cells, -1);
+		for (int z = 0; z < resolution[2]; z++)
+		{
+			for (int y = 0; y < resolution[1]; y++)
+			{
+				for (int x = 0; x < resolution[0]; x++)
+				{
+					size_t c = cellIndex(x, y, z);
+					if (cellStart[c + 1] - cellStart[c] <= uint32_t(GRID_SPLIT_COUNT))
+						continue;
+
+					BoundingBox cell(bounds.a + vec3(x * cellSize[0], y * cellSize[1], z * cellSize[2]),
+						bounds.a + vec3((x + 1) * cellSize[0], (y + 1) * cellSize[1], (z + 1) * cellSize[2]));
+					std::vector<const Hittable*> cellObjects;
+					std::vector<BoundingBox> cellBoxes;
+					for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; k++)
+					{
+						cellObjects.push_back(objects[items[k]]);
+						cellBoxes.push_back(boxes[items[k]]);
+					}
+
+					shared_ptr<UniformGrid> child(new UniformGrid(true, density, depth + 1));
+					child->buildIn(cellObjects, cellBoxes, cell, density);
+					cellChild[c] = int32_t(children.size());
+					children.push_back(child);
+				}
+			}
+		}
+	}
+
+public:
+	/// <summary>
+	/// Parameterized constructor; the grid is empty until built
+	/// </summary>
+	/// <param name="hierarchical">Give crowded cells a finer grid of their own</param>
+	/// <param name="density">Cells per primitive; a hierarchical grid uses an eighth of it for its top level</param>
+	UniformGrid(bool hierarchical = false, double density = 4.0)
+		: UniformGrid(hierarchical, density, 0)
+	{}
+
+	virtual void build(const std::vector<shared_ptr<Hittable>>& objects) override
+	{
+		std::vector<const Hittable*> pointers;
+		std::vector<BoundingBox> boxes;
+		BoundingBox box, all;
+
+		for (const auto& object : objects)
+		{
+			if (!object->boundingBox(box))
+				continue;
+			all = boxes.empty() ? box : combinedBox(all, box);
+			pointers.push_back(object.get());
+			boxes.push_back(box);
+		}
+
+		buildIn(pointers, boxes, all, hierarchical ? density / 8.0 : density);
+	}
+
+	virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override
+	{
+		if (primitives.empty())
+			return false;
+
+		// clip the ray to the grid
+		double origin[3] = { r.origin.x(), r.origin.y(), r.origin.z() };
+		double direction[3] = { r.direction.x(), r.direction.y(), r.direction.z() };
+		double tEnter = tMin, tExit = tMax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double inverse = 1.0 / direction[axis];
+			double t0 = (bounds.a[axis] - origin[axis]) * inverse;
+			double t1 = (bounds.b[axis] - origin[axis]) * inverse;
+			if (inverse < 0.0)
+				std::swap(t0, t1);
+			tEnter = t0 > tEnter ? t0 : tEnter;
+			tExit = t1 < tExit ? t1 : tExit;
+			if (tExit < tEnter)
+				return false;
+		}
+
+		// set up the walk from the cell the ray enters
+		int cell[3], step[3], stop[3];
+		double tNext[3], tDelta[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double entry = origin[axis] + tEnter * direction[axis];
+			cell[axis] = clampCell(axis, int(std::floor((entry - bounds.a[axis]) * inverseCellSize[axis])));
+			if (direction[axis] > 0.0)
+			{
+				step[axis] = 1;
+				stop[axis] = resolution[axis];
+				tNext[axis] = (bounds.a[axis] + (cell[axis] + 1) * cellSize[axis] - origin[axis]) / direction[axis];
+				tDelta[axis] = cellSize[axis] / direction[axis];
+			}
+			else if (direction[axis] < 0.0)
+			{
+				step[axis] = -1;
+				stop[axis] = -1;
+				tNext[axis] = (bounds.a[axis] + cell[axis] * cellSize[axis] - origin[axis]) / direction[axis];
+				tDelta[axis] = -cellSize[axis] / direction[axis];
+			}
+			else
+			{
+				step[axis] = 0;
+				stop[axis] = -1;
+				tNext[axis] = infinity;
+				tDelta[axis] = infinity;
+			}
+		}
+
+		TraversalCounters& counters = traversalCounters();
+		bool hitAnything = false;
+
+		while (true)
+		{
+			counters.nodes++;
+			size_t c = cellIndex(cell[0], cell[1], cell[2]);
+			int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			double cellExit = std::min(tNext[axis], tExit);
+
+			if (!cellChild.empty() && cellChild[c] >= 0)
+			{
+				if (children[cellChild[c]]->hit(r, tMin, tMax, rec))
+				{
+					hitAnything = true;
+					tMax = rec.t;
+				}
+			}
+			else
+			{
+				for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; k++)
+				{
+					if (primitives[items[k]]->hit(r, tMin, tMax, rec))
+					{
+						hitAnything = true;
+						tMax = rec.t;
+					}
+				}
+			}
+
+			// a hit inside this cell is closer than anything in the cells beyond it; one further on may not be
+			if (hitAnything && tMax <= cellExit)
+				return true;
+			if (tNext[axis] > std::min(tMax, tExit))
+				return hitAnything;
+
+			cell[axis] += step[axis];
+			if (cell[axis] == stop[axis])
+				return hitAnything;
+			tNext[axis] += tDelta[axis];
+		}
+	}
+
+	virtual bool boundingBox(BoundingBox& output) const override
+	{
+		output = bounds;
+		return !primitives.empty();
+	}
+
+	virtual size_t memoryBytes() const override
+	{
+		size_t bytes = cellStart.size() * sizeof(uint32_t) + items.size() * sizeof(uint32_t) + primitives.size() * sizeof(const Hittable*)
+			+ cellChild.size() * sizeof(int32_t) + children.size() * sizeof(shared_ptr<UniformGrid>);
+		for (const auto& child : children)
+			bytes += sizeof(UniformGrid) + child->memoryBytes();
+		return bytes;
+	}
+
+	virtual const char* name() const override
+	{
+		return hierarchical ? "hgrid" : "grid";
+	}
+
+	/// <summary>
+	/// Number of cells, those of the finer grids included
+	/// </summary>
+	size_t cellCount() const
+	{
+		size_t cells = cellStart.empty() ? 0 : cellStart.size() - 1;
+		for (const auto& child : children)
+			cells += child->cellCount();
+		return cells;
+	}
+};
+
+#endif
@@ -4,19 +4,46 @@
 #include "ray.h"
 #include "const_utility.h"
 #include "bounding_box.h"
+#include "stats.h"
 
 class Material;
+class Hittable;
 
 /// <summary>
-/// Stores the data about the intersection of the ray and object
+/// Stores the data about the intersection of the ray and object. Traversal only fills t, object, primitive, u and v;
+/// the rest is filled once for the closest hit by Hittable::surfaceInteraction
 /// </summary>
 struct hitRecord
 {
+    double t;
+    /// <summary>
+    /// Primitive that was hit
+    /// </summary>
+    const Hittable* object;
+    /// <summary>
+    /// Index of the primitive within object, for objects holding many primitives
+    /// </summary>
+    uint32_t primitive;
+    /// <summary>
+    /// Surface coordinates of the hit, in whatever form the object finds cheapest during traversal
+    /// </summary>
+    double u, v;
+    /// <summary>
+    /// Width of the ray cone at the hit, see Ray::widthAt, set by the renderer
+    /// </summary>
+    double footprint = 0.0;
+    /// <summary>
+    /// Surface coordinates per unit of length at the hit, for converting the footprint; set with u and v
+    /// </summary>
+    double uvScale = 0.0;
+
     point p;
     vec3 normal;
-    double t;
     bool frontFace;
-    shared_ptr<Material> mat_ptr;
+    /// <summary>
+    /// Material of the object hit. The object keeps the material alive, so copying a record costs no reference counting
+    /// </summary>
+    Material* mat_ptr;
 
     inline void setFaceNormal(const Ray& r, const vec3& outwardNormal) 
     {
@@ -46,6 +73,70 @@ public:
     /// <param name="output">Reference to the bounding box variable</param>
     /// <returns>The bounding box of the object</returns>
     virtual bool boundingBox(BoundingBox& output) const = 0;
+    /// <summary>
+    /// Fills the point, normal and material of a hit on this object, once traversal has found the closest hit.
+    /// Objects that only group other objects never appear in a record and keep this empty
+    /// </summary>
+    /// <param name="r">Reference to the ray object</param>
+    /// <param name="rec">Record filled by hit, receives the shading data</param>
+    virtual void surfaceInteraction(const Ray& /*r*/, hitRecord& /*rec*/) const
+    {}
+    /// <summary>
+    /// Material of the surface, null for objects that only group other objects
+    /// </summary>
+    virtual Material* material() const
+    {
+        return nullptr;
+    }
+    /// <summary>
+    /// Surface area, 0 for objects that cannot be sampled as lights
+    /// </summary>
+    virtual double area() const
+    {
+        return 0.0;
+    }
+    /// <summary>
+    /// Picks a point on the surface that is visible from a given point, for sampling the object as a light
+    /// </summary>
+    /// <param name="from">Point being lit</param>
+    /// <param name="u1">Uniform random number in [0, 1)</param>
+    /// <param name="u2">Uniform random number in [0, 1)</param>
+    /// <param name="sample">Receives the point on the surface</param>
+    /// <param name="pdf">Receives the probability density of the direction towards the point, per solid angle</param>
+    /// <returns>False, if the object cannot be sampled from there</returns>
+    virtual bool sampleSurface(const point& /*from*/, double /*u1*/, double /*u2*/, point& /*sample*/, double& /*pdf*/) const
+    {
+        return false;
+    }
+    /// <summary>
+    /// Picks a point uniformly over the whole surface, for sending light out from the object
+    /// </summary>
+    /// <param name="u1">Uniform random number in [0, 1)</param>
+    /// <param name="u2">Uniform random number in [0, 1)</param>
+    /// <param name="sample">Receives the point on the surface</param>
+    /// <param name="normal">Receives the unit normal at the point, outwards for closed surfaces</param>
+    /// <returns>False, if the object cannot be sampled</returns>
+    virtual bool samplePoint(double /*u1*/, double /*u2*/, point& /*sample*/, vec3& /*normal*/) const
+    {
+        return false;
+    }
+    /// <summary>
+    /// Probability density, per solid angle, with which sampleSurface picks the direction from one point to a point
+    /// on the surface
+    /// </summary>
+    virtual double surfacePdf(const point& /*from*/, const point& /*onSurface*/) const
+    {
+        return 0.0;
+    }
+    /// <summary>
+    /// Moves the object. The BVH above it has to be refitted afterwards
+    /// </summary>
+    /// <param name="offset">Distance to move the object by</param>
+    /// <returns>False, if the object cannot be moved</returns>
+    virtual bool translate(const vec3& /*offset*/)
+    {
+        return false;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -36,28 +36,28 @@ public:
 
     virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override;
     virtual bool boundingBox(BoundingBox& output) const override;
+    virtual bool translate(const vec3& offset) override;
 };
 
-bool HittableList::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+inline bool HittableList::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
 {
-    hitRecord temp;
+    // objects only write the record when they hit closer than closest, so no temporary record is needed
     bool hitAnything = false;
     auto closest = tMax;
 
     for (const auto& object : objects) 
     {
-        if (object->hit(r, tMin, closest, temp)) 
+        if (object->hit(r, tMin, closest, rec)) 
         {
             hitAnything = true;
-            closest = temp.t;
-            rec = temp;
+            closest = rec.t;
         }
     }
 
     return hitAnything;
 }
 
-bool HittableList::boundingBox(BoundingBox& output) const
+inline bool HittableList::boundingBox(BoundingBox& output) const
 {
     if (objects.empty())
         return false;
@@ -75,4 +75,13 @@ bool HittableList::boundingBox(BoundingBox& output) const
 
     return true;
 }
+inline bool HittableList::translate(const vec3& offset)
+{
+    bool moved = true;
+
+    for (const auto& object : objects)
+        moved = object->translate(offset) && moved;
+
+    return moved;
+}
 #endif
\ No newline at end of file
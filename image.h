@@ -0,0 +1,327 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "const_utility.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Rectangle of pixels [x0, x1) x [y0, y1) of the image, with y counted from the top row
+/// </summary>
+struct Tile
+{
+	int x0, y0, x1, y1;
+
+	int width() const
+	{
+		return x1 - x0;
+	}
+
+	int height() const
+	{
+		return y1 - y0;
+	}
+};
+
+/// <summary>
+/// Cuts the image into tiles of (at most) size x size pixels, in row-major order
+/// </summary>
+/// <param name="imgWidth">Width of the image</param>
+/// <param name="imgHeight">Height of the image</param>
+/// <param name="size">Width and height of a tile</param>
+/// <returns>List of tiles covering the image</returns>
+inline std::vector<Tile> makeTiles(int imgWidth, int imgHeight, int size)
+{
+	std::vector<Tile> tiles;
+
+	for (int y = 0; y < imgHeight; y += size)
+		for (int x = 0; x < imgWidth; x += size)
+			tiles.push_back({ x, y, std::min(x + size, imgWidth), std::min(y + size, imgHeight) });
+
+	return tiles;
+}
+
+/// <summary>
+/// Colour of a value on the false-colour scale of heatmaps: black, blue, red, yellow and white at 0, 0.25, 0.5, 0.75
+/// and 1
+/// </summary>
+/// <param name="t">Value in [0, 1]; values outside are clamped</param>
+/// <param name="rgb">Receives the colour, 0 to 255 per channel</param>
+inline void falseColour(double t, int rgb[3])
+{
+	static const double stops[5][3] = { { 0, 0, 0 }, { 0, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } };
+
+	t = clamp(t, 0.0, 1.0) * 4.0;
+	int i = std::min(int(t), 3);
+	double f = t - i;
+	for (int c = 0; c < 3; c++)
+		rgb[c] = int(255.0 * ((1.0 - f) * stops[i][c] + f * stops[i + 1][c]) + 0.5);
+}
+
+/// <summary>
+/// Linear (not gamma corrected) floating point RGB image, stored row by row from the top row
+/// </summary>
+class FloatImage
+{
+public:
+	int width = 0;
+	int height = 0;
+	/// <summary>
+	/// Three floats per pixel
+	/// </summary>
+	std::vector<float> pixels;
+
+	FloatImage()
+	{}
+
+	FloatImage(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		pixels.assign(size_t(width) * height * 3, 0.0f);
+	}
+
+	float* at(int x, int y)
+	{
+		return &pixels[(size_t(y) * width + x) * 3];
+	}
+
+	const float* at(int x, int y) const
+	{
+		return &pixels[(size_t(y) * width + x) * 3];
+	}
+
+	/// <summary>
+	/// Copies the pixels of a tile into the image
+	/// </summary>
+	/// <param name="tile">Position of the tile in the image</param>
+	/// <param name="data">Three floats per pixel of the tile, row by row</param>
+	void setTile(const Tile& tile, const float* data)
+	{
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			std::copy(data, data + size_t(tile.width()) * 3, at(tile.x0, y));
+			data += size_t(tile.width()) * 3;
+		}
+	}
+
+	/// <summary>
+	/// Writes the image as an ASCII PPM, gamma corrected the same way the renderer always has
+	/// </summary>
+	/// <param name="filename">Name of the file, including the extension</param>
+	/// <returns>True, if the file was written</returns>
+	bool writePPM(const std::string& filename) const
+	{
+		std::ofstream file(filename);
+		if (!file)
+			return false;
+
+		file << "P3\n" << width << ' ' << height << "\n255\n";
+
+		for (size_t i = 0; i < pixels.size(); i += 3)
+		{
+			file << static_cast<int>(256 * clamp(sqrt(pixels[i]), 0.0, 0.999)) << ' '
+				<< static_cast<int>(256 * clamp(sqrt(pixels[i + 1]), 0.0, 0.999)) << ' '
+				<< static_cast<int>(256 * clamp(sqrt(pixels[i + 2]), 0.0, 0.999)) << '\n';
+		}
+		return bool(file);
+	}
+
+	/// <summary>
+	/// Reads an ASCII (P3) or binary (P6) PPM with at most 8 bits per channel, undoing the gamma writePPM applies
+	/// </summary>
+	/// <param name="filename">Name of the file, including the extension</param>
+	/// <returns>False, if the file could not be read</returns>
+	bool readPPM(const std::string& filename)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		std::string type;
+		int maxValue;
+		file >> type >> width >> height >> maxValue;
+		file.get();
+		if (!file || (type != "P3" && type != "P6") || width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255)
+			return false;
+
+		pixels.assign(size_t(width) * height * 3, 0.0f);
+		for (float& value : pixels)
+		{
+			int level = 0;
+			if (type == "P3")
+				file >> level;
+			else
+				level = file.get();
+			if (!file)
+				return false;
+
+			float encoded = float(level) / maxValue;
+			value = encoded * encoded;
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Writes one channel as an ASCII PPM in false colour, white at the given value
+	/// </summary>
+	/// <param name="filename">Name of the file, including the extension</param>
+	/// <param name="channel">0, 1 or 2</param>
+	/// <param name="white">Value shown as white; values above it are clipped</param>
+	/// <returns>True, if the file was written</returns>
+	bool writeFalseColour(const std::string& filename, int channel, float white) const
+	{
+		std::ofstream file(filename);
+		if (!file)
+			return false;
+
+		file << "P3\n" << width << ' ' << height << "\n255\n";
+
+		for (size_t i = channel; i < pixels.size(); i += 3)
+		{
+			int rgb[3];
+			falseColour(white > 0.0f ? pixels[i] / white : 0.0, rgb);
+			file << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << '\n';
+		}
+		return bool(file);
+	}
+
+	/// <summary>
+	/// Value of a channel that the given share of the pixels do not exceed
+	/// </summary>
+	/// <param name="channel">0, 1 or 2</param>
+	/// <param name="share">Between 0 and 1</param>
+	float percentile(int channel, double share) const
+	{
+		std::vector<float> values;
+		values.reserve(pixels.size() / 3);
+		for (size_t i = channel; i < pixels.size(); i += 3)
+			values.push_back(pixels[i]);
+		if (values.empty())
+			return 0.0f;
+
+		size_t k = std::min(size_t(share * values.size()), values.size() - 1);
+		std::nth_element(values.begin(), values.begin() + k, values.end());
+		return values[k];
+	}
+
+	/// <summary>
+	/// Reads a little-endian colour PFM such as writePFM writes
+	/// </summary>
+	/// <param name="filename">Name of the file, including the extension</param>
+	/// <returns>False, if the file could not be read</returns>
+	bool readPFM(const std::string& filename)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		std::string type;
+		double endianness;
+		file >> type >> width >> height >> endianness;
+		file.get();
+		if (!file || type != "PF" || width <= 0 || height <= 0 || endianness > 0.0)
+			return false;
+
+		pixels.assign(size_t(width) * height * 3, 0.0f);
+		for (int y = height - 1; y >= 0; y--)
+			if (!file.read(reinterpret_cast<char*>(at(0, y)), sizeof(float) * 3 * width))
+				return false;
+		return true;
+	}
+
+	/// <summary>
+	/// Writes the linear values as a little-endian colour PFM
+	/// </summary>
+	/// <param name="filename">Name of the file, including the extension</param>
+	/// <returns>True, if the file was written</returns>
+	bool writePFM(const std::string& filename) const
+	{
+		std::ofstream file(filename, std::ios::binary);
+		if (!file)
+			return false;
+
+		file << "PF\n" << width << ' ' << height << "\n-1.0\n";
+
+		// PFM stores the bottom row first
+		for (int y = height - 1; y >= 0; y--)
+			file.write(reinterpret_cast<const char*>(at(0, y)), sizeof(float) * 3 * width);
+
+		return bool(file);
+	}
+};
+
+/// <summary>
+/// Running sums of the samples of every pixel together with how many samples each pixel has received, so a render
+/// can keep adding samples to the same frame
+/// </summary>
+class AccumulationBuffer
+{
+public:
+	int width = 0;
+	int height = 0;
+	/// <summary>
+	/// Three floats per pixel, the sum of all samples so far
+	/// </summary>
+	std::vector<float> sums;
+	/// <summary>
+	/// Number of samples added to each pixel
+	/// </summary>
+	std::vector<uint32_t> counts;
+
+	AccumulationBuffer()
+	{}
+
+	AccumulationBuffer(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		sums.assign(size_t(width) * height * 3, 0.0f);
+		counts.assign(size_t(width) * height, 0);
+	}
+
+	/// <summary>
+	/// Adds the averages of a tile, each worth the given number of samples
+	/// </summary>
+	/// <param name="tile">Position of the tile in the image</param>
+	/// <param name="averages">Three floats per pixel of the tile, row by row</param>
+	/// <param name="samples">Number of samples behind each average</param>
+	void addTile(const Tile& tile, const float* averages, int samples)
+	{
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			size_t pixel = size_t(y) * width + tile.x0;
+			for (int x = tile.x0; x < tile.x1; x++, pixel++)
+			{
+				sums[pixel * 3] += *averages++ * samples;
+				sums[pixel * 3 + 1] += *averages++ * samples;
+				sums[pixel * 3 + 2] += *averages++ * samples;
+				counts[pixel] += samples;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Number of samples in the first pixel of a tile (every pixel of a tile receives the same number)
+	/// </summary>
+	uint32_t tileSamples(const Tile& tile) const
+	{
+		return counts[size_t(tile.y0) * width + tile.x0];
+	}
+
+	/// <summary>
+	/// Divides every sum by its sample count
+	/// </summary>
+	/// <returns>The average colour of every pixel, black where there are no samples yet</returns>
+	FloatImage resolve() const
+	{
+		FloatImage image(width, height);
+
+		for (size_t pixel = 0; pixel < counts.size(); pixel++)
+		{
+			float scale = counts[pixel] > 0 ? 1.0f / counts[pixel] : 0.0f;
+			for (int c = 0; c < 3; c++)
+				image.pixels[pixel * 3 + c] = sums[pixel * 3 + c] * scale;
+		}
+		return image;
+	}
+};
+
+#endif
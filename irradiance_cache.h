@@ -0,0 +1,161 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "const_utility.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Indirect light arriving at one point of a diffuse surface
+/// </summary>
+struct IrradianceRecord
+{
+	point p;
+	vec3 normal;
+	/// <summary>
+	/// Mean radiance of the cosine-weighted directions of the hemisphere, counting only light that was reflected at
+	/// least once on its way: irradiance / pi, so a Lambertian surface reflects albedo times it
+	/// </summary>
+	colour irradiance;
+	/// <summary>
+	/// Harmonic mean distance to the surfaces around the point, clamped; the record is valid in a radius that scales
+	/// with it, so it covers little near walls and corners and much in the open
+	/// </summary>
+	double radius;
+};
+
+/// <summary>
+/// Sparse irradiance records (Ward's irradiance cache) in a spatial hash. A record is used at a point within accuracy
+/// times its radius and whose normal is close to its own; the weights fall to zero at that bound, so the
+/// interpolation has no seams. The cache is filled between renders and only read while rendering, so threads share it
+/// without locks
+/// </summary>
+class IrradianceCache
+{
+private:
+	double accuracy;
+	double minRadius;
+	double maxRadius;
+	/// <summary>
+	/// Side of the hash cells: the largest distance at which any record is used, so a record covers at most eight
+	/// cells and a lookup reads one
+	/// </summary>
+	double cellSize;
+	std::vector<IrradianceRecord> records;
+	std::unordered_map<uint64_t, std::vector<uint32_t>> cells;
+
+	int cellOf(double coordinate) const
+	{
+		return int(std::floor(coordinate / cellSize));
+	}
+
+	static uint64_t cellKey(int x, int y, int z)
+	{
+		return (uint64_t(uint32_t(x) & 0x1FFFFF) << 42) | (uint64_t(uint32_t(y) & 0x1FFFFF) << 21) | uint64_t(uint32_t(z) & 0x1FFFFF);
+	}
+
+public:
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="accuracy">Ward's a: the error a record may make, as the sum of its distance relative to its radius
+	/// and the square root of one minus the cosine of the angle between the normals; smaller values need more records</param>
+	/// <param name="minRadius">Least radius of a record, so corners do not need unbounded numbers of them</param>
+	/// <param name="maxRadius">Largest radius of a record, so open areas still get some detail</param>
+	IrradianceCache(double accuracy, double minRadius, double maxRadius)
+	{
+		this->accuracy = accuracy;
+		this->minRadius = minRadius;
+		this->maxRadius = maxRadius;
+		cellSize = std::max(accuracy * maxRadius, 1e-9);
+	}
+
+	/// <summary>
+	/// Clamps a harmonic mean distance to the radii allowed
+	/// </summary>
+	double clampRadius(double radius) const
+	{
+		return clamp(radius, minRadius, maxRadius);
+	}
+
+	void add(const IrradianceRecord& record)
+	{
+		uint32_t index = uint32_t(records.size());
+		records.push_back(record);
+
+		double reach = accuracy * record.radius;
+		int lo[3], hi[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			lo[axis] = cellOf(record.p[axis] - reach);
+			hi[axis] = cellOf(record.p[axis] + reach);
+		}
+
+		for (int x = lo[0]; x <= hi[0]; x++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int z = lo[2]; z <= hi[2]; z++)
+					cells[cellKey(x, y, z)].push_back(index);
+	}
+
+	/// <summary>
+	/// Interpolates the records valid at a point
+	/// </summary>
+	/// <param name="p">Point on a diffuse surface</param>
+	/// <param name="normal">Normal of the surface at the point, facing the ray</param>
+	/// <param name="irradiance">Receives the weighted mean of the irradiance of the valid records</param>
+	/// <returns>False, if no record is valid there</returns>
+	bool lookup(const point& p, const vec3& normal, colour& irradiance) const
+	{
+		auto found = cells.find(cellKey(cellOf(p.x()), cellOf(p.y()), cellOf(p.z())));
+		if (found == cells.end())
+			return false;
+
+		colour sum(0.0, 0.0, 0.0);
+		double weights = 0.0;
+		for (uint32_t index : found->second)
+		{
+			const IrradianceRecord& record = records[index];
+			vec3 offset = p - record.p;
+
+			// a point in front of the record's surface sees light the record did not
+			if (dot(offset, record.normal + normal) < -1e-3 * record.radius)
+				continue;
+
+			double error = offset.length() / record.radius + sqrt(std::max(0.0, 1.0 - dot(normal, record.normal)));
+			if (error >= accuracy)
+				continue;
+
+			double weight = 1.0 / std::max(error, 1e-9) - 1.0 / accuracy;
+			sum += weight * record.irradiance;
+			weights += weight;
+		}
+
+		if (weights <= 0.0)
+			return false;
+		irradiance = sum / weights;
+		return true;
+	}
+
+	size_t size() const
+	{
+		return records.size();
+	}
+
+	/// <summary>
+	/// Bytes taken by the records and the hash cells
+	/// </summary>
+	size_t memoryBytes() const
+	{
+		size_t bytes = records.capacity() * sizeof(IrradianceRecord);
+		for (const auto& cell : cells)
+			bytes += sizeof(cell) + cell.second.capacity() * sizeof(uint32_t);
+		return bytes;
+	}
+};
+
+#endif
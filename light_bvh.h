@@ -0,0 +1,322 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "bounding_box.h"
+#include "cuboid.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// How direct light is found at diffuse surfaces
+/// </summary>
+enum class LightSampling
+{
+	/// <summary>
+	/// Only by scattered rays that happen to hit an emitter
+	/// </summary>
+	Off,
+	/// <summary>
+	/// A shadow ray towards one emitter per bounce, every emitter equally likely
+	/// </summary>
+	Uniform,
+	/// <summary>
+	/// A shadow ray towards one emitter per bounce, picked through the LightBVH in proportion to its estimated
+	/// contribution at the shading point
+	/// </summary>
+	BVH
+};
+
+/// <summary>
+/// Reads a light sampling name: off, uniform or bvh
+/// </summary>
+/// <returns>False, if the name is unknown</returns>
+inline bool parseLightSampling(const std::string& name, LightSampling& sampling)
+{
+	if (name == "off")
+		sampling = LightSampling::Off;
+	else if (name == "uniform")
+		sampling = LightSampling::Uniform;
+	else if (name == "bvh")
+		sampling = LightSampling::BVH;
+	else
+		return false;
+	return true;
+}
+
+inline const char* lightSamplingName(LightSampling sampling)
+{
+	switch (sampling)
+	{
+	case LightSampling::Uniform: return "uniform";
+	case LightSampling::BVH: return "bvh";
+	default: return "off";
+	}
+}
+
+/// <summary>
+/// The emitters of a scene, in a BVH whose nodes store the bounds and the total power of the emitters below them.
+/// A light is picked by walking down from the root and choosing each child with a probability proportional to its
+/// power over the squared distance to the shading point, zero if its box lies behind the surface, so the cost of a
+/// pick grows with the logarithm of the number of emitters and lights far away or out of sight are rarely chosen
+/// </summary>
+class LightBVH
+{
+private:
+	/// <summary>
+	/// Node of the tree. Interior nodes have both children, leaves have left = -1 and hold emitters[emitter]
+	/// </summary>
+	struct Node
+	{
+		BoundingBox box;
+		double power;
+		int left;
+		int right;
+		uint32_t emitter;
+	};
+
+	/// <summary>
+	/// A sampleable emitter. The path from the root to its leaf is kept as one bit per level, set where the path
+	/// goes right, so the probability of picking it can be recomputed without searching
+	/// </summary>
+	struct Emitter
+	{
+		const Hittable* object;
+		colour radiance;
+		double power;
+		BoundingBox box;
+		point centroid;
+		uint64_t path;
+		int depth;
+	};
+
+	std::vector<Node> nodes;
+	std::vector<Emitter> emitters;
+	std::unordered_map<const Hittable*, uint32_t> index;
+
+	static double luminance(const colour& c)
+	{
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+	/// <summary>
+	/// Adds the object, or the objects it groups, if they emit light and can be sampled
+	/// </summary>
+	void collect(const Hittable* object)
+	{
+		if (auto list = dynamic_cast<const HittableList*>(object))
+		{
+			for (const auto& child : list->objects)
+				collect(child.get());
+			return;
+		}
+		if (auto box = dynamic_cast<const Cuboid*>(object))
+		{
+			for (const auto& side : box->cuboid.objects)
+				collect(side.get());
+			return;
+		}
+
+		Material* material = object->material();
+		double area = object->area();
+		BoundingBox bounds;
+		if (material == nullptr || area <= 0.0 || !object->boundingBox(bounds))
+			return;
+
+		colour radiance = material->emitted();
+		double power = luminance(radiance) * area * pi;
+		if (power <= 0.0)
+			return;
+
+		emitters.push_back({ object, radiance, power, bounds, 0.5 * (bounds.a + bounds.b), 0, 0 });
+	}
+
+	/// <summary>
+	/// Builds the subtree over emitters[start, end) by splitting at the median centroid along the longest axis
+	/// </summary>
+	/// <returns>Index of the node</returns>
+	int build(size_t start, size_t end, uint64_t path, int depth)
+	{
+		int node = int(nodes.size());
+		nodes.push_back(Node());
+
+		if (end - start == 1 || depth == 63)
+		{
+			// emitters sharing one centroid beyond depth 63 cannot be told apart; the first one stands for all
+			Emitter& emitter = emitters[start];
+			emitter.path = path;
+			emitter.depth = depth;
+			nodes[node] = { emitter.box, emitter.power, -1, -1, uint32_t(start) };
+			return node;
+		}
+
+		BoundingBox centroids(emitters[start].centroid, emitters[start].centroid);
+		for (size_t i = start + 1; i < end; i++)
+			centroids = combinedBox(centroids, BoundingBox(emitters[i].centroid, emitters[i].centroid));
+
+		int axis = 0;
+		for (int k = 1; k < 3; k++)
+			if (centroids.b[k] - centroids.a[k] > centroids.b[axis] - centroids.a[axis])
+				axis = k;
+
+		size_t mid = start + (end - start) / 2;
+		std::nth_element(emitters.begin() + start, emitters.begin() + mid, emitters.begin() + end,
+			[axis](const Emitter& a, const Emitter& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+		int left = build(start, mid, path, depth + 1);
+		int right = build(mid, end, path | (uint64_t(1) << depth), depth + 1);
+		nodes[node] = { combinedBox(nodes[left].box, nodes[right].box), nodes[left].power + nodes[right].power, left, right, 0 };
+		return node;
+	}
+
+	/// <summary>
+	/// Estimated contribution of the emitters below a node at a shading point
+	/// </summary>
+	double importance(const Node& node, const point& p, const vec3& normal) const
+	{
+		// nothing in a box entirely below the surface can light it; the corner furthest along the normal tells
+		double highest = 0.0;
+		for (int k = 0; k < 3; k++)
+			highest += (normal[k] > 0.0 ? node.box.b[k] - p[k] : node.box.a[k] - p[k]) * normal[k];
+		if (highest <= 0.0)
+			return 0.0;
+
+		// the distance is clamped to half the diagonal so a point inside or next to a large box does not blow up
+		point center = 0.5 * (node.box.a + node.box.b);
+		double distanceSquared = (center - p).length_squared();
+		double halfDiagonalSquared = 0.25 * (node.box.b - node.box.a).length_squared();
+		return node.power / std::max(distanceSquared, halfDiagonalSquared);
+	}
+
+public:
+	/// <summary>
+	/// Collects the emitters among the objects and builds the tree over them
+	/// </summary>
+	/// <param name="objects">Objects of the scene; lists and boxes are searched for emitters too</param>
+	explicit LightBVH(const std::vector<shared_ptr<Hittable>>& objects)
+	{
+		for (const auto& object : objects)
+			collect(object.get());
+
+		if (emitters.empty())
+			return;
+
+		nodes.reserve(2 * emitters.size());
+		build(0, emitters.size(), 0, 0);
+
+		for (size_t i = 0; i < emitters.size(); i++)
+			index[emitters[i].object] = uint32_t(i);
+	}
+
+	/// <summary>
+	/// Number of emitters that can be sampled
+	/// </summary>
+	size_t size() const
+	{
+		return emitters.size();
+	}
+
+	/// <summary>
+	/// One of the emitters, in no particular order
+	/// </summary>
+	/// <param name="i">Index of the emitter, below size()</param>
+	/// <param name="radiance">Receives the radiance the emitter sends out</param>
+	/// <param name="power">Receives the luminance of the power the emitter sends out of one side</param>
+	const Hittable* emitter(size_t i, colour& radiance, double& power) const
+	{
+		radiance = emitters[i].radiance;
+		power = emitters[i].power;
+		return emitters[i].object;
+	}
+
+	/// <summary>
+	/// Picks an emitter to send a shadow ray to
+	/// </summary>
+	/// <param name="sampling">Uniform or BVH</param>
+	/// <param name="p">Shading point</param>
+	/// <param name="normal">Normal at the shading point, on the side the light has to come from</param>
+	/// <param name="u">Uniform random number in [0, 1)</param>
+	/// <param name="pmf">Receives the probability of the emitter being picked</param>
+	/// <param name="radiance">Receives the radiance the emitter sends out</param>
+	/// <returns>The emitter, null if there is none that could light the point</returns>
+	const Hittable* sample(LightSampling sampling, const point& p, const vec3& normal, double u, double& pmf, colour& radiance) const
+	{
+		if (emitters.empty())
+			return nullptr;
+
+		if (sampling == LightSampling::Uniform)
+		{
+			size_t i = std::min(size_t(u * emitters.size()), emitters.size() - 1);
+			pmf = 1.0 / emitters.size();
+			radiance = emitters[i].radiance;
+			return emitters[i].object;
+		}
+
+		int node = 0;
+		pmf = 1.0;
+		while (nodes[node].left >= 0)
+		{
+			double left = importance(nodes[nodes[node].left], p, normal);
+			double right = importance(nodes[nodes[node].right], p, normal);
+			if (left + right <= 0.0)
+				return nullptr;
+
+			// the random number is stretched back to [0, 1) after every choice and reused for the next one
+			double pLeft = left / (left + right);
+			if (u < pLeft)
+			{
+				u = std::min(u / pLeft, 1.0 - 1e-16);
+				pmf *= pLeft;
+				node = nodes[node].left;
+			}
+			else
+			{
+				u = std::min((u - pLeft) / (1.0 - pLeft), 1.0 - 1e-16);
+				pmf *= 1.0 - pLeft;
+				node = nodes[node].right;
+			}
+		}
+
+		const Emitter& emitter = emitters[nodes[node].emitter];
+		radiance = emitter.radiance;
+		return emitter.object;
+	}
+
+	/// <summary>
+	/// Probability with which sample() picks the given object at a shading point
+	/// </summary>
+	/// <returns>0, if the object is not one of the emitters</returns>
+	double pmf(LightSampling sampling, const Hittable* object, const point& p, const vec3& normal) const
+	{
+		auto found = index.find(object);
+		if (found == index.end())
+			return 0.0;
+
+		if (sampling == LightSampling::Uniform)
+			return 1.0 / emitters.size();
+
+		const Emitter& emitter = emitters[found->second];
+		double pmf = 1.0;
+		int node = 0;
+		for (int level = 0; level < emitter.depth; level++)
+		{
+			double left = importance(nodes[nodes[node].left], p, normal);
+			double right = importance(nodes[nodes[node].right], p, normal);
+			if (left + right <= 0.0)
+				return 0.0;
+
+			bool goRight = (emitter.path >> level) & 1;
+			pmf *= (goRight ? right : left) / (left + right);
+			node = goRight ? nodes[node].right : nodes[node].left;
+		}
+		return nodes[node].emitter == found->second ? pmf : 0.0;
+	}
+};
+
+#endif
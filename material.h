@@ -2,6 +2,7 @@
 #define MATERIAL_H
 
 #include "const_utility.h"
+#include "texture.h"
 
 struct hitRecord;
 
@@ -28,6 +29,24 @@ public:
     {
         return colour(0.0, 0.0, 0.0);
     }
+    /// <summary>
+    /// Tells whether the material scatters like a Lambertian surface, which is what direct light sampling needs to
+    /// know: the reflected light is albedo / pi per unit of incoming light, and scatter picks cosine-weighted directions
+    /// </summary>
+    /// <param name="rec">Record of the interaction</param>
+    /// <param name="albedo">Receives the albedo, if the material is diffuse</param>
+    /// <returns>True, if the material is diffuse</returns>
+    virtual bool diffuse(const hitRecord& /*rec*/, colour& /*albedo*/) const
+    {
+        return false;
+    }
+    /// <summary>
+    /// Tells whether the material reads a texture, so the surface coordinates of a hit have to be computed
+    /// </summary>
+    virtual bool textured() const
+    {
+        return false;
+    }
 };
 
 /// <summary>
@@ -37,12 +56,29 @@ class Lambertian : public Material
 {
 public:
     colour albedo;
+    /// <summary>
+    /// Albedo varying over the surface, in place of the constant one
+    /// </summary>
+    shared_ptr<Texture> texture;
 
     Lambertian(const colour& a)
     {
         albedo = a;
     }
 
+    Lambertian(shared_ptr<Texture> t)
+    {
+        texture = t;
+    }
+
+    /// <summary>
+    /// Albedo at the hit
+    /// </summary>
+    colour albedoAt(const hitRecord& rec) const
+    {
+        return texture ? texture->value(rec.u, rec.v, rec.footprint * rec.uvScale) : albedo;
+    }
+
     virtual bool scatter(const Ray& r_in, const hitRecord& rec, colour& attenuation, Ray& scattered) const override 
     {
         auto scatterDir = rec.normal + randomUnitVector();
@@ -51,9 +87,20 @@ public:
             scatterDir = rec.normal;
 
         scattered = Ray(rec.p, scatterDir);
-        attenuation = albedo;
+        attenuation = albedoAt(rec);
+        return true;
+    }
+
+    virtual bool diffuse(const hitRecord& rec, colour& albedo) const override
+    {
+        albedo = albedoAt(rec);
         return true;
     }
+
+    virtual bool textured() const override
+    {
+        return texture != nullptr;
+    }
 };
 
 /// <summary>
@@ -199,6 +246,12 @@ public:
         return true;
     }
 
+    virtual bool diffuse(const hitRecord& /*rec*/, colour& albedo) const override
+    {
+        albedo = this->albedo;
+        return true;
+    }
+
     virtual colour emitted() const override
     {
         return albedo;
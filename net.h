@@ -0,0 +1,459 @@
+#ifndef NET_H
+#define NET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET SocketHandle;
+const SocketHandle INVALID_HANDLE = INVALID_SOCKET;
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int SocketHandle;
+const SocketHandle INVALID_HANDLE = -1;
+#endif
+
+/// <summary>
+/// Starts the socket library once per process (only needed on Windows)
+/// </summary>
+inline void startNetworking()
+{
+#ifdef _WIN32
+	static bool started = false;
+	if (!started)
+	{
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+		started = true;
+	}
+#endif
+}
+
+/// <summary>
+/// Owns a stream socket and closes it on destruction
+/// </summary>
+class Socket
+{
+private:
+	SocketHandle handle = INVALID_HANDLE;
+
+public:
+	Socket()
+	{}
+
+	explicit Socket(SocketHandle handle)
+	{
+		this->handle = handle;
+	}
+
+	Socket(const Socket&) = delete;
+	Socket& operator = (const Socket&) = delete;
+
+	Socket(Socket&& other) noexcept
+	{
+		handle = other.handle;
+		other.handle = INVALID_HANDLE;
+	}
+
+	Socket& operator = (Socket&& other) noexcept
+	{
+		if (this != &other)
+		{
+			close();
+			handle = other.handle;
+			other.handle = INVALID_HANDLE;
+		}
+		return *this;
+	}
+
+	~Socket()
+	{
+		close();
+	}
+
+	bool valid() const
+	{
+		return handle != INVALID_HANDLE;
+	}
+
+	SocketHandle native() const
+	{
+		return handle;
+	}
+
+	void close()
+	{
+		if (!valid())
+			return;
+#ifdef _WIN32
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+		handle = INVALID_HANDLE;
+	}
+
+	/// <summary>
+	/// Wakes up any thread blocked on the socket without releasing the handle
+	/// </summary>
+	void shutdown()
+	{
+		if (valid())
+#ifdef _WIN32
+			::shutdown(handle, SD_BOTH);
+#else
+			::shutdown(handle, SHUT_RDWR);
+#endif
+	}
+
+	/// <summary>
+	/// Sets how long a receive may block before it fails
+	/// </summary>
+	/// <param name="seconds">Timeout in seconds, 0 to block forever</param>
+	void setReceiveTimeout(int seconds)
+	{
+#ifdef _WIN32
+		DWORD value = DWORD(seconds) * 1000;
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&value), sizeof(value));
+#else
+		timeval value = { seconds, 0 };
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &value, sizeof(value));
+#endif
+	}
+
+	/// <summary>
+	/// Sends the whole buffer
+	/// </summary>
+	/// <returns>False, if the connection failed</returns>
+	bool sendAll(const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+#ifdef _WIN32
+			int sent = ::send(handle, bytes, int(std::min<size_t>(size, 1 << 30)), 0);
+#else
+			ssize_t sent = ::send(handle, bytes, size, MSG_NOSIGNAL);
+#endif
+			if (sent <= 0)
+				return false;
+			bytes += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Receives exactly size bytes
+	/// </summary>
+	/// <returns>False, if the connection was closed, failed or timed out first</returns>
+	bool receiveAll(void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+#ifdef _WIN32
+			int received = ::recv(handle, bytes, int(std::min<size_t>(size, 1 << 30)), 0);
+#else
+			ssize_t received = ::recv(handle, bytes, size, 0);
+#endif
+			if (received <= 0)
+				return false;
+			bytes += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Receives one line of text
+	/// </summary>
+	/// <param name="line">Receives the line, without the line break</param>
+	/// <returns>False, if the connection ended before a line break</returns>
+	bool receiveLine(std::string& line)
+	{
+		line.clear();
+		char c;
+		while (receiveAll(&c, 1))
+		{
+			if (c == '\n')
+				return true;
+			if (c != '\r')
+				line += c;
+		}
+		return false;
+	}
+
+	/// <summary>
+	/// Sends one line of text, adding the line break
+	/// </summary>
+	/// <returns>False, if the connection failed</returns>
+	bool sendLine(const std::string& line)
+	{
+		std::string text = line + "\n";
+		return sendAll(text.data(), text.size());
+	}
+
+	/// <summary>
+	/// Accepts the next connection on a listening socket
+	/// </summary>
+	/// <returns>The connection, invalid if the listening socket was closed</returns>
+	Socket accept()
+	{
+		SocketHandle client = ::accept(handle, nullptr, nullptr);
+		if (client != INVALID_HANDLE)
+		{
+			int on = 1;
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+		}
+		return Socket(client);
+	}
+};
+
+/// <summary>
+/// Opens a TCP socket listening on all interfaces
+/// </summary>
+/// <param name="port">Port to listen on, 0 lets the system pick one; receives the port actually used</param>
+/// <returns>The listening socket, invalid on failure</returns>
+inline Socket listenTcp(int& port)
+{
+	startNetworking();
+
+	Socket server(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+	if (!server.valid())
+		return server;
+
+	int on = 1;
+	setsockopt(server.native(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(uint16_t(port));
+
+	if (::bind(server.native(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(server.native(), 64) != 0)
+		return Socket();
+
+	socklen_t length = sizeof(address);
+	getsockname(server.native(), reinterpret_cast<sockaddr*>(&address), &length);
+	port = ntohs(address.sin_port);
+	return server;
+}
+
+/// <summary>
+/// Connects to a TCP server
+/// </summary>
+/// <param name="host">Host name or address of the server</param>
+/// <param name="port">Port of the server</param>
+/// <returns>The connection, invalid on failure</returns>
+inline Socket connectTcp(const std::string& host, int port)
+{
+	startNetworking();
+
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+		return Socket();
+
+	Socket client;
+	for (addrinfo* info = result; info != nullptr; info = info->ai_next)
+	{
+		Socket attempt(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+		if (attempt.valid() && ::connect(attempt.native(), info->ai_addr, socklen_t(info->ai_addrlen)) == 0)
+		{
+			client = std::move(attempt);
+			break;
+		}
+	}
+	freeaddrinfo(result);
+
+	if (client.valid())
+	{
+		int on = 1;
+		setsockopt(client.native(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+	}
+	return client;
+}
+
+/// <summary>
+/// Opens a UNIX domain socket listening at the given path, replacing any stale socket file left there
+/// </summary>
+/// <param name="path">Path of the socket file</param>
+/// <returns>The listening socket, invalid on failure</returns>
+inline Socket listenLocal(const std::string& path)
+{
+	startNetworking();
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return Socket();
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	Socket server(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (!server.valid())
+		return server;
+
+	std::remove(path.c_str());
+	if (::bind(server.native(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(server.native(), 64) != 0)
+		return Socket();
+	return server;
+}
+
+/// <summary>
+/// Connects to a UNIX domain socket
+/// </summary>
+/// <param name="path">Path of the socket file</param>
+/// <returns>The connection, invalid on failure</returns>
+inline Socket connectLocal(const std::string& path)
+{
+	startNetworking();
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return Socket();
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	Socket client(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (client.valid() && ::connect(client.native(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+		return Socket();
+	return client;
+}
+
+/// <summary>
+/// Builds the payload of a message. Values are copied in host byte order, so every machine taking part has to be
+/// little-endian (any x86-64 or ARM64 box)
+/// </summary>
+class MessageWriter
+{
+public:
+	std::vector<char> bytes;
+
+	template <typename T>
+	MessageWriter& put(const T& value)
+	{
+		const char* p = reinterpret_cast<const char*>(&value);
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+		return *this;
+	}
+
+	MessageWriter& putBytes(const void* data, size_t size)
+	{
+		const char* p = static_cast<const char*>(data);
+		bytes.insert(bytes.end(), p, p + size);
+		return *this;
+	}
+
+	MessageWriter& putString(const std::string& value)
+	{
+		put(uint32_t(value.size()));
+		return putBytes(value.data(), value.size());
+	}
+};
+
+/// <summary>
+/// Reads values back out of a message payload
+/// </summary>
+class MessageReader
+{
+private:
+	const std::vector<char>& bytes;
+	size_t offset = 0;
+
+public:
+	/// <summary>
+	/// Set when a read ran past the end of the payload
+	/// </summary>
+	bool failed = false;
+
+	explicit MessageReader(const std::vector<char>& bytes) : bytes(bytes)
+	{}
+
+	template <typename T>
+	T get()
+	{
+		T value = T();
+		getBytes(&value, sizeof(T));
+		return value;
+	}
+
+	void getBytes(void* data, size_t size)
+	{
+		if (offset + size > bytes.size())
+		{
+			failed = true;
+			return;
+		}
+		std::memcpy(data, bytes.data() + offset, size);
+		offset += size;
+	}
+
+	std::string getString()
+	{
+		uint32_t size = get<uint32_t>();
+		if (failed || offset + size > bytes.size())
+		{
+			failed = true;
+			return std::string();
+		}
+		std::string value(bytes.data() + offset, size);
+		offset += size;
+		return value;
+	}
+};
+
+/// <summary>
+/// Sends one framed message: type, payload size, payload
+/// </summary>
+/// <returns>False, if the connection failed</returns>
+inline bool sendMessage(Socket& socket, uint32_t type, const MessageWriter& payload)
+{
+	uint32_t header[2] = { type, uint32_t(payload.bytes.size()) };
+	return socket.sendAll(header, sizeof(header)) && (payload.bytes.empty() || socket.sendAll(payload.bytes.data(), payload.bytes.size()));
+}
+
+/// <summary>
+/// Receives one framed message
+/// </summary>
+/// <param name="socket">Connection to read from</param>
+/// <param name="type">Receives the type of the message</param>
+/// <param name="payload">Receives the payload of the message</param>
+/// <returns>False, if the connection was closed, failed or timed out</returns>
+inline bool receiveMessage(Socket& socket, uint32_t& type, std::vector<char>& payload)
+{
+	uint32_t header[2];
+	if (!socket.receiveAll(header, sizeof(header)))
+		return false;
+
+	// refuse anything larger than 1 GiB, it can only be garbage
+	if (header[1] > (1u << 30))
+		return false;
+
+	type = header[0];
+	payload.resize(header[1]);
+	return payload.empty() || socket.receiveAll(payload.data(), payload.size());
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "const_utility.h"
+#include "image.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "irradiance_cache.h"
+#include "photon_map.h"
+
+#include <cstdint>
+#include <string>
+
+/// <summary>
+/// Settings read from the command line. Without any arguments the program asks for the thread count and renders
+/// scene 3 as it always has
+/// </summary>
+struct Options
+{
+	int scene = 3;
+	int threads = 0;
+	int height = 0;
+	RenderSettings settings;
+	bool samplesGiven = false;
+	int tileSize = 32;
+	std::string output = "image";
+
+	bool coordinator = false;
+	int port = 0;
+	int spawnWorkers = 0;
+	int tileTimeout = 600;
+	int workerTimeout = 300;
+
+	bool worker = false;
+	std::string host;
+	int failAfter = -1;
+
+	std::string checkpoint;
+	std::string resume;
+	int checkpointInterval = 60;
+	int passSamples = 1;
+
+	int frames = 0;
+	double moveFraction = 0.05;
+	bool dirtyTiles = false;
+
+	Tile crop = { 0, 0, 0, 0 };
+	std::string composite;
+
+	std::string views;
+
+	bool gbufferReport = false;
+
+	bool irradianceCache = false;
+	double irradianceAccuracy = 0.3;
+	int irradianceRays = 128;
+	bool irradianceReport = false;
+
+	bool caustics = false;
+	size_t photons = 200000;
+	int photonNearest = 50;
+	bool causticsReport = false;
+
+	std::string serve;
+	std::string submit;
+	std::string socket = "raytracer.sock";
+
+	bool allocReport = false;
+	bool arena = true;
+	bool traversalReport = false;
+
+	BVHSettings bvh;
+	bool layoutReport = false;
+	bool acceleratorReport = false;
+
+	bool bvhStats = false;
+	int bvhRays = 100000;
+	std::string bvhObj;
+	int bvhObjDepth = -1;
+
+	std::string isa;
+	bool checkIsa = false;
+
+	bool lightReport = false;
+
+	std::string environment;
+	double environmentScale = 1.0;
+
+	std::string costMap;
+	double timeLimit = 0.0;
+
+	std::string makeTexture;
+	int textureCacheMiB = 0;
+	bool textureReport = false;
+
+	std::string regress;
+	bool regressUpdate = false;
+	std::string regressBaseline;
+	double regressPsnr = 40.0;
+	double regressSlowdown = 10.0;
+};
+
+/// <summary>
+/// Makes an empty irradiance cache sized for a scene: records reach at most a tenth of the size of its bounded
+/// primitives and at least a five-hundredth
+/// </summary>
+inline IrradianceCache makeIrradianceCache(const SceneData& scene, double accuracy)
+{
+	BoundingBox box;
+	double size = 1.0;
+	if (scene.root->tree && scene.root->tree->boundingBox(box))
+		size = (box.b - box.a).length();
+	return IrradianceCache(accuracy, size / 500.0, size / 10.0);
+}
+
+/// <summary>
+/// Makes an empty photon map sized for a scene: photons are gathered from at most a two-hundredth of the size of its
+/// bounded primitives
+/// </summary>
+inline PhotonMap makePhotonMap(const SceneData& scene, const Options& options)
+{
+	BoundingBox box;
+	double size = 1.0;
+	if (scene.root->tree && scene.root->tree->boundingBox(box))
+		size = (box.b - box.a).length();
+
+	PhotonSettings settings;
+	settings.maxPhotons = options.photons;
+	settings.nearest = options.photonNearest;
+	settings.maxRadius = size / 200.0;
+	settings.seed = mixSeed(options.settings.seed, 49);
+	return PhotonMap(settings);
+}
+
+#endif
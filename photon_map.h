@@ -0,0 +1,515 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "const_utility.h"
+#include "cuboid.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sphere.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Most photons gathered for one estimate
+/// </summary>
+const int PHOTON_MAX_NEAREST = 256;
+/// <summary>
+/// Photons emitted by one task of the emission stage, from a random stream of its own
+/// </summary>
+const size_t PHOTON_BATCH_SIZE = 4096;
+
+/// <summary>
+/// Light that reached a diffuse surface through mirrors and glass. Kept in floats, as there are many of them
+/// </summary>
+struct Photon
+{
+	float position[3];
+	/// <summary>
+	/// Direction the photon travelled in when it landed
+	/// </summary>
+	float direction[3];
+	/// <summary>
+	/// Power carried, as radiance times area times solid angle
+	/// </summary>
+	float power[3];
+	/// <summary>
+	/// Axis the kd-tree splits along at this photon
+	/// </summary>
+	uint8_t axis;
+};
+
+/// <summary>
+/// How the photon map is filled and read
+/// </summary>
+struct PhotonSettings
+{
+	/// <summary>
+	/// Most photons stored; emission stops before the map would grow past it, so this bounds its memory
+	/// </summary>
+	size_t maxPhotons = 200000;
+	/// <summary>
+	/// Most photons emitted, as a multiple of maxPhotons, for scenes where few photons find a caustic
+	/// </summary>
+	size_t emitFactor = 16;
+	/// <summary>
+	/// Photons gathered for the estimate at a point, at most PHOTON_MAX_NEAREST
+	/// </summary>
+	int nearest = 50;
+	/// <summary>
+	/// Largest distance photons are gathered from
+	/// </summary>
+	double maxRadius = 1.0;
+	/// <summary>
+	/// Most surfaces a photon is followed to
+	/// </summary>
+	int maxDepth = 8;
+	uint64_t seed = 0;
+};
+
+/// <summary>
+/// Caustic photon map: the light of the emitters that reaches diffuse surfaces after one or more bounces off mirrors
+/// and glass (paths L S+ D), which a path tracer only finds when a diffuse bounce happens to hit a light through the
+/// glass. Photons are sent from the emitters towards the bounding spheres of the metal and glass objects only and
+/// followed through them to the first diffuse surface, where they are stored. The photons are kept as a balanced
+/// kd-tree in one array, each node at the median of its range, and the light at a point is estimated from its k
+/// nearest photons. The map is filled before rendering and only read while rendering, so threads share it without locks
+/// </summary>
+class PhotonMap
+{
+private:
+	/// <summary>
+	/// Sphere around a metal or glass object that photons are aimed at
+	/// </summary>
+	struct Target
+	{
+		point center;
+		double radius;
+	};
+
+	PhotonSettings settings;
+	std::vector<Photon> photons;
+	std::vector<Target> targets;
+	/// <summary>
+	/// Photons emitted for the ones stored, those that found no caustic included
+	/// </summary>
+	size_t emitted = 0;
+
+	/// <summary>
+	/// Adds the metal and glass objects among the object, or the objects it groups, to the targets
+	/// </summary>
+	void collectTargets(const Hittable* object)
+	{
+		if (auto list = dynamic_cast<const HittableList*>(object))
+		{
+			for (const auto& child : list->objects)
+				collectTargets(child.get());
+			return;
+		}
+		if (auto box = dynamic_cast<const Cuboid*>(object))
+		{
+			for (const auto& side : box->cuboid.objects)
+				collectTargets(side.get());
+			return;
+		}
+
+		Material* material = object->material();
+		BoundingBox bounds;
+		if (dynamic_cast<Dielectric*>(material) == nullptr && dynamic_cast<Metal*>(material) == nullptr)
+			return;
+		if (!object->boundingBox(bounds))
+			return;
+		targets.push_back({ 0.5 * (bounds.a + bounds.b), 0.5 * (bounds.b - bounds.a).length() });
+	}
+
+	/// <summary>
+	/// 1 - cos of the half angle of the cone of directions from a point towards a target; 2, the whole sphere of
+	/// directions, if the point is inside it
+	/// </summary>
+	static double coneWidth(const Target& target, const point& from)
+	{
+		double width = sphereConeWidth(target.center, target.radius, from);
+		return width > 0.0 ? width : 2.0;
+	}
+
+	/// <summary>
+	/// Density per solid angle of a direction from a point when a target is picked uniformly and a direction uniformly
+	/// in its cone
+	/// </summary>
+	double directionPdf(const point& from, const vec3& direction) const
+	{
+		double pdf = 0.0;
+		for (const Target& target : targets)
+		{
+			double width = coneWidth(target, from);
+			vec3 toCenter = target.center - from;
+			double distance = toCenter.length();
+			if (width >= 2.0 || dot(direction, toCenter) >= (1.0 - width) * distance)
+				pdf += 1.0 / (2.0 * pi * width);
+		}
+		return pdf / targets.size();
+	}
+
+	/// <summary>
+	/// Follows a photon through mirrors and glass and stores it at the diffuse surface it reaches, if it met at least
+	/// one of them on the way
+	/// </summary>
+	void tracePhoton(const Hittable& world, Ray ray, colour power, std::vector<Photon>& found) const
+	{
+		int bounces = 0;
+		for (int depth = 0; depth < settings.maxDepth; depth++)
+		{
+			hitRecord record;
+			traversalCounters().rays++;
+			if (!world.hit(ray, 0.001, infinity, record))
+				return;
+			record.object->surfaceInteraction(ray, record);
+
+			colour albedo;
+			if (record.mat_ptr->diffuse(record, albedo))
+			{
+				if (bounces > 0)
+				{
+					vec3 direction = unitVector(ray.direction);
+					Photon photon;
+					for (int k = 0; k < 3; k++)
+					{
+						photon.position[k] = float(record.p[k]);
+						photon.direction[k] = float(direction[k]);
+						photon.power[k] = float(power[k]);
+					}
+					photon.axis = 0;
+					found.push_back(photon);
+				}
+				return;
+			}
+
+			colour attenuation;
+			Ray scattered;
+			if (!record.mat_ptr->scatter(ray, record, attenuation, scattered))
+				return;
+			power = power * attenuation;
+			ray = scattered;
+			bounces++;
+		}
+	}
+
+	/// <summary>
+	/// Emits one batch of photons from its own random stream. The power of the photons is not yet divided by the
+	/// number emitted
+	/// </summary>
+	/// <param name="cumulative">Running sum of the power of the emitters, for picking them in proportion to it</param>
+	void emitBatch(const Hittable& world, const LightBVH& lights, const std::vector<double>& cumulative, size_t batch, size_t count,
+		std::vector<Photon>& found) const
+	{
+		seedRandom(mixSeed(settings.seed, batch));
+		double totalPower = cumulative.back();
+
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t index = std::upper_bound(cumulative.begin(), cumulative.end(), randomDouble() * totalPower) - cumulative.begin();
+			index = std::min(index, cumulative.size() - 1);
+			colour radiance;
+			double power;
+			const Hittable* emitter = lights.emitter(index, radiance, power);
+			double pmf = power / totalPower;
+
+			point origin;
+			vec3 normal;
+			double u1 = randomDouble();
+			double u2 = randomDouble();
+			if (!emitter->samplePoint(u1, u2, origin, normal))
+				continue;
+
+			// a direction in the cone of one target; light leaves both sides of open surfaces, and rays into a closed
+			// one end on its far side
+			const Target& target = targets[std::min(size_t(randomDouble() * targets.size()), targets.size() - 1)];
+			double width = coneWidth(target, origin);
+			double cosTheta = 1.0 - randomDouble() * width;
+			double sinTheta = sqrt(fmax(0.0, 1.0 - cosTheta * cosTheta));
+			double phi = 2.0 * pi * randomDouble();
+			vec3 w = unitVector(target.center - origin);
+			vec3 v = unitVector(cross(w, fabs(w.x()) > 0.9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+			vec3 u = cross(w, v);
+			vec3 direction = cos(phi) * sinTheta * u + sin(phi) * sinTheta * v + cosTheta * w;
+
+			double cosine = fabs(dot(direction, normal));
+			double pdf = directionPdf(origin, direction);
+			if (cosine <= 0.0 || pdf <= 0.0)
+				continue;
+
+			tracePhoton(world, Ray(origin, direction), radiance * (cosine * emitter->area() / (pmf * pdf)), found);
+		}
+	}
+
+	/// <summary>
+	/// Makes the photon at the median of photons[start, end), along the longest axis of their bounds, the node of the
+	/// range, with the smaller ones before it and the larger ones after it
+	/// </summary>
+	/// <returns>Index of the node</returns>
+	size_t split(size_t start, size_t end)
+	{
+		float lo[3], hi[3];
+		for (int k = 0; k < 3; k++)
+			lo[k] = hi[k] = photons[start].position[k];
+		for (size_t i = start + 1; i < end; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				lo[k] = std::min(lo[k], photons[i].position[k]);
+				hi[k] = std::max(hi[k], photons[i].position[k]);
+			}
+		}
+
+		int axis = 0;
+		for (int k = 1; k < 3; k++)
+			if (hi[k] - lo[k] > hi[axis] - lo[axis])
+				axis = k;
+
+		size_t mid = start + (end - start) / 2;
+		std::nth_element(photons.begin() + start, photons.begin() + mid, photons.begin() + end,
+			[axis](const Photon& a, const Photon& b) { return a.position[axis] < b.position[axis]; });
+		photons[mid].axis = uint8_t(axis);
+		return mid;
+	}
+
+	/// <summary>
+	/// Balances the subtree over photons[start, end)
+	/// </summary>
+	void balance(size_t start, size_t end)
+	{
+		while (start < end)
+		{
+			size_t mid = split(start, end);
+			balance(start, mid);
+			start = mid + 1;
+		}
+	}
+
+	/// <summary>
+	/// Balances the whole tree. The top levels are split on the calling thread until there are a few ranges per
+	/// thread; the subtrees of those ranges are then balanced in parallel
+	/// </summary>
+	void buildTree(ThreadPool& pool)
+	{
+		std::vector<std::pair<size_t, size_t>> ranges;
+		if (!photons.empty())
+			ranges.push_back({ 0, photons.size() });
+
+		size_t wanted = 4 * size_t(std::max(pool.size(), 1));
+		bool splitAny = true;
+		while (ranges.size() < wanted && splitAny)
+		{
+			splitAny = false;
+			std::vector<std::pair<size_t, size_t>> next;
+			for (const auto& range : ranges)
+			{
+				if (range.second - range.first < 2)
+				{
+					if (range.first < range.second)
+						next.push_back(range);
+					continue;
+				}
+				size_t mid = split(range.first, range.second);
+				next.push_back({ range.first, mid });
+				next.push_back({ mid + 1, range.second });
+				splitAny = true;
+			}
+			ranges = std::move(next);
+		}
+
+		pool.parallelFor(ranges.size(), [&](size_t i) { balance(ranges[i].first, ranges[i].second); });
+	}
+
+	/// <summary>
+	/// Keeps the k nearest photons of photons[start, end) within the distance in a max-heap of their squared distances
+	/// </summary>
+	/// <param name="maxDistanceSquared">Squared distance searched within; shrinks to that of the k-th nearest photon
+	/// once k are found</param>
+	void nearest(const point& p, size_t start, size_t end, std::pair<double, uint32_t>* heap, int k, int& found,
+		double& maxDistanceSquared) const
+	{
+		while (start < end)
+		{
+			size_t mid = start + (end - start) / 2;
+			const Photon& photon = photons[mid];
+			double offset = p[photon.axis] - photon.position[photon.axis];
+
+			// the side of the split the point is on first, so the search radius shrinks before the other side is tried
+			if (offset < 0.0)
+				nearest(p, start, mid, heap, k, found, maxDistanceSquared);
+			else
+				nearest(p, mid + 1, end, heap, k, found, maxDistanceSquared);
+
+			double distanceSquared = 0.0;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				double d = p[axis] - photon.position[axis];
+				distanceSquared += d * d;
+			}
+			if (distanceSquared < maxDistanceSquared)
+			{
+				if (found < k)
+				{
+					heap[found++] = { distanceSquared, uint32_t(mid) };
+					std::push_heap(heap, heap + found);
+				}
+				else
+				{
+					std::pop_heap(heap, heap + k);
+					heap[k - 1] = { distanceSquared, uint32_t(mid) };
+					std::push_heap(heap, heap + k);
+				}
+				if (found == k)
+					maxDistanceSquared = heap[0].first;
+			}
+
+			if (offset * offset >= maxDistanceSquared)
+				return;
+			if (offset < 0.0)
+				start = mid + 1;
+			else
+				end = mid;
+		}
+	}
+
+public:
+	PhotonMap()
+	{}
+
+	explicit PhotonMap(const PhotonSettings& settings)
+	{
+		this->settings = settings;
+	}
+
+	/// <summary>
+	/// Fills the map, replacing the photons it held. Photons are emitted in batches, several batches at a time on the
+	/// pool, and the batches are kept in order for as long as their photons fit in settings.maxPhotons, so the map is
+	/// the same for any number of threads. The power of every photon is divided by the number of photons emitted by
+	/// the batches kept
+	/// </summary>
+	/// <param name="world">Root of the scene the photons are traced through</param>
+	/// <param name="objects">Objects of the scene, searched for metal and glass to aim the photons at</param>
+	/// <param name="lights">Emitters the photons start from</param>
+	/// <param name="pool">Threads to emit the photons and build the tree on</param>
+	void build(const Hittable& world, const std::vector<shared_ptr<Hittable>>& objects, const LightBVH& lights, ThreadPool& pool)
+	{
+		photons.clear();
+		targets.clear();
+		emitted = 0;
+
+		for (const auto& object : objects)
+			collectTargets(object.get());
+
+		std::vector<double> cumulative;
+		double totalPower = 0.0;
+		for (size_t i = 0; i < lights.size(); i++)
+		{
+			colour radiance;
+			double power;
+			lights.emitter(i, radiance, power);
+			totalPower += power;
+			cumulative.push_back(totalPower);
+		}
+		if (targets.empty() || totalPower <= 0.0)
+			return;
+
+		size_t maxEmitted = settings.maxPhotons * settings.emitFactor;
+		size_t batchesPerRound = 4 * size_t(std::max(pool.size(), 1));
+		size_t nextBatch = 0;
+		bool full = false;
+		while (!full && nextBatch * PHOTON_BATCH_SIZE < maxEmitted)
+		{
+			size_t batches = std::min(batchesPerRound, (maxEmitted - nextBatch * PHOTON_BATCH_SIZE + PHOTON_BATCH_SIZE - 1) / PHOTON_BATCH_SIZE);
+			std::vector<std::vector<Photon>> found(batches);
+			auto batchSize = [&](size_t batch) { return std::min(PHOTON_BATCH_SIZE, maxEmitted - batch * PHOTON_BATCH_SIZE); };
+
+			pool.parallelFor(batches, [&](size_t i)
+			{
+				emitBatch(world, lights, cumulative, nextBatch + i, batchSize(nextBatch + i), found[i]);
+			});
+
+			for (size_t i = 0; i < batches && !full; i++)
+			{
+				if (photons.size() + found[i].size() > settings.maxPhotons)
+					full = true;
+				else
+				{
+					photons.insert(photons.end(), found[i].begin(), found[i].end());
+					emitted += batchSize(nextBatch + i);
+				}
+			}
+			nextBatch += batches;
+		}
+
+		for (Photon& photon : photons)
+			for (int k = 0; k < 3; k++)
+				photon.power[k] = float(photon.power[k] / emitted);
+		photons.shrink_to_fit();
+
+		buildTree(pool);
+	}
+
+	/// <summary>
+	/// Caustic light leaving a point of a diffuse surface, per unit of albedo, from the nearest photons that landed
+	/// on the side the normal faces: their power over pi times the area of the disc they are spread over, times the
+	/// 1 / pi of a Lambertian surface
+	/// </summary>
+	/// <param name="p">Point on a diffuse surface</param>
+	/// <param name="normal">Normal of the surface at the point, facing the ray</param>
+	colour radiance(const point& p, const vec3& normal) const
+	{
+		if (photons.empty())
+			return colour(0.0, 0.0, 0.0);
+
+		std::pair<double, uint32_t> heap[PHOTON_MAX_NEAREST];
+		int k = std::max(1, std::min(settings.nearest, PHOTON_MAX_NEAREST));
+		int found = 0;
+		double maxDistanceSquared = settings.maxRadius * settings.maxRadius;
+		nearest(p, 0, photons.size(), heap, k, found, maxDistanceSquared);
+
+		colour power(0.0, 0.0, 0.0);
+		for (int i = 0; i < found; i++)
+		{
+			const Photon& photon = photons[heap[i].second];
+			if (photon.direction[0] * normal.x() + photon.direction[1] * normal.y() + photon.direction[2] * normal.z() >= 0.0)
+				continue;
+			power += colour(photon.power[0], photon.power[1], photon.power[2]);
+		}
+		return power / (pi * pi * maxDistanceSquared);
+	}
+
+	size_t size() const
+	{
+		return photons.size();
+	}
+
+	/// <summary>
+	/// Photons emitted to fill the map, those that found no caustic included
+	/// </summary>
+	size_t emittedCount() const
+	{
+		return emitted;
+	}
+
+	/// <summary>
+	/// Number of metal and glass objects the photons were aimed at
+	/// </summary>
+	size_t targetCount() const
+	{
+		return targets.size();
+	}
+
+	size_t memoryBytes() const
+	{
+		return photons.capacity() * sizeof(Photon) + targets.capacity() * sizeof(Target);
+	}
+};
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "renderer.h"
+#include "image.h"
+#include "checkpoint.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Renders a frame in passes of a few samples per pixel into an accumulation buffer, so the frame can be
+/// checkpointed between tiles and resumed later, or stopped at a deadline with the samples reached so far
+/// </summary>
+class ProgressiveRenderer
+{
+private:
+	RenderContext context;
+	std::vector<Tile> tiles;
+	/// <summary>
+	/// Samples every tile already had when the render started
+	/// </summary>
+	std::vector<uint32_t> initialSamples;
+	int passSamples;
+	int totalSamples;
+	int passes = 0;
+
+	bool hasDeadline = false;
+	std::chrono::steady_clock::time_point deadline;
+	std::chrono::steady_clock::time_point started;
+	/// <summary>
+	/// Tiles finished in every pass begun so far, guarded by bufferMutex
+	/// </summary>
+	std::vector<size_t> passTiles;
+
+	std::mutex bufferMutex;
+	std::mutex doneMutex;
+	std::condition_variable doneChanged;
+	int stoppedThreads = 0;
+	bool done = false;
+	std::atomic<size_t> nextJob;
+	std::atomic<size_t> finishedJobs;
+
+	/// <summary>
+	/// Adds one pass to one tile. The random streams are keyed by the number of samples the tile had before the
+	/// pass, so every sample of a pixel comes from a different stream, even across resumes
+	/// </summary>
+	void renderJob(size_t job, std::vector<float>& pixels, std::vector<float>& cost)
+	{
+		size_t tileIndex = job % tiles.size();
+		int pass = int(job / tiles.size());
+		const Tile& tile = tiles[tileIndex];
+
+		long long start = (long long)initialSamples[tileIndex] + (long long)pass * passSamples;
+		int samples = int(std::min<long long>(passSamples, totalSamples - start));
+		if (samples <= 0)
+			return;
+
+		RenderContext jobContext = context;
+		jobContext.settings.samples = samples;
+		jobContext.settings.seed = mixSeed(context.settings.seed, uint64_t(start));
+
+		size_t tileFloats = size_t(tile.width()) * tile.height() * 3;
+		pixels.resize(tileFloats);
+		if (costs.width > 0)
+			cost.resize(tileFloats);
+
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			size_t row = size_t(y - tile.y0) * tile.width() * 3;
+			renderTileRow(jobContext, tile, y, pixels.data() + row, costs.width > 0 ? cost.data() + row : nullptr);
+		}
+
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		buffer.addTile(tile, pixels.data(), samples);
+
+		if (costs.width > 0)
+		{
+			const float* add = cost.data();
+			for (int y = tile.y0; y < tile.y1; y++)
+				for (int x = tile.x0; x < tile.x1; x++)
+					for (int c = 0; c < 3; c++)
+						costs.at(x, y)[c] += *add++;
+		}
+	}
+
+	void work()
+	{
+		std::vector<float> pixels;
+		std::vector<float> cost;
+		size_t jobs = tiles.size() * passes;
+
+		// jobs are handed out pass by pass, so stopping at the deadline leaves at most one pass unfinished
+		for (size_t job = nextJob++; job < jobs; job = nextJob++)
+		{
+			if (hasDeadline && std::chrono::steady_clock::now() >= deadline)
+				return;
+
+			renderJob(job, pixels, cost);
+			finishedJobs++;
+
+			std::lock_guard<std::mutex> lock(bufferMutex);
+			size_t pass = job / tiles.size();
+			if (passTiles.size() <= pass)
+				passTiles.resize(pass + 1, 0);
+			if (++passTiles[pass] == tiles.size())
+				passSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+		}
+	}
+
+public:
+	AccumulationBuffer buffer;
+	/// <summary>
+	/// Cost of every pixel summed over the passes of this render, see renderTileRow; only kept after recordCosts()
+	/// </summary>
+	FloatImage costs;
+	/// <summary>
+	/// Seconds from the start of render() to the end of every pass finished on all tiles, in the order they finished
+	/// </summary>
+	std::vector<double> passSeconds;
+
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="context">Scene and settings of the render; settings.samples is ignored</param>
+	/// <param name="tileSize">Width and height of the tiles</param>
+	/// <param name="passSamples">Samples per pixel added by each pass</param>
+	/// <param name="totalSamples">Samples per pixel to reach</param>
+	/// <param name="start">Samples accumulated so far, e.g. read from a checkpoint; empty to start from scratch</param>
+	ProgressiveRenderer(const RenderContext& context, int tileSize, int passSamples, int totalSamples, AccumulationBuffer start)
+		: nextJob(0), finishedJobs(0)
+	{
+		this->context = context;
+		this->passSamples = std::max(passSamples, 1);
+		this->totalSamples = totalSamples;
+		tiles = makeTiles(context.imgWidth, context.imgHeight, tileSize);
+
+		buffer = start.counts.empty() ? AccumulationBuffer(context.imgWidth, context.imgHeight) : std::move(start);
+
+		uint32_t fewest = uint32_t(std::max(totalSamples, 0));
+		for (const Tile& tile : tiles)
+		{
+			initialSamples.push_back(buffer.tileSamples(tile));
+			fewest = std::min(fewest, initialSamples.back());
+		}
+
+		passes = (std::max(totalSamples - int(fewest), 0) + this->passSamples - 1) / this->passSamples;
+	}
+
+	/// <summary>
+	/// Makes the next render measure the time and traversal work of every pixel into costs
+	/// </summary>
+	void recordCosts()
+	{
+		costs = FloatImage(context.imgWidth, context.imgHeight);
+	}
+
+	/// <summary>
+	/// Makes the next render stop handing out tiles at the deadline; tiles already begun are finished
+	/// </summary>
+	void setDeadline(std::chrono::steady_clock::time_point deadline)
+	{
+		hasDeadline = true;
+		this->deadline = deadline;
+	}
+
+	/// <summary>
+	/// Fewest and most samples any pixel of the buffer holds
+	/// </summary>
+	void sampleRange(uint32_t& fewest, uint32_t& most) const
+	{
+		fewest = UINT32_MAX;
+		most = 0;
+		for (const Tile& tile : tiles)
+		{
+			uint32_t samples = buffer.tileSamples(tile);
+			fewest = std::min(fewest, samples);
+			most = std::max(most, samples);
+		}
+	}
+
+	/// <summary>
+	/// Renders until every pixel has totalSamples samples or the deadline passes
+	/// </summary>
+	/// <param name="threadCount">Number of render threads</param>
+	/// <param name="writer">Receives a snapshot of the buffer every interval seconds and at the end; may be null</param>
+	/// <param name="interval">Seconds between checkpoints</param>
+	void render(int threadCount, CheckpointWriter* writer, int interval)
+	{
+		size_t jobs = tiles.size() * passes;
+		std::vector<std::thread> threads;
+		started = std::chrono::steady_clock::now();
+
+		threadCount = std::max(threadCount, 1);
+		for (int i = 0; i < threadCount; i++)
+			threads.emplace_back([this, threadCount]()
+			{
+				work();
+				std::lock_guard<std::mutex> lock(doneMutex);
+				done = ++stoppedThreads == threadCount;
+				doneChanged.notify_all();
+			});
+
+		auto lastCheckpoint = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(doneMutex);
+
+		while (!done)
+		{
+			doneChanged.wait_for(lock, std::chrono::seconds(1));
+			if (hasDeadline)
+			{
+				double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+				std::cerr << "\rpass " << finishedJobs / std::max<size_t>(tiles.size(), 1) + 1 << ", " << std::max(int(left + 0.5), 0) << " s left   " << std::flush;
+			}
+			else
+				std::cerr << "\r" << (jobs > 0 ? 100 * finishedJobs / jobs : 100) << "% " << std::flush;
+
+			if (writer != nullptr && std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(interval))
+			{
+				std::lock_guard<std::mutex> bufferLock(bufferMutex);
+				writer->save(buffer);
+				lastCheckpoint = std::chrono::steady_clock::now();
+			}
+		}
+		lock.unlock();
+
+		for (auto& thread : threads)
+			thread.join();
+
+		if (writer != nullptr)
+		{
+			writer->save(buffer);
+			writer->flush();
+		}
+	}
+};
+
+#endif
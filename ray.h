@@ -17,6 +17,14 @@ public:
     /// Direction of the ray
     /// </summary>
     vec3 direction;
+    /// <summary>
+    /// Width of the cone of rays this ray stands for (a pixel, at first) where it starts
+    /// </summary>
+    double width = 0.0;
+    /// <summary>
+    /// Growth of that width per unit of distance travelled, the angle of the cone in radians
+    /// </summary>
+    double spread = 0.0;
     
     /// <summary>
     /// Default constructor
@@ -44,6 +52,14 @@ public:
     {
         return origin + t * direction;
     }
+
+    /// <summary>
+    /// Width of the cone of the ray at A + Bt, which texture lookups use to pick how much detail to read
+    /// </summary>
+    double widthAt(double t) const
+    {
+        return spread > 0.0 ? width + spread * t * direction.length() : width;
+    }
 };
 
 #endif
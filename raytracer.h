@@ -0,0 +1,37 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+/// <summary>
+/// Everything needed to build scenes and render them from another program. Every function defined in these headers
+/// is inline, so the header can be included from any number of translation units of the same program.
+/// Typical use: build a scene with buildScene or from your own objects, create one ThreadPool for the whole program,
+/// and start a RenderSession per image; sessions running at the same time share the threads of the pool
+/// </summary>
+
+#include "const_utility.h"
+#include "vec3.h"
+#include "ray.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "material.h"
+#include "texture.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "cuboid.h"
+#include "accelerator.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "grid.h"
+#include "light_bvh.h"
+#include "environment.h"
+#include "scenes.h"
+#include "image.h"
+#include "checkpoint.h"
+#include "renderer.h"
+#include "progressive.h"
+#include "crop.h"
+#include "thread_pool.h"
+#include "render_session.h"
+
+#endif
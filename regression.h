@@ -0,0 +1,248 @@
+#ifndef REGRESSION_H
+#define REGRESSION_H
+
+#include "const_utility.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// PSNR written for images that match exactly, which JSON has no infinity for
+/// </summary>
+const double REGRESSION_EXACT_PSNR = 100.0;
+
+/// <summary>
+/// Timed measurements of every scene; their spread decides how large a drop in speed counts as a regression
+/// </summary>
+const int REGRESSION_REPEATS = 5;
+
+/// <summary>
+/// Least time one measurement renders for; a scene that renders faster is rendered again until it is reached, so the
+/// timer and the thread start-up do not dominate small scenes
+/// </summary>
+const double REGRESSION_MIN_SECONDS = 0.25;
+
+/// <summary>
+/// Standard deviations of the change in rays/s a scene may drop below its baseline before it counts as slower
+/// </summary>
+const double REGRESSION_NOISE_FACTOR = 3.0;
+
+/// <summary>
+/// Settings every scene of a regression run is rendered with; runs are only comparable if these match
+/// </summary>
+struct RegressionSettings
+{
+	int height = 0;
+	int samples = 0;
+	int maxDepth = 0;
+	uint64_t seed = 0;
+	int threads = 0;
+};
+
+/// <summary>
+/// Measurements of one scene in a regression run
+/// </summary>
+struct RegressionResult
+{
+	int scene = 0;
+	int width = 0;
+	int height = 0;
+	/// <summary>
+	/// Mean time of one render and the rays it traces
+	/// </summary>
+	double seconds = 0.0;
+	double rays = 0.0;
+	/// <summary>
+	/// Mean and standard deviation of rays/s over the timed measurements
+	/// </summary>
+	double raysPerSecond = 0.0;
+	double raysPerSecondDeviation = 0.0;
+	int repeats = 0;
+	/// <summary>
+	/// Peak resident memory of the process so far, in MiB. The scenes share one process, so this is the high-water
+	/// mark of this scene and every one before it, not the memory of this scene alone
+	/// </summary>
+	double processPeakMiB = 0.0;
+	/// <summary>
+	/// Whether a reference image was there to compare with; rmse and psnr are 0 otherwise
+	/// </summary>
+	bool reference = false;
+	double rmse = 0.0;
+	double psnr = 0.0;
+	bool passed = true;
+};
+
+/// <summary>
+/// Difference between two images as they are displayed, gamma corrected and clipped to [0, 1] the way writePPM does,
+/// so a single firefly or a bright light cannot dominate the error
+/// </summary>
+/// <param name="rmse">Receives the root mean squared error over all channels</param>
+/// <param name="psnr">Receives the peak signal to noise ratio in dB, REGRESSION_EXACT_PSNR for identical images</param>
+/// <returns>False, if the images differ in size</returns>
+inline bool imageDifference(const FloatImage& image, const FloatImage& reference, double& rmse, double& psnr)
+{
+	if (image.width != reference.width || image.height != reference.height)
+		return false;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < image.pixels.size(); i++)
+	{
+		double d = sqrt(clamp(image.pixels[i], 0.0, 1.0)) - sqrt(clamp(reference.pixels[i], 0.0, 1.0));
+		sum += d * d;
+	}
+
+	rmse = image.pixels.empty() ? 0.0 : sqrt(sum / image.pixels.size());
+	psnr = rmse > 0.0 ? std::min(-20.0 * log10(rmse), REGRESSION_EXACT_PSNR) : REGRESSION_EXACT_PSNR;
+	return true;
+}
+
+/// <summary>
+/// Mean and sample standard deviation of a set of measurements
+/// </summary>
+inline void meanAndDeviation(const std::vector<double>& values, double& mean, double& deviation)
+{
+	mean = 0.0;
+	deviation = 0.0;
+	if (values.empty())
+		return;
+
+	for (double value : values)
+		mean += value;
+	mean /= values.size();
+
+	if (values.size() < 2)
+		return;
+	for (double value : values)
+		deviation += (value - mean) * (value - mean);
+	deviation = sqrt(deviation / (values.size() - 1));
+}
+
+/// <summary>
+/// Percentage by which the rays/s of a scene may drop below its baseline before the scene counts as slower:
+/// REGRESSION_NOISE_FACTOR times the relative spread of the ratio of the two, given the spread of both runs, or the
+/// given least percentage if that is larger
+/// </summary>
+/// <param name="least">Least percentage, for runs whose measurements happen to agree closely</param>
+inline double slowdownThreshold(const RegressionResult& result, const RegressionResult& base, double least)
+{
+	double current = result.raysPerSecond > 0.0 ? result.raysPerSecondDeviation / result.raysPerSecond : 0.0;
+	double previous = base.raysPerSecond > 0.0 ? base.raysPerSecondDeviation / base.raysPerSecond : 0.0;
+	return std::max(least, 100.0 * REGRESSION_NOISE_FACTOR * sqrt(current * current + previous * previous));
+}
+
+/// <summary>
+/// Writes the settings and results of a run as JSON, one scene per line so two runs diff line by line
+/// </summary>
+/// <returns>True, if the file was written</returns>
+inline bool writeRegressionSummary(const std::string& filename, const RegressionSettings& settings, const std::vector<RegressionResult>& results)
+{
+	std::ofstream file(filename);
+	if (!file)
+		return false;
+
+	file.precision(6);
+	file << "{\n  \"settings\": { \"height\": " << settings.height << ", \"samples\": " << settings.samples << ", \"depth\": "
+		<< settings.maxDepth << ", \"seed\": " << settings.seed << ", \"threads\": " << settings.threads << " },\n  \"scenes\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const RegressionResult& r = results[i];
+		file << "    { \"scene\": " << r.scene << ", \"width\": " << r.width << ", \"height\": " << r.height
+			<< ", \"seconds\": " << r.seconds << ", \"rays\": " << r.rays << ", \"rays_per_second\": " << r.raysPerSecond
+			<< ", \"rays_per_second_stddev\": " << r.raysPerSecondDeviation << ", \"repeats\": " << r.repeats
+			<< ", \"process_peak_rss_mib\": " << r.processPeakMiB << ", \"reference\": " << (r.reference ? "true" : "false")
+			<< ", \"rmse\": " << r.rmse << ", \"psnr\": " << r.psnr << ", \"passed\": " << (r.passed ? "true" : "false") << " }"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+
+	file << "  ]\n}\n";
+	return bool(file);
+}
+
+/// <summary>
+/// Finds "key": in a line
+/// </summary>
+/// <returns>The value after it, null if the key is not in the line</returns>
+inline const char* findJsonValue(const std::string& line, const std::string& key)
+{
+	size_t at = line.find("\"" + key + "\":");
+	if (at == std::string::npos)
+		return nullptr;
+
+	const char* text = line.c_str() + at + key.size() + 3;
+	while (*text == ' ')
+		text++;
+	return text;
+}
+
+/// <summary>
+/// Finds "key": in a line and reads the number or boolean after it
+/// </summary>
+/// <returns>False, if the key is not in the line</returns>
+inline bool readJsonValue(const std::string& line, const std::string& key, double& value)
+{
+	const char* text = findJsonValue(line, key);
+	if (text == nullptr)
+		return false;
+
+	if (std::strncmp(text, "true", 4) == 0)
+		value = 1.0;
+	else if (std::strncmp(text, "false", 5) == 0)
+		value = 0.0;
+	else
+		value = std::strtod(text, nullptr);
+	return true;
+}
+
+/// <summary>
+/// Reads a summary written by writeRegressionSummary. Only that layout is understood, not JSON in general
+/// </summary>
+/// <returns>False, if the file could not be read or holds no scenes</returns>
+inline bool readRegressionSummary(const std::string& filename, RegressionSettings& settings, std::vector<RegressionResult>& results)
+{
+	std::ifstream file(filename);
+	if (!file)
+		return false;
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		double value;
+		if (line.find("\"settings\"") != std::string::npos)
+		{
+			if (readJsonValue(line, "height", value)) settings.height = int(value);
+			if (readJsonValue(line, "samples", value)) settings.samples = int(value);
+			if (readJsonValue(line, "depth", value)) settings.maxDepth = int(value);
+			if (const char* seed = findJsonValue(line, "seed")) settings.seed = std::strtoull(seed, nullptr, 10);
+			if (readJsonValue(line, "threads", value)) settings.threads = int(value);
+		}
+		else if (readJsonValue(line, "scene", value))
+		{
+			RegressionResult r;
+			r.scene = int(value);
+			if (readJsonValue(line, "width", value)) r.width = int(value);
+			if (readJsonValue(line, "height", value)) r.height = int(value);
+			if (readJsonValue(line, "seconds", value)) r.seconds = value;
+			if (readJsonValue(line, "rays", value)) r.rays = value;
+			if (readJsonValue(line, "rays_per_second", value)) r.raysPerSecond = value;
+			if (readJsonValue(line, "rays_per_second_stddev", value)) r.raysPerSecondDeviation = value;
+			if (readJsonValue(line, "repeats", value)) r.repeats = int(value);
+			if (readJsonValue(line, "process_peak_rss_mib", value)) r.processPeakMiB = value;
+			if (readJsonValue(line, "reference", value)) r.reference = value != 0.0;
+			if (readJsonValue(line, "rmse", value)) r.rmse = value;
+			if (readJsonValue(line, "psnr", value)) r.psnr = value;
+			if (readJsonValue(line, "passed", value)) r.passed = value != 0.0;
+			results.push_back(r);
+		}
+	}
+	return !results.empty();
+}
+
+#endif
@@ -0,0 +1,508 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "const_utility.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "image.h"
+#include "net.h"
+#include "thread_pool.h"
+#include "render_session.h"
+#include "gbuffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// One render request sent to the server, e.g.
+/// "render scene=2 width=400 spp=4 crop=0,0,200,200 from=478,278,-600 at=278,278,0 vfov=40 priority=5 hits=on out=view.ppm"
+/// </summary>
+struct RenderJob
+{
+	int scene = 3;
+	int width = 0;
+	int height = 0;
+	int samples = 1;
+	int maxDepth = 5;
+	uint64_t seed = 0;
+	/// <summary>
+	/// Tiles of jobs with a higher priority are rendered first
+	/// </summary>
+	int priority = 0;
+	/// <summary>
+	/// Part of the frame to render, the whole frame if empty
+	/// </summary>
+	Tile crop = { 0, 0, 0, 0 };
+	std::string output;
+	/// <summary>
+	/// Set to keep the primary hits of the view, or to take them from an earlier job with the same view, resolution,
+	/// samples and seed instead of tracing the camera rays
+	/// </summary>
+	bool reuseHits = false;
+
+	/// <summary>
+	/// Set when the job brings its own camera instead of the one of the scene
+	/// </summary>
+	bool customCamera = false;
+	point lookFrom;
+	point lookAt;
+	double vfov = 40.0;
+	double aperture = 0.0;
+	double focusDistance = 10.0;
+};
+
+/// <summary>
+/// Reads a list of numbers separated by commas
+/// </summary>
+inline std::vector<double> parseNumbers(const std::string& text)
+{
+	std::vector<double> numbers;
+	std::stringstream stream(text);
+	std::string item;
+
+	while (std::getline(stream, item, ','))
+		numbers.push_back(std::stod(item));
+	return numbers;
+}
+
+/// <summary>
+/// Parses the key=value pairs following the "render" command
+/// </summary>
+/// <param name="words">The words of the request, the first being the command</param>
+/// <param name="job">Receives the job</param>
+/// <param name="error">Receives what is wrong with the request</param>
+/// <returns>False, if the request is malformed</returns>
+inline bool parseRenderJob(const std::vector<std::string>& words, RenderJob& job, std::string& error)
+{
+	try
+	{
+		for (size_t i = 1; i < words.size(); i++)
+		{
+			auto equals = words[i].find('=');
+			if (equals == std::string::npos)
+			{
+				error = "expected key=value, got " + words[i];
+				return false;
+			}
+
+			std::string key = words[i].substr(0, equals);
+			std::string value = words[i].substr(equals + 1);
+
+			if (key == "scene")
+				job.scene = std::stoi(value);
+			else if (key == "width")
+				job.width = std::stoi(value);
+			else if (key == "height")
+				job.height = std::stoi(value);
+			else if (key == "spp")
+				job.samples = std::stoi(value);
+			else if (key == "depth")
+				job.maxDepth = std::stoi(value);
+			else if (key == "seed")
+				job.seed = std::stoull(value);
+			else if (key == "priority")
+				job.priority = std::stoi(value);
+			else if (key == "out")
+				job.output = value;
+			else if (key == "hits")
+				job.reuseHits = value != "off";
+			else if (key == "crop" || key == "from" || key == "at")
+			{
+				auto numbers = parseNumbers(value);
+				size_t expected = key == "crop" ? 4 : 3;
+				if (numbers.size() != expected)
+				{
+					error = key + " takes " + std::to_string(expected) + " numbers";
+					return false;
+				}
+
+				if (key == "crop")
+					job.crop = { int(numbers[0]), int(numbers[1]), int(numbers[2]), int(numbers[3]) };
+				else if (key == "from")
+					job.lookFrom = point(numbers[0], numbers[1], numbers[2]);
+				else
+					job.lookAt = point(numbers[0], numbers[1], numbers[2]);
+
+				if (key != "crop")
+					job.customCamera = true;
+			}
+			else if (key == "vfov")
+				job.vfov = std::stod(value);
+			else if (key == "aperture")
+				job.aperture = std::stod(value);
+			else if (key == "focus")
+				job.focusDistance = std::stod(value);
+			else
+			{
+				error = "unknown key " + key;
+				return false;
+			}
+		}
+	}
+	catch (const std::exception&)
+	{
+		error = "bad number in request";
+		return false;
+	}
+
+	if (job.output.empty())
+	{
+		error = "out= is required";
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Memory the render server keeps primary hits in, over all views; the views used longest ago are dropped first
+/// </summary>
+const size_t SERVER_GBUFFER_BYTES = size_t(256) << 20;
+
+/// <summary>
+/// Everything the primary hits of a job depend on: scene, camera, resolution, samples and seed
+/// </summary>
+inline std::string viewKey(const RenderJob& job)
+{
+	std::ostringstream key;
+	key.precision(17);
+	key << job.scene << " " << job.width << "x" << job.height << " " << job.samples << " " << job.seed;
+	if (job.customCamera)
+		key << " " << job.lookFrom << " " << job.lookAt << " " << job.vfov << " " << job.aperture << " " << job.focusDistance;
+	return key.str();
+}
+
+/// <summary>
+/// Long-running render daemon listening on a UNIX domain socket. Scenes are built once, on first use, and stay in
+/// memory with their BVH; every client gets its own connection thread, and the tiles of all jobs share one thread
+/// pool, ordered by job priority. The geometry of a scene never changes once built, so the primary hits of a view
+/// stay valid: jobs asking for them (hits=on) keep them, and later jobs with the same view only shade them
+/// </summary>
+class RenderServer
+{
+private:
+	ThreadPool& pool;
+	int tileSize;
+
+	std::mutex sceneMutex;
+	std::map<int, std::shared_future<shared_ptr<SceneData>>> scenes;
+
+	/// <summary>
+	/// Complete G-buffers by view key, and the keys from the least to the most recently used
+	/// </summary>
+	std::mutex gbufferMutex;
+	std::map<std::string, shared_ptr<GBuffer>> gbuffers;
+	std::vector<std::string> gbufferOrder;
+	size_t gbufferBytes = 0;
+
+	Socket server;
+	std::string path;
+	std::mutex clientMutex;
+	std::vector<std::thread> clients;
+	std::vector<Socket*> connections;
+	std::atomic<bool> stopping;
+	std::atomic<long long> jobsDone;
+
+	/// <summary>
+	/// Gets a scene, building it if this is its first use. Concurrent first requests wait for the same build. A build
+	/// that fails is not cached: the requests waiting for it get the failure, and the next request tries again
+	/// </summary>
+	/// <returns>The scene, null if there is no scene with the given number</returns>
+	shared_ptr<SceneData> scene(int id)
+	{
+		if (id < 1 || id > SCENE_COUNT)
+			return nullptr;
+
+		std::shared_future<shared_ptr<SceneData>> loading;
+		bool build = false;
+		std::promise<shared_ptr<SceneData>> promise;
+		{
+			std::lock_guard<std::mutex> lock(sceneMutex);
+			auto found = scenes.find(id);
+			if (found == scenes.end())
+			{
+				loading = promise.get_future().share();
+				scenes[id] = loading;
+				build = true;
+			}
+			else
+				loading = found->second;
+		}
+
+		if (build)
+		{
+			auto start = std::chrono::steady_clock::now();
+			shared_ptr<SceneData> built;
+			try
+			{
+				built = buildScene(id, 0);
+			}
+			catch (...)
+			{
+				// the entry goes before the waiters are released, so none of them finds the failed build again
+				{
+					std::lock_guard<std::mutex> lock(sceneMutex);
+					scenes.erase(id);
+				}
+				promise.set_exception(std::current_exception());
+				throw;
+			}
+
+			if (!built)
+			{
+				std::lock_guard<std::mutex> lock(sceneMutex);
+				scenes.erase(id);
+			}
+			promise.set_value(built);
+
+			if (built)
+				std::cerr << "Loaded scene " << id << " (" << built->world.objects.size() << " objects) in "
+					<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+		}
+		return loading.get();
+	}
+
+	/// <summary>
+	/// Gets the complete G-buffer of a view and marks it as the most recently used
+	/// </summary>
+	/// <returns>Null, if no job kept the hits of the view yet</returns>
+	shared_ptr<GBuffer> findHits(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock(gbufferMutex);
+		auto found = gbuffers.find(key);
+		if (found == gbuffers.end())
+			return nullptr;
+
+		gbufferOrder.erase(std::find(gbufferOrder.begin(), gbufferOrder.end(), key));
+		gbufferOrder.push_back(key);
+		return found->second;
+	}
+
+	/// <summary>
+	/// Keeps a complete G-buffer for later jobs with the same view, dropping the least recently used ones to stay
+	/// within SERVER_GBUFFER_BYTES
+	/// </summary>
+	void keepHits(const std::string& key, shared_ptr<GBuffer> gbuffer)
+	{
+		std::lock_guard<std::mutex> lock(gbufferMutex);
+		if (gbuffer->memoryBytes() > SERVER_GBUFFER_BYTES || gbuffers.count(key))
+			return;
+
+		while (gbufferBytes + gbuffer->memoryBytes() > SERVER_GBUFFER_BYTES)
+		{
+			gbufferBytes -= gbuffers[gbufferOrder.front()]->memoryBytes();
+			gbuffers.erase(gbufferOrder.front());
+			gbufferOrder.erase(gbufferOrder.begin());
+		}
+
+		gbufferBytes += gbuffer->memoryBytes();
+		gbuffers[key] = std::move(gbuffer);
+		gbufferOrder.push_back(key);
+	}
+
+	/// <summary>
+	/// Renders a job and writes its image
+	/// </summary>
+	/// <returns>The reply to the client</returns>
+	std::string render(RenderJob job)
+	{
+		auto start = std::chrono::steady_clock::now();
+		auto data = scene(job.scene);
+		if (!data)
+			return "error no scene " + std::to_string(job.scene);
+
+		if (job.width <= 0 && job.height <= 0)
+		{
+			job.width = data->imgWidth;
+			job.height = data->imgHeight;
+		}
+		else if (job.width <= 0)
+			job.width = static_cast<int>(job.height * data->aspectRatio);
+		else if (job.height <= 0)
+			job.height = static_cast<int>(job.width / data->aspectRatio);
+
+		if (job.crop.width() <= 0 || job.crop.height() <= 0)
+			job.crop = { 0, 0, job.width, job.height };
+
+		if (job.width < 2 || job.height < 2 || job.samples <= 0 || job.crop.x0 < 0 || job.crop.y0 < 0 || job.crop.x1 > job.width || job.crop.y1 > job.height)
+			return "error bad resolution, samples or crop window";
+
+		RenderContext context;
+		context.world = data->root.get();
+		context.lights = data->lights.get();
+		context.camera = job.customCamera ? Camera(job.lookFrom, job.lookAt, double(job.width) / job.height, job.vfov, job.aperture, job.focusDistance) : data->camera;
+		context.imgWidth = job.width;
+		context.imgHeight = job.height;
+		context.settings.samples = job.samples;
+		context.settings.maxDepth = job.maxDepth;
+		context.settings.seed = job.seed;
+
+		RenderSession session(pool, data, context, job.crop, tileSize, job.priority);
+
+		// a view seen before only needs shading; a new one records its hits into a buffer of its own, which is shared
+		// once the whole frame is in it. Only full frames are recorded, as a crop would leave the rest of it empty
+		std::string key;
+		shared_ptr<GBuffer> recording;
+		if (job.reuseHits && job.maxDepth > 0)
+		{
+			key = viewKey(job);
+			if (auto hits = findHits(key))
+				session.reuseHits(hits);
+			else if (job.crop.width() == job.width && job.crop.height() == job.height)
+			{
+				recording = make_shared<GBuffer>(job.width, job.height, job.samples);
+				session.reuseHits(recording);
+			}
+		}
+
+		FloatImage image = session.start().get();
+		if (recording && recording->ready)
+			keepHits(key, recording);
+
+		bool pfm = job.output.size() > 4 && job.output.compare(job.output.size() - 4, 4, ".pfm") == 0;
+		if (!(pfm ? image.writePFM(job.output) : image.writePPM(job.output)))
+			return "error could not write " + job.output;
+
+		jobsDone++;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::ostringstream reply;
+		reply << "ok " << job.output << " " << image.width << "x" << image.height << " " << ms << " ms";
+		return reply.str();
+	}
+
+	/// <summary>
+	/// Answers one request line
+	/// </summary>
+	std::string handle(const std::string& line)
+	{
+		std::vector<std::string> words;
+		std::istringstream stream(line);
+		for (std::string word; stream >> word; )
+			words.push_back(word);
+
+		if (words.empty())
+			return "error empty request";
+
+		if (words[0] == "render")
+		{
+			RenderJob job;
+			std::string error;
+			if (!parseRenderJob(words, job, error))
+				return "error " + error;
+			return render(job);
+		}
+
+		if (words[0] == "load" && words.size() == 2)
+		{
+			int id = std::stoi(words[1].substr(words[1].find('=') + 1));
+			return scene(id) ? "ok loaded scene " + std::to_string(id) : "error no scene " + std::to_string(id);
+		}
+
+		if (words[0] == "status")
+		{
+			std::lock_guard<std::mutex> lock(sceneMutex);
+			std::lock_guard<std::mutex> hitsLock(gbufferMutex);
+			return "ok " + std::to_string(scenes.size()) + " scenes loaded, " + std::to_string(gbuffers.size()) + " views of hits kept ("
+				+ std::to_string(gbufferBytes >> 20) + " MiB), " + std::to_string(jobsDone) + " jobs done, " + std::to_string(pool.size()) + " threads";
+		}
+
+		return "error unknown command " + words[0];
+	}
+
+	void serveClient(Socket socket)
+	{
+		{
+			std::lock_guard<std::mutex> lock(clientMutex);
+			connections.push_back(&socket);
+		}
+
+		std::string line;
+		while (!stopping && socket.receiveLine(line))
+		{
+			if (line == "shutdown")
+			{
+				socket.sendLine("ok shutting down");
+				stop();
+				break;
+			}
+
+			std::string reply;
+			try
+			{
+				reply = handle(line);
+			}
+			catch (const std::exception& e)
+			{
+				reply = std::string("error ") + e.what();
+			}
+
+			if (!socket.sendLine(reply))
+				break;
+		}
+
+		std::lock_guard<std::mutex> lock(clientMutex);
+		connections.erase(std::find(connections.begin(), connections.end(), &socket));
+	}
+
+	void stop()
+	{
+		stopping = true;
+		server.shutdown();
+	}
+
+public:
+	RenderServer(ThreadPool& pool, int tileSize) : pool(pool), stopping(false), jobsDone(0)
+	{
+		this->tileSize = tileSize;
+	}
+
+	/// <summary>
+	/// Starts listening for clients
+	/// </summary>
+	/// <returns>False, if the socket could not be created</returns>
+	bool listen(const std::string& path)
+	{
+		this->path = path;
+		server = listenLocal(path);
+		return server.valid();
+	}
+
+	/// <summary>
+	/// Serves clients until one of them sends "shutdown"
+	/// </summary>
+	void run()
+	{
+		while (!stopping)
+		{
+			Socket socket = server.accept();
+			if (!socket.valid())
+				break;
+
+			std::lock_guard<std::mutex> lock(clientMutex);
+			clients.emplace_back(&RenderServer::serveClient, this, std::move(socket));
+		}
+
+		{
+			// wake up clients still waiting for their next request
+			std::lock_guard<std::mutex> lock(clientMutex);
+			for (Socket* connection : connections)
+				connection->shutdown();
+		}
+
+		for (auto& client : clients)
+			client.join();
+
+		server.close();
+		std::remove(path.c_str());
+	}
+};
+
+#endif
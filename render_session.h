@@ -0,0 +1,322 @@
+#ifndef RENDER_SESSION_H
+#define RENDER_SESSION_H
+
+#include "const_utility.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "gbuffer.h"
+#include "image.h"
+#include "thread_pool.h"
+#include "crop.h"
+#include "stats.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// <summary>
+/// Called after every finished tile with the number of tiles finished and the number in the frame
+/// </summary>
+typedef std::function<void(size_t finished, size_t total)> ProgressCallback;
+
+/// <summary>
+/// Called with every finished tile, in image co-ordinates, and its three floats per pixel, row by row
+/// </summary>
+typedef std::function<void(const Tile& tile, const float* pixels)> TileCallback;
+
+/// <summary>
+/// One asynchronous render of a frame, or of a crop window of it, on a thread pool that may be shared with other
+/// sessions. Every tile is queued as its own task at the priority of the session, so concurrent sessions split the
+/// threads of the pool between them instead of each starting threads of its own.
+/// Callbacks run on the pool threads, one at a time per session, and may call any method of the session but its
+/// destructor. Cancelling is cooperative: tiles not yet begun are skipped and tiles being rendered stop at their next
+/// row, and the future then receives the tiles finished so far. A tile that throws cancels the render the same way,
+/// and the future receives its exception instead
+/// </summary>
+class RenderSession
+{
+private:
+	struct State
+	{
+		/// <summary>
+		/// Keeps the objects the context points to alive until the last task has run
+		/// </summary>
+		shared_ptr<SceneData> scene;
+		RenderContext context;
+		/// <summary>
+		/// G-buffer the context records into or reuses, kept alive with the session; null to trace every camera ray
+		/// </summary>
+		shared_ptr<GBuffer> gbuffer;
+		Tile crop;
+		std::vector<Tile> tiles;
+
+		std::mutex mutex;
+		FloatImage image;
+		size_t finished = 0;
+		size_t remaining = 0;
+		std::promise<FloatImage> result;
+		/// <summary>
+		/// First exception thrown by a tile, given to the future instead of the image
+		/// </summary>
+		std::exception_ptr failure;
+
+		/// <summary>
+		/// Held while the callbacks run, and while they are changed
+		/// </summary>
+		std::mutex callbackMutex;
+		ProgressCallback progress;
+		TileCallback tileDone;
+
+		std::atomic<bool> cancelled;
+		/// <summary>
+		/// Rays traced and nanoseconds spent by the tiles of this session, summed over the threads
+		/// </summary>
+		std::atomic<uint64_t> rays;
+		std::atomic<uint64_t> nanoseconds;
+
+		State() : cancelled(false), rays(0), nanoseconds(0)
+		{}
+
+		void renderTile(size_t index)
+		{
+			std::exception_ptr error;
+			try
+			{
+				renderAndReport(tiles[index]);
+			}
+			catch (...)
+			{
+				// the pool swallows what its tasks throw, so the error goes to the future and the other tiles stop
+				error = std::current_exception();
+				cancelled = true;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (error && !failure)
+				failure = error;
+			if (--remaining == 0)
+			{
+				if (failure)
+				{
+					result.set_exception(failure);
+					return;
+				}
+				// a buffer is only complete once every pixel of the frame recorded its hits
+				if (gbuffer && !gbuffer->ready && finished == tiles.size() && crop.x0 == 0 && crop.y0 == 0
+					&& crop.x1 == context.imgWidth && crop.y1 == context.imgHeight && context.settings.maxDepth > 0)
+					gbuffer->ready = true;
+				result.set_value(std::move(image));
+			}
+		}
+
+		/// <summary>
+		/// Renders a tile and, unless the session was cancelled meanwhile, stores it and calls back
+		/// </summary>
+		void renderAndReport(const Tile& tile)
+		{
+			size_t rowFloats = size_t(tile.width()) * 3;
+			std::vector<float> pixels(rowFloats * tile.height());
+
+			uint64_t raysBefore = traversalCounters().rays;
+			auto start = std::chrono::steady_clock::now();
+
+			bool complete = true;
+			for (int y = tile.y0; y < tile.y1 && complete; y++)
+			{
+				if (cancelled)
+					complete = false;
+				else
+					renderTileRow(context, tile, y, pixels.data() + (y - tile.y0) * rowFloats);
+			}
+
+			rays += traversalCounters().rays - raysBefore;
+			nanoseconds += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			if (!complete)
+				return;
+
+			// the callback lock keeps the callbacks one at a time and in order; the state lock is released before
+			// they run, so they may ask the session for its progress
+			std::lock_guard<std::mutex> callbackLock(callbackMutex);
+			size_t finishedNow;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				image.setTile({ tile.x0 - crop.x0, tile.y0 - crop.y0, tile.x1 - crop.x0, tile.y1 - crop.y0 }, pixels.data());
+				finishedNow = ++finished;
+			}
+			if (tileDone)
+				tileDone(tile, pixels.data());
+			if (progress)
+				progress(finishedNow, tiles.size());
+		}
+	};
+
+	ThreadPool& pool;
+	shared_ptr<State> state;
+	int priority;
+	bool started = false;
+
+	void prepare(shared_ptr<SceneData> scene, const RenderContext& context, const Tile& crop, int tileSize, int priority)
+	{
+		this->priority = priority;
+		state->scene = std::move(scene);
+		state->context = context;
+		state->crop = crop;
+		state->image = FloatImage(crop.width(), crop.height());
+		state->tiles = makeCropTiles(crop, tileSize);
+		state->remaining = state->tiles.size();
+	}
+
+public:
+	/// <summary>
+	/// Prepares a render of a whole scene as it was built
+	/// </summary>
+	/// <param name="pool">Pool the tiles are rendered on; must outlive the tasks of the session</param>
+	/// <param name="scene">Scene to render</param>
+	/// <param name="settings">Samples, depth, seed and light sampling of the render</param>
+	/// <param name="tileSize">Width and height of the tiles</param>
+	/// <param name="priority">Tiles of sessions with a higher priority run first</param>
+	RenderSession(ThreadPool& pool, shared_ptr<SceneData> scene, const RenderSettings& settings, int tileSize = 32, int priority = 0)
+		: pool(pool), state(make_shared<State>())
+	{
+		RenderContext context;
+		context.world = scene->root.get();
+		context.lights = scene->lights.get();
+		context.camera = scene->camera;
+		context.imgWidth = scene->imgWidth;
+		context.imgHeight = scene->imgHeight;
+		context.settings = settings;
+		prepare(std::move(scene), context, { 0, 0, context.imgWidth, context.imgHeight }, tileSize, priority);
+	}
+
+	/// <summary>
+	/// Prepares a render with a camera, resolution or crop window of its own
+	/// </summary>
+	/// <param name="pool">Pool the tiles are rendered on; must outlive the tasks of the session</param>
+	/// <param name="scene">Scene the context points into, kept alive for as long as the session renders</param>
+	/// <param name="context">World, camera, image size and settings of the render; the environment map, if any, must
+	/// outlive the session</param>
+	/// <param name="crop">Pixels of the frame to render; empty for the whole frame</param>
+	/// <param name="tileSize">Width and height of the tiles</param>
+	/// <param name="priority">Tiles of sessions with a higher priority run first</param>
+	RenderSession(ThreadPool& pool, shared_ptr<SceneData> scene, const RenderContext& context, Tile crop, int tileSize = 32, int priority = 0)
+		: pool(pool), state(make_shared<State>())
+	{
+		if (crop.width() <= 0 || crop.height() <= 0)
+			crop = { 0, 0, context.imgWidth, context.imgHeight };
+		prepare(std::move(scene), context, crop, tileSize, priority);
+	}
+
+	RenderSession(const RenderSession&) = delete;
+	RenderSession& operator = (const RenderSession&) = delete;
+
+	/// <summary>
+	/// Cancels the render; tasks still queued finish on their own without touching the session or calling back
+	/// </summary>
+	~RenderSession()
+	{
+		cancel();
+		std::lock_guard<std::mutex> lock(state->callbackMutex);
+		state->progress = nullptr;
+		state->tileDone = nullptr;
+	}
+
+	/// <summary>
+	/// Takes the camera rays through a G-buffer; only before start(). A buffer that is not ready records the primary
+	/// hits, and becomes ready when the session finishes the whole frame; a ready one gives the hits of any crop window
+	/// without tracing them, which is only right if nothing but materials changed since it was recorded. Sessions may
+	/// share a ready buffer, but only one at a time may record into a buffer
+	/// </summary>
+	/// <returns>False, if the buffer was made for another resolution or sample count</returns>
+	bool reuseHits(shared_ptr<GBuffer> gbuffer)
+	{
+		const RenderContext& context = state->context;
+		if (!gbuffer->matches(context.imgWidth, context.imgHeight, context.settings.samples))
+			return false;
+
+		state->context.gbuffer = gbuffer.get();
+		state->gbuffer = std::move(gbuffer);
+		return true;
+	}
+
+	/// <summary>
+	/// Sets the function called after every finished tile; only before start()
+	/// </summary>
+	void onProgress(ProgressCallback callback)
+	{
+		state->progress = std::move(callback);
+	}
+
+	/// <summary>
+	/// Sets the function that receives every finished tile; only before start()
+	/// </summary>
+	void onTile(TileCallback callback)
+	{
+		state->tileDone = std::move(callback);
+	}
+
+	/// <summary>
+	/// Queues the tiles on the pool and returns at once
+	/// </summary>
+	/// <returns>The image of the crop window once every tile has finished or been skipped; an invalid future if the
+	/// session was already started</returns>
+	std::future<FloatImage> start()
+	{
+		if (started)
+			return std::future<FloatImage>();
+		started = true;
+
+		std::future<FloatImage> image = state->result.get_future();
+		if (state->tiles.empty())
+		{
+			state->result.set_value(std::move(state->image));
+			return image;
+		}
+
+		shared_ptr<State> shared = state;
+		for (size_t i = 0; i < shared->tiles.size(); i++)
+			pool.submit([shared, i]() { shared->renderTile(i); }, priority);
+		return image;
+	}
+
+	/// <summary>
+	/// Asks the render to stop; returns at once, the future becomes ready when the tiles being rendered have stopped
+	/// </summary>
+	void cancel()
+	{
+		state->cancelled = true;
+	}
+
+	bool cancelled() const
+	{
+		return state->cancelled;
+	}
+
+	/// <summary>
+	/// Number of tiles finished so far and in the whole crop window
+	/// </summary>
+	void progress(size_t& finished, size_t& total) const
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		finished = state->finished;
+		total = state->tiles.size();
+	}
+
+	/// <summary>
+	/// Work done by the tiles rendered so far
+	/// </summary>
+	/// <param name="rays">Receives the number of rays traced</param>
+	/// <param name="seconds">Receives the time the pool threads spent on the tiles, summed over the threads</param>
+	void statistics(uint64_t& rays, double& seconds) const
+	{
+		rays = state->rays;
+		seconds = state->nanoseconds * 1e-9;
+	}
+};
+
+#endif
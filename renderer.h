@@ -0,0 +1,758 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "const_utility.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "image.h"
+#include "light_bvh.h"
+#include "environment.h"
+#include "gbuffer.h"
+#include "irradiance_cache.h"
+#include "photon_map.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Settings shared by every pixel of a render
+/// </summary>
+struct RenderSettings
+{
+	int samples = 5;
+	int maxDepth = 5;
+	colour background = colour(0.0, 0.0, 0.0);
+	bool lightOff = false;
+	/// <summary>
+	/// Base seed of the per-row random streams
+	/// </summary>
+	uint64_t seed = 0;
+	/// <summary>
+	/// How direct light is found; anything but Off needs RenderContext::lights
+	/// </summary>
+	LightSampling lightSampling = LightSampling::Off;
+};
+
+/// <summary>
+/// Everything needed to render pixels of a scene
+/// </summary>
+struct RenderContext
+{
+	const Hittable* world = nullptr;
+	/// <summary>
+	/// Emitters of the world, for sampling direct light
+	/// </summary>
+	const LightBVH* lights = nullptr;
+	/// <summary>
+	/// Light of the sky, in place of the gradient; null for the gradient
+	/// </summary>
+	const EnvironmentMap* environment = nullptr;
+	Camera camera;
+	int imgWidth = 0;
+	int imgHeight = 0;
+	RenderSettings settings;
+	/// <summary>
+	/// Primary hits to record, or to reuse once ready, instead of tracing camera rays; null to always trace them
+	/// </summary>
+	GBuffer* gbuffer = nullptr;
+	/// <summary>
+	/// Indirect light of the diffuse surfaces, looked up instead of following rays further; null to trace every path
+	/// to its end. Only used when no lights are sampled
+	/// </summary>
+	const IrradianceCache* irradiance = nullptr;
+	/// <summary>
+	/// Caustics, added at every diffuse surface in place of the paths that find emitters through mirrors and glass;
+	/// null to leave caustics to those paths. Only used when no lights are sampled and there is no irradiance cache
+	/// </summary>
+	const PhotonMap* photons = nullptr;
+};
+
+/// <summary>
+/// Light of the sky seen by a ray that escapes the scene
+/// </summary>
+/// <param name="r">Reference to the ray object</param>
+/// <param name="environment">Environment map, null for the gradient from white to blue</param>
+inline colour skyColour(const Ray& r, const EnvironmentMap* environment)
+{
+	if (environment != nullptr)
+		return environment->radiance(r.direction);
+
+	vec3 unitDir = unitVector(r.direction);
+	auto root = 0.5 * (unitDir.y() + 1.0);
+	return (1.0 - root) * colour(1.0, 1.0, 1.0) + root * colour(0.5, 0.7, 1.0);
+}
+
+inline colour getColour(const Ray& r, const colour& background, const Hittable& world, int depth, bool lightOff, const EnvironmentMap* environment);
+
+/// <summary>
+/// Colour of a ray that escapes the scene
+/// </summary>
+inline colour missColour(const Ray& r, const colour& background, bool lightOff, const EnvironmentMap* environment)
+{
+	if(lightOff)
+		return background;
+	else
+		return skyColour(r, environment);
+}
+
+/// <summary>
+/// Shades a hit found by traversal and follows the ray it scatters, see getColour
+/// </summary>
+/// <param name="r">Ray that found the hit</param>
+/// <param name="record">Hit as traversal left it, with t, object, primitive, u and v</param>
+/// <returns>The colour carried back along the ray</returns>
+inline colour shadeHit(const Ray& r, hitRecord& record, const colour& background, const Hittable& world, int depth, bool lightOff, const EnvironmentMap* environment)
+{
+	// traversal only recorded which primitive was hit, the shading data is built for that one hit
+	record.object->surfaceInteraction(r, record);
+	record.footprint = r.widthAt(record.t);
+
+	colour objColour;
+	Ray reflected;
+	colour emitted = record.mat_ptr->emitted();
+
+	if (record.mat_ptr->scatter(r, record, objColour, reflected))
+	{
+		// the cone keeps its angle through a bounce, as it would off a flat mirror
+		reflected.width = record.footprint;
+		reflected.spread = r.spread;
+		return emitted + objColour * getColour(reflected, background, world, depth - 1, lightOff, environment);
+	}
+	return emitted;
+}
+
+/// <summary>
+/// Traces the ray through the scene
+/// </summary>
+/// <param name="r">Reference to the ray object</param>
+/// <param name="background">Colour returned by rays that escape the scene, when lightOff is set</param>
+/// <param name="world">Root of the scene, usually a BVH</param>
+/// <param name="depth">Number of bounces left</param>
+/// <param name="lightOff">If set, the sky does not emit light</param>
+/// <param name="environment">Light of the sky, null for the gradient</param>
+/// <returns>The colour carried back along the ray</returns>
+inline colour getColour(const Ray& r, const colour& background, const Hittable& world, int depth, bool lightOff, const EnvironmentMap* environment)
+{
+	hitRecord record;
+
+	if (depth <= 0)
+		return colour(0.0, 0.0, 0.0);
+
+	traversalCounters().rays++;
+	if (world.hit(r, 0.001, infinity, record))
+		return shadeHit(r, record, background, world, depth, lightOff, environment);
+	return missColour(r, background, lightOff, environment);
+}
+
+/// <summary>
+/// Diffuse surface a ray was scattered from after a light was sampled there. The emission the ray finds is weighted
+/// against the light sample with the power heuristic, so light reaching the surface is not counted twice
+/// </summary>
+struct PathVertex
+{
+	point p;
+	vec3 normal;
+	/// <summary>
+	/// Density, per solid angle, of the direction the ray was scattered in
+	/// </summary>
+	double scatterPdf;
+};
+
+/// <summary>
+/// Share of the light samples that go to the environment map rather than to the emitters
+/// </summary>
+inline double environmentChance(const LightBVH& lights, const EnvironmentMap* environment)
+{
+	if (environment == nullptr)
+		return 0.0;
+	return lights.size() > 0 ? 0.5 : 1.0;
+}
+
+/// <summary>
+/// Light arriving directly from one emitter, or from the environment map, at a diffuse surface, weighted for
+/// combination with scattered rays
+/// </summary>
+/// <param name="record">Hit on the diffuse surface</param>
+/// <param name="albedo">Albedo of the surface</param>
+/// <param name="world">Root of the scene, for the shadow ray</param>
+/// <param name="lights">Emitters of the scene</param>
+/// <param name="environment">Light of the sky, null if it sends none that could be sampled</param>
+/// <param name="sampling">How the emitter is picked</param>
+/// <returns>The reflected light</returns>
+inline colour sampleDirectLight(const hitRecord& record, const colour& albedo, const Hittable& world, const LightBVH& lights,
+	const EnvironmentMap* environment, LightSampling sampling)
+{
+	double chance = environmentChance(lights, environment);
+	if (chance > 0.0 && randomDouble() < chance)
+	{
+		vec3 direction;
+		double pdf;
+		double u1 = randomDouble();
+		double u2 = randomDouble();
+		double u3 = randomDouble();
+		if (!environment->sample(u1, u2, u3, direction, pdf))
+			return colour(0.0, 0.0, 0.0);
+
+		double cosine = dot(direction, record.normal);
+		if (cosine <= 0.0)
+			return colour(0.0, 0.0, 0.0);
+
+		// the sky is only seen by rays that leave the scene
+		hitRecord blocker;
+		traversalCounters().rays++;
+		if (world.hit(Ray(record.p, direction), 0.001, infinity, blocker))
+			return colour(0.0, 0.0, 0.0);
+
+		double lightPdf = chance * pdf;
+		double scatterPdf = cosine / pi;
+		double weight = lightPdf * lightPdf / (lightPdf * lightPdf + scatterPdf * scatterPdf);
+		return albedo / pi * environment->radiance(direction) * (cosine * weight / lightPdf);
+	}
+
+	double pmf;
+	colour radiance;
+	const Hittable* light = lights.sample(sampling, record.p, record.normal, randomDouble(), pmf, radiance);
+	if (light == nullptr)
+		return colour(0.0, 0.0, 0.0);
+
+	point target;
+	double pdf;
+	double u1 = randomDouble();
+	double u2 = randomDouble();
+	if (!light->sampleSurface(record.p, u1, u2, target, pdf))
+		return colour(0.0, 0.0, 0.0);
+
+	vec3 toLight = target - record.p;
+	double distance = toLight.length();
+	vec3 direction = toLight / distance;
+	double cosine = dot(direction, record.normal);
+	if (cosine <= 0.0)
+		return colour(0.0, 0.0, 0.0);
+
+	// anything but the light itself hit before the sampled point casts a shadow
+	hitRecord blocker;
+	traversalCounters().rays++;
+	if (world.hit(Ray(record.p, direction), 0.001, distance * (1.0 - 1e-6), blocker) && blocker.object != light)
+		return colour(0.0, 0.0, 0.0);
+
+	double lightPdf = (1.0 - chance) * pmf * pdf;
+	double scatterPdf = cosine / pi;
+	double weight = lightPdf * lightPdf / (lightPdf * lightPdf + scatterPdf * scatterPdf);
+	return albedo / pi * radiance * (cosine * weight / lightPdf);
+}
+
+inline colour getColourWithLights(const Ray& r, const colour& background, const Hittable& world, const LightBVH& lights,
+	const EnvironmentMap* environment, LightSampling sampling, int depth, bool lightOff, const PathVertex* from);
+
+/// <summary>
+/// Colour of a ray that escapes the scene, weighted against the light sample taken where it was scattered, see
+/// getColourWithLights
+/// </summary>
+inline colour missColourWithLights(const Ray& r, const colour& background, const LightBVH& lights, const EnvironmentMap* environment,
+	bool lightOff, const PathVertex* from)
+{
+	if (lightOff)
+		return background;
+
+	colour sky = skyColour(r, environment);
+	if (from != nullptr && environment != nullptr)
+	{
+		double lightPdf = environmentChance(lights, environment) * environment->pdf(r.direction);
+		sky = sky * (from->scatterPdf * from->scatterPdf / (from->scatterPdf * from->scatterPdf + lightPdf * lightPdf));
+	}
+	return sky;
+}
+
+/// <summary>
+/// Shades a hit found by traversal, sampling a light if the surface is diffuse, and follows the ray it scatters, see
+/// getColourWithLights
+/// </summary>
+/// <param name="r">Ray that found the hit</param>
+/// <param name="record">Hit as traversal left it, with t, object, primitive, u and v</param>
+/// <returns>The colour carried back along the ray</returns>
+inline colour shadeHitWithLights(const Ray& r, hitRecord& record, const colour& background, const Hittable& world, const LightBVH& lights,
+	const EnvironmentMap* environment, LightSampling sampling, int depth, bool lightOff, const PathVertex* from)
+{
+	record.object->surfaceInteraction(r, record);
+	record.footprint = r.widthAt(record.t);
+	const Material& material = *record.mat_ptr;
+	colour emitted = material.emitted();
+
+	if (from != nullptr && (emitted.x() > 0.0 || emitted.y() > 0.0 || emitted.z() > 0.0))
+	{
+		double lightPdf = (1.0 - environmentChance(lights, lightOff ? nullptr : environment))
+			* lights.pmf(sampling, record.object, from->p, from->normal) * record.object->surfacePdf(from->p, record.p);
+		if (lightPdf > 0.0)
+			emitted = emitted * (from->scatterPdf * from->scatterPdf / (from->scatterPdf * from->scatterPdf + lightPdf * lightPdf));
+	}
+
+	colour attenuation;
+	Ray scattered;
+	colour albedo;
+
+	// the light sampled at the last bounce would arrive one bounce later than getColour allows, so none is sampled there
+	if (depth > 1 && material.diffuse(record, albedo))
+	{
+		colour direct = sampleDirectLight(record, albedo, world, lights, lightOff ? nullptr : environment, sampling);
+		if (!material.scatter(r, record, attenuation, scattered))
+			return emitted + direct;
+		scattered.width = record.footprint;
+		scattered.spread = r.spread;
+
+		PathVertex vertex = { record.p, record.normal, fmax(dot(unitVector(scattered.direction), record.normal), 0.0) / pi };
+		return emitted + direct + attenuation * getColourWithLights(scattered, background, world, lights, environment, sampling, depth - 1, lightOff, &vertex);
+	}
+
+	if (material.scatter(r, record, attenuation, scattered))
+	{
+		scattered.width = record.footprint;
+		scattered.spread = r.spread;
+		return emitted + attenuation * getColourWithLights(scattered, background, world, lights, environment, sampling, depth - 1, lightOff, nullptr);
+	}
+	return emitted;
+}
+
+/// <summary>
+/// Traces the ray like getColour, but samples a light at every diffuse surface and combines that light with the light
+/// found by scattered rays through multiple importance sampling
+/// </summary>
+/// <param name="r">Reference to the ray object</param>
+/// <param name="background">Colour returned by rays that escape the scene, when lightOff is set</param>
+/// <param name="world">Root of the scene, usually a BVH</param>
+/// <param name="lights">Emitters of the scene</param>
+/// <param name="environment">Light of the sky, null for the gradient</param>
+/// <param name="sampling">Uniform or BVH</param>
+/// <param name="depth">Number of bounces left</param>
+/// <param name="lightOff">If set, the sky does not emit light</param>
+/// <param name="from">Diffuse surface the ray was scattered from, null if no light was sampled there</param>
+/// <returns>The colour carried back along the ray</returns>
+inline colour getColourWithLights(const Ray& r, const colour& background, const Hittable& world, const LightBVH& lights,
+	const EnvironmentMap* environment, LightSampling sampling, int depth, bool lightOff, const PathVertex* from)
+{
+	hitRecord record;
+
+	if (depth <= 0)
+		return colour(0.0, 0.0, 0.0);
+
+	traversalCounters().rays++;
+	if (!world.hit(r, 0.001, infinity, record))
+		return missColourWithLights(r, background, lights, environment, lightOff, from);
+	return shadeHitWithLights(r, record, background, world, lights, environment, sampling, depth, lightOff, from);
+}
+
+/// <summary>
+/// Camera ray of one sample of a pixel, jittered by numbers hashed from the seed, pixel and sample instead of drawn from
+/// the random stream. The ray then does not depend on how many numbers the samples before it used for shading, which
+/// changes with the materials, so a G-buffer hit recorded for the sample still belongs to it after a material edit
+/// </summary>
+/// <param name="context">Scene and settings of the render</param>
+/// <param name="x">Column of the pixel</param>
+/// <param name="y">Row of the pixel, counted from the top</param>
+/// <param name="k">Sample of the pixel</param>
+inline Ray cameraSample(const RenderContext& context, int x, int y, int k)
+{
+	uint64_t hash = mixSeed(context.settings.seed, (uint64_t(y) * context.imgWidth + x) * context.settings.samples + k);
+	double numbers[4];
+	for (double& number : numbers)
+	{
+		hash = mixSeed(hash, 0);
+		number = (hash >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	auto u = (x + numbers[0]) / (double(context.imgWidth) - 1);
+	auto v = (context.imgHeight - 1 - y + numbers[1]) / (double(context.imgHeight) - 1);
+	double radius = sqrt(numbers[2]);
+	double angle = 2.0 * pi * numbers[3];
+	return context.camera.getRay(u, v, vec3(radius * cos(angle), radius * sin(angle), 0.0));
+}
+
+/// <summary>
+/// Colour of one camera ray, with its hit taken from the G-buffer of the context if it is ready, and recorded there
+/// otherwise. Traversing the primary ray draws no random numbers, so with the camera rays of cameraSample a render
+/// reusing the hits gives the same image as one tracing them
+/// </summary>
+/// <param name="context">Scene and settings of the render, with a G-buffer</param>
+/// <param name="ray">Camera ray</param>
+/// <param name="cached">Slot of the sample in the G-buffer</param>
+inline colour cameraColour(const RenderContext& context, const Ray& ray, PrimaryHit& cached)
+{
+	const RenderSettings& settings = context.settings;
+	if (settings.maxDepth <= 0)
+		return colour(0.0, 0.0, 0.0);
+
+	hitRecord record;
+	bool hit;
+	if (context.gbuffer->ready)
+	{
+		hit = cached.object != nullptr;
+		record.object = cached.object;
+		record.primitive = cached.primitive;
+		record.t = cached.t;
+		record.u = cached.u;
+		record.v = cached.v;
+	}
+	else
+	{
+		traversalCounters().rays++;
+		hit = context.world->hit(ray, 0.001, infinity, record);
+		cached = hit ? PrimaryHit{ record.object, record.primitive, record.t, record.u, record.v } : PrimaryHit{ nullptr, 0, 0.0, 0.0, 0.0 };
+	}
+
+	if (settings.lightSampling != LightSampling::Off && context.lights != nullptr)
+	{
+		if (!hit)
+			return missColourWithLights(ray, settings.background, *context.lights, context.environment, settings.lightOff, nullptr);
+		return shadeHitWithLights(ray, record, settings.background, *context.world, *context.lights, context.environment, settings.lightSampling,
+			settings.maxDepth, settings.lightOff, nullptr);
+	}
+
+	if (!hit)
+		return missColour(ray, settings.background, settings.lightOff, context.environment);
+	return shadeHit(ray, record, settings.background, *context.world, settings.maxDepth, settings.lightOff, context.environment);
+}
+
+/// <summary>
+/// Light arriving along a ray straight from whatever it hits first: the light of an emitter, or the sky. Together
+/// with the light kept in an irradiance cache this is all the light a diffuse surface receives
+/// </summary>
+inline colour firstLight(const RenderContext& context, const Ray& r)
+{
+	const RenderSettings& settings = context.settings;
+	hitRecord record;
+
+	traversalCounters().rays++;
+	if (!context.world->hit(r, 0.001, infinity, record))
+		return missColour(r, settings.background, settings.lightOff, context.environment);
+
+	record.object->surfaceInteraction(r, record);
+	return record.mat_ptr->emitted();
+}
+
+/// <summary>
+/// Shades a hit with the irradiance cache of the context, defined below
+/// </summary>
+inline colour shadeWithIrradiance(const RenderContext& context, const Ray& r, hitRecord& record, int depth);
+
+/// <summary>
+/// Measures the indirect light at a point of a diffuse surface for an irradiance cache: stratified cosine-weighted
+/// rays are traced over the hemisphere and whatever they carry back, less the light of the emitters and the sky they
+/// hit first, is averaged. Where the rays hit diffuse surfaces already covered by the records of the cache in the
+/// context, if any, they take the indirect light from there instead of following their paths on
+/// </summary>
+/// <param name="context">Scene and settings of the render</param>
+/// <param name="cache">Cache the record is for, which clamps its radius</param>
+/// <param name="record">Hit on the diffuse surface, with its shading data</param>
+/// <param name="depth">Number of bounces left at the hit</param>
+/// <param name="rays">Number of rays to trace, rounded down to a square</param>
+inline IrradianceRecord gatherIrradiance(const RenderContext& context, const IrradianceCache& cache, const hitRecord& record, int depth, int rays)
+{
+	const RenderSettings& settings = context.settings;
+	vec3 normal = record.normal;
+	vec3 tangent = unitVector(cross(fabs(normal.x()) > 0.9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), normal));
+	vec3 bitangent = cross(normal, tangent);
+
+	int strata = std::max(1, int(sqrt(double(rays))));
+	int count = strata * strata;
+	colour sum(0.0, 0.0, 0.0);
+	double inverseDistances = 0.0;
+
+	for (int i = 0; i < strata && depth > 1; i++)
+	{
+		for (int j = 0; j < strata; j++)
+		{
+			double u1 = (i + randomDouble()) / strata;
+			double u2 = (j + randomDouble()) / strata;
+			double radius = sqrt(u1);
+			double angle = 2.0 * pi * u2;
+			Ray ray(record.p, radius * cos(angle) * tangent + radius * sin(angle) * bitangent + sqrt(1.0 - u1) * normal);
+
+			hitRecord hit;
+			traversalCounters().rays++;
+			if (!context.world->hit(ray, 0.001, infinity, hit))
+				continue;
+
+			inverseDistances += 1.0 / hit.t;
+			colour incoming = context.irradiance != nullptr ? shadeWithIrradiance(context, ray, hit, depth - 1)
+				: shadeHit(ray, hit, settings.background, *context.world, depth - 1, settings.lightOff, context.environment);
+			sum += incoming - hit.mat_ptr->emitted();
+		}
+	}
+
+	double distance = inverseDistances > 0.0 ? count / inverseDistances : infinity;
+	return { record.p, normal, sum / count, cache.clampRadius(distance) };
+}
+
+/// <summary>
+/// Traces the ray like getColour, but at a diffuse surface covered by the irradiance cache of the context the path
+/// ends: the scattered ray only picks up the light it meets directly, and the light that bounced on its way comes from
+/// the cache. Surfaces the cache does not cover are shaded as usual
+/// </summary>
+/// <param name="context">Scene and settings of the render, with an irradiance cache</param>
+/// <param name="r">Ray to trace</param>
+/// <param name="depth">Number of bounces left</param>
+inline colour irradianceColour(const RenderContext& context, const Ray& r, int depth)
+{
+	const RenderSettings& settings = context.settings;
+	hitRecord record;
+
+	if (depth <= 0)
+		return colour(0.0, 0.0, 0.0);
+
+	traversalCounters().rays++;
+	if (!context.world->hit(r, 0.001, infinity, record))
+		return missColour(r, settings.background, settings.lightOff, context.environment);
+	return shadeWithIrradiance(context, r, record, depth);
+}
+
+/// <summary>
+/// Shades a hit found by traversal and follows the ray it scatters, see irradianceColour
+/// </summary>
+/// <param name="context">Scene and settings of the render, with an irradiance cache</param>
+/// <param name="r">Ray that found the hit</param>
+/// <param name="record">Hit as traversal left it, with t, object, primitive, u and v</param>
+/// <param name="depth">Number of bounces left</param>
+inline colour shadeWithIrradiance(const RenderContext& context, const Ray& r, hitRecord& record, int depth)
+{
+	record.object->surfaceInteraction(r, record);
+	record.footprint = r.widthAt(record.t);
+
+	colour objColour;
+	Ray reflected;
+	colour emitted = record.mat_ptr->emitted();
+	if (!record.mat_ptr->scatter(r, record, objColour, reflected))
+		return emitted;
+	reflected.width = record.footprint;
+	reflected.spread = r.spread;
+
+	colour albedo, indirect;
+	if (record.mat_ptr->diffuse(record, albedo) && context.irradiance->lookup(record.p, record.normal, indirect))
+	{
+		colour direct = depth > 1 ? firstLight(context, reflected) : colour(0.0, 0.0, 0.0);
+		return emitted + objColour * (direct + indirect);
+	}
+	return emitted + objColour * irradianceColour(context, reflected, depth - 1);
+}
+
+/// <summary>
+/// Traces the ray like getColour, adding the caustics of the photon map of the context at every diffuse surface. The
+/// photons already carry all the light that reaches a diffuse surface from the emitters through mirrors and glass, so
+/// a path that left a diffuse surface and was reflected or refracted since gets nothing from the emitter it ends on;
+/// the light of the sky is not in the map and still counts
+/// </summary>
+/// <param name="context">Scene and settings of the render, with a photon map</param>
+/// <param name="r">Ray to trace</param>
+/// <param name="depth">Number of bounces left</param>
+/// <param name="leftDiffuse">The path has been scattered by a diffuse surface</param>
+/// <param name="caustic">The path has been reflected or refracted since it last left a diffuse surface</param>
+inline colour photonColour(const RenderContext& context, const Ray& r, int depth, bool leftDiffuse, bool caustic)
+{
+	const RenderSettings& settings = context.settings;
+	hitRecord record;
+
+	if (depth <= 0)
+		return colour(0.0, 0.0, 0.0);
+
+	traversalCounters().rays++;
+	if (!context.world->hit(r, 0.001, infinity, record))
+		return missColour(r, settings.background, settings.lightOff, context.environment);
+
+	record.object->surfaceInteraction(r, record);
+	record.footprint = r.widthAt(record.t);
+
+	colour objColour;
+	Ray reflected;
+	colour emitted = caustic ? colour(0.0, 0.0, 0.0) : record.mat_ptr->emitted();
+	if (!record.mat_ptr->scatter(r, record, objColour, reflected))
+		return emitted;
+	reflected.width = record.footprint;
+	reflected.spread = r.spread;
+
+	colour albedo;
+	if (record.mat_ptr->diffuse(record, albedo))
+		return emitted + albedo * context.photons->radiance(record.p, record.normal)
+			+ objColour * photonColour(context, reflected, depth - 1, true, false);
+	return emitted + objColour * photonColour(context, reflected, depth - 1, leftDiffuse, leftDiffuse);
+}
+
+/// <summary>
+/// Averages all the samples of one pixel
+/// </summary>
+/// <param name="context">Scene and settings of the render</param>
+/// <param name="x">Column of the pixel</param>
+/// <param name="y">Row of the pixel, counted from the top</param>
+/// <returns>Linear colour of the pixel</returns>
+inline colour renderPixel(const RenderContext& context, int x, int y)
+{
+	const RenderSettings& settings = context.settings;
+	int i = context.imgHeight - 1 - y;
+	colour pixelColour(0.0, 0.0, 0.0);
+	double spread = context.camera.pixelSpread(context.imgHeight);
+
+	for (int k = 0; k < settings.samples; k++)
+	{
+		if (context.gbuffer != nullptr)
+		{
+			Ray ray = cameraSample(context, x, y, k);
+			ray.spread = spread;
+			pixelColour += cameraColour(context, ray, context.gbuffer->at(x, y)[k]);
+			continue;
+		}
+
+		auto u = (x + randomDouble()) / (double(context.imgWidth) - 1);
+		auto v = (i + randomDouble()) / (double(context.imgHeight) - 1);
+		Ray ray = context.camera.getRay(u, v);
+		ray.spread = spread;
+		if (settings.lightSampling != LightSampling::Off && context.lights != nullptr)
+			pixelColour += getColourWithLights(ray, settings.background, *context.world, *context.lights, context.environment, settings.lightSampling,
+				settings.maxDepth, settings.lightOff, nullptr);
+		else if (context.irradiance != nullptr)
+			pixelColour += irradianceColour(context, ray, settings.maxDepth);
+		else if (context.photons != nullptr)
+			pixelColour += photonColour(context, ray, settings.maxDepth, false, false);
+		else
+			pixelColour += getColour(ray, settings.background, *context.world, settings.maxDepth, settings.lightOff, context.environment);
+	}
+
+	return pixelColour / settings.samples;
+}
+
+/// <summary>
+/// Renders one row of a tile. The random stream is seeded from the position of the row alone, so a tile gives the
+/// same pixels no matter which thread or process renders it
+/// </summary>
+/// <param name="context">Scene and settings of the render</param>
+/// <param name="tile">Tile the row belongs to</param>
+/// <param name="y">Row of the image</param>
+/// <param name="out">Three floats per pixel of the row</param>
+/// <param name="cost">If not null, receives three floats per pixel of the row: the nanoseconds spent on the pixel, the
+/// BVH nodes visited and the primitives tested</param>
+inline void renderTileRow(const RenderContext& context, const Tile& tile, int y, float* out, float* cost = nullptr)
+{
+	seedRandom(mixSeed(context.settings.seed, uint64_t(y) * context.imgWidth + tile.x0));
+
+	for (int x = tile.x0; x < tile.x1; x++)
+	{
+		colour c;
+		if (cost == nullptr)
+			c = renderPixel(context, x, y);
+		else
+		{
+			TraversalCounters& counters = traversalCounters();
+			TraversalCounters before = counters;
+			auto start = std::chrono::steady_clock::now();
+			c = renderPixel(context, x, y);
+			*cost++ = float(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+			*cost++ = float(counters.nodes - before.nodes);
+			*cost++ = float(counters.primitives - before.primitives);
+		}
+		*out++ = float(c.x());
+		*out++ = float(c.y());
+		*out++ = float(c.z());
+	}
+}
+
+/// <summary>
+/// Renders a tile, sharing its rows between threads
+/// </summary>
+/// <param name="context">Scene and settings of the render</param>
+/// <param name="tile">Tile to render</param>
+/// <param name="threadCount">Number of threads to use</param>
+/// <param name="out">Three floats per pixel of the tile, row by row</param>
+/// <param name="cost">If not null, receives the cost of every pixel, see renderTileRow</param>
+inline void renderTile(const RenderContext& context, const Tile& tile, int threadCount, float* out, float* cost = nullptr)
+{
+	std::atomic<int> nextRow(tile.y0);
+	size_t rowFloats = size_t(tile.width()) * 3;
+
+	auto work = [&]()
+	{
+		for (int y = nextRow++; y < tile.y1; y = nextRow++)
+			renderTileRow(context, tile, y, out + (y - tile.y0) * rowFloats, cost != nullptr ? cost + (y - tile.y0) * rowFloats : nullptr);
+	};
+
+	if (threadCount <= 1)
+	{
+		work();
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < threadCount; i++)
+		threads.emplace_back(work);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+/// <summary>
+/// Fills an irradiance cache for one view before it is rendered. Camera rays go through a grid of pixels, coarse to
+/// fine, follow mirrors and glass to the first diffuse surface and gather a record there wherever the records so far
+/// are not valid. The pixels of a pass are gathered in parallel against the records of the passes before it; the new
+/// records are then added in pixel order, each only if the ones added before it leave its point uncovered, and every
+/// pixel seeds its own random stream, so the cache is the same for any number of threads. The gathering rays of a pass
+/// take the indirect light of the surfaces they hit from the records of the passes before it where they can
+/// </summary>
+/// <param name="context">Scene, camera and settings of the render</param>
+/// <param name="cache">Cache to fill</param>
+/// <param name="pool">Threads to gather on</param>
+/// <param name="rays">Rays traced per record</param>
+/// <param name="finestSpacing">Pixel spacing of the last pass</param>
+inline void fillIrradianceCache(const RenderContext& context, IrradianceCache& cache, ThreadPool& pool, int rays, int finestSpacing = 2)
+{
+	const RenderSettings& settings = context.settings;
+	RenderContext gathering = context;
+	gathering.irradiance = &cache;
+
+	for (int spacing = 16; spacing >= std::max(finestSpacing, 1); spacing /= 2)
+	{
+		int columns = (context.imgWidth + spacing - 1) / spacing;
+		int rows = (context.imgHeight + spacing - 1) / spacing;
+		std::vector<std::vector<IrradianceRecord>> found(rows);
+
+		pool.parallelFor(size_t(rows), [&](size_t row)
+		{
+			int y = std::min(int(row) * spacing + spacing / 2, context.imgHeight - 1);
+			for (int column = 0; column < columns; column++)
+			{
+				int x = std::min(column * spacing + spacing / 2, context.imgWidth - 1);
+				seedRandom(mixSeed(mixSeed(settings.seed, uint64_t(spacing)), uint64_t(y) * context.imgWidth + x));
+
+				Ray ray = context.camera.getRay((x + 0.5) / (double(context.imgWidth) - 1),
+					(context.imgHeight - 1 - y + 0.5) / (double(context.imgHeight) - 1));
+				for (int depth = settings.maxDepth; depth > 0; depth--)
+				{
+					hitRecord record;
+					traversalCounters().rays++;
+					if (!context.world->hit(ray, 0.001, infinity, record))
+						break;
+					record.object->surfaceInteraction(ray, record);
+
+					colour albedo, indirect;
+					if (record.mat_ptr->diffuse(record, albedo))
+					{
+						if (!cache.lookup(record.p, record.normal, indirect))
+							found[row].push_back(gatherIrradiance(gathering, cache, record, depth, rays));
+						break;
+					}
+
+					colour attenuation;
+					Ray scattered;
+					if (!record.mat_ptr->scatter(ray, record, attenuation, scattered))
+						break;
+					ray = scattered;
+				}
+			}
+		});
+
+		colour indirect;
+		for (const auto& records : found)
+			for (const IrradianceRecord& record : records)
+				if (!cache.lookup(record.p, record.normal, indirect))
+					cache.add(record);
+	}
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "const_utility.h"
+#include "camera.h"
+#include "hittableList.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "cuboid.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "light_bvh.h"
+
+inline void scene1(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto ground = create<Lambertian>(colour(0.5, 0.5, 0.5));
+	world.add(create<Sphere>(point(0, -1000, 0), 1000, ground));
+
+	for (int a = -11; a < 11; a++)
+	{
+		for (int b = -11; b < 11; b++) 
+		{
+			point center(a + 0.9 * randomDouble(), 0.2, b + 0.9 * randomDouble());
+
+			if ((center - point(4, 0.2, 0)).length() > 0.9) 
+			{
+				shared_ptr<Material> sphereMaterial;
+				auto materialChooser = randomDouble();
+
+				if (materialChooser < 0.8) 
+				{
+					// lambertian
+					auto albedo = colour::random() * colour::random();
+					sphereMaterial = create<Lambertian>(albedo);
+					world.add(create<Sphere>(center, 0.2, sphereMaterial));
+				}
+				else if (materialChooser < 0.95) 
+				{
+					// metal
+					auto albedo = colour::random(0.5, 1);
+					auto fuzz = randomDouble(0, 0.5);
+					sphereMaterial = create<Metal>(albedo, fuzz);
+					world.add(create<Sphere>(center, 0.2, sphereMaterial));
+				}
+				else 
+				{
+					// glass
+					sphereMaterial = create<Dielectric>(1.5);
+					world.add(create<Sphere>(center, 0.2, sphereMaterial));
+				}
+			}
+		}
+	}
+
+	auto matte = create<Lambertian>(colour(0.4, 0.2, 0.1));
+	world.add(create<Sphere>(point(-4, 1, 0), 1.0, matte));
+
+	auto glass = create<Dielectric>(1.5);
+	world.add(create<Sphere>(point(0, 1, 0), 1.0, glass));
+
+	auto metal = create<Metal>(colour(0.7, 0.6, 0.5), 0.0);
+	world.add(create<Sphere>(point(4, 1, 0), 1.0, metal));
+
+	aspectRatio = 16.0 / 9.0;
+	imgHeight = 1080;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 20;
+	auto aperture = 0.1;
+	auto fDis = 10.0;
+
+	Camera cam(point(13, 2, 3), point(0, 0, 0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+inline void scene2(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto ground = create<Lambertian>(colour(0.48, 0.83, 0.53));
+	auto light = create<Light>(colour(9.0, 9.0, 9.0));
+	auto white = create<Lambertian>(colour(.73, .73, .73));
+	auto metalGrey = create<Metal>(colour(0.8, 0.8, 0.9), 0.0);
+	auto metalBlue = create<Metal>(colour(0.2, 0.4, 0.9), 0.2);
+	auto metalYellow = create<Metal>(colour(1, 1, 0), 0.0);
+	auto matteRed = create<Lambertian>(colour(0.8, 0.0, 0.0));
+	auto matteGrey = create<Lambertian>(colour(0.25, 0.25, 0.25));
+
+	world.add(create<xzPlane>(123, 423, 147, 412, 554, light));
+
+	const int boxes = 20;
+	for (int i = 0; i < boxes; i++)
+	{
+		for (int j = 0; j < boxes; j++)
+		{
+			auto w = 100.0;
+			auto x0 = -1000.0 + i * w;
+			auto z0 = -1000.0 + j * w;
+			auto y0 = 0.0;
+			auto x1 = x0 + w;
+			auto z1 = z0 + w;
+			auto y1 = randomDouble(1, 101);
+
+			world.add(create<Cuboid>(point(x0, y0, z0), point(x1, y1, z1), ground));
+		}
+	}
+
+	world.add(create<Sphere>(point(230, 150, 45), 50, create<Dielectric>(1.5)));
+	world.add(create<Sphere>(point(0, 200, 145), 50, metalGrey));
+	world.add(create<Sphere>(point(360, 150, 145), 70,metalBlue));
+	world.add(create<Sphere>(point(400, 200, 400), 100, matteRed));
+	world.add(create<Sphere>(point(220, 330, 300), 80, metalYellow));
+	
+	auto cloud = create<SphereSet>();
+	cloud->reserve(1000);
+	for (int j = 0; j < 1000; j++) {
+		cloud->add(point::random(0, 165) + point(0, 300, 0), 10, white);
+	}
+	cloud->build();
+	world.add(cloud);
+	
+	world.add(create<xyPlane>(-600, 600, 0, 1000, 600, matteGrey));
+	world.add(create<xyPlane>(-600, 600, 0, 1000, -601, matteGrey));
+
+	world.add(create<yzPlane>(0, 1000, -601, 600, 600, matteGrey));
+	world.add(create<yzPlane>(0, 1000, -601, 600, -600, matteGrey));
+	
+	world.add(create<xzPlane>(-600, 600, -601, 600, 555, matteGrey));
+
+	aspectRatio = 1.0;
+	imgHeight = 800;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 40;
+	auto aperture = 0.0;
+	auto fDis = 10.0;
+
+	Camera cam(point(478, 278, -600), point(278, 278, 0.0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+inline void scene3(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto red = create<Lambertian>(colour(.65, .05, .05));
+	auto green = create<Lambertian>(colour(.12, .45, .15));
+	auto blue = create<Lambertian>(colour(0.2, 0.4, 0.9));
+	auto yellow = create<Lambertian>(colour(1, 1, 0));
+	auto lightGrey = create<Lambertian>(colour(.73, .73, .73));
+
+	world.add(create<xyPlane>(0, 555, 0, 555, 555, lightGrey));
+	world.add(create<yzPlane>(0, 555, -100, 555, 555, green));
+	world.add(create<yzPlane>(0, 555, -100, 555, 0, red));
+	world.add(create<xzPlane>(0, 555, -100, 555, 0, lightGrey));
+	world.add(create<xzPlane>(0, 555, -100, 555, 555, lightGrey));
+
+	world.add(create<Cuboid>(point(130, 0, 65), point(295, 165, 230), lightGrey));
+	world.add(create<Cuboid>(point(265, 0, 295), point(430, 330, 460), lightGrey));
+
+	aspectRatio = 1.0;
+	imgHeight = 2160;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 40;
+	auto aperture = 0.0;
+	auto fDis = 10.0;
+
+	Camera cam(point(278, 278, -800), point(278, 278, 0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+inline void scene4(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto red = create<Lambertian>(colour(.65, .05, .05));
+	auto green = create<Lambertian>(colour(.12, .45, .15));
+	auto blue = create<Lambertian>(colour(0.2, 0.4, 0.9));
+	auto yellow = create<Lambertian>(colour(1, 1, 0));
+	auto lightGrey = create<Lambertian>(colour(.73, .73, .73));
+	auto light = create<Light>(colour(15, 15, 15));
+
+	world.add(create<xyPlane>(0, 555, 0, 555, 555, lightGrey));
+	world.add(create<yzPlane>(0, 555, -100, 555, 555, green));
+	world.add(create<yzPlane>(0, 555, -100, 555, 0, red));
+	world.add(create<xzPlane>(0, 555, -100, 555, 0, lightGrey));
+	world.add(create<xzPlane>(0, 555, -100, 555, 555, lightGrey));
+	world.add(create<xzPlane>(213, 343, 227, 332, 554, light));
+
+	world.add(create<Cuboid>(point(130, 0, 65), point(295, 165, 230), lightGrey));
+	world.add(create<Cuboid>(point(265, 0, 295), point(430, 330, 460), lightGrey));
+
+	aspectRatio = 1.0;
+	imgHeight = 2160;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 40;
+	auto aperture = 0.0;
+	auto fDis = 10.0;
+
+	Camera cam(point(278, 278, -800), point(278, 278, 0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+inline void scene5(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto red = create<Lambertian>(colour(0.8, 0.0, 0.0));
+	auto light = create<Light>(colour(15.0, 15.0, 15.0));
+	auto black = create<Lambertian>(colour(0.25, 0.25, 0.25));
+
+	world.add(create<Sphere>(point(0, -1000, 0), 1000, black));
+	world.add(create<Sphere>(point(0, 2, 0), 2,red));
+
+	auto difflight = create<Light>(colour(4, 4, 4));
+	world.add(create<xyPlane>(3, 7, 1, 5, -2, difflight));
+
+	aspectRatio = 16.0 / 9.0;
+	imgHeight = 2160;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 20;
+	auto aperture = 0.0;
+	auto fDis = 10.0;
+
+	Camera cam(point(26, 3, 6), point(0, 2, 0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+inline void scene6(HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	auto sun = create<Light>(colour(2.0, 2.0, 2.0));
+	auto ground = create<Lambertian>(colour(0.25, 0.25, 0.25));
+
+	world.add(create<Sphere>(point(0.0, -20000.0, 0.0), 20000.0, ground));
+	world.add(create<Sphere>(point(1250.0, 1250.0, -0.0), 1000.0, sun));
+
+	for (int a = -6; a < 6; a++)
+	{
+		for (int b = -4; b < 3; b++)
+		{
+			point center(a * 5 + randomDouble(randomDouble(-1500, 1000), randomDouble(-1500, 1000)), 50, 5 * b + randomDouble(randomDouble(-1500, 1250), randomDouble(-1500, 1250)));
+			
+			shared_ptr<Material> sphereMaterial;
+			auto materialChooser = randomDouble();
+
+			if (materialChooser < 0.4)
+			{
+				// metal
+				auto albedo = colour::random(0.5, 1);
+				auto fuzz = randomDouble(0, 0.25);
+				sphereMaterial = create<Metal>(albedo, fuzz);
+				world.add(create<Sphere>(center, 50, sphereMaterial));
+			}
+			else if (materialChooser < 0.73)
+			{
+				// diffuse
+				auto albedo = colour::random() * colour::random();
+				sphereMaterial = create<Lambertian>(albedo);
+				world.add(create<Sphere>(center, 50, sphereMaterial));
+			}
+			else
+			{
+				// dielectric
+				sphereMaterial = create<Dielectric>(randomDouble(1.25, 2.0));
+				world.add(create<Sphere>(center, 50, sphereMaterial));
+			}
+
+				
+		}
+	}
+
+	aspectRatio = 16.0 / 9.0;
+	imgHeight = 2160;
+	imgWidth = static_cast<int>(imgHeight * aspectRatio);
+	auto vfov = 20;
+	auto aperture = 0.0;
+	auto fDis = 10.0;
+
+	Camera cam(point(-3000.0, 1700, 4500) + 2500 * unitVector(point(3000, -1700, -4500)), point(0, 0, 0), aspectRatio, vfov, aperture, fDis);
+	camera = cam;
+}
+
+/// <summary>
+/// Number of built-in scenes
+/// </summary>
+const int SCENE_COUNT = 6;
+
+/// <summary>
+/// Builds one of the built-in scenes by its number. The random number generator is reset first, so every process
+/// (and every call) builds exactly the same scene for the same number
+/// </summary>
+/// <param name="id">Number of the scene, from 1 to SCENE_COUNT</param>
+/// <param name="world">List to add the objects of the scene to</param>
+/// <param name="camera">Reference to the camera of the scene</param>
+/// <param name="imgWidth">Width of the image</param>
+/// <param name="imgHeight">Height of the image</param>
+/// <param name="aspectRatio">Aspect ratio of the image</param>
+/// <returns>False, if there is no scene with the given number</returns>
+inline bool loadScene(int id, HittableList& world, Camera& camera, int& imgWidth, int& imgHeight, double& aspectRatio)
+{
+	resetRandom();
+
+	switch (id)
+	{
+	case 1: scene1(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	case 2: scene2(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	case 3: scene3(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	case 4: scene4(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	case 5: scene5(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	case 6: scene6(world, camera, imgWidth, imgHeight, aspectRatio); return true;
+	default: return false;
+	}
+}
+
+/// <summary>
+/// A built-in scene together with its BVH, ready to be rendered
+/// </summary>
+struct SceneData
+{
+	/// <summary>
+	/// Owns the objects, materials and BVH nodes of the scene; declared first so it is destroyed last
+	/// </summary>
+	shared_ptr<SceneArena> arena;
+	HittableList world;
+	Camera camera;
+	int imgWidth = 0;
+	int imgHeight = 0;
+	double aspectRatio = 1.0;
+	shared_ptr<SceneBVH> root;
+	/// <summary>
+	/// Emitters of the world, for direct light sampling
+	/// </summary>
+	shared_ptr<LightBVH> lights;
+};
+
+/// <summary>
+/// Builds one of the built-in scenes and its BVH
+/// </summary>
+/// <param name="id">Number of the scene, from 1 to SCENE_COUNT</param>
+/// <param name="imgHeight">Height of the image, 0 keeps the height chosen by the scene</param>
+/// <param name="useArena">If set, the objects, materials and BVH nodes are placed in an arena owned by the scene
+/// instead of being allocated one by one on the heap</param>
+/// <param name="bvh">How the acceleration structure is built and laid out</param>
+/// <returns>The scene, null if there is no scene with the given number</returns>
+inline shared_ptr<SceneData> buildScene(int id, int imgHeight, bool useArena = true, const BVHSettings& bvh = BVHSettings())
+{
+	auto scene = make_shared<SceneData>();
+	if (useArena)
+		scene->arena = make_shared<SceneArena>();
+	ArenaScope scope(scene->arena.get());
+
+	if (!loadScene(id, scene->world, scene->camera, scene->imgWidth, scene->imgHeight, scene->aspectRatio))
+		return nullptr;
+
+	if (imgHeight > 0)
+	{
+		scene->imgHeight = imgHeight;
+		scene->imgWidth = static_cast<int>(imgHeight * scene->aspectRatio);
+	}
+
+	scene->root = create<SceneBVH>(scene->world.objects, bvh.largeFactor);
+	buildAccelerator(*scene->root, bvh);
+	scene->lights = create<LightBVH>(scene->world.objects);
+	return scene;
+}
+
+#endif
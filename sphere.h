@@ -38,9 +38,39 @@ public:
 
     virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override;
     virtual bool boundingBox(BoundingBox& output) const override;
+    virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override;
+    virtual Material* material() const override
+    {
+        return mat_ptr.get();
+    }
+    virtual double area() const override
+    {
+        return 4.0 * pi * radius * radius;
+    }
+    virtual bool sampleSurface(const point& from, double u1, double u2, point& sample, double& pdf) const override;
+    virtual double surfacePdf(const point& from, const point& onSurface) const override;
+    virtual bool samplePoint(double u1, double u2, point& sample, vec3& normal) const override
+    {
+        double z = 1.0 - 2.0 * u1;
+        double r = sqrt(fmax(0.0, 1.0 - z * z));
+        double phi = 2.0 * pi * u2;
+        normal = vec3(r * cos(phi), r * sin(phi), z);
+        sample = center + radius * normal;
+        return true;
+    }
+    virtual bool translate(const vec3& offset) override
+    {
+        center += offset;
+        return true;
+    }
 };
 
-bool Sphere::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const 
+/// <summary>
+/// Ray-sphere intersection shared by Sphere and the typed leaves of FlatBVH
+/// </summary>
+/// <param name="t">Receives the nearest root within [tMin, tMax]</param>
+/// <returns>True, if there is such a root</returns>
+inline bool intersectSphere(const point& center, double radius, const Ray& r, double tMin, double tMax, double& t)
 {
     vec3 oc = r.origin - center;
     auto a = r.direction.length_squared();
@@ -61,16 +91,95 @@ bool Sphere::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
             return false;
     }
 
-    rec.t = root;
+    t = root;
+    return true;
+}
+
+/// <summary>
+/// Surface coordinates of a point of a sphere: u goes once around the y axis starting at -x, v from the bottom (0) to
+/// the top (1)
+/// </summary>
+/// <param name="outwardNormal">Unit normal at the point</param>
+/// <param name="radius">Radius of the sphere</param>
+/// <param name="rec">Receives u, v and uvScale</param>
+inline void sphereCoordinates(const vec3& outwardNormal, double radius, hitRecord& rec)
+{
+    rec.u = (atan2(-outwardNormal.z(), outwardNormal.x()) + pi) / (2.0 * pi);
+    rec.v = acos(clamp(-outwardNormal.y(), -1.0, 1.0)) / pi;
+    rec.uvScale = 1.0 / (2.0 * pi * radius);
+}
+
+inline bool Sphere::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const 
+{
+    traversalCounters().primitives++;
+
+    double t;
+    if (!intersectSphere(center, radius, r, tMin, tMax, t))
+        return false;
+
+    rec.t = t;
+    rec.object = this;
+    rec.primitive = 0;
+
+    return true;
+}
+
+inline void Sphere::surfaceInteraction(const Ray& r, hitRecord& rec) const
+{
     rec.p = r.at(rec.t);
     vec3 outwardNormal = (rec.p - center) / radius;
     rec.setFaceNormal(r, outwardNormal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+    if (mat_ptr->textured())
+        sphereCoordinates(outwardNormal, radius, rec);
+}
 
+/// <summary>
+/// 1 - cos of the half angle of the cone in which the sphere is seen from a point, 0 if the point is inside. Written
+/// as sin^2 / (1 + cos) so it keeps its precision for small, distant spheres
+/// </summary>
+inline double sphereConeWidth(const point& center, double radius, const point& from)
+{
+    double sinSquared = radius * radius / (center - from).length_squared();
+    if (sinSquared >= 1.0)
+        return 0.0;
+    return sinSquared / (1.0 + sqrt(1.0 - sinSquared));
+}
+
+// directions are picked uniformly in the cone the sphere fills, so no sample lands on the far side
+inline bool Sphere::sampleSurface(const point& from, double u1, double u2, point& sample, double& pdf) const
+{
+    double width = sphereConeWidth(center, radius, from);
+    if (width <= 0.0)
+        return false;
+
+    double cosTheta = 1.0 - u1 * width;
+    double sinTheta = sqrt(fmax(0.0, 1.0 - cosTheta * cosTheta));
+    double phi = 2.0 * pi * u2;
+
+    vec3 toCenter = center - from;
+    vec3 w = unitVector(toCenter);
+    vec3 v = unitVector(cross(w, fabs(w.x()) > 0.9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 u = cross(w, v);
+    vec3 direction = cos(phi) * sinTheta * u + sin(phi) * sinTheta * v + cosTheta * w;
+
+    // directions grazing the rim can miss by rounding; the point of closest approach is then on the surface
+    double t;
+    if (!intersectSphere(center, radius, Ray(from, direction), 0.0, infinity, t))
+        t = dot(toCenter, direction);
+
+    sample = from + t * direction;
+    pdf = 1.0 / (2.0 * pi * width);
     return true;
 }
 
-bool Sphere::boundingBox(BoundingBox& output) const 
+inline double Sphere::surfacePdf(const point& from, const point& /*onSurface*/) const
+{
+    double width = sphereConeWidth(center, radius, from);
+    return width > 0.0 ? 1.0 / (2.0 * pi * width) : 0.0;
+}
+
+inline bool Sphere::boundingBox(BoundingBox& output) const 
 {
     output = BoundingBox(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
     return true;
@@ -0,0 +1,401 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "cpu_dispatch.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+/// <summary>
+/// Large number of spheres stored as one object: centers, radii and material indices are kept in separate float
+/// arrays (structure of arrays) and indexed by a BVH of their own whose leaves hold up to LANES spheres. A leaf is
+/// tested in one call of the sphere kernel for the instruction set the CPU supports, and a sphere costs about 26 bytes
+/// instead of a heap object, a shared_ptr and a share of the scene BVH
+/// </summary>
+class SphereSet : public Hittable
+{
+public:
+	/// <summary>
+	/// Maximum number of spheres in a leaf, tested together
+	/// </summary>
+	static const int LANES = KERNEL_LANES;
+
+private:
+	/// <summary>
+	/// Node of the internal BVH, 32 bytes. Leaves point at count spheres from start; interior nodes have count 0,
+	/// their left child follows them and start is the index of the right child
+	/// </summary>
+	struct Node
+	{
+		float lo[3];
+		float hi[3];
+		uint32_t start;
+		uint16_t count;
+		uint16_t axis;
+	};
+
+	std::vector<float> cx, cy, cz, radii;
+	std::vector<uint16_t> materialIndex;
+	std::vector<shared_ptr<Material>> materials;
+	std::vector<Node> nodes;
+	size_t count = 0;
+
+	/// <summary>
+	/// Sphere being sorted into the tree; the centers are copied next to the index so the build reads contiguous memory
+	/// </summary>
+	struct BuildItem
+	{
+		float center[3];
+		uint32_t index;
+	};
+
+	/// <summary>
+	/// Builds the subtree over items[start, end) by splitting at the median center along the longest axis
+	/// </summary>
+	/// <returns>Index of the node</returns>
+	uint32_t buildNode(std::vector<BuildItem>& items, size_t start, size_t end)
+	{
+		uint32_t index = uint32_t(nodes.size());
+		nodes.push_back(Node());
+
+		if (end - start <= LANES)
+		{
+			double lo[3] = { infinity, infinity, infinity };
+			double hi[3] = { -infinity, -infinity, -infinity };
+
+			for (size_t i = start; i < end; i++)
+			{
+				double radius = radii[items[i].index];
+				for (int k = 0; k < 3; k++)
+				{
+					lo[k] = std::min(lo[k], items[i].center[k] - radius);
+					hi[k] = std::max(hi[k], items[i].center[k] + radius);
+				}
+			}
+
+			// round outwards, so the float box still encloses the spheres
+			Node& leaf = nodes[index];
+			for (int k = 0; k < 3; k++)
+			{
+				leaf.lo[k] = std::nextafter(float(lo[k]), -std::numeric_limits<float>::infinity());
+				leaf.hi[k] = std::nextafter(float(hi[k]), std::numeric_limits<float>::infinity());
+			}
+			leaf.start = uint32_t(start);
+			leaf.count = uint16_t(end - start);
+			leaf.axis = 0;
+			return index;
+		}
+
+		float lo[3] = { items[start].center[0], items[start].center[1], items[start].center[2] };
+		float hi[3] = { lo[0], lo[1], lo[2] };
+		for (size_t i = start + 1; i < end; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				lo[k] = std::min(lo[k], items[i].center[k]);
+				hi[k] = std::max(hi[k], items[i].center[k]);
+			}
+		}
+
+		int axis = 0;
+		for (int k = 1; k < 3; k++)
+			if (hi[k] - lo[k] > hi[axis] - lo[axis])
+				axis = k;
+
+		size_t mid = start + (end - start) / 2;
+		std::nth_element(items.begin() + start, items.begin() + mid, items.begin() + end,
+			[axis](const BuildItem& a, const BuildItem& b) { return a.center[axis] < b.center[axis]; });
+
+		uint32_t left = buildNode(items, start, mid);
+		uint32_t right = buildNode(items, mid, end);
+
+		Node& node = nodes[index];
+		for (int k = 0; k < 3; k++)
+		{
+			node.lo[k] = std::min(nodes[left].lo[k], nodes[right].lo[k]);
+			node.hi[k] = std::max(nodes[left].hi[k], nodes[right].hi[k]);
+		}
+		node.start = right;
+		node.count = 0;
+		node.axis = uint16_t(axis);
+		return index;
+	}
+
+	/// <summary>
+	/// Recomputes the boxes of a node and the nodes below it from the spheres, which are in leaf order once built
+	/// </summary>
+	void refitNode(uint32_t index)
+	{
+		Node& node = nodes[index];
+		if (node.count > 0)
+		{
+			double lo[3] = { infinity, infinity, infinity };
+			double hi[3] = { -infinity, -infinity, -infinity };
+			for (size_t i = node.start; i < node.start + node.count; i++)
+			{
+				const double center[3] = { cx[i], cy[i], cz[i] };
+				for (int k = 0; k < 3; k++)
+				{
+					lo[k] = std::min(lo[k], center[k] - radii[i]);
+					hi[k] = std::max(hi[k], center[k] + radii[i]);
+				}
+			}
+
+			// round outwards once, from the exact bounds, so repeated refits do not keep growing the box
+			for (int k = 0; k < 3; k++)
+			{
+				node.lo[k] = std::nextafter(float(lo[k]), -std::numeric_limits<float>::infinity());
+				node.hi[k] = std::nextafter(float(hi[k]), std::numeric_limits<float>::infinity());
+			}
+			return;
+		}
+
+		uint32_t left = index + 1;
+		uint32_t right = node.start;
+		refitNode(left);
+		refitNode(right);
+		for (int k = 0; k < 3; k++)
+		{
+			node.lo[k] = std::min(nodes[left].lo[k], nodes[right].lo[k]);
+			node.hi[k] = std::max(nodes[left].hi[k], nodes[right].hi[k]);
+		}
+	}
+
+	/// <summary>
+	/// Slab test of a node against the ray
+	/// </summary>
+	static bool hitNode(const Node& node, const double origin[3], const double inverse[3], double tMin, double tMax)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double t0 = (node.lo[k] - origin[k]) * inverse[k];
+			double t1 = (node.hi[k] - origin[k]) * inverse[k];
+			if (inverse[k] < 0.0)
+				std::swap(t0, t1);
+
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+			if (tMax <= tMin)
+				return false;
+		}
+		return true;
+	}
+
+public:
+	/// <summary>
+	/// Default constructor, spheres are added with add() and become visible after build()
+	/// </summary>
+	SphereSet()
+	{}
+
+	/// <summary>
+	/// Reserves memory for the given number of spheres
+	/// </summary>
+	void reserve(size_t spheres)
+	{
+		for (auto array : { &cx, &cy, &cz, &radii })
+			array->reserve(spheres + LANES);
+		materialIndex.reserve(spheres + LANES);
+	}
+
+	/// <summary>
+	/// Adds a sphere
+	/// </summary>
+	/// <param name="center">Center of the sphere</param>
+	/// <param name="radius">Radius of the sphere</param>
+	/// <param name="material">Material of the sphere; every distinct material is stored once</param>
+	void add(const point& center, double radius, const shared_ptr<Material>& material)
+	{
+		auto found = std::find(materials.begin(), materials.end(), material);
+		if (found == materials.end())
+		{
+			if (materials.size() > std::numeric_limits<uint16_t>::max())
+				throw std::length_error("SphereSet supports at most 65536 materials");
+			found = materials.insert(materials.end(), material);
+		}
+
+		if (cx.size() > count)
+		{
+			// drop the padding of an earlier build, the set needs build() again anyway
+			for (auto array : { &cx, &cy, &cz, &radii })
+				array->resize(count);
+			materialIndex.resize(count);
+		}
+
+		cx.push_back(float(center.x()));
+		cy.push_back(float(center.y()));
+		cz.push_back(float(center.z()));
+		radii.push_back(float(radius));
+		materialIndex.push_back(uint16_t(found - materials.begin()));
+		count++;
+	}
+
+	/// <summary>
+	/// Builds the BVH over the spheres added so far and sorts the arrays into leaf order
+	/// </summary>
+	void build()
+	{
+		nodes.clear();
+
+		if (count == 0)
+			return;
+
+		std::vector<BuildItem> items(count);
+		for (size_t i = 0; i < count; i++)
+			items[i] = { { cx[i], cy[i], cz[i] }, uint32_t(i) };
+
+		nodes.reserve(4 * (count / LANES + 1));
+		buildNode(items, 0, count);
+
+		for (auto array : { &cx, &cy, &cz, &radii })
+		{
+			std::vector<float> sorted(count + LANES);
+			for (size_t i = 0; i < count; i++)
+				sorted[i] = (*array)[items[i].index];
+			array->swap(sorted);
+		}
+
+		std::vector<uint16_t> sorted(count + LANES);
+		for (size_t i = 0; i < count; i++)
+			sorted[i] = materialIndex[items[i].index];
+		materialIndex.swap(sorted);
+
+		nodes.shrink_to_fit();
+	}
+
+	/// <summary>
+	/// Number of spheres
+	/// </summary>
+	size_t size() const
+	{
+		return count;
+	}
+
+	/// <summary>
+	/// Bytes taken by the sphere arrays and the BVH
+	/// </summary>
+	size_t memoryBytes() const
+	{
+		return (cx.capacity() + cy.capacity() + cz.capacity() + radii.capacity()) * sizeof(float)
+			+ materialIndex.capacity() * sizeof(uint16_t) + nodes.capacity() * sizeof(Node);
+	}
+
+	virtual bool hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const override;
+
+	virtual void surfaceInteraction(const Ray& r, hitRecord& rec) const override
+	{
+		size_t i = rec.primitive;
+		point center(cx[i], cy[i], cz[i]);
+		rec.p = r.at(rec.t);
+		vec3 outwardNormal = (rec.p - center) / double(radii[i]);
+		rec.setFaceNormal(r, outwardNormal);
+		rec.mat_ptr = materials[materialIndex[i]].get();
+		if (rec.mat_ptr->textured())
+			sphereCoordinates(outwardNormal, radii[i], rec);
+	}
+
+	virtual bool boundingBox(BoundingBox& output) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		output = BoundingBox(point(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]), point(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]));
+		return true;
+	}
+
+	virtual bool translate(const vec3& offset) override
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			cx[i] = float(cx[i] + offset.x());
+			cy[i] = float(cy[i] + offset.y());
+			cz[i] = float(cz[i] + offset.z());
+		}
+
+		if (!nodes.empty())
+			refitNode(0);
+		return true;
+	}
+};
+
+inline bool SphereSet::hit(const Ray& r, double tMin, double tMax, hitRecord& rec) const
+{
+	if (nodes.empty())
+		return false;
+
+	const double origin[3] = { r.origin.x(), r.origin.y(), r.origin.z() };
+	const double direction[3] = { r.direction.x(), r.direction.y(), r.direction.z() };
+	const double inverse[3] = { 1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2] };
+	const double a = r.direction.length_squared();
+	const double invA = 1.0 / a;
+
+	size_t closest = count;
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+
+	TraversalCounters& counters = traversalCounters();
+	const SphereLanesKernel sphereLanes = activeKernels().sphereLanes;
+
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		counters.nodes++;
+		if (!hitNode(node, origin, inverse, tMin, tMax))
+			continue;
+
+		if (node.count == 0)
+		{
+			// visit the child nearer to the ray origin first, so tMax shrinks sooner
+			uint32_t index = uint32_t(&node - nodes.data());
+			bool rightFirst = direction[node.axis] < 0.0;
+			stack[top++] = rightFirst ? index + 1 : node.start;
+			stack[top++] = rightFirst ? node.start : index + 1;
+			continue;
+		}
+
+		// the discriminants of all lanes are computed in one kernel call; lanes past count read the padding and are
+		// skipped when the roots are taken
+		const size_t start = node.start;
+		const int lanes = node.count;
+		counters.primitives += lanes;
+		double halfB[LANES];
+		double discriminant[LANES];
+		sphereLanes(&cx[start], &cy[start], &cz[start], &radii[start], origin, direction, a, halfB, discriminant);
+
+		for (int i = 0; i < lanes; i++)
+		{
+			if (discriminant[i] < 0.0)
+				continue;
+
+			double sqrtD = sqrt(discriminant[i]);
+			double root = (-halfB[i] - sqrtD) * invA;
+			if (root < tMin)
+				root = (-halfB[i] + sqrtD) * invA;
+
+			if (root >= tMin && root < tMax)
+			{
+				tMax = root;
+				closest = start + i;
+			}
+		}
+	}
+
+	if (closest == count)
+		return false;
+
+	rec.t = tMax;
+	rec.object = this;
+	rec.primitive = uint32_t(closest);
+
+	return true;
+}
+
+#endif
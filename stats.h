@@ -0,0 +1,168 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+
+#include <cstddef>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+#ifdef _WIN32
+// lean, so winsock2.h can still be included after it
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+/// <summary>
+/// Work done by the calling thread while tracing rays: counted by the BVH and the primitives, read and reset by the
+/// reports
+/// </summary>
+struct TraversalCounters
+{
+	/// <summary>
+	/// Rays traced through the scene
+	/// </summary>
+	uint64_t rays = 0;
+	/// <summary>
+	/// BVH nodes whose box was tested
+	/// </summary>
+	uint64_t nodes = 0;
+	/// <summary>
+	/// Primitives tested against a ray
+	/// </summary>
+	uint64_t primitives = 0;
+};
+
+/// <summary>
+/// Gets the counters of the calling thread
+/// </summary>
+inline TraversalCounters& traversalCounters()
+{
+	static thread_local TraversalCounters counters;
+	return counters;
+}
+
+/// <summary>
+/// Hardware event counter of the calling thread, read through perf_event_open. Only available on Linux, and only
+/// where the kernel lets unprivileged processes count their own events; valid() tells
+/// </summary>
+class PerfCounter
+{
+private:
+	int fd = -1;
+
+public:
+	/// <summary>
+	/// Opens a counter, stopped and at zero
+	/// </summary>
+	/// <param name="type">PERF_TYPE_HARDWARE or PERF_TYPE_HW_CACHE</param>
+	/// <param name="config">Event of that type</param>
+	PerfCounter(uint32_t type, uint64_t config)
+	{
+#ifdef __linux__
+		perf_event_attr attributes;
+		std::memset(&attributes, 0, sizeof(attributes));
+		attributes.size = sizeof(attributes);
+		attributes.type = type;
+		attributes.config = config;
+		attributes.disabled = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		fd = int(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+	}
+
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator = (const PerfCounter&) = delete;
+
+	~PerfCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	bool valid() const
+	{
+		return fd >= 0;
+	}
+
+	/// <summary>
+	/// Sets the counter to zero and starts counting
+	/// </summary>
+	void start()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	/// <summary>
+	/// Stops counting
+	/// </summary>
+	/// <returns>Events counted since start</returns>
+	uint64_t stop()
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &count, sizeof(count)) != sizeof(count))
+				count = 0;
+		}
+#endif
+		return count;
+	}
+};
+
+/// <summary>
+/// Most memory the process has had resident at any one time since it started
+/// </summary>
+/// <returns>Bytes, 0 where the system does not tell</returns>
+inline size_t peakResidentBytes()
+{
+#if defined(__linux__)
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		return size_t(usage.ru_maxrss) * 1024;
+#elif defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+#endif
+	return 0;
+}
+
+#ifdef __linux__
+const uint32_t PERF_HARDWARE = PERF_TYPE_HARDWARE;
+const uint64_t PERF_CACHE_MISSES = PERF_COUNT_HW_CACHE_MISSES;
+const uint32_t PERF_CACHE = PERF_TYPE_HW_CACHE;
+const uint64_t PERF_L1D_READ_MISSES = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+#else
+const uint32_t PERF_HARDWARE = 0;
+const uint64_t PERF_CACHE_MISSES = 0;
+const uint32_t PERF_CACHE = 0;
+const uint64_t PERF_L1D_READ_MISSES = 0;
+#endif
+
+#endif
@@ -0,0 +1,509 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "const_utility.h"
+#include "image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Colour that varies over a surface
+/// </summary>
+class Texture
+{
+public:
+	virtual ~Texture()
+	{}
+
+	/// <summary>
+	/// Colour at a point of the surface
+	/// </summary>
+	/// <param name="u">Horizontal surface coordinate; the texture repeats every unit</param>
+	/// <param name="v">Vertical surface coordinate; the texture repeats every unit</param>
+	/// <param name="footprint">Width of the area of the texture the ray covers, in the same units; 0 for a point</param>
+	virtual colour value(double u, double v, double footprint) const = 0;
+};
+
+/// <summary>
+/// Header of a tiled texture file (.rtex). It is followed by the offsets of the tiles of every level, finest level
+/// first and row by row within a level, and then by the tiles themselves: tileSize x tileSize texels of three bytes,
+/// encoded with the gamma of 2 writePPM uses, edge tiles padded to full size
+/// </summary>
+struct TextureFileHeader
+{
+	char magic[4] = { 'R', 'T', 'X', '1' };
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t tileSize = 0;
+	uint32_t levels = 0;
+};
+
+/// <summary>
+/// Width and height of the tiles written by writeTiledTexture, 12 KiB each
+/// </summary>
+const int TEXTURE_TILE_SIZE = 64;
+
+/// <summary>
+/// Width (or height) of a mip level; odd sizes round up, so no texel is left out of the next level
+/// </summary>
+inline int mipWidth(int width, int level)
+{
+	return std::max(int((int64_t(width) + (int64_t(1) << level) - 1) >> level), 1);
+}
+
+inline uint8_t encodeTexel(float linear)
+{
+	return uint8_t(255.0 * clamp(sqrt(std::max(linear, 0.0f)), 0.0, 1.0) + 0.5);
+}
+
+/// <summary>
+/// Writes an image as a tiled texture with every mip level down to one texel, each level a 2x2 box filter of the one
+/// before
+/// </summary>
+/// <param name="filename">Name of the file, including the extension</param>
+/// <param name="image">Linear colours of the finest level</param>
+/// <param name="tileSize">Width and height of a tile in texels</param>
+/// <returns>True, if the file was written</returns>
+inline bool writeTiledTexture(const std::string& filename, const FloatImage& image, int tileSize)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file || image.width <= 0 || image.height <= 0)
+		return false;
+
+	TextureFileHeader header;
+	header.width = uint32_t(image.width);
+	header.height = uint32_t(image.height);
+	header.tileSize = uint32_t(tileSize);
+	while (mipWidth(image.width, header.levels) > 1 || mipWidth(image.height, header.levels) > 1)
+		header.levels++;
+	header.levels++;
+
+	size_t tileCount = 0;
+	for (uint32_t level = 0; level < header.levels; level++)
+		tileCount += size_t((mipWidth(image.width, level) + tileSize - 1) / tileSize) * ((mipWidth(image.height, level) + tileSize - 1) / tileSize);
+
+	size_t tileBytes = size_t(tileSize) * tileSize * 3;
+	std::vector<uint64_t> offsets(tileCount);
+	uint64_t offset = sizeof(header) + tileCount * sizeof(uint64_t);
+	for (uint64_t& tile : offsets)
+	{
+		tile = offset;
+		offset += tileBytes;
+	}
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+
+	// only the level being written and the one after it are held besides the image
+	FloatImage coarser;
+	const FloatImage* current = &image;
+	// texels of the finest level behind every texel of the current level, which differ along odd edges
+	std::vector<float> coverage(size_t(image.width) * image.height, 1.0f);
+	std::vector<uint8_t> tile(tileBytes);
+	for (uint32_t l = 0; l < header.levels; l++)
+	{
+		const FloatImage& level = *current;
+		for (int ty = 0; ty < level.height; ty += tileSize)
+			for (int tx = 0; tx < level.width; tx += tileSize)
+			{
+				std::fill(tile.begin(), tile.end(), uint8_t(0));
+				for (int y = ty; y < std::min(ty + tileSize, level.height); y++)
+					for (int x = tx; x < std::min(tx + tileSize, level.width); x++)
+					{
+						const float* texel = level.at(x, y);
+						uint8_t* out = &tile[(size_t(y - ty) * tileSize + (x - tx)) * 3];
+						for (int c = 0; c < 3; c++)
+							out[c] = encodeTexel(texel[c]);
+					}
+				file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+			}
+
+		if (l + 1 == header.levels)
+			break;
+
+		// every texel is the mean of the finest texels it covers; the last texel of an odd row or column covers fewer
+		FloatImage next(mipWidth(level.width, 1), mipWidth(level.height, 1));
+		std::vector<float> nextCoverage(size_t(next.width) * next.height);
+		for (int y = 0; y < next.height; y++)
+			for (int x = 0; x < next.width; x++)
+			{
+				float sum[3] = { 0.0f, 0.0f, 0.0f };
+				float covered = 0.0f;
+				for (int sy = 2 * y; sy < std::min(2 * y + 2, level.height); sy++)
+					for (int sx = 2 * x; sx < std::min(2 * x + 2, level.width); sx++)
+					{
+						float weight = coverage[size_t(sy) * level.width + sx];
+						for (int c = 0; c < 3; c++)
+							sum[c] += level.at(sx, sy)[c] * weight;
+						covered += weight;
+					}
+				for (int c = 0; c < 3; c++)
+					next.at(x, y)[c] = sum[c] / covered;
+				nextCoverage[size_t(y) * next.width + x] = covered;
+			}
+		coverage = std::move(nextCoverage);
+		coarser = std::move(next);
+		current = &coarser;
+	}
+	return bool(file);
+}
+
+/// <summary>
+/// Tiled texture file opened for reading. Only the header and the tile offsets are kept in memory; tiles are read on
+/// request, by any thread
+/// </summary>
+class TiledTexture
+{
+private:
+	std::ifstream file;
+	std::mutex fileMutex;
+	TextureFileHeader header;
+	std::vector<uint64_t> offsets;
+	/// <summary>
+	/// Index in offsets of the first tile of every level
+	/// </summary>
+	std::vector<size_t> firstTile;
+
+public:
+	/// <summary>
+	/// Number telling the textures apart in the tile cache
+	/// </summary>
+	const uint32_t id;
+
+	TiledTexture()
+		: id(nextId()++)
+	{}
+
+	static std::atomic<uint32_t>& nextId()
+	{
+		static std::atomic<uint32_t> id(0);
+		return id;
+	}
+
+	/// <summary>
+	/// Opens the file and reads its header and tile offsets
+	/// </summary>
+	/// <returns>False, if the file could not be read or is not a tiled texture</returns>
+	bool open(const std::string& filename)
+	{
+		file.open(filename, std::ios::binary);
+		if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "RTX1", 4) != 0
+			|| header.width == 0 || header.height == 0 || header.tileSize == 0 || header.levels == 0 || header.levels > 32)
+			return false;
+
+		size_t tileCount = 0;
+		for (uint32_t level = 0; level < header.levels; level++)
+		{
+			firstTile.push_back(tileCount);
+			tileCount += size_t(tilesAcross(level)) * tilesDown(level);
+		}
+		offsets.resize(tileCount);
+		return bool(file.read(reinterpret_cast<char*>(offsets.data()), offsets.size() * sizeof(uint64_t)));
+	}
+
+	int width(int level) const
+	{
+		return mipWidth(int(header.width), level);
+	}
+
+	int height(int level) const
+	{
+		return mipWidth(int(header.height), level);
+	}
+
+	int levels() const
+	{
+		return int(header.levels);
+	}
+
+	int tileSize() const
+	{
+		return int(header.tileSize);
+	}
+
+	int tilesAcross(int level) const
+	{
+		return (width(level) + tileSize() - 1) / tileSize();
+	}
+
+	int tilesDown(int level) const
+	{
+		return (height(level) + tileSize() - 1) / tileSize();
+	}
+
+	size_t tileBytes() const
+	{
+		return size_t(header.tileSize) * header.tileSize * 3;
+	}
+
+	/// <summary>
+	/// Reads one tile from the file
+	/// </summary>
+	/// <param name="out">Receives tileBytes() bytes</param>
+	/// <returns>False, if the read failed</returns>
+	bool readTile(int level, int tx, int ty, uint8_t* out)
+	{
+		uint64_t offset = offsets[firstTile[level] + size_t(ty) * tilesAcross(level) + tx];
+		std::lock_guard<std::mutex> lock(fileMutex);
+		file.clear();
+		return file.seekg(std::streamoff(offset)) && file.read(reinterpret_cast<char*>(out), tileBytes());
+	}
+};
+
+/// <summary>
+/// Tiles of the tiled textures held in memory, shared by all render threads and bounded in size. The least recently
+/// used tiles are evicted first. Tiles are spread over shards by their key, each with its own lock and its own share
+/// of the capacity, so threads reading different tiles rarely wait for each other; a miss reads the file outside the
+/// lock
+/// </summary>
+class TextureCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> TileData;
+
+	static const int SHARDS = 16;
+
+private:
+	struct Shard
+	{
+		std::mutex mutex;
+		std::list<std::pair<uint64_t, TileData>> recent;
+		std::unordered_map<uint64_t, std::list<std::pair<uint64_t, TileData>>::iterator> tiles;
+		size_t bytes = 0;
+	};
+
+	Shard shards[SHARDS];
+	std::atomic<size_t> capacity;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> bytesRead;
+	std::atomic<uint64_t> evictions;
+
+	static uint64_t key(uint32_t texture, int level, int tx, int ty)
+	{
+		return (uint64_t(texture) << 48) | (uint64_t(level) << 42) | (uint64_t(ty) << 21) | uint64_t(tx);
+	}
+
+	static size_t shardOf(uint64_t key)
+	{
+		// neighbouring tiles go to different shards
+		key ^= key >> 29;
+		key *= 0xbf58476d1ce4e5b9ull;
+		key ^= key >> 32;
+		return size_t(key % SHARDS);
+	}
+
+public:
+	/// <param name="capacityBytes">Largest number of tile bytes kept in memory</param>
+	explicit TextureCache(size_t capacityBytes)
+		: capacity(capacityBytes), hits(0), misses(0), bytesRead(0), evictions(0)
+	{}
+
+	/// <summary>
+	/// Changes the size of the cache; only to be called while nothing renders
+	/// </summary>
+	void setCapacity(size_t capacityBytes)
+	{
+		capacity = capacityBytes;
+	}
+
+	/// <summary>
+	/// Gets a tile, reading it from the file if it is not in memory
+	/// </summary>
+	/// <returns>The tile, null if it could not be read</returns>
+	TileData tile(TiledTexture& texture, int level, int tx, int ty)
+	{
+		uint64_t k = key(texture.id, level, tx, ty);
+		Shard& shard = shards[shardOf(k)];
+
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.tiles.find(k);
+			if (found != shard.tiles.end())
+			{
+				shard.recent.splice(shard.recent.begin(), shard.recent, found->second);
+				hits.fetch_add(1, std::memory_order_relaxed);
+				return found->second->second;
+			}
+		}
+
+		auto data = std::make_shared<std::vector<uint8_t>>(texture.tileBytes());
+		if (!texture.readTile(level, tx, ty, data->data()))
+			return nullptr;
+		misses.fetch_add(1, std::memory_order_relaxed);
+		bytesRead.fetch_add(data->size(), std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		// another thread may have read the same tile meanwhile
+		auto found = shard.tiles.find(k);
+		if (found != shard.tiles.end())
+			return found->second->second;
+
+		shard.recent.emplace_front(k, data);
+		shard.tiles[k] = shard.recent.begin();
+		shard.bytes += data->size();
+
+		// tiles in use elsewhere stay alive through their shared pointers after they leave the cache
+		size_t limit = capacity / SHARDS;
+		while (shard.bytes > limit && shard.recent.size() > 1)
+		{
+			shard.bytes -= shard.recent.back().second->size();
+			shard.tiles.erase(shard.recent.back().first);
+			shard.recent.pop_back();
+			evictions.fetch_add(1, std::memory_order_relaxed);
+		}
+		return data;
+	}
+
+	/// <summary>
+	/// Drops every tile and sets the statistics to zero; only to be called while nothing renders
+	/// </summary>
+	void clear()
+	{
+		for (Shard& shard : shards)
+		{
+			shard.recent.clear();
+			shard.tiles.clear();
+			shard.bytes = 0;
+		}
+		hits = misses = bytesRead = evictions = 0;
+	}
+
+	uint64_t lookups() const
+	{
+		return hits + misses;
+	}
+
+	double hitRate() const
+	{
+		uint64_t total = lookups();
+		return total > 0 ? double(hits) / total : 0.0;
+	}
+
+	uint64_t bytesFromDisk() const
+	{
+		return bytesRead;
+	}
+
+	uint64_t evictedTiles() const
+	{
+		return evictions;
+	}
+
+	size_t residentBytes()
+	{
+		size_t bytes = 0;
+		for (Shard& shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			bytes += shard.bytes;
+		}
+		return bytes;
+	}
+
+	/// <summary>
+	/// Prints the hit rate, the bytes read from disk and the evictions
+	/// </summary>
+	void report(std::ostream& out)
+	{
+		out << "Texture cache: " << lookups() << " tile lookups, " << std::fixed << std::setprecision(2) << 100.0 * hitRate()
+			<< "% hits, " << double(bytesFromDisk()) / (1024 * 1024) << " MiB read, " << evictions << " evictions, "
+			<< double(residentBytes()) / (1024 * 1024) << " of " << double(capacity) / (1024 * 1024) << " MiB resident"
+			<< std::defaultfloat << "\n";
+	}
+};
+
+/// <summary>
+/// Cache shared by every image texture, 256 MiB unless resized
+/// </summary>
+inline TextureCache& textureCache()
+{
+	static TextureCache cache(size_t(256) << 20);
+	return cache;
+}
+
+/// <summary>
+/// Texture read from a tiled texture file through textureCache(). The mip level is picked from the ray footprint so
+/// that a texel is about as wide as the footprint, and filtered bilinearly within the level
+/// </summary>
+class ImageTexture : public Texture
+{
+private:
+	shared_ptr<TiledTexture> file;
+
+	/// <summary>
+	/// Colour of one texel; the coordinates wrap around
+	/// </summary>
+	/// <param name="data">Tile last looked up, and its position, reused while the texels stay in it</param>
+	colour texel(int level, int x, int y, TextureCache::TileData& data, int& dataX, int& dataY) const
+	{
+		int w = file->width(level), h = file->height(level), size = file->tileSize();
+		x = ((x % w) + w) % w;
+		y = ((y % h) + h) % h;
+
+		if (!data || x / size != dataX || y / size != dataY)
+		{
+			dataX = x / size;
+			dataY = y / size;
+			data = textureCache().tile(*file, level, dataX, dataY);
+			if (!data)
+				return colour(0.0, 0.0, 0.0);
+		}
+
+		const uint8_t* t = &(*data)[(size_t(y % size) * size + x % size) * 3];
+		const double scale = 1.0 / 255.0;
+		return colour(t[0] * scale * t[0] * scale, t[1] * scale * t[1] * scale, t[2] * scale * t[2] * scale);
+	}
+
+public:
+	explicit ImageTexture(shared_ptr<TiledTexture> file)
+	{
+		this->file = file;
+	}
+
+	virtual colour value(double u, double v, double footprint) const override
+	{
+		int size = std::max(file->width(0), file->height(0));
+		double texels = footprint * size;
+		int level = texels > 1.0 ? std::min(int(std::log2(texels)), file->levels() - 1) : 0;
+
+		// v = 0 is the bottom of the image
+		double x = (u - std::floor(u)) * file->width(level) - 0.5;
+		double y = (1.0 - (v - std::floor(v))) * file->height(level) - 0.5;
+		int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+		double fx = x - x0, fy = y - y0;
+
+		TextureCache::TileData data;
+		int dataX = -1, dataY = -1;
+		return (1.0 - fy) * ((1.0 - fx) * texel(level, x0, y0, data, dataX, dataY) + fx * texel(level, x0 + 1, y0, data, dataX, dataY))
+			+ fy * ((1.0 - fx) * texel(level, x0, y0 + 1, data, dataX, dataY) + fx * texel(level, x0 + 1, y0 + 1, data, dataX, dataY));
+	}
+};
+
+/// <summary>
+/// Opens a tiled texture file as a texture
+/// </summary>
+/// <returns>The texture, null if the file could not be read</returns>
+inline shared_ptr<Texture> openTexture(const std::string& filename)
+{
+	auto file = make_shared<TiledTexture>();
+	if (!file->open(filename))
+		return nullptr;
+	return make_shared<ImageTexture>(file);
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Fixed set of threads that stay alive between frames and jobs. Tasks with a higher priority run first, tasks of
+/// equal priority run in the order they were queued
+/// </summary>
+class ThreadPool
+{
+private:
+	struct Task
+	{
+		int priority;
+		uint64_t sequence;
+		std::function<void()> run;
+
+		bool operator < (const Task& other) const
+		{
+			// std::priority_queue pops the largest element first
+			if (priority != other.priority)
+				return priority < other.priority;
+			return sequence > other.sequence;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	std::priority_queue<Task> tasks;
+	uint64_t queued = 0;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void run()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = std::move(const_cast<Task&>(tasks.top()).run);
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+public:
+	/// <summary>
+	/// Parameterized constructor
+	/// </summary>
+	/// <param name="threadCount">Number of threads, at least one</param>
+	explicit ThreadPool(int threadCount)
+	{
+		for (int i = 0; i < std::max(threadCount, 1); i++)
+			threads.emplace_back(&ThreadPool::run, this);
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+
+	/// <summary>
+	/// Finishes the tasks already queued, then stops the threads
+	/// </summary>
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	int size() const
+	{
+		return int(threads.size());
+	}
+
+	/// <summary>
+	/// Queues a task
+	/// </summary>
+	/// <param name="task">Task to run</param>
+	/// <param name="priority">Tasks with a higher priority run first</param>
+	/// <returns>Future that becomes ready when the task has run</returns>
+	std::future<void> submit(std::function<void()> task, int priority = 0)
+	{
+		auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+		std::future<void> done = packaged->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push({ priority, queued++, [packaged]() { (*packaged)(); } });
+		}
+		wake.notify_one();
+		return done;
+	}
+
+	/// <summary>
+	/// Runs body(0) ... body(count - 1) on the pool and waits for all of them. Every index is queued as its own
+	/// task, so a job with a higher priority submitted meanwhile gets the next free thread. Must not be called from
+	/// a task running on the same pool
+	/// </summary>
+	/// <param name="count">Number of indices</param>
+	/// <param name="body">Function to run for every index</param>
+	/// <param name="priority">Priority of the tasks</param>
+	void parallelFor(size_t count, const std::function<void(size_t)>& body, int priority = 0)
+	{
+		std::mutex doneMutex;
+		std::condition_variable doneChanged;
+		size_t remaining = count;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t index = 0; index < count; index++)
+			{
+				tasks.push({ priority, queued++, [&, index]()
+				{
+					body(index);
+					std::lock_guard<std::mutex> doneLock(doneMutex);
+					if (--remaining == 0)
+						doneChanged.notify_all();
+				} });
+			}
+		}
+		wake.notify_all();
+
+		std::unique_lock<std::mutex> lock(doneMutex);
+		doneChanged.wait(lock, [&]() { return remaining == 0; });
+	}
+};
+
+#endif
@@ -3,12 +3,18 @@
 
 #include <cmath>
 #include <iostream>
+#include <random>
+
+inline std::mt19937& rdGenerator()
+{
+    static thread_local std::mt19937 generator;
+    return generator;
+}
 
 inline double rd()
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(rdGenerator());
 }
 
 inline double rd(double min, double max)
@@ -183,12 +189,12 @@ inline vec3 random_in_unit_sphere()
     }
 }
 
-vec3 randomUnitVector() 
+inline vec3 randomUnitVector() 
 {
     return unitVector(random_in_unit_sphere());
 }
 
-vec3 random_in_hemisphere(const vec3& normal) 
+inline vec3 random_in_hemisphere(const vec3& normal) 
 {
     vec3 in_unit_sphere = random_in_unit_sphere();
     if (dot(in_unit_sphere, normal) > 0.0)
@@ -197,12 +203,12 @@ vec3 random_in_hemisphere(const vec3& normal)
         return -in_unit_sphere;
 }
 
-vec3 reflect(const vec3& v, const vec3& n) 
+inline vec3 reflect(const vec3& v, const vec3& n) 
 {
     return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& r_in, const vec3& n, double iot)
+inline vec3 refract(const vec3& r_in, const vec3& n, double iot)
 {
     auto cosTheta = fmin(dot(-r_in, n), 1.0);
     vec3 rPerpendicular = iot * (r_in + cosTheta * n);
@@ -210,7 +216,7 @@ vec3 refract(const vec3& r_in, const vec3& n, double iot)
     return rPerpendicular + rParallel;
 }
 
-vec3 random_in_unit_disk() 
+inline vec3 random_in_unit_disk() 
 {
     while (true) 
     {